@@ -96,6 +96,7 @@ enum { ACLC_ACL,
 #ifdef WITH_CONTENT_SCAN
        ACLC_MIME_REGEX,
 #endif
+       ACLC_PRIORITY,
        ACLC_QUEUE,
        ACLC_RATELIMIT,
        ACLC_RECIPIENTS,
@@ -119,8 +120,8 @@ enum { ACLC_ACL,
 };
 
 /* ACL conditions/modifiers: "delay", "control", "continue", "endpass",
-"message", "log_message", "log_reject_target", "logwrite", "queue" and "set" are
-modifiers that look like conditions but always return TRUE. They are used for
+"message", "log_message", "log_reject_target", "logwrite", "priority", "queue"
+and "set" are modifiers that look like conditions but always return TRUE. They are used for
 their side effects.  Do not invent new modifier names that result in one name
 being the prefix of another; the binary-search in the list will go wrong. */
 
@@ -265,6 +266,15 @@ static condition_def conditions[] = {
 				  PERMITTED(ACL_BIT_MIME) },
 #endif
 
+  [ACLC_PRIORITY] =		{ US"priority",		ACD_EXP | ACD_MOD,
+				  PERMITTED(ACL_BIT_MAIL | ACL_BIT_RCPT |
+				    ACL_BIT_PREDATA | ACL_BIT_DATA |
+				    ACL_BIT_PRDR |
+				    ACL_BIT_MIME | ACL_BIT_NOTSMTP |
+				    ACL_BIT_DKIM |
+				    ACL_BIT_NOTSMTP_START),
+  },
+
   [ACLC_QUEUE] =		{ US"queue",		ACD_EXP | ACD_MOD,
 				  FORBIDDEN(ACL_BIT_NOTSMTP |
 				  ACL_BIT_PRDR |
@@ -3306,6 +3316,7 @@ acl_check_condition(int verb, acl_condition_block * cb, int where,
 {
 uschar * user_message = NULL, * log_message = NULL;
 int rc = OK;
+int prof_depth = profile_depth;
 
 for (; cb; cb = cb->next)
   {
@@ -3313,6 +3324,8 @@ for (; cb; cb = cb->next)
   int control_type;
   BOOL textonly = FALSE;
 
+  if (profile_depth > prof_depth) profile_pop(prof_depth);
+
   switch (cb->type)
     {
     /* The message and log_message items set up messages to be used in
@@ -3333,6 +3346,10 @@ for (; cb; cb = cb->next)
       *epp = TRUE;		continue;
     }
 
+  /* The timing for a profile covers expansion of the argument */
+
+  if (f.profiling) profile_push(PROF_ACL, conditions[cb->type].name);
+
   /* For other conditions and modifiers, the argument is expanded now for some
   of them, but not for all, because expansion happens down in some lower level
   checking functions in some cases. */
@@ -4068,6 +4085,21 @@ for (; cb; cb = cb->next)
       break;
 #endif
 
+    case ACLC_PRIORITY:
+      {
+      uschar * end;
+      long n = Ustrtol(arg, &end, 0);
+
+      Uskip_whitespace(&end);
+      if (end == arg || *end || n > INT_MAX/2 || n < -INT_MAX/2)
+	{
+	*log_msgptr = string_sprintf("bad priority value '%s'", arg);
+	return ERROR;
+	}
+      message_priority = (int)n;
+      break;
+      }
+
     case ACLC_QUEUE:
       if (is_tainted(arg))
 	{
@@ -4227,6 +4259,7 @@ for (; cb; cb = cb->next)
 
   if (rc != OK) break;   /* Conditions loop */
   }
+if (profile_depth > prof_depth) profile_pop(prof_depth);
 
 
 /* If the result is the one for which "message" and/or "log_message" are used,
@@ -4456,7 +4489,7 @@ static int
 acl_check_internal(int where, address_item *addr, uschar *s,
   uschar **user_msgptr, uschar **log_msgptr)
 {
-int fd = -1;
+int fd = -1, prof_depth;
 acl_block *acl = NULL;
 uschar *acl_name = US"inline ACL";
 uschar *ss;
@@ -4605,9 +4638,14 @@ while ((acl_current = acl))
   this condition. */
 
   search_error_message = NULL;
+  prof_depth = profile_depth;
   cond = acl_check_condition(acl->verb, acl->condition, where, addr, acl_level,
     &endpass_seen, user_msgptr, log_msgptr, &basic_errno);
 
+  /* Close any profile record left open by an early error return */
+
+  if (profile_depth > prof_depth) profile_pop(prof_depth);
+
   /* Handle special returns: DEFER causes a return except on a WARN verb;
   ERROR always causes a return. */
 
@@ -11,24 +11,79 @@
 
 
 #include "exim.h"
+#include <sys/mman.h>
 
 
-/* Structure for holding data for each SMTP connection */
+/* Structure for holding data for each SMTP connection. A pid of -1 marks a
+slot claimed by an acceptor which has not yet forked the reception process. */
 
 typedef struct smtp_slot {
   pid_t		pid;		/* pid of the spawned reception process */
-  uschar *	host_address;	/* address of the client host */
+  int		acceptor;	/* index of the acceptor which spawned it */
+  uschar	host_address[EXIM_IPADDR_MAX+1]; /* address of the client host */
 } smtp_slot;
 
+/* The slots, and the count of those in use, are kept together. When there
+are multiple acceptor processes the table lives in shared memory, so that the
+connection limits apply across all of them; it is then guarded by a simple
+spinlock holding the pid of the locker. */
+
+typedef struct smtp_slot_table {
+  volatile pid_t lock;
+  int		count;		/* slots in use */
+  smtp_slot	slots[];
+} smtp_slot_table;
+
+/* A pre-forked SMTP worker process, as seen by the daemon. The connection
+slot is the one for the connection it is handling, if any. */
+
+typedef struct smtp_worker {
+  pid_t		pid;		/* zero if there is none */
+  int		fd;		/* daemon end of the socketpair */
+  int		slot;		/* connection slot in use, or -1 */
+  BOOL		busy;
+} smtp_worker;
+
+/* What is passed to a worker along with the connection's socket */
+
+typedef struct smtp_worker_call {
+  union sockaddr_46 accepted;	/* the client's address */
+  int		accept_count;	/* other connections, for logging and queueing */
+  int		listen_backlog;
+  int		load_average;
+} smtp_worker_call;
+
+/* A request to the delivery fork server; what would otherwise go on the
+command line of a re-exec for -Mc */
+
+typedef struct forkserver_req {
+  uschar	message_id[MESSAGE_ID_LENGTH + 1];
+  uschar	queue_name[EXIM_DRIVERNAME_MAX + 1];
+  unsigned	debug_selector;
+  unsigned	dtrigger_selector;
+  int		connection_max_messages;
+  BOOL		dont_deliver;
+  BOOL		queue_smtp;
+  BOOL		synchronous_delivery;
+  BOOL		testsuite_delays;
+} forkserver_req;
+
 typedef struct runner_slot {
   pid_t		pid;		/* pid of spawned queue-runner process */
   const uschar *queue_name;	/* pointer to the name in the qrunner struct */
 } runner_slot;
 
-/* An empty slot for initializing (Standard C does not allow constructor
-expressions in assignments except as initializers in declarations). */
+/* Multiple acceptors need listening sockets each with their own queue of
+pending connections, which the kernel balances across the sockets. */
 
-static smtp_slot empty_smtp_slot = { .pid = 0, .host_address = NULL };
+#if defined(SO_REUSEPORT_LB)			/* FreeBSD */
+# define EXIM_SO_REUSEPORT SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT) && defined(__linux__)
+# define EXIM_SO_REUSEPORT SO_REUSEPORT
+#endif
+#ifndef MAP_ANON
+# define MAP_ANON MAP_ANONYMOUS
+#endif
 
 /*************************************************
 *               Local static variables           *
@@ -46,10 +101,34 @@ static int   queue_run_count = 0;	/* current runners */
 
 static unsigned queue_runner_slot_count = 0;
 static runner_slot * queue_runner_slots = NULL;
-static smtp_slot * smtp_slots = NULL;
+static smtp_slot_table * smtp_slots = NULL;
+
+static int   acceptor_index = 0;	/* zero for the main daemon process */
+static int   acceptor_count = 1;
+static int * acceptor_fds = NULL;	/* listening sockets for the others */
+static pid_t * acceptor_pids = NULL;
+static time_t * acceptor_started = NULL;
+static BOOL  acceptor_restart = FALSE;
+static BOOL  orphan_slots = FALSE;
+
+static smtp_worker * smtp_workers = NULL;
+static struct pollfd * smtp_worker_polls;
+static int   smtp_worker_count = 0;
+static BOOL  smtp_workers_wanted = FALSE;
+static int   worker_sock = -1;		/* in a worker, its end of the socketpair */
+
+static pid_t forkserver_pid = 0;
+static pid_t syncserver_pid = 0;
+static pid_t * lookupproxy_pids = NULL;
+static int   lookupproxy_count = 0;
+static int   lookupproxy_live = 0;
 
 static BOOL  write_pid = TRUE;
 
+#ifdef EXIM_HAVE_EPOLL
+static int   daemon_epoll_fd = -1;
+#endif
+
 #ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
 static uschar * notifier_socket_name;
 #endif
@@ -158,41 +237,283 @@ if (daemon_notifier_fd >= 0)
   }
 
 for (int i = 0; i < listen_socket_count; i++) (void) close(fd_polls[i].fd);
+if (acceptor_fds)
+  for (int i = 0; i < (acceptor_count-1) * listen_socket_count; i++)
+    (void) close(acceptor_fds[i]);
+if (smtp_workers)
+  for (smtp_worker * w = smtp_workers; w < smtp_workers + smtp_worker_count; w++)
+    if (w->fd >= 0) (void) close(w->fd);
+
+#ifdef EXIM_HAVE_EPOLL
+if (daemon_epoll_fd >= 0)
+  {
+  (void) close(daemon_epoll_fd);
+  daemon_epoll_fd = -1;
+  }
+#endif
 }
 
 
+
 /*************************************************
-*            Handle a connected SMTP call        *
+*      Wait for activity on the daemon sockets   *
 *************************************************/
 
-/* This function is called when an SMTP connection has been accepted.
-If there are too many, give an error message and close down. Otherwise
-spin off a sub-process to handle the call. The list of listening sockets
-is required so that they can be closed in the sub-process. Take care not to
-leak store in this process - reset the stacking pool at the end.
+/* Where the OS has epoll, the set of listening and ancillary sockets is
+registered once with an epoll instance rather than being handed to poll() on
+every trip round the daemon loop; the cost of a wait then depends on the
+number of ready sockets rather than on the number of listeners. The index of
+each pollfd is kept as the event data, and the results are presented back in
+the revents fields just as poll() would do, so that the loop itself does not
+care which mechanism is in use. If anything goes wrong with the epoll setup we
+quietly fall back to poll(). */
+
+#ifdef EXIM_HAVE_EPOLL
+static BOOL
+daemon_poll_add(struct pollfd * fd_polls, int idx)
+{
+struct epoll_event ev = {.events = EPOLLIN, .data.u32 = idx};
+
+if (  daemon_epoll_fd >= 0 && fd_polls[idx].fd >= 0
+   && epoll_ctl(daemon_epoll_fd, EPOLL_CTL_ADD, fd_polls[idx].fd, &ev) < 0
+   && errno != EEXIST)
+  {
+  log_write(0, LOG_MAIN, "epoll_ctl: %s: using poll()", strerror(errno));
+  (void) close(daemon_epoll_fd);
+  daemon_epoll_fd = -1;
+  return FALSE;
+  }
+return TRUE;
+}
+#endif
+
+
+static void
+daemon_poll_init(struct pollfd * fd_polls, int poll_fd_count)
+{
+#ifdef EXIM_HAVE_EPOLL
+if ((daemon_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+  log_write(0, LOG_MAIN, "epoll_create1: %s: using poll()", strerror(errno));
+  return;
+  }
+for (int i = 0; i < poll_fd_count; i++)
+  if (!daemon_poll_add(fd_polls, i)) return;
+DEBUG(D_any) debug_printf("using epoll for %d daemon sockets\n", poll_fd_count);
+#endif
+}
+
+
+static int
+daemon_poll(struct pollfd * fd_polls, int poll_fd_count)
+{
+#ifdef EXIM_HAVE_EPOLL
+if (daemon_epoll_fd >= 0)
+  {
+  struct epoll_event evs[32];
+  int n = epoll_wait(daemon_epoll_fd, evs, nelem(evs), -1);
+
+  for (struct pollfd * p = fd_polls; p < fd_polls + poll_fd_count; p++)
+    p->revents = 0;
+  for (int i = 0; i < n; i++)			/* the EPOLL and POLL bit */
+    fd_polls[evs[i].data.u32].revents = evs[i].events;	/* values match */
+  return n;
+  }
+#endif
+return poll(fd_polls, poll_fd_count, -1);
+}
+
+
+/*************************************************
+*          SMTP connection slot table            *
+*************************************************/
+
+/* With a single acceptor the locking is a no-op. Otherwise a process wanting
+the table spins (politely) until it can swap its pid into the lock word. Should
+the holder of the lock die while holding it, the lock is broken once it is
+seen to have gone, so that the other acceptors are not wedged. */
+
+static pid_t slots_lock_pid;
+
+static void
+smtp_slots_lock(void)
+{
+if (acceptor_count <= 1) return;
+for (unsigned spins = 1;
+     !__sync_bool_compare_and_swap(&smtp_slots->lock, 0, slots_lock_pid);
+     spins++)
+  if (spins % 1024 == 0)
+    {
+    pid_t holder = smtp_slots->lock;
+    if (holder > 0 && kill(holder, 0) < 0 && errno == ESRCH)
+      (void) __sync_bool_compare_and_swap(&smtp_slots->lock, holder, 0);
+    else
+      (void) poll(NULL, 0, 1);
+    }
+}
+
+static void
+smtp_slots_unlock(void)
+{
+if (acceptor_count > 1) __sync_lock_release(&smtp_slots->lock);
+}
+
+
+/* Claim a free slot for a new connection, checking again the total limit
+(another acceptor may have taken the last slot since the preliminary check)
+and the per-host limit.
 
 Arguments:
-  fd_polls        sockets which are listening for incoming calls
-  listen_socket_count   count of listening sockets
-  accept_socket         socket of the current accepted call
-  accepted              socket information about the current call
+  max_for_this_host	per-host limit, or zero for none
+  host_accept_count	where to return the count for this host
 
-Returns:            nothing
+Returns:  the slot index, or -1 if the total limit is reached, or -2
+	  if the limit for this host is reached
 */
 
+static int
+smtp_slot_claim(int max_for_this_host, int * host_accept_count)
+{
+smtp_slot * sp;
+int i;
+
+smtp_slots_lock();
+smtp_accept_count = smtp_slots->count;
+
+if (smtp_accept_count >= smtp_accept_max)
+  { i = -1; goto UNLOCK; }
+
+/* If we have fewer total connections than max_for_this_host, we can skip the
+tedious per host_address checks. Note that at this stage smtp_accept_count
+contains the count of *other* connections, not including this one. */
+
+*host_accept_count = 0;
+if (max_for_this_host > 0 && smtp_accept_count >= max_for_this_host)
+  {
+  int other_host_count = 0;    /* keep a count of non matches to optimise */
+
+  for (i = 0, sp = smtp_slots->slots; i < smtp_accept_max; i++, sp++)
+    if (sp->pid != 0 && sp->host_address[0])
+      {
+      if (Ustrcmp(sender_host_address, sp->host_address) == 0)
+       (*host_accept_count)++;
+      else
+       other_host_count++;
+
+      /* Testing all these strings is expensive - see if we can drop out
+      early, either by hitting the target, or finding there are not enough
+      connections left to make the target. */
+
+      if (  *host_accept_count >= max_for_this_host
+         || smtp_accept_count - other_host_count < max_for_this_host)
+       break;
+      }
+
+  if (*host_accept_count >= max_for_this_host)
+    { i = -2; goto UNLOCK; }
+  }
+
+/* There must be a free slot, as the count is below the maximum. The address is
+recorded only when it might be needed for the per-host check. */
+
+for (i = 0, sp = smtp_slots->slots; sp->pid != 0; i++, sp++) ;
+sp->pid = -1;
+sp->acceptor = acceptor_index;
+if (smtp_accept_max_per_host)
+  Ustrncpy(sp->host_address, sender_host_address, sizeof(sp->host_address)-1);
+else
+  sp->host_address[0] = '\0';
+smtp_slots->count++;
+
+UNLOCK:
+smtp_slots_unlock();
+return i;
+}
+
+
 static void
-handle_smtp_call(struct pollfd * fd_polls, int listen_socket_count,
-  int accept_socket, const struct sockaddr * accepted)
+smtp_slot_release(smtp_slot * sp)
+{
+smtp_slots_lock();
+sp->pid = 0;
+sp->host_address[0] = '\0';
+smtp_slots->count--;
+smtp_slots_unlock();
+}
+
+
+/* Called in the main daemon process when an acceptor has gone (with the index
+of that acceptor) and then on subsequent trips round the loop while any are
+left (with -1): the slots for reception processes spawned by a vanished
+acceptor are freed only when the processes themselves are seen to have gone,
+as nobody is left to reap them. */
+
+static void
+smtp_slots_sweep(int dead_acceptor)
+{
+smtp_slot * sp = smtp_slots->slots;
+BOOL left = FALSE;
+
+smtp_slots_lock();
+for (int i = 0; i < smtp_accept_max; i++, sp++) if (sp->pid != 0)
+  {
+  if (sp->acceptor == dead_acceptor) sp->acceptor = -1;
+  if (sp->acceptor >= 0) continue;
+
+  if (sp->pid < 0 || kill(sp->pid, 0) < 0 && errno == ESRCH)
+    {
+    sp->pid = 0;
+    sp->host_address[0] = '\0';
+    smtp_slots->count--;
+    }
+  else
+    left = TRUE;
+  }
+smtp_slots_unlock();
+orphan_slots = left;
+}
+
+
+
+/*************************************************
+*      Refuse a call over the total limit        *
+*************************************************/
+
+static void
+refuse_too_many(const gstring * whofrom)
+{
+DEBUG(D_any) debug_printf("rejecting SMTP connection: count=%d max=%d\n",
+  smtp_accept_count, smtp_accept_max);
+smtp_printf("421 Too many concurrent SMTP connections; "
+  "please try again later.\r\n", SP_NO_MORE);
+log_write(L_connection_reject,
+          LOG_MAIN, "Connection from %Y refused: too many connections",
+  whofrom);
+}
+
+
+
+/*************************************************
+*          Set up for an accepted call           *
+*************************************************/
+
+/* Fill in the client and interface addresses for a connection, and the SMTP
+input and output fds.
+
+Arguments:
+  accept_socket	  socket of the call
+  accepted	  socket information about the call
+
+Returns:  a string identifying the client for logging, or NULL on failure
+*/
+
+static gstring *
+smtp_call_setup(int accept_socket, const struct sockaddr * accepted)
 {
-pid_t pid;
 union sockaddr_46 interface_sockaddr;
 EXIM_SOCKLEN_T ifsize = sizeof(interface_sockaddr);
-int max_for_this_host = 0;
-int save_log_selector = *log_selector;
 gstring * whofrom;
 
-rmark reset_point = store_mark();
-
 /* Make the address available in ASCII representation, and also fish out
 the remote port. */
 
@@ -210,7 +531,7 @@ if ((smtp_in_fd = dup(accept_socket)) < 0)
   {
   never_error(US"daemon: couldn't dup socket descriptor",
     US"Connection setup failed", errno);
-  goto ERROR_RETURN;
+  return NULL;
   }
 
 /* Get the data for the local interface address. Panic for most errors, but
@@ -222,7 +543,7 @@ if (getsockname(accept_socket, (struct sockaddr *)(&interface_sockaddr),
   log_write(0, LOG_MAIN | ((errno == ECONNRESET)? 0 : LOG_PANIC),
     "getsockname() failed: %s", strerror(errno));
   smtp_printf("421 Local problem: getsockname() failed; please try again later\r\n", SP_NO_MORE);
-  goto ERROR_RETURN;
+  return NULL;
   }
 
 interface_address = host_ntoa(-1, &interface_sockaddr, NULL, &interface_port);
@@ -230,8 +551,8 @@ DEBUG(D_interface) debug_printf("interface address=%s port=%d\n",
   interface_address, interface_port);
 
 /* Build a string identifying the remote host and, if requested, the port and
-the local interface data. This is for logging; at the end of this function the
-memory is reclaimed. */
+the local interface data. This is for logging; the caller reclaims the
+memory. */
 
 whofrom = string_append(NULL, 3, "[", sender_host_address, "]");
 
@@ -243,523 +564,413 @@ if (LOGGING(incoming_interface))
   whofrom = string_fmt_append(whofrom, " I=[%s]", interface_address);
   whofrom = log_portnum(whofrom, interface_port);
   }
+return whofrom;
+}
 
-/* Check maximum number of connections. We do not check for reserved
-connections or unacceptable hosts here. That is done in the subprocess because
-it might take some time. */
-
-if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
-  {
-  DEBUG(D_any) debug_printf("rejecting SMTP connection: count=%d max=%d\n",
-    smtp_accept_count, smtp_accept_max);
-  smtp_printf("421 Too many concurrent SMTP connections; "
-    "please try again later.\r\n", SP_NO_MORE);
-  log_write(L_connection_reject,
-            LOG_MAIN, "Connection from %Y refused: too many connections",
-    whofrom);
-  goto ERROR_RETURN;
-  }
-
-/* If a load limit above which only reserved hosts are acceptable is defined,
-get the load average here, and if there are in fact no reserved hosts, do
-the test right away (saves a fork). If there are hosts, do the check in the
-subprocess because it might take time. */
-
-if (smtp_load_reserve >= 0)
-  {
-  load_average = OS_GETLOADAVG();
-  if (!smtp_reserve_hosts && load_average > smtp_load_reserve)
-    {
-    DEBUG(D_any) debug_printf("rejecting SMTP connection: load average = %.2f\n",
-      (double)load_average/1000.0);
-    smtp_printf("421 Too much load; please try again later.\r\n", SP_NO_MORE);
-    log_write(L_connection_reject,
-              LOG_MAIN, "Connection from %Y refused: load average = %.2f",
-      whofrom, (double)load_average/1000.0);
-    goto ERROR_RETURN;
-    }
-  }
-
-/* Check that one specific host (strictly, IP address) is not hogging
-resources. This is done here to prevent a denial of service attack by someone
-forcing you to fork lots of times before denying service. The value of
-smtp_accept_max_per_host is a string which is expanded. This makes it possible
-to provide host-specific limits according to $sender_host address, but because
-this is in the daemon mainline, only fast expansions (such as inline address
-checks) should be used. The documentation is full of warnings. */
-
-GET_OPTION("smtp_accept_max_per_host");
-if (smtp_accept_max_per_host)
-  {
-  uschar * expanded = expand_string(smtp_accept_max_per_host);
-  if (!expanded)
-    {
-    if (!f.expand_string_forcedfail)
-      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
-        "failed for %Y: %s", whofrom, expand_string_message);
-    }
-  /* For speed, interpret a decimal number inline here */
-  else
-    {
-    uschar * s = expanded;
-    while (isdigit(*s))
-      max_for_this_host = max_for_this_host * 10 + *s++ - '0';
-    if (*s)
-      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
-        "for %Y contains non-digit: %s", whofrom, expanded);
-    }
-  }
-
-/* If we have fewer total connections than max_for_this_host, we can skip the
-tedious per host_address checks. Note that at this stage smtp_accept_count
-contains the count of *other* connections, not including this one. */
-
-if (  smtp_slots
-   && max_for_this_host > 0 && smtp_accept_count >= max_for_this_host)
-  {
-  int host_accept_count = 0;
-  int other_host_count = 0;    /* keep a count of non matches to optimise */
-
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].host_address)
-      {
-      if (Ustrcmp(sender_host_address, smtp_slots[i].host_address) == 0)
-       host_accept_count++;
-      else
-       other_host_count++;
-
-      /* Testing all these strings is expensive - see if we can drop out
-      early, either by hitting the target, or finding there are not enough
-      connections left to make the target. */
-
-      if (  host_accept_count >= max_for_this_host
-         || smtp_accept_count - other_host_count < max_for_this_host)
-       break;
-      }
 
-  if (host_accept_count >= max_for_this_host)
-    {
-    DEBUG(D_any) debug_printf("rejecting SMTP connection: too many from this "
-      "IP address: count=%d max=%d\n",
-      host_accept_count, max_for_this_host);
-    smtp_printf("421 Too many concurrent SMTP connections "
-      "from this IP address; please try again later.\r\n", SP_NO_MORE);
-    log_write(L_connection_reject,
-              LOG_MAIN, "Connection from %Y refused: too many connections "
-      "from that IP address", whofrom);
-    search_tidyup();
-    goto ERROR_RETURN;
-    }
-  }
 
-/* OK, the connection count checks have been passed.
-Now we can fork the accepting process; do a lookup tidy, just in case any
-expansion above did a lookup. */
+/*************************************************
+*          Handle an SMTP session                *
+*************************************************/
 
-search_tidyup();
-pid = exim_fork(US"daemon-accept");
+/* This is run in a process forked for the connection, or in a pre-forked
+worker. A forked process ends with the session; a worker returns at the end of
+a session which finishes in an orderly way, so as to take another.
 
-/* Handle the child process */
+Arguments:
+  whofrom	  identification of the client, for logging
+  save_log_selector  log selector to use
+  accept_socket	  socket of the call
+  fd_polls	  daemon sockets to close, or NULL for a worker
+  listen_socket_count  count of listening sockets
+*/
 
-if (pid == 0)
-  {
-  int queue_only_reason = 0;
-  int old_pool = store_pool;
-  int save_debug_selector = debug_selector;
-  BOOL local_queue_only;
-  BOOL session_local_queue_only;
+static void
+smtp_session(gstring * whofrom, int save_log_selector, int accept_socket,
+  struct pollfd * fd_polls, int listen_socket_count)
+{
+int queue_only_reason = 0;
+int old_pool = store_pool;
+int save_debug_selector = debug_selector;
+BOOL local_queue_only;
+BOOL session_local_queue_only;
+rmark reset_point;
 #ifdef SA_NOCLDWAIT
-  struct sigaction act;
+struct sigaction act;
 #endif
 
-  smtp_accept_count++;    /* So that it includes this process */
-  set_connection_id();
+smtp_connection_reset();
+smtp_accept_count++;    /* So that it includes this process */
+set_connection_id();
 
-  /* Log the connection if requested.
-  In order to minimize the cost (because this is going to happen for every
-  connection), do a preliminary selector test here. This saves ploughing through
-  the generalized logging code each time when the selector is false. If the
-  selector is set, check whether the host is on the list for logging. If not,
-  arrange to unset the selector in the subprocess.
+/* Log the connection if requested.
+In order to minimize the cost (because this is going to happen for every
+connection), do a preliminary selector test here. This saves ploughing through
+the generalized logging code each time when the selector is false. If the
+selector is set, check whether the host is on the list for logging. If not,
+arrange to unset the selector in the subprocess.
 
-  jgh 2023/08/08 :- moved this logging in from the parent process, just
-  pre-fork.  There was a claim back from 4.21 (when it was moved from
-  smtp_start_session()) that smtp_accept_count could have become out-of-date by
-  the time the child could log it, and I can't see how that could happen. */
+jgh 2023/08/08 :- moved this logging in from the parent process, just
+pre-fork.  There was a claim back from 4.21 (when it was moved from
+smtp_start_session()) that smtp_accept_count could have become out-of-date by
+the time the child could log it, and I can't see how that could happen. */
 
-  if (LOGGING(smtp_connection))
-    {
-    uschar * list = hosts_connection_nolog;
-    memset(sender_host_cache, 0, sizeof(sender_host_cache));
-    if (list && verify_check_host(&list) == OK)
-      save_log_selector &= ~L_smtp_connection;
-    else if (LOGGING(connection_id))
-      log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %Y "
-	"Ci=%s (TCP/IP connection count = %d)",
-	whofrom, connection_id, smtp_accept_count);
-    else
-      log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %Y "
-	"(TCP/IP connection count = %d)", whofrom, smtp_accept_count);
-    }
+if (LOGGING(smtp_connection))
+  {
+  uschar * list = hosts_connection_nolog;
+  memset(sender_host_cache, 0, sizeof(sender_host_cache));
+  if (list && verify_check_host(&list) == OK)
+    save_log_selector &= ~L_smtp_connection;
+  else if (LOGGING(connection_id))
+    log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %Y "
+      "Ci=%s (TCP/IP connection count = %d)",
+      whofrom, connection_id, smtp_accept_count);
+  else
+    log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %Y "
+      "(TCP/IP connection count = %d)", whofrom, smtp_accept_count);
+  }
 
-  /* If the listen backlog was over the monitoring level, log it. */
+/* If the listen backlog was over the monitoring level, log it. */
 
-  if (smtp_listen_backlog > smtp_backlog_monitor)
-    log_write(0, LOG_MAIN, "listen backlog %d I=[%s]:%d",
-		smtp_listen_backlog, interface_address, interface_port);
+if (smtp_listen_backlog > smtp_backlog_monitor)
+  log_write(0, LOG_MAIN, "listen backlog %d I=[%s]:%d",
+	      smtp_listen_backlog, interface_address, interface_port);
 
-  /* May have been modified for the subprocess */
+/* May have been modified for the subprocess */
 
-  *log_selector = save_log_selector;
+*log_selector = save_log_selector;
 
-  /* Get the local interface address into permanent store */
+/* Get the local interface address into permanent store */
 
-  store_pool = POOL_PERM;
-  interface_address = string_copy(interface_address);
-  store_pool = old_pool;
+store_pool = POOL_PERM;
+interface_address = string_copy(interface_address);
+store_pool = old_pool;
 
-  /* Check for a tls-on-connect port */
+/* Check for a tls-on-connect port */
 
-  if (host_is_tls_on_connect_port(interface_port)) tls_in.on_connect = TRUE;
+if (host_is_tls_on_connect_port(interface_port)) tls_in.on_connect = TRUE;
 
-  /* Expand smtp_active_hostname if required. We do not do this any earlier,
-  because it may depend on the local interface address (indeed, that is most
-  likely what it depends on.) */
+/* Expand smtp_active_hostname if required. We do not do this any earlier,
+because it may depend on the local interface address (indeed, that is most
+likely what it depends on.) */
 
-  smtp_active_hostname = primary_hostname;
-  GET_OPTION("smtp_active_hostname");
-  if (raw_active_hostname)
+smtp_active_hostname = primary_hostname;
+GET_OPTION("smtp_active_hostname");
+if (raw_active_hostname)
+  {
+  uschar * nah = expand_string(raw_active_hostname);
+  if (!nah)
     {
-    uschar * nah = expand_string(raw_active_hostname);
-    if (!nah)
+    if (!f.expand_string_forcedfail)
       {
-      if (!f.expand_string_forcedfail)
-        {
-        log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand %q "
-          "(smtp_active_hostname): %s", raw_active_hostname,
-          expand_string_message);
-        smtp_printf("421 Local configuration error; "
-          "please try again later.\r\n", SP_NO_MORE);
-        search_tidyup();
-        exim_underbar_exit(EXIT_FAILURE);
-        }
+      log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand %q "
+        "(smtp_active_hostname): %s", raw_active_hostname,
+        expand_string_message);
+      smtp_printf("421 Local configuration error; "
+        "please try again later.\r\n", SP_NO_MORE);
+      search_tidyup();
+      exim_underbar_exit(EXIT_FAILURE);
       }
-    else if (*nah) smtp_active_hostname = nah;
     }
+  else if (*nah) smtp_active_hostname = nah;
+  }
 
-  /* Initialize the queueing flags */
+/* Initialize the queueing flags */
 
-  queue_check_only();
-  session_local_queue_only = queue_only;
+queue_check_only();
+session_local_queue_only = queue_only;
 
-  /* Close the listening sockets, and set the SIGCHLD handler to SIG_IGN.
-  We also attempt to set things up so that children are automatically reaped,
-  but just in case this isn't available, there's a paranoid waitpid() in the
-  loop too (except for systems where we are sure it isn't needed). See the more
-  extensive comment before the reception loop in exim.c for a fuller
-  explanation of this logic. */
+/* Close the listening sockets (a worker has done so already), and set the
+SIGCHLD handler to SIG_IGN. We also attempt to set things up so that children
+are automatically reaped, but just in case this isn't available, there's a
+paranoid waitpid() in the loop too (except for systems where we are sure it
+isn't needed). See the more extensive comment before the reception loop in
+exim.c for a fuller explanation of this logic. */
 
+if (fd_polls)
   close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
 
-  /* Set FD_CLOEXEC on the SMTP socket. We don't want any rogue child processes
-  to be able to communicate with them, under any circumstances. */
-  (void)fcntl(accept_socket, F_SETFD,
-              fcntl(accept_socket, F_GETFD) | FD_CLOEXEC);
-  (void)fcntl(smtp_in_fd, F_SETFD,
-              fcntl(smtp_in_fd, F_GETFD) | FD_CLOEXEC);
+/* Set FD_CLOEXEC on the SMTP socket. We don't want any rogue child processes
+to be able to communicate with them, under any circumstances. */
+(void)fcntl(accept_socket, F_SETFD,
+            fcntl(accept_socket, F_GETFD) | FD_CLOEXEC);
+(void)fcntl(smtp_in_fd, F_SETFD,
+            fcntl(smtp_in_fd, F_GETFD) | FD_CLOEXEC);
 
 #ifdef SA_NOCLDWAIT
-  act.sa_handler = SIG_IGN;
-  sigemptyset(&(act.sa_mask));
-  act.sa_flags = SA_NOCLDWAIT;
-  sigaction(SIGCHLD, &act, NULL);
+act.sa_handler = SIG_IGN;
+sigemptyset(&(act.sa_mask));
+act.sa_flags = SA_NOCLDWAIT;
+sigaction(SIGCHLD, &act, NULL);
 #else
-  signal(SIGCHLD, SIG_IGN);
+signal(SIGCHLD, SIG_IGN);
 #endif
-  signal(SIGTERM, SIG_DFL);
-  signal(SIGINT, SIG_DFL);
+signal(SIGTERM, SIG_DFL);
+signal(SIGINT, SIG_DFL);
 
-  /* Attempt to get an id from the sending machine via the RFC 1413
-  protocol. We do this in the sub-process in order not to hold up the
-  main process if there is any delay. Then set up the fullhost information
-  in case there is no HELO/EHLO.
+/* Attempt to get an id from the sending machine via the RFC 1413
+protocol. We do this in the sub-process in order not to hold up the
+main process if there is any delay. Then set up the fullhost information
+in case there is no HELO/EHLO.
 
-  If debugging is enabled only for the daemon, we must turn if off while
-  finding the id, but turn it on again afterwards so that information about the
-  incoming connection is output. */
+If debugging is enabled only for the daemon, we must turn if off while
+finding the id, but turn it on again afterwards so that information about the
+incoming connection is output. */
 
-  if (f.debug_daemon) debug_selector = 0;
-  verify_get_ident(IDENT_PORT);
-  host_build_sender_fullhost();
-  debug_selector = save_debug_selector;
+if (f.debug_daemon) debug_selector = 0;
+verify_get_ident(IDENT_PORT);
+host_build_sender_fullhost();
+debug_selector = save_debug_selector;
 
-  DEBUG(D_any)
-    debug_printf("Process %d is handling incoming connection from %s\n",
-      (int)getpid(), sender_fullhost);
+DEBUG(D_any)
+  debug_printf("Process %d is handling incoming connection from %s\n",
+    (int)getpid(), sender_fullhost);
 
-  /* Now disable debugging permanently if it's required only for the daemon
-  process. */
+/* Now disable debugging permanently if it's required only for the daemon
+process. */
 
-  if (f.debug_daemon) debug_selector = 0;
+if (f.debug_daemon) debug_selector = 0;
 
-  /* If there are too many child processes for immediate delivery,
-  set the session_local_queue_only flag, which is initialized from the
-  configured value and may therefore already be TRUE. Leave logging
-  till later so it will have a message id attached. Note that there is no
-  possibility of re-calculating this per-message, because the value of
-  smtp_accept_count does not change in this subprocess. */
+/* If there are too many child processes for immediate delivery,
+set the session_local_queue_only flag, which is initialized from the
+configured value and may therefore already be TRUE. Leave logging
+till later so it will have a message id attached. Note that there is no
+possibility of re-calculating this per-message, because the value of
+smtp_accept_count does not change in this subprocess. */
 
-  if (smtp_accept_queue > 0 && smtp_accept_count > smtp_accept_queue)
-    {
-    session_local_queue_only = TRUE;
-    queue_only_reason = 1;
-    }
+if (smtp_accept_queue > 0 && smtp_accept_count > smtp_accept_queue)
+  {
+  session_local_queue_only = TRUE;
+  queue_only_reason = 1;
+  }
 
-  /* Handle the start of the SMTP session, then loop, accepting incoming
-  messages from the SMTP connection. The end will come at the QUIT command,
-  when smtp_setup_msg() returns 0. A break in the connection causes the
-  process to die (see accept.c).
+/* Handle the start of the SMTP session, then loop, accepting incoming
+messages from the SMTP connection. The end will come at the QUIT command,
+when smtp_setup_msg() returns 0. A break in the connection causes the
+process to die (see accept.c).
 
-  NOTE: We do *not* call smtp_log_no_mail() if smtp_start_session() fails,
-  because a log line has already been written for all its failure exists
-  (usually "connection refused: <reason>") and writing another one is
-  unnecessary clutter. */
+NOTE: We do *not* call smtp_log_no_mail() if smtp_start_session() fails,
+because a log line has already been written for all its failure exists
+(usually "connection refused: <reason>") and writing another one is
+unnecessary clutter. */
 
-  if (!smtp_start_session())
-    {
-    smtp_fflush(SFF_NO_UNCORK);
-    search_tidyup();
-    exim_underbar_exit(EXIT_SUCCESS);
-    }
+if (!smtp_start_session())
+  {
+  smtp_fflush(SFF_NO_UNCORK);
+  search_tidyup();
+  if (worker_sock >= 0) return;
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
 
-  for (;;)
-    {
-    int rc;
-    message_id[0] = 0;            /* Clear out any previous message_id */
-    reset_point = store_mark();   /* Save current store high water point */
+for (;;)
+  {
+  int rc;
+  message_id[0] = 0;            /* Clear out any previous message_id */
+  reset_point = store_mark();   /* Save current store high water point */
 
-    DEBUG(D_any)
-      debug_printf("Process %d is ready for new message\n", (int)getpid());
+  DEBUG(D_any)
+    debug_printf("Process %d is ready for new message\n", (int)getpid());
 
-    /* Smtp_setup_msg() returns 0 on QUIT or if the call is from an
-    unacceptable host or if an ACL "drop" command was triggered, -1 on
-    connection lost or synprot-error, and +1 on validly reaching DATA.
-    Receive_msg() almost always returns TRUE when smtp_input is true; just retry
-    if no message was accepted (can happen for invalid message parameters).
-    However, it can yield FALSE if the connection was forcibly dropped by the
-    DATA ACL. */
+  /* Smtp_setup_msg() returns 0 on QUIT or if the call is from an
+  unacceptable host or if an ACL "drop" command was triggered, -1 on
+  connection lost or synprot-error, and +1 on validly reaching DATA.
+  Receive_msg() almost always returns TRUE when smtp_input is true; just retry
+  if no message was accepted (can happen for invalid message parameters).
+  However, it can yield FALSE if the connection was forcibly dropped by the
+  DATA ACL. */
 
-    if ((rc = smtp_setup_msg()) <= 0)		/* bad smtp_setup_msg() */
+  if ((rc = smtp_setup_msg()) <= 0)		/* bad smtp_setup_msg() */
+    {
+    if (smtp_out_fd >= 0 && smtp_in_fd >= 0)
       {
-      if (smtp_out_fd >= 0 && smtp_in_fd >= 0)
-	{
-	uschar buf[128];
+      uschar buf[128];
 
-	smtp_fflush(SFF_NO_UNCORK);
+      smtp_fflush(SFF_NO_UNCORK);
 
-	/* drain socket, for clean TCP FINs */
-	if (fcntl(smtp_in_fd, F_SETFL, O_NONBLOCK) == 0)
-	  for(int i = 16; read(smtp_in_fd, buf, sizeof(buf)) > 0 && i > 0; )
-	    i--;
-	}
-      cancel_cutthrough_connection(TRUE, US"message setup dropped");
-      search_tidyup();
-      smtp_log_no_mail();                 /* Log no mail if configured */
-
-      /*XXX should we pause briefly, hoping that the client will be the
-      active TCP closer hence get the TCP_WAIT endpoint? */
-      DEBUG(D_receive) debug_printf("SMTP>>(close on process exit)\n");
-      exim_underbar_exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+      /* drain socket, for clean TCP FINs */
+      if (fcntl(smtp_in_fd, F_SETFL, O_NONBLOCK) == 0)
+	for(int i = 16; read(smtp_in_fd, buf, sizeof(buf)) > 0 && i > 0; )
+	  i--;
       }
+    cancel_cutthrough_connection(TRUE, US"message setup dropped");
+    search_tidyup();
+    smtp_log_no_mail();                 /* Log no mail if configured */
 
-     {
-      BOOL ok = receive_msg(FALSE);
-      search_tidyup();                    /* Close cached databases */
-      if (!ok)                            /* Connection was dropped */
-        {
-	cancel_cutthrough_connection(TRUE, US"receive dropped");
-        smtp_fflush(SFF_NO_UNCORK);
-        smtp_log_no_mail();               /* Log no mail if configured */
-        exim_underbar_exit(EXIT_SUCCESS);
-        }
-      if (!message_id[0]) continue;	/* No message was accepted */
-     }
+    /*XXX should we pause briefly, hoping that the client will be the
+    active TCP closer hence get the TCP_WAIT endpoint? */
+    if (worker_sock >= 0) return;
+    DEBUG(D_receive) debug_printf("SMTP>>(close on process exit)\n");
+    exim_underbar_exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-    /* Show the recipients when debugging */
+   {
+    BOOL ok = receive_msg(FALSE);
+    search_tidyup();                    /* Close cached databases */
+    if (!ok)                            /* Connection was dropped */
+      {
+      cancel_cutthrough_connection(TRUE, US"receive dropped");
+      smtp_fflush(SFF_NO_UNCORK);
+      smtp_log_no_mail();               /* Log no mail if configured */
+      if (worker_sock >= 0) return;
+      exim_underbar_exit(EXIT_SUCCESS);
+      }
+    if (!message_id[0]) continue;	/* No message was accepted */
+   }
 
-    DEBUG(D_receive)
+  /* Show the recipients when debugging */
+
+  DEBUG(D_receive)
+    {
+    if (sender_address)
+      debug_printf("Sender: %s\n", sender_address);
+    if (recipients_list)
       {
-      if (sender_address)
-        debug_printf("Sender: %s\n", sender_address);
-      if (recipients_list)
-        {
-        debug_printf("Recipients:\n");
-        for (int i = 0; i < recipients_count; i++)
-          debug_printf("  %s\n", recipients_list[i].address);
-        }
+      debug_printf("Recipients:\n");
+      for (int i = 0; i < recipients_count; i++)
+        debug_printf("  %s\n", recipients_list[i].address);
       }
+    }
 
-    /* A message has been accepted. Clean up any previous delivery processes
-    that have completed and are defunct, on systems where they don't go away
-    by themselves (see comments when setting SIG_IGN above). On such systems
-    (if any) these delivery processes hang around after termination until
-    the next message is received. */
+  /* A message has been accepted. Clean up any previous delivery processes
+  that have completed and are defunct, on systems where they don't go away
+  by themselves (see comments when setting SIG_IGN above). On such systems
+  (if any) these delivery processes hang around after termination until
+  the next message is received. */
 
-    #ifndef SIG_IGN_WORKS
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    #endif
+  #ifndef SIG_IGN_WORKS
+  while (waitpid(-1, NULL, WNOHANG) > 0);
+  #endif
 
-    /* Reclaim up the store used in accepting this message */
+  /* Reclaim up the store used in accepting this message */
 
-      {
-      int r = receive_messagecount;
-      BOOL q = f.queue_only_policy;
-      smtp_reset(reset_point);
-      reset_point = NULL;
-      f.queue_only_policy = q;
-      receive_messagecount = r;
-      }
+    {
+    int r = receive_messagecount;
+    BOOL q = f.queue_only_policy;
+    smtp_reset(reset_point);
+    reset_point = NULL;
+    f.queue_only_policy = q;
+    receive_messagecount = r;
+    }
 
-    /* If queue_only is set or if there are too many incoming connections in
-    existence, session_local_queue_only will be TRUE. If it is not, check
-    whether we have received too many messages in this session for immediate
-    delivery. */
+  /* If queue_only is set or if there are too many incoming connections in
+  existence, session_local_queue_only will be TRUE. If it is not, check
+  whether we have received too many messages in this session for immediate
+  delivery. */
 
-    if (!session_local_queue_only &&
-        smtp_accept_queue_per_connection > 0 &&
-        receive_messagecount > smtp_accept_queue_per_connection)
-      {
-      session_local_queue_only = TRUE;
-      queue_only_reason = 2;
-      }
+  if (!session_local_queue_only &&
+      smtp_accept_queue_per_connection > 0 &&
+      receive_messagecount > smtp_accept_queue_per_connection)
+    {
+    session_local_queue_only = TRUE;
+    queue_only_reason = 2;
+    }
 
-    /* Initialize local_queue_only from session_local_queue_only. If it is not
-    true, and queue_only_load is set, check that the load average is below it.
-    If local_queue_only is set by this means, we also set if for the session if
-    queue_only_load_latch is true (the default). This means that, once set,
-    local_queue_only remains set for any subsequent messages on the same SMTP
-    connection. This is a deliberate choice; even though the load average may
-    fall, it doesn't seem right to deliver later messages on the same call when
-    not delivering earlier ones. However, the are special circumstances such as
-    very long-lived connections from scanning appliances where this is not the
-    best strategy. In such cases, queue_only_load_latch should be set false. */
-
-    if (  !(local_queue_only = session_local_queue_only)
-       && queue_only_load >= 0
-       && (local_queue_only = (load_average = OS_GETLOADAVG()) > queue_only_load)
-       )
-      {
-      queue_only_reason = 3;
-      if (queue_only_load_latch) session_local_queue_only = TRUE;
-      }
+  /* Initialize local_queue_only from session_local_queue_only. If it is not
+  true, and queue_only_load is set, check that the load average is below it.
+  If local_queue_only is set by this means, we also set if for the session if
+  queue_only_load_latch is true (the default). This means that, once set,
+  local_queue_only remains set for any subsequent messages on the same SMTP
+  connection. This is a deliberate choice; even though the load average may
+  fall, it doesn't seem right to deliver later messages on the same call when
+  not delivering earlier ones. However, the are special circumstances such as
+  very long-lived connections from scanning appliances where this is not the
+  best strategy. In such cases, queue_only_load_latch should be set false. */
+
+  if (  !(local_queue_only = session_local_queue_only)
+     && queue_only_load >= 0
+     && (local_queue_only = (load_average = OS_GETLOADAVG()) > queue_only_load)
+     )
+    {
+    queue_only_reason = 3;
+    if (queue_only_load_latch) session_local_queue_only = TRUE;
+    }
 
-    /* Log the queueing here, when it will get a message id attached, but
-    not if queue_only is set (case 0). */
+  /* Log the queueing here, when it will get a message id attached, but
+  not if queue_only is set (case 0). */
 
-    if (local_queue_only) switch(queue_only_reason)
-      {
-      case 1: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: too many connections "
-                "(%d, max %d)", smtp_accept_count, smtp_accept_queue);
-	      break;
+  if (local_queue_only) switch(queue_only_reason)
+    {
+    case 1: log_write(L_delay_delivery,
+              LOG_MAIN, "no immediate delivery: too many connections "
+              "(%d, max %d)", smtp_accept_count, smtp_accept_queue);
+	    break;
 
-      case 2: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: more than %d messages "
-                "received in one connection", smtp_accept_queue_per_connection);
-	      break;
+    case 2: log_write(L_delay_delivery,
+              LOG_MAIN, "no immediate delivery: more than %d messages "
+              "received in one connection", smtp_accept_queue_per_connection);
+	    break;
 
-      case 3: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: load average %.2f",
-                (double)load_average/1000.0);
-	      break;
-      }
+    case 3: log_write(L_delay_delivery,
+              LOG_MAIN, "no immediate delivery: load average %.2f",
+              (double)load_average/1000.0);
+	    break;
+    }
 
-    /* If a delivery attempt is required, spin off a new process to handle it.
-    If we are not root, we have to re-exec exim unless deliveries are being
-    done unprivileged. */
+  /* If a delivery attempt is required, spin off a new process to handle it.
+  If we are not root, we have to re-exec exim unless deliveries are being
+  done unprivileged. */
 
-    else if (  (!f.queue_only_policy || f.queue_smtp)
-            && !f.deliver_freeze)
-      {
-      pid_t dpid;
+  else if (  (!f.queue_only_policy || f.queue_smtp)
+          && !f.deliver_freeze)
+    {
+    pid_t dpid;
 
-      /* We used to flush smtp_out before forking so that buffered data was not
-      duplicated, but now we want to pipeline the responses for data and quit.
-      Instead, hard-close the fd underlying smtp_out right after fork to discard
-      the data buffer. */
+    /* We used to flush smtp_out before forking so that buffered data was not
+    duplicated, but now we want to pipeline the responses for data and quit.
+    Instead, hard-close the fd underlying smtp_out right after fork to discard
+    the data buffer. */
 
-      if ((dpid = exim_fork(US"daemon-accept-delivery")) == 0)
-        {
-        (void)close(smtp_in_fd);
-	(void)close(smtp_out_fd);
-	smtp_in_fd = smtp_out_fd = -1;
+    if ((dpid = exim_fork(US"daemon-accept-delivery")) == 0)
+      {
+      (void)close(smtp_in_fd);
+      (void)close(smtp_out_fd);
+      smtp_in_fd = smtp_out_fd = -1;
+      if (worker_sock >= 0) (void)close(worker_sock);
 
-        /* Don't ever molest the parent's SSL connection, but do clean up
-        the data structures if necessary. */
+      /* Don't ever molest the parent's SSL connection, but do clean up
+      the data structures if necessary. */
 
 #ifndef DISABLE_TLS
-        tls_close(NULL, TLS_NO_SHUTDOWN);
+      tls_close(NULL, TLS_NO_SHUTDOWN);
 #endif
 
-        /* Reset SIGHUP and SIGCHLD in the child in both cases. */
+      /* Reset SIGHUP and SIGCHLD in the child in both cases. */
 
-        signal(SIGHUP,  SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-        signal(SIGTERM, SIG_DFL);
-        signal(SIGINT, SIG_DFL);
+      signal(SIGHUP,  SIG_DFL);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
 
-        if (geteuid() != root_uid && !deliver_drop_privilege)
-	  delivery_re_exec(CEE_EXEC_PANIC);
-          /* Control does not return here. */
+      if (geteuid() != root_uid && !deliver_drop_privilege)
+	delivery_re_exec(CEE_EXEC_PANIC);
+        /* Control does not return here. */
 
-        /* No need to re-exec; SIGALRM remains set to the default handler */
-
-        (void) deliver_message(message_id, FALSE, FALSE);
-        search_tidyup();
-        exim_underbar_exit(EXIT_SUCCESS);
-        }
+      /* No need to re-exec; SIGALRM remains set to the default handler */
 
-      if (dpid > 0)
-        {
-	release_cutthrough_connection(US"passed for delivery");
-        DEBUG(D_any) debug_printf("forked delivery process %d\n", (int)dpid);
-        }
-      else
-	{
-	cancel_cutthrough_connection(TRUE, US"delivery fork failed");
-        log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery process fork "
-          "failed: %s", strerror(errno));
-	}
+      (void) deliver_message(message_id, FALSE, FALSE);
+      search_tidyup();
+      exim_underbar_exit(EXIT_SUCCESS);
       }
-    }
-  }
 
-
-/* Carrying on in the parent daemon process... Can't do much if the fork
-failed. Otherwise, keep count of the number of accepting processes and
-remember the pid for ticking off when the child completes. */
-
-if (pid < 0)
-  never_error(US"daemon: accept process fork failed", US"Fork failed", errno);
-else if (smtp_slots)
-  {
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].pid <= 0)
+    if (dpid > 0)
       {
-      smtp_slots[i].pid = pid;
-      /* Connection closes come asyncronously, so we cannot stack this store */
-      if (smtp_accept_max_per_host)
-        smtp_slots[i].host_address = string_copy_malloc(sender_host_address);
-      smtp_accept_count++;
-      break;
+      release_cutthrough_connection(US"passed for delivery");
+      DEBUG(D_any) debug_printf("forked delivery process %d\n", (int)dpid);
       }
-  DEBUG(D_any) debug_printf("%d SMTP accept process%s running\n",
-    smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
+    else
+      {
+      cancel_cutthrough_connection(TRUE, US"delivery fork failed");
+      log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery process fork "
+        "failed: %s", strerror(errno));
+      }
+    }
   }
+}
 
-/* Get here via goto in error cases */
 
-ERROR_RETURN:
+/*************************************************
+*          Close down an SMTP call               *
+*************************************************/
 
 /* Close the streams associated with the socket which will also close the
 socket fds in this process. We can't do anything if fclose() fails, but
@@ -769,6 +980,9 @@ manifest itself as a broken pipe, so drop that one too. If the streams don't
 exist, something went wrong while setting things up. Make sure the socket
 descriptors are closed, in order to drop the connection. */
 
+static void
+smtp_call_close(void)
+{
 if (smtp_out_fd >= 0)
   {
   if (close(smtp_out_fd) != 0 && errno != ECONNRESET && errno != EPIPE)
@@ -784,904 +998,2136 @@ if (smtp_in_fd >= 0)
       strerror(errno));
   smtp_in_fd = -1;
   }
-
-/* Release any store used in this process, including the store used for holding
-the incoming host address and an expanded active_hostname. */
-
-log_close_all();
-interface_address = sender_host_name = sender_host_address = NULL;
-store_reset(reset_point);
 }
 
 
 
-
 /*************************************************
-*       Check wildcard listen special cases      *
+*          Pre-forked SMTP workers               *
 *************************************************/
 
-/* This function is used when binding and listening on lists of addresses and
-ports. It tests for special cases of wildcard listening, when IPv4 and IPv6
-sockets may interact in different ways in different operating systems. It is
-passed an error number, the list of listening addresses, and the current
-address. Two checks are available: for a previous wildcard IPv6 address, or for
-a following wildcard IPv4 address, in both cases on the same port.
+/* With daemon_smtp_workers set, a listening daemon process keeps a pool of
+processes forked in advance. A connection which has passed the checks made in
+the daemon is handed to an idle worker, along with the details needed to set
+up for it, over a unix-domain socketpair using SCM_RIGHTS; only if there is no
+idle worker is a process forked for it. A worker handles connections in turn,
+tidying up after each (see smtp_session_restore(); the connection state is
+cleared, as for a forked process, by smtp_connection_reset()) and then writing
+a byte back to say it is idle, until it has handled daemon_smtp_worker_sessions
+or a connection leaves state it cannot tidy. Then it exits, and the daemon
+starts another. While a worker is busy, its pid occupies the connection slot. */
 
-In practice, pairs of wildcard addresses should be adjacent in the address list
-because they are sorted that way below.
+static BOOL
+smtp_worker_send(smtp_worker * w, int fd, const smtp_worker_call * call)
+{
+struct msghdr msg = {0};
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf = {0};
+struct cmsghdr * cmsg;
+struct iovec vec = {.iov_base = US call, .iov_len = sizeof(*call)};
+ssize_t n;
+
+msg.msg_control = &cmsgbuf.buf;
+msg.msg_controllen = sizeof(cmsgbuf.buf);
+cmsg = CMSG_FIRSTHDR(&msg);
+cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+cmsg->cmsg_level = SOL_SOCKET;
+cmsg->cmsg_type = SCM_RIGHTS;
+memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+
+while ((n = sendmsg(w->fd, &msg, 0)) < 0 && errno == EINTR) ;
+return n == sizeof(*call);
+}
 
-Arguments:
-  eno            the error number
-  addresses      the list of addresses
-  ipa            the current IP address
-  back           if TRUE, check for previous wildcard IPv6 address
-                 if FALSE, check for a following wildcard IPv4 address
 
-Returns:         TRUE or FALSE
-*/
+/* Wait for the daemon to hand over a connection. Returns the socket, or -1 if
+the daemon has gone away. */
 
-static BOOL
-check_special_case(int eno, ip_address_item *addresses, ip_address_item *ipa,
-  BOOL back)
+static int
+smtp_worker_receive(smtp_worker_call * call)
 {
-ip_address_item *ipa2;
+struct msghdr msg = {0};
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf = {0};
+struct cmsghdr * cmsg;
+struct iovec vec = {.iov_base = US call, .iov_len = sizeof(*call)};
+ssize_t n;
+int fd;
 
-/* For the "back" case, if the failure was "address in use" for a wildcard IPv4
-address, seek a previous IPv6 wildcard address on the same port. As it is
-previous, it must have been successfully bound and be listening. Flag it as a
-"6 including 4" listener. */
+msg.msg_control = &cmsgbuf.buf;
+msg.msg_controllen = sizeof(cmsgbuf.buf);
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+
+while ((n = recvmsg(worker_sock, &msg, 0)) < 0 && errno == EINTR) ;
+if (  n != sizeof(*call)
+   || !(cmsg = CMSG_FIRSTHDR(&msg))
+   || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+  return -1;
+memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+return fd;
+}
 
-if (back)
+
+/* The body of a worker process. Does not return. */
+
+static void
+smtp_worker_loop(void)
+{
+int save_log_selector = *log_selector;
+
+smtp_input = TRUE;
+smtp_session_save();
+
+for (int sessions = 1; ; sessions++)
   {
-  if (eno != EADDRINUSE || ipa->address[0] != 0) return FALSE;
-  for (ipa2 = addresses; ipa2 != ipa; ipa2 = ipa2->next)
+  smtp_worker_call call;
+  rmark reset_point = store_mark();
+  gstring * whofrom;
+  int fd;
+
+  set_process_info("daemon(%s): SMTP worker, idle", version_string);
+  if ((fd = smtp_worker_receive(&call)) < 0)
+    exim_underbar_exit(EXIT_SUCCESS);		/* the daemon has gone */
+
+  smtp_accept_count = call.accept_count;
+  smtp_listen_backlog = call.listen_backlog;
+  load_average = call.load_average;
+  if ((whofrom = smtp_call_setup(fd, (struct sockaddr *)&call.accepted)))
+    smtp_session(whofrom, save_log_selector, fd, NULL, 0);
+
+  smtp_call_close();
+  search_tidyup();
+  log_close_all();
+  if (sessions >= daemon_smtp_worker_sessions || !smtp_session_restore())
     {
-    if (ipa2->address[1] == 0 && ipa2->port == ipa->port)
-      {
-      ipa2->v6_include_v4 = TRUE;
-      return TRUE;
-      }
+    DEBUG(D_receive) debug_printf("SMTP>>(close on process exit)\n");
+    exim_underbar_exit(EXIT_SUCCESS);
     }
+  *log_selector = save_log_selector;
+  store_reset(reset_point);
+
+  DEBUG(D_any) debug_printf("worker %d is idle\n", (int)getpid());
+  if (write(worker_sock, "", 1) != 1)
+    exim_underbar_exit(EXIT_SUCCESS);
   }
+}
 
-/* For the "forward" case, if the current address is a wildcard IPv6 address,
-we seek a following wildcard IPv4 address on the same port. */
 
-else
+/* Start a worker, in the daemon. Its pollfd records the socketpair, so that
+the daemon learns when it is idle. */
+
+static void
+smtp_worker_start(smtp_worker * w, struct pollfd * fd_polls,
+  int listen_socket_count)
+{
+struct pollfd * p = smtp_worker_polls + (w - smtp_workers);
+int sv[2];
+pid_t pid;
+
+if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
   {
-  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
-  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
-    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: socketpair for SMTP worker: %s",
+    strerror(errno));
+  return;
   }
+(void) fcntl(sv[0], F_SETFD, fcntl(sv[0], F_GETFD) | FD_CLOEXEC);
+(void) fcntl(sv[1], F_SETFD, fcntl(sv[1], F_GETFD) | FD_CLOEXEC);
 
-return FALSE;
-}
+if ((pid = exim_fork(US"daemon-smtp-worker")) == 0)
+  {
+  (void) close(sv[0]);
+  close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
+  smtp_workers = NULL;
+  acceptor_pids = NULL;
+  queue_runner_slots = NULL;
+  worker_sock = sv[1];
+#ifdef PR_SET_PDEATHSIG
+  (void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGTERM, SIG_DFL);
+  smtp_worker_loop();				/* Does not return */
+  }
 
+(void) close(sv[1]);
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: SMTP worker fork failed: %s",
+    strerror(errno));
+  (void) close(sv[0]);
+  return;
+  }
 
+DEBUG(D_any) debug_printf("started SMTP worker %ld\n", (long)pid);
+w->pid = pid;
+w->fd = p->fd = sv[0];
+w->slot = -1;
+w->busy = FALSE;
+#ifdef EXIM_HAVE_EPOLL
+(void) daemon_poll_add(fd_polls, p - fd_polls);
+#endif
+}
 
 
-/*************************************************
-*         Handle terminating subprocesses        *
-*************************************************/
+/* Start workers for any gaps in the pool */
 
-/* Handle the termination of child processes. Theoretically, this need be done
-only when sigchld_seen is TRUE, but rumour has it that some systems lose
-SIGCHLD signals at busy times, so to be on the safe side, this function is
-called each time round. It shouldn't be too expensive.
+static void
+smtp_workers_start(struct pollfd * fd_polls, int listen_socket_count)
+{
+smtp_workers_wanted = FALSE;
+for (smtp_worker * w = smtp_workers; w < smtp_workers + smtp_worker_count; w++)
+  if (w->pid == 0)
+    smtp_worker_start(w, fd_polls, listen_socket_count);
+}
 
-Arguments:  none
-Returns:    nothing
-*/
 
-static void
-handle_ending_processes(void)
+/* Deal with workers reporting that they are idle, or their sockets closing.
+Returns the number of pollfds dealt with. */
+
+static int
+smtp_worker_events(void)
 {
-int status;
-pid_t pid;
+int count = 0;
 
-while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+for (smtp_worker * w = smtp_workers; w < smtp_workers + smtp_worker_count; w++)
   {
-  DEBUG(D_any)
-    {
-    debug_printf("child %ld ended: status=0x%x\n", (long)pid, status);
-#ifdef WCOREDUMP
-    if (WIFEXITED(status))
-      debug_printf("  normal exit, %d\n", WEXITSTATUS(status));
-    else if (WIFSIGNALED(status))
-      debug_printf("  signal exit, signal %d%s\n", WTERMSIG(status),
-          WCOREDUMP(status) ? " (core dumped)" : "");
-#endif
-    }
+  struct pollfd * p = smtp_worker_polls + (w - smtp_workers);
+  uschar buf[16];
 
-  /* If it's a listening daemon for which we are keeping track of individual
-  subprocesses, deal with an accepting process that has terminated. */
+  if (!p->revents) continue;
+  p->revents = 0;
+  count++;
+  if (w->fd < 0) continue;
 
-  if (smtp_slots)
+  if (recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
     {
-    int i;
-    smtp_slot * sp;
-    for (i = 0, sp = smtp_slots; i < smtp_accept_max; i++, sp++)
-      if (sp->pid == pid)
-        {
-        if (sp->host_address)
-          store_free(sp->host_address);
-        *sp = empty_smtp_slot;
-        if (--smtp_accept_count < 0) smtp_accept_count = 0;
-        DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
-          smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
-        break;
-        }
-    if (i < smtp_accept_max) continue;  /* Found an accepting process */
-    }
-
-  /* If it wasn't an accepting process, see if it was a queue-runner
-  process that we are tracking. */
-
-  if (queue_runner_slots)
-    for (unsigned i = 0; i < queue_runner_slot_count; i++)
+    if (w->slot >= 0)
       {
-      runner_slot * r = queue_runner_slots + i;
-      if (r->pid == pid)
-        {
-        r->pid = 0;			/* free up the slot */
-
-        if (--queue_run_count < 0) queue_run_count = 0;
-        DEBUG(D_any) debug_printf("%d queue-runner process%s now running\n",
-          queue_run_count, queue_run_count == 1 ? "" : "es");
-
-	for (qrunner ** p = &qrunners, * q = qrunners; q; p = &q->next, q = *p)
-	  if (q->name == r->queue_name)
-	    {
-	    if (q->interval)		/* a periodic queue run */
-	      q->run_count--;
-	    else			/* a one-time run */
-	      *p = q->next;		/* drop this qrunner */
-	    break;
-	    }
-        break;
-        }
+      smtp_slot_release(&smtp_slots->slots[w->slot]);
+      smtp_accept_count = smtp_slots->count;
       }
+    w->slot = -1;
+    w->busy = FALSE;
+    DEBUG(D_any) debug_printf("SMTP worker %ld idle\n", (long)w->pid);
+    }
+  else if (errno != EAGAIN && errno != EINTR)
+    {
+    (void) close(w->fd);			/* the worker is going */
+    w->fd = p->fd = -1;
+    w->busy = TRUE;				/* until it is reaped */
+    }
   }
+return count;
 }
 
 
-static void
-set_pid_file_path(void)
+/* Hand a connection to an idle worker, if there is one. Returns its pid, or
+zero if the connection was not handed over. */
+
+static pid_t
+smtp_worker_handoff(int accept_socket, const struct sockaddr * accepted,
+  int slot)
 {
-if (override_pid_file_path)
-  pid_file_path = override_pid_file_path;
+smtp_worker_call call = {
+  .accept_count = smtp_accept_count, .listen_backlog = smtp_listen_backlog,
+  .load_average = load_average };
 
-if (!*pid_file_path)
-  pid_file_path = string_sprintf("%s/exim-daemon.pid", spool_directory);
-
-if (pid_file_path[0] != '/')
-  log_write_die(0, LOG_PANIC_DIE,
-		"pid file path %s must be absolute\n", pid_file_path);
+for (smtp_worker * w = smtp_workers; w < smtp_workers + smtp_worker_count; w++)
+  if (w->pid > 0 && !w->busy)
+    {
+    memcpy(&call.accepted, accepted, sizeof(call.accepted));
+    if (!smtp_worker_send(w, accept_socket, &call))
+      {
+      log_write(0, LOG_MAIN, "daemon: passing connection to SMTP worker %ld "
+	"failed: %s", (long)w->pid, strerror(errno));
+      (void) kill(w->pid, SIGTERM);
+      w->busy = TRUE;				/* until it is reaped */
+      continue;
+      }
+    w->busy = TRUE;
+    w->slot = slot;
+    return w->pid;
+    }
+return 0;
 }
 
 
-enum pid_op { PID_WRITE, PID_CHECK, PID_DELETE };
-
-/* Do various pid file operations as safe as possible. Ideally we'd just
-drop the privileges for creation of the pid file and not care at all about removal of
-the file. FIXME.
-Returns: true on success, false + errno==EACCES otherwise
-*/
 
-static BOOL
-operate_on_pid_file(const enum pid_op operation, const pid_t pid)
-{
-char pid_line[sizeof(int) * 3 + 2];
-const int pid_len = snprintf(pid_line, sizeof(pid_line), "%ld\n", (long)pid);
-BOOL lines_match = FALSE;
-uschar * path, * base, * dir;
+/*************************************************
+*            Handle a connected SMTP call        *
+*************************************************/
 
-const int dir_flags = O_RDONLY | O_NONBLOCK;
-const int base_flags = O_NOFOLLOW | O_NONBLOCK;
-const mode_t base_mode = 0644;
-struct stat sb;
-int cwd_fd = -1, dir_fd = -1, base_fd = -1;
-BOOL success = FALSE;
-errno = EACCES;
+/* This function is called when an SMTP connection has been accepted.
+If there are too many, give an error message and close down. Otherwise
+spin off a sub-process to handle the call. The list of listening sockets
+is required so that they can be closed in the sub-process. Take care not to
+leak store in this process - reset the stacking pool at the end.
 
-set_pid_file_path();
-if (!f.running_in_test_harness && real_uid != root_uid && real_uid != exim_uid) goto cleanup;
-if (pid_len < 2 || pid_len >= (int)sizeof(pid_line)) goto cleanup;
+Arguments:
+  fd_polls        sockets which are listening for incoming calls
+  listen_socket_count   count of listening sockets
+  accept_socket         socket of the current accepted call
+  accepted              socket information about the current call
 
-path = string_copy(pid_file_path);
-if ((base = Ustrrchr(path, '/')) == NULL)	/* should not happen, but who knows */
-  log_write_die(0, LOG_MAIN, "pid file path %q does not contain a '/'", pid_file_path);
+Returns:            nothing
+*/
 
-dir = base != path ? path : US"/";
-*base++ = '\0';
+static void
+handle_smtp_call(struct pollfd * fd_polls, int listen_socket_count,
+  int accept_socket, const struct sockaddr * accepted)
+{
+pid_t pid;
+int max_for_this_host = 0, slot = -1;
+int save_log_selector = *log_selector;
+gstring * whofrom;
 
-if (!dir || *dir != '/') goto cleanup;
-if (!base || !*base || Ustrchr(base, '/') != NULL) goto cleanup;
+rmark reset_point = store_mark();
 
-cwd_fd = open(".", dir_flags);
-if (cwd_fd < 0 || fstat(cwd_fd, &sb) != 0 || !S_ISDIR(sb.st_mode)) goto cleanup;
-dir_fd = open(CS dir, dir_flags);
-if (dir_fd < 0 || fstat(dir_fd, &sb) != 0 || !S_ISDIR(sb.st_mode)) goto cleanup;
+if (!(whofrom = smtp_call_setup(accept_socket, accepted)))
+  goto ERROR_RETURN;
 
-/* emulate openat */
-if (fchdir(dir_fd) != 0) goto cleanup;
-base_fd = open(CS base, O_RDONLY | base_flags);
-if (fchdir(cwd_fd) != 0)
-  log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
+/* Check maximum number of connections. We do not check for reserved
+connections or unacceptable hosts here. That is done in the subprocess because
+it might take some time. With multiple acceptors the count is a snapshot of the
+shared table; it is checked again when a slot is claimed. */
 
-if (base_fd >= 0)
+if (smtp_slots) smtp_accept_count = smtp_slots->count;
+if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
   {
-  char line[sizeof(pid_line)];
-  ssize_t len = -1;
-
-  if (fstat(base_fd, &sb) != 0 || !S_ISREG(sb.st_mode)) goto cleanup;
-  if ((sb.st_mode & 07777) != base_mode || sb.st_nlink != 1) goto cleanup;
-  if (sb.st_size < 2 || sb.st_size >= (off_t)sizeof(line)) goto cleanup;
-
-  len = read(base_fd, line, sizeof(line));
-  if (len != (ssize_t)sb.st_size) goto cleanup;
-  line[len] = '\0';
-
-  if (strspn(line, "0123456789") != (size_t)len-1) goto cleanup;
-  if (line[len-1] != '\n') goto cleanup;
-  lines_match = len == pid_len && strcmp(line, pid_line) == 0;
+  refuse_too_many(whofrom);
+  goto ERROR_RETURN;
   }
 
-if (operation == PID_WRITE)
+/* If a load limit above which only reserved hosts are acceptable is defined,
+get the load average here, and if there are in fact no reserved hosts, do
+the test right away (saves a fork). If there are hosts, do the check in the
+subprocess because it might take time. */
+
+if (smtp_load_reserve >= 0)
   {
-  if (!lines_match)
+  load_average = OS_GETLOADAVG();
+  if (!smtp_reserve_hosts && load_average > smtp_load_reserve)
     {
-    if (base_fd >= 0)
-      {
-      int error = -1;
-      /* emulate unlinkat */
-      if (fchdir(dir_fd) != 0) goto cleanup;
-      error = unlink(CS base);
-      if (fchdir(cwd_fd) != 0)
-        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
-      if (error) goto cleanup;
-      (void)close(base_fd);
-      base_fd = -1;
-     }
-    /* emulate openat */
-    if (fchdir(dir_fd) != 0) goto cleanup;
-    base_fd = open(CS base, O_WRONLY | O_CREAT | O_EXCL | base_flags, base_mode);
-    if (fchdir(cwd_fd) != 0)
-        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
-    if (base_fd < 0) goto cleanup;
-    if (fchmod(base_fd, base_mode) != 0) goto cleanup;
-    if (write(base_fd, pid_line, pid_len) != pid_len) goto cleanup;
-    DEBUG(D_any) debug_printf("pid written to %s\n", pid_file_path);
+    DEBUG(D_any) debug_printf("rejecting SMTP connection: load average = %.2f\n",
+      (double)load_average/1000.0);
+    smtp_printf("421 Too much load; please try again later.\r\n", SP_NO_MORE);
+    log_write(L_connection_reject,
+              LOG_MAIN, "Connection from %Y refused: load average = %.2f",
+      whofrom, (double)load_average/1000.0);
+    goto ERROR_RETURN;
     }
   }
-else
+
+/* Check that one specific host (strictly, IP address) is not hogging
+resources. This is done here to prevent a denial of service attack by someone
+forcing you to fork lots of times before denying service. The value of
+smtp_accept_max_per_host is a string which is expanded. This makes it possible
+to provide host-specific limits according to $sender_host address, but because
+this is in the daemon mainline, only fast expansions (such as inline address
+checks) should be used. The documentation is full of warnings. */
+
+GET_OPTION("smtp_accept_max_per_host");
+if (smtp_accept_max_per_host)
   {
-  if (!lines_match) goto cleanup;
-  if (operation == PID_DELETE)
+  uschar * expanded = expand_string(smtp_accept_max_per_host);
+  if (!expanded)
     {
-    int error = -1;
-    /* emulate unlinkat */
-    if (fchdir(dir_fd) != 0) goto cleanup;
-    error = unlink(CS base);
-    if (fchdir(cwd_fd) != 0)
-        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
-    if (error) goto cleanup;
+    if (!f.expand_string_forcedfail)
+      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
+        "failed for %Y: %s", whofrom, expand_string_message);
+    }
+  /* For speed, interpret a decimal number inline here */
+  else
+    {
+    uschar * s = expanded;
+    while (isdigit(*s))
+      max_for_this_host = max_for_this_host * 10 + *s++ - '0';
+    if (*s)
+      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
+        "for %Y contains non-digit: %s", whofrom, expanded);
     }
   }
 
-success = TRUE;
-errno = 0;
-
-cleanup:
-if (cwd_fd >= 0) (void)close(cwd_fd);
-if (dir_fd >= 0) (void)close(dir_fd);
-if (base_fd >= 0) (void)close(base_fd);
-return success;
-}
-
+/* Claim a slot for the connection; this is where the per-host limit is
+checked. */
 
-/* Remove the daemon's pidfile.  Note: runs with root privilege,
-as a direct child of the daemon.  Does not return. */
+if (smtp_slots)
+  {
+  int host_accept_count;
 
-void
-delete_pid_file(void)
-{
-const BOOL success = operate_on_pid_file(PID_DELETE, getppid());
+  if ((slot = smtp_slot_claim(max_for_this_host, &host_accept_count)) == -1)
+    {
+    refuse_too_many(whofrom);
+    search_tidyup();
+    goto ERROR_RETURN;
+    }
+  if (slot == -2)
+    {
+    DEBUG(D_any) debug_printf("rejecting SMTP connection: too many from this "
+      "IP address: count=%d max=%d\n",
+      host_accept_count, max_for_this_host);
+    smtp_printf("421 Too many concurrent SMTP connections "
+      "from this IP address; please try again later.\r\n", SP_NO_MORE);
+    log_write(L_connection_reject,
+              LOG_MAIN, "Connection from %Y refused: too many connections "
+      "from that IP address", whofrom);
+    search_tidyup();
+    goto ERROR_RETURN;
+    }
+  }
 
-DEBUG(D_any)
-  debug_printf("delete pid file %s %s: %s\n", pid_file_path,
-    success ? "success" : "failure", strerror(errno));
+/* OK, the connection count checks have been passed.
+Now we can pass the connection to an idle worker or, failing that, fork the
+accepting process; do a lookup tidy, just in case any expansion above did a
+lookup. */
 
-exim_exit(EXIT_SUCCESS);
-}
+search_tidyup();
+if ((pid = smtp_worker_handoff(accept_socket, accepted, slot)) > 0)
+  {
+  DEBUG(D_any) debug_printf("connection passed to SMTP worker %ld\n", (long)pid);
+  }
 
+/* Handle the child process */
 
-/* Called by the daemon; exec a child to get the pid file deleted
-since we may require privs for the containing directory */
+else if ((pid = exim_fork(US"daemon-accept")) == 0)
+  smtp_session(whofrom, save_log_selector, accept_socket,
+    fd_polls, listen_socket_count);		/* Does not return */
 
-static void
-daemon_die(void)
-{
-pid_t pid;
 
-DEBUG(D_any) debug_printf("SIGTERM/SIGINT seen\n");
-#if !defined(DISABLE_TLS) && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
-tls_watch_invalidate();
-#endif
+/* Carrying on in the parent daemon process... Can't do much if the fork
+failed. Otherwise, keep count of the number of accepting processes and
+remember the pid for ticking off when the child (or worker) completes. */
 
-if (daemon_notifier_fd >= 0)
+if (pid < 0)
   {
-  close(daemon_notifier_fd);
-  daemon_notifier_fd = -1;
-  unlink_notifier_socket();
+  if (slot >= 0) smtp_slot_release(&smtp_slots->slots[slot]);
+  never_error(US"daemon: accept process fork failed", US"Fork failed", errno);
   }
-
-if (f.running_in_test_harness || write_pid)
+else if (slot >= 0)
   {
-  if ((pid = exim_fork(US"daemon-del-pidfile")) == 0)
-    {
-    if (override_pid_file_path)
-      (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, 3,
-	"-oP", override_pid_file_path, "-oPX");
-    else
-      (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, 1, "-oPX");
-
-    /* Control never returns here. */
-    }
-  if (pid > 0)
-    child_close(pid, 1);
+  smtp_slots->slots[slot].pid = pid;
+  smtp_accept_count++;
+  DEBUG(D_any) debug_printf("%d SMTP accept process%s running\n",
+    smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
   }
-exim_exit(EXIT_SUCCESS);
-}
 
+/* Get here via goto in error cases */
 
-/*************************************************
-*	Listener socket for local work prompts	 *
-*************************************************/
+ERROR_RETURN:
 
-ssize_t
-daemon_client_sockname(struct sockaddr_un * sup, uschar ** sname)
-{
+smtp_call_close();
+
+/* Release any store used in this process, including the store used for holding
+the incoming host address and an expanded active_hostname. */
+
+log_close_all();
+interface_address = sender_host_name = sender_host_address = NULL;
+store_reset(reset_point);
+}
+
+
+
+
+/*************************************************
+*       Check wildcard listen special cases      *
+*************************************************/
+
+/* This function is used when binding and listening on lists of addresses and
+ports. It tests for special cases of wildcard listening, when IPv4 and IPv6
+sockets may interact in different ways in different operating systems. It is
+passed an error number, the list of listening addresses, and the current
+address. Two checks are available: for a previous wildcard IPv6 address, or for
+a following wildcard IPv4 address, in both cases on the same port.
+
+In practice, pairs of wildcard addresses should be adjacent in the address list
+because they are sorted that way below.
+
+Arguments:
+  eno            the error number
+  addresses      the list of addresses
+  ipa            the current IP address
+  back           if TRUE, check for previous wildcard IPv6 address
+                 if FALSE, check for a following wildcard IPv4 address
+
+Returns:         TRUE or FALSE
+*/
+
+static BOOL
+check_special_case(int eno, ip_address_item *addresses, ip_address_item *ipa,
+  BOOL back)
+{
+ip_address_item *ipa2;
+
+/* For the "back" case, if the failure was "address in use" for a wildcard IPv4
+address, seek a previous IPv6 wildcard address on the same port. As it is
+previous, it must have been successfully bound and be listening. Flag it as a
+"6 including 4" listener. */
+
+if (back)
+  {
+  if (eno != EADDRINUSE || ipa->address[0] != 0) return FALSE;
+  for (ipa2 = addresses; ipa2 != ipa; ipa2 = ipa2->next)
+    {
+    if (ipa2->address[1] == 0 && ipa2->port == ipa->port)
+      {
+      ipa2->v6_include_v4 = TRUE;
+      return TRUE;
+      }
+    }
+  }
+
+/* For the "forward" case, if the current address is a wildcard IPv6 address,
+we seek a following wildcard IPv4 address on the same port. */
+
+else
+  {
+  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
+  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
+    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  }
+
+return FALSE;
+}
+
+
+
+
+/*************************************************
+*         Handle terminating subprocesses        *
+*************************************************/
+
+/* Handle the termination of child processes. Theoretically, this need be done
+only when sigchld_seen is TRUE, but rumour has it that some systems lose
+SIGCHLD signals at busy times, so to be on the safe side, this function is
+called each time round. It shouldn't be too expensive.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+static void
+handle_ending_processes(void)
+{
+int status;
+pid_t pid;
+
+while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+  DEBUG(D_any)
+    {
+    debug_printf("child %ld ended: status=0x%x\n", (long)pid, status);
+#ifdef WCOREDUMP
+    if (WIFEXITED(status))
+      debug_printf("  normal exit, %d\n", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+      debug_printf("  signal exit, signal %d%s\n", WTERMSIG(status),
+          WCOREDUMP(status) ? " (core dumped)" : "");
+#endif
+    }
+
+  /* The delivery fork server cannot be replaced, as privilege has been
+  given up; deliveries go back to re-execing. */
+
+  if (pid == forkserver_pid)
+    {
+    log_write(0, LOG_MAIN, "daemon: delivery fork server (pid %ld) ended",
+      (long)pid);
+    (void) close(daemon_forkserver_fd);
+    daemon_forkserver_fd = -1;
+    forkserver_pid = 0;
+    continue;
+    }
+
+  /* Likewise the spool sync server; without it, processes sync their own
+  spool files. */
+
+  if (pid == syncserver_pid)
+    {
+    log_write(0, LOG_MAIN, "daemon: spool sync server (pid %ld) ended",
+      (long)pid);
+    (void) close(daemon_syncserver_fd);
+    daemon_syncserver_fd = -1;
+    syncserver_pid = 0;
+    continue;
+    }
+
+  /* A lookup proxy is not replaced either. Its clients do their own lookups
+  once they see it has gone, and when all have gone no more are sent. */
+
+  for (int i = 0; i < lookupproxy_count; i++)
+    if (lookupproxy_pids[i] == pid)
+      {
+      log_write(0, LOG_MAIN, "daemon: lookup proxy (pid %ld) ended", (long)pid);
+      lookupproxy_pids[i] = 0;
+      if (--lookupproxy_live == 0)
+	{
+	(void) close(daemon_lookupproxy_fd);
+	daemon_lookupproxy_fd = -1;
+	}
+      pid = 0;
+      break;
+      }
+  if (pid == 0) continue;
+
+  /* If it was an SMTP worker, arrange for a replacement. A busy one still
+  holds a connection slot, which is recovered below. */
+
+  for (smtp_worker * w = smtp_workers; w && w < smtp_workers + smtp_worker_count; w++)
+    if (w->pid == pid)
+      {
+      if (w->fd >= 0) (void) close(w->fd);
+      w->fd = smtp_worker_polls[w - smtp_workers].fd = -1;
+      w->pid = 0;
+      smtp_workers_wanted = TRUE;
+      break;
+      }
+
+  /* If it's a listening daemon for which we are keeping track of individual
+  subprocesses, deal with an accepting process that has terminated. */
+
+  if (smtp_slots)
+    {
+    int i;
+    smtp_slot * sp;
+    for (i = 0, sp = smtp_slots->slots; i < smtp_accept_max; i++, sp++)
+      if (sp->pid == pid)
+        {
+        smtp_slot_release(sp);
+        smtp_accept_count = smtp_slots->count;
+        DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
+          smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
+        break;
+        }
+    if (i < smtp_accept_max) continue;  /* Found an accepting process */
+    }
+
+  /* In the main daemon, see if it was one of the additional acceptors. Its
+  reception processes are orphaned; their slots are recovered as they go. */
+
+  if (acceptor_pids)
+    {
+    int i;
+    for (i = 1; i < acceptor_count; i++)
+      if (acceptor_pids[i] == pid)
+	{
+	log_write(0, LOG_MAIN|(status ? LOG_PANIC : 0),
+	  "daemon acceptor %d (pid %ld) ended: status=0x%x", i, (long)pid, status);
+	acceptor_pids[i] = 0;
+	acceptor_restart = TRUE;
+	if (smtp_slots) smtp_slots_sweep(i);
+	break;
+	}
+    if (i < acceptor_count) continue;
+    }
+
+  /* If it wasn't an accepting process, see if it was a queue-runner
+  process that we are tracking. */
+
+  if (queue_runner_slots)
+    for (unsigned i = 0; i < queue_runner_slot_count; i++)
+      {
+      runner_slot * r = queue_runner_slots + i;
+      if (r->pid == pid)
+        {
+        r->pid = 0;			/* free up the slot */
+
+        if (--queue_run_count < 0) queue_run_count = 0;
+        DEBUG(D_any) debug_printf("%d queue-runner process%s now running\n",
+          queue_run_count, queue_run_count == 1 ? "" : "es");
+
+	for (qrunner ** p = &qrunners, * q = qrunners; q; p = &q->next, q = *p)
+	  if (q->name == r->queue_name)
+	    {
+	    if (q->interval)		/* a periodic queue run */
+	      q->run_count--;
+	    else			/* a one-time run */
+	      *p = q->next;		/* drop this qrunner */
+	    break;
+	    }
+        break;
+        }
+      }
+  }
+}
+
+
+static void
+set_pid_file_path(void)
+{
+if (override_pid_file_path)
+  pid_file_path = override_pid_file_path;
+
+if (!*pid_file_path)
+  pid_file_path = string_sprintf("%s/exim-daemon.pid", spool_directory);
+
+if (pid_file_path[0] != '/')
+  log_write_die(0, LOG_PANIC_DIE,
+		"pid file path %s must be absolute\n", pid_file_path);
+}
+
+
+enum pid_op { PID_WRITE, PID_CHECK, PID_DELETE };
+
+/* Do various pid file operations as safe as possible. Ideally we'd just
+drop the privileges for creation of the pid file and not care at all about removal of
+the file. FIXME.
+Returns: true on success, false + errno==EACCES otherwise
+*/
+
+static BOOL
+operate_on_pid_file(const enum pid_op operation, const pid_t pid)
+{
+char pid_line[sizeof(int) * 3 + 2];
+const int pid_len = snprintf(pid_line, sizeof(pid_line), "%ld\n", (long)pid);
+BOOL lines_match = FALSE;
+uschar * path, * base, * dir;
+
+const int dir_flags = O_RDONLY | O_NONBLOCK;
+const int base_flags = O_NOFOLLOW | O_NONBLOCK;
+const mode_t base_mode = 0644;
+struct stat sb;
+int cwd_fd = -1, dir_fd = -1, base_fd = -1;
+BOOL success = FALSE;
+errno = EACCES;
+
+set_pid_file_path();
+if (!f.running_in_test_harness && real_uid != root_uid && real_uid != exim_uid) goto cleanup;
+if (pid_len < 2 || pid_len >= (int)sizeof(pid_line)) goto cleanup;
+
+path = string_copy(pid_file_path);
+if ((base = Ustrrchr(path, '/')) == NULL)	/* should not happen, but who knows */
+  log_write_die(0, LOG_MAIN, "pid file path %q does not contain a '/'", pid_file_path);
+
+dir = base != path ? path : US"/";
+*base++ = '\0';
+
+if (!dir || *dir != '/') goto cleanup;
+if (!base || !*base || Ustrchr(base, '/') != NULL) goto cleanup;
+
+cwd_fd = open(".", dir_flags);
+if (cwd_fd < 0 || fstat(cwd_fd, &sb) != 0 || !S_ISDIR(sb.st_mode)) goto cleanup;
+dir_fd = open(CS dir, dir_flags);
+if (dir_fd < 0 || fstat(dir_fd, &sb) != 0 || !S_ISDIR(sb.st_mode)) goto cleanup;
+
+/* emulate openat */
+if (fchdir(dir_fd) != 0) goto cleanup;
+base_fd = open(CS base, O_RDONLY | base_flags);
+if (fchdir(cwd_fd) != 0)
+  log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
+
+if (base_fd >= 0)
+  {
+  char line[sizeof(pid_line)];
+  ssize_t len = -1;
+
+  if (fstat(base_fd, &sb) != 0 || !S_ISREG(sb.st_mode)) goto cleanup;
+  if ((sb.st_mode & 07777) != base_mode || sb.st_nlink != 1) goto cleanup;
+  if (sb.st_size < 2 || sb.st_size >= (off_t)sizeof(line)) goto cleanup;
+
+  len = read(base_fd, line, sizeof(line));
+  if (len != (ssize_t)sb.st_size) goto cleanup;
+  line[len] = '\0';
+
+  if (strspn(line, "0123456789") != (size_t)len-1) goto cleanup;
+  if (line[len-1] != '\n') goto cleanup;
+  lines_match = len == pid_len && strcmp(line, pid_line) == 0;
+  }
+
+if (operation == PID_WRITE)
+  {
+  if (!lines_match)
+    {
+    if (base_fd >= 0)
+      {
+      int error = -1;
+      /* emulate unlinkat */
+      if (fchdir(dir_fd) != 0) goto cleanup;
+      error = unlink(CS base);
+      if (fchdir(cwd_fd) != 0)
+        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
+      if (error) goto cleanup;
+      (void)close(base_fd);
+      base_fd = -1;
+     }
+    /* emulate openat */
+    if (fchdir(dir_fd) != 0) goto cleanup;
+    base_fd = open(CS base, O_WRONLY | O_CREAT | O_EXCL | base_flags, base_mode);
+    if (fchdir(cwd_fd) != 0)
+        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
+    if (base_fd < 0) goto cleanup;
+    if (fchmod(base_fd, base_mode) != 0) goto cleanup;
+    if (write(base_fd, pid_line, pid_len) != pid_len) goto cleanup;
+    DEBUG(D_any) debug_printf("pid written to %s\n", pid_file_path);
+    }
+  }
+else
+  {
+  if (!lines_match) goto cleanup;
+  if (operation == PID_DELETE)
+    {
+    int error = -1;
+    /* emulate unlinkat */
+    if (fchdir(dir_fd) != 0) goto cleanup;
+    error = unlink(CS base);
+    if (fchdir(cwd_fd) != 0)
+        log_write_die(0, LOG_MAIN, "can't return to previous working dir: %s", strerror(errno));
+    if (error) goto cleanup;
+    }
+  }
+
+success = TRUE;
+errno = 0;
+
+cleanup:
+if (cwd_fd >= 0) (void)close(cwd_fd);
+if (dir_fd >= 0) (void)close(dir_fd);
+if (base_fd >= 0) (void)close(base_fd);
+return success;
+}
+
+
+/* Remove the daemon's pidfile.  Note: runs with root privilege,
+as a direct child of the daemon.  Does not return. */
+
+void
+delete_pid_file(void)
+{
+const BOOL success = operate_on_pid_file(PID_DELETE, getppid());
+
+DEBUG(D_any)
+  debug_printf("delete pid file %s %s: %s\n", pid_file_path,
+    success ? "success" : "failure", strerror(errno));
+
+exim_exit(EXIT_SUCCESS);
+}
+
+
+/* Called by the main daemon process on its way out */
+
+static void
+daemon_acceptors_stop(void)
+{
+if (acceptor_pids)
+  for (int i = 1; i < acceptor_count; i++)
+    if (acceptor_pids[i] > 0)
+      (void) kill(acceptor_pids[i], SIGTERM);
+if (forkserver_pid > 0)
+  (void) kill(forkserver_pid, SIGTERM);
+if (syncserver_pid > 0)
+  (void) kill(syncserver_pid, SIGTERM);
+for (int i = 0; i < lookupproxy_count; i++)
+  if (lookupproxy_pids[i] > 0)
+    (void) kill(lookupproxy_pids[i], SIGTERM);
+}
+
+
+/* Called by the daemon; exec a child to get the pid file deleted
+since we may require privs for the containing directory. An additional
+acceptor process just goes; the pid file and notifier belong to the main one. */
+
+static void
+daemon_die(void)
+{
+pid_t pid;
+
+DEBUG(D_any) debug_printf("SIGTERM/SIGINT seen\n");
+if (acceptor_index > 0)
+  exim_exit(EXIT_SUCCESS);
+daemon_acceptors_stop();
+
+#if !defined(DISABLE_TLS) && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
+tls_watch_invalidate();
+#endif
+
+if (daemon_notifier_fd >= 0)
+  {
+  close(daemon_notifier_fd);
+  daemon_notifier_fd = -1;
+  unlink_notifier_socket();
+  }
+
+if (f.running_in_test_harness || write_pid)
+  {
+  if ((pid = exim_fork(US"daemon-del-pidfile")) == 0)
+    {
+    if (override_pid_file_path)
+      (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, 3,
+	"-oP", override_pid_file_path, "-oPX");
+    else
+      (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, 1, "-oPX");
+
+    /* Control never returns here. */
+    }
+  if (pid > 0)
+    child_close(pid, 1);
+  }
+exim_exit(EXIT_SUCCESS);
+}
+
+
+/*************************************************
+*	Listener socket for local work prompts	 *
+*************************************************/
+
+ssize_t
+daemon_client_sockname(struct sockaddr_un * sup, uschar ** sname)
+{
 #ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
 sup->sun_path[0] = 0;  /* Abstract local socket addr - Linux-specific? */
 return offsetof(struct sockaddr_un, sun_path) + 1
   + snprintf(sup->sun_path+1, sizeof(sup->sun_path)-1, "exim_%d", getpid());
 #else
-*sname = string_sprintf("%s/p_%d", spool_directory, getpid());
-return offsetof(struct sockaddr_un, sun_path)
-  + snprintf(sup->sun_path, sizeof(sup->sun_path), "%s", CS *sname);
+*sname = string_sprintf("%s/p_%d", spool_directory, getpid());
+return offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sup->sun_path, sizeof(sup->sun_path), "%s", CS *sname);
+#endif
+}
+
+ssize_t
+daemon_notifier_sockname(struct sockaddr_un * sup)
+{
+GET_OPTION("notifier_socket");
+#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+sup->sun_path[0] = 0;  /* Abstract local socket addr - Linux-specific? */
+return offsetof(struct sockaddr_un, sun_path) + 1
+  + snprintf(sup->sun_path+1, sizeof(sup->sun_path)-1, "%s",
+              CS expand_string(notifier_socket));
+#else
+notifier_socket_name = expand_string(notifier_socket);
+return offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sup->sun_path, sizeof(sup->sun_path), "%s",
+              CS notifier_socket_name);
+#endif
+}
+
+
+static void
+daemon_notifier_socket(void)
+{
+int fd;
+const uschar * where;
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+ssize_t len;
+
+if (!f.notifier_socket_en)
+  {
+  DEBUG(D_any) debug_printf("-oY used so not creating notifier socket\n");
+  return;
+  }
+if (override_local_interfaces && !override_pid_file_path)
+  {
+  DEBUG(D_any)
+    debug_printf("-oX used without -oP so not creating notifier socket\n");
+  return;
+  }
+if (!notifier_socket || !*notifier_socket)
+  {
+  DEBUG(D_any) debug_printf("no name for notifier socket\n");
+  return;
+  }
+
+DEBUG(D_any) debug_printf("creating notifier socket\n");
+
+#ifdef SOCK_CLOEXEC
+if ((fd = socket(PF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0)
+  { where = US"socket"; goto bad; }
+#else
+if ((fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0)
+  { where = US"socket"; goto bad; }
+(void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+#endif
+
+len = daemon_notifier_sockname(&sa_un);
+
+#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+DEBUG(D_any) debug_printf(" @%s\n", sa_un.sun_path+1);
+#else			/* filesystem-visible and persistent; will neeed removal */
+DEBUG(D_any) debug_printf(" %s\n", sa_un.sun_path);
+#endif
+
+if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  { where = US"bind"; goto bad; }
+
+#ifdef SO_PASSCRED		/* Linux */
+if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+  { where = US"SO_PASSCRED"; goto bad2; }
+#elif defined(LOCAL_CREDS)	/* FreeBSD-ish */
+if (setsockopt(fd, 0, LOCAL_CREDS, &on, sizeof(on)) < 0)
+  { where = US"LOCAL_CREDS"; goto bad2; }
+#endif
+
+/* debug_printf("%s: fd %d\n", __FUNCTION__, fd); */
+daemon_notifier_fd = fd;
+return;
+
+bad2:
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sa_un.sun_path);
+#endif
+bad:
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s %s: %s",
+    __FUNCTION__, where, strerror(errno));
+  close(fd);
+  return;
+}
+
+
+/* Data for notifier-triggered queue runs */
+
+static uschar queuerun_msgid[MESSAGE_ID_LENGTH+1];
+static const uschar * queuerun_msg_qname;
+
+
+/* The notifier socket has something to read. Pull the message from it, decode
+and do the action.
+*/
+
+static void
+daemon_notification(void)
+{
+uschar buf[256], cbuf[256];
+struct sockaddr_un sa_un;
+struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)-1};
+struct msghdr msg = { .msg_name = &sa_un,
+		      .msg_namelen = sizeof(sa_un),
+		      .msg_iov = &iov,
+		      .msg_iovlen = 1,
+		      .msg_control = cbuf,
+		      .msg_controllen = sizeof(cbuf)
+		    };
+ssize_t sz;
+
+buf[sizeof(buf)-1] = 0;
+if ((sz = recvmsg(daemon_notifier_fd, &msg, 0)) <= 0) return;
+if (sz >= sizeof(buf)) return;
+
+#ifdef notdef
+debug_printf("addrlen %d\n", msg.msg_namelen);
+#endif
+DEBUG(D_queue_run)
+  if (msg.msg_namelen > 0)
+    {
+    BOOL abstract = !*sa_un.sun_path;
+    char * name = sa_un.sun_path + (abstract ? 1 : 0);
+    int namelen =  (int)msg.msg_namelen - abstract ? 1 : 0;
+    if (*name)
+      debug_printf("%s from addr '%s%.*s'\n", __FUNCTION__,
+	abstract ? "@" : "",
+	namelen, name);
+    else
+      debug_printf("%s (from unknown addr)\n", __FUNCTION__);
+    }
+  else
+    debug_printf("%s (from unknown addr)\n", __FUNCTION__);
+
+/* Refuse to handle the item unless the peer has good credentials */
+#ifdef SCM_CREDENTIALS
+# define EXIM_SCM_CR_TYPE SCM_CREDENTIALS
+#elif defined(LOCAL_CREDS) && defined(SCM_CREDS)
+# define EXIM_SCM_CR_TYPE SCM_CREDS
+#else
+	/* The OS has no way to get the creds of the caller (for a unix/datagram socket.
+	Punt; don't try to check. */
+#endif
+
+#ifdef EXIM_SCM_CR_TYPE
+for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
+     cp;
+     cp = CMSG_NXTHDR(&msg, cp))
+  if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == EXIM_SCM_CR_TYPE)
+  {
+# ifdef SCM_CREDENTIALS					/* Linux */
+  struct ucred * cr = (struct ucred *) CMSG_DATA(cp);
+  if (cr->uid && cr->uid != exim_uid)
+    {
+    DEBUG(D_queue_run) debug_printf("%s: sender creds pid %ld uid %d gid %d\n",
+      __FUNCTION__, (long)cr->pid, (int)cr->uid, (int)cr->gid);
+    }
+# elif defined(LOCAL_CREDS)				/* BSD-ish */
+  struct sockcred * cr = (struct sockcred *) CMSG_DATA(cp);
+  if (cr->sc_uid && cr->sc_uid != exim_uid)
+    {
+    DEBUG(D_queue_run) debug_printf("%s: sender creds pid ??? uid %d gid %d\n",
+      __FUNCTION__, (int)cr->sc_uid, (int)cr->sc_gid);
+    }
+# endif
+  break;
+  }
+#endif
+
+buf[sz] = 0;
+switch (buf[0])
+  {
+#ifndef DISABLE_QUEUE_RAMP
+  case NOTIFY_MSG_QRUN:
+    /* this should be a message_id */
+    DEBUG(D_queue_run)
+      debug_printf("%s: qrunner trigger: %s\n", __FUNCTION__, buf+1);
+
+    memcpy(queuerun_msgid, buf+1, MESSAGE_ID_LENGTH+1);
+
+    for (qrunner * q = qrunners; q; q = q->next)
+      if (q->name
+	  ? Ustrcmp(q->name, buf+1+MESSAGE_ID_LENGTH+1) == 0
+	  : !buf[1+MESSAGE_ID_LENGTH+1]
+	 )
+	{ queuerun_msg_qname = q->name; break; }
+    return;
+#endif
+
+  case NOTIFY_QUEUE_SIZE_REQ:
+    {
+    uschar qsbuf[16];
+    int len = snprintf(CS qsbuf, sizeof(qsbuf), "%u", queue_count_cached());
+
+    DEBUG(D_queue_run)
+      debug_printf("%s: queue size request: %s\n", __FUNCTION__, qsbuf);
+
+    if (sendto(daemon_notifier_fd, qsbuf, len, 0,
+		(const struct sockaddr *)&sa_un, msg.msg_namelen) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+    break;
+    }
+
+  case NOTIFY_REGEX:
+    regex_at_daemon(buf);
+    break;
+  }
+return;
+}
+
+
+
+static void
+daemon_inetd_wtimeout(time_t last_connection_time)
+{
+time_t resignal_interval = inetd_wait_timeout;
+
+if (last_connection_time == (time_t)0)
+  {
+  DEBUG(D_any)
+    debug_printf("inetd wait timeout expired, but still not seen first message, ignoring\n");
+  }
+else
+  {
+  time_t now = time(NULL);
+  if (now == (time_t)-1)
+    {
+    DEBUG(D_any) debug_printf("failed to get time: %s\n", strerror(errno));
+    }
+  else if ((now - last_connection_time) >= inetd_wait_timeout)
+    {
+    DEBUG(D_any)
+      debug_printf("inetd wait timeout %d expired, ending daemon\n",
+	  inetd_wait_timeout);
+    log_write(0, LOG_MAIN, "exim %s daemon terminating, inetd wait timeout reached.\n",
+	version_string);
+    daemon_die();		/* Does not return */
+    }
+  else
+    resignal_interval -= (now - last_connection_time);
+  }
+
+sigalrm_seen = FALSE;
+ALARM(resignal_interval);
+}
+
+
+/* Re-sort the qrunners list, and return the shortest interval.
+That could be negatime.
+The next-tick times should have been updated by any runs initiated,
+though will not be when the global limit on runners was reached.
+
+Unlikely to have many queues, so insertion-sort.
+*/
+
+static int
+next_qrunner_interval(void)
+{
+qrunner * sorted = NULL;
+for (qrunner * q = qrunners, * next; q; q = next)
+  {
+  next = q->next;
+  q->next = NULL;
+  if (sorted)
+    {
+    qrunner ** p = &sorted;
+    for (qrunner * qq; qq = *p; p = &qq->next)
+      if (  q->next_tick < qq->next_tick
+	 || q->next_tick == qq->next_tick && q->interval < qq->interval
+	 )
+	{
+	*p = q;
+	q->next = qq;
+	goto INSERTED;
+	}
+    *p = q;
+  INSERTED: ;
+    }
+  else
+    sorted = q;
+  }
+qrunners = sorted;
+return qrunners ? qrunners->next_tick - time(NULL) : 0;
+}
+
+/* See if we can do a queue run.  If policy limit permit, kick one off.
+If both notification and timer events are present, handle the former
+and leave the timer outstanding.
+
+Return the number of seconds until the next due runner.
+*/
+
+static int
+daemon_qrun(int local_queue_run_max, struct pollfd * fd_polls, int listen_socket_count)
+{
+DEBUG(D_any) debug_printf("%s received\n",
+#ifndef DISABLE_QUEUE_RAMP
+  *queuerun_msgid ? "qrun notification" :
+#endif
+  "SIGALRM");
+
+/* Do a full queue run in a child process, if required, unless we already have
+enough queue runners on the go. If we are not running as root, a re-exec is
+required. In the calling process, restart the alamr timer for the next run.  */
+
+if (is_multiple_qrun())				/* we are managing periodic runs */
+  if (local_queue_run_max <= 0 || queue_run_count < local_queue_run_max)
+    {
+    qrunner * q = NULL;
+
+#ifndef DISABLE_QUEUE_RAMP
+    /* If this is a triggered run for a specific message, see if we can start
+    another runner for this queue. */
+
+    if (*queuerun_msgid)
+      {
+      for (qrunner * qq = qrunners; qq; qq = qq->next)
+	if (qq->name == queuerun_msg_qname)
+	  {
+	  q = qq->run_count < qq->run_max ? qq : NULL;
+	  break;
+	  }
+      }
+    else
+#endif
+      /* Normal periodic run: in order of run priority, find the first queue
+      for which we can start a runner */
+
+      for (q = qrunners; q; q = q->next)
+	if (q->run_count < q->run_max) break;
+
+    if (q)					/* found a queue to run */
+      {
+      pid_t pid;
+
+      /* Bump this queue's next-tick by it's interval */
+
+      if (q->interval)
+	{
+	time_t now = time(NULL);
+	do ; while ((q->next_tick += q->interval) <= now);
+	}
+
+      if ((pid = exim_fork(US"queue-runner")) == 0)
+	{
+	/* Disable debugging if it's required only for the daemon process. We
+	leave the above message, because it ties up with the "child ended"
+	debugging messages. */
+
+	if (f.debug_daemon) debug_selector = 0;
+
+	/* Close any open listening sockets in the child */
+
+	close_daemon_sockets(daemon_notifier_fd,
+	  fd_polls, listen_socket_count);
+
+	/* Reset SIGHUP and SIGCHLD in the child in both cases. */
+
+	signal(SIGHUP,  SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	/* Re-exec if privilege has been given up, unless deliver_drop_
+	privilege is set. Reset SIGALRM before exec(). */
+
+	if (geteuid() != root_uid && !deliver_drop_privilege)
+	  {
+	  uschar opt[8];
+	  uschar *p = opt;
+	  uschar *extra[7];
+	  int extracount = 1;
+
+	  signal(SIGALRM, SIG_DFL);
+	  queue_name = US"";
+
+	  *p++ = '-';
+	  *p++ = 'q';
+	  if (  q->queue_2stage
+#ifndef DISABLE_QUEUE_RAMP
+	     && !*queuerun_msgid
 #endif
-}
+	     ) *p++ = 'q';
+	  if (q->queue_run_first_delivery) *p++ = 'i';
+	  if (q->queue_run_force) *p++ = 'f';
+	  if (q->deliver_force_thaw) *p++ = 'f';
+	  if (q->queue_run_local) *p++ = 'l';
+	  *p = 0;
 
-ssize_t
-daemon_notifier_sockname(struct sockaddr_un * sup)
-{
-GET_OPTION("notifier_socket");
-#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-sup->sun_path[0] = 0;  /* Abstract local socket addr - Linux-specific? */
-return offsetof(struct sockaddr_un, sun_path) + 1
-  + snprintf(sup->sun_path+1, sizeof(sup->sun_path)-1, "%s",
-              CS expand_string(notifier_socket));
-#else
-notifier_socket_name = expand_string(notifier_socket);
-return offsetof(struct sockaddr_un, sun_path)
-  + snprintf(sup->sun_path, sizeof(sup->sun_path), "%s",
-              CS notifier_socket_name);
+	  extra[0] = q->name
+	    ? string_sprintf("%sG%s", opt, q->name) : opt;
+
+#ifndef DISABLE_QUEUE_RAMP
+	  if (*queuerun_msgid)
+	    {
+	    log_write(0, LOG_MAIN, "notify triggered queue run");
+	    extra[extracount++] = queuerun_msgid;	/* Trigger only the */
+	    extra[extracount++] = queuerun_msgid;	/* one message      */
+	    }
 #endif
-}
 
+	  /* If -R or -S were on the original command line, ensure they get
+	  passed on. */
 
-static void
-daemon_notifier_socket(void)
-{
-int fd;
-const uschar * where;
-struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
-ssize_t len;
+	  if (deliver_selectstring)
+	    {
+	    extra[extracount++] = f.deliver_selectstring_regex ? US"-Rr" : US"-R";
+	    extra[extracount++] = deliver_selectstring;
+	    }
 
-if (!f.notifier_socket_en)
-  {
-  DEBUG(D_any) debug_printf("-oY used so not creating notifier socket\n");
-  return;
-  }
-if (override_local_interfaces && !override_pid_file_path)
+	  if (deliver_selectstring_sender)
+	    {
+	    extra[extracount++] = f.deliver_selectstring_sender_regex
+	      ? US"-Sr" : US"-S";
+	    extra[extracount++] = deliver_selectstring_sender;
+	    }
+
+	  /* Overlay this process with a new execution. */
+
+	  (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, extracount,
+	    extra[0], extra[1], extra[2], extra[3], extra[4], extra[5], extra[6]);
+
+	  /* Control never returns here. */
+	  }
+
+	/* No need to re-exec; SIGALRM remains set to the default handler */
+
+#ifndef DISABLE_QUEUE_RAMP
+	if (*queuerun_msgid)
+	  {
+	  log_write(0, LOG_MAIN, "notify triggered queue run");
+	  f.queue_2stage = FALSE;
+	  queue_run(q, queuerun_msgid, queuerun_msgid, FALSE);
+	  }
+	else
+#endif
+	  queue_run(q, NULL, NULL, FALSE);
+	exim_underbar_exit(EXIT_SUCCESS);
+	}
+
+      if (pid < 0)
+	{
+	log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of queue-runner "
+	  "process failed: %s", strerror(errno));
+	log_close_all();
+	}
+      else
+	{
+	for (int i = 0; i < local_queue_run_max; ++i)
+	  if (queue_runner_slots[i].pid <= 0)
+	    {
+	    queue_runner_slots[i].pid = pid;
+	    queue_runner_slots[i].queue_name = q->name;
+	    q->run_count++;
+	    queue_run_count++;
+	    break;
+	    }
+	DEBUG(D_any) debug_printf("%d queue-runner process%s running\n",
+	  queue_run_count, queue_run_count == 1 ? "" : "es");
+	}
+      }
+    }
+
+/* The queue run has been initiated (unless we were already running enough) */
+
+#ifndef DISABLE_QUEUE_RAMP
+if (*queuerun_msgid)		/* it was a fast-ramp kick; dealt with */
+  *queuerun_msgid = 0;
+else				/* periodic or one-time queue run */
+#endif
+  /* Set up next timer callback. Impose a minimum 1s tick,
+  even when a run was outstanding */
   {
-  DEBUG(D_any)
-    debug_printf("-oX used without -oP so not creating notifier socket\n");
-  return;
+  int interval = next_qrunner_interval();
+  if (interval <= 0) interval = 1;
+
+  sigalrm_seen = FALSE;
+  if (qrunners)			/* there are still periodic qrunners */
+    {
+    ALARM(interval);		/* set up next qrun tick */
+    return interval;
+    }
   }
-if (!notifier_socket || !*notifier_socket)
+return 0;
+}
+
+
+
+
+static const uschar *
+describe_queue_runners(void)
+{
+gstring * g = NULL;
+
+if (!is_multiple_qrun()) return US"no queue runs";
+
+for (qrunner * q = qrunners; q; q = q->next)
   {
-  DEBUG(D_any) debug_printf("no name for notifier socket\n");
-  return;
+  g = string_catn(g, US"-q", 2);
+  if (q->queue_2stage) g = string_catn(g, US"q", 1);
+  if (q->name) g = string_append(g, 3, US"G", q->name, US"/");
+  g = string_cat(g, readconf_printtime(q->interval));
+  g = string_catn(g, US" ", 1);
   }
+gstring_trim(g, 1);
+gstring_release_unused(g);
+return string_from_gstring(g);
+}
 
-DEBUG(D_any) debug_printf("creating notifier socket\n");
 
-#ifdef SOCK_CLOEXEC
-if ((fd = socket(PF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0)
-  { where = US"socket"; goto bad; }
-#else
-if ((fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0)
-  { where = US"socket"; goto bad; }
-(void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
-#endif
 
-len = daemon_notifier_sockname(&sa_un);
+static void
+daemon_preload_modules(void)
+{
+#ifdef LOOKUP_MODULE_DIR
+uschar namebuf[32];
+const uschar * list = daemon_modules_load, * ele;
+int sep = 0;
 
-#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-DEBUG(D_any) debug_printf(" @%s\n", sa_un.sun_path+1);
-#else			/* filesystem-visible and persistent; will neeed removal */
-DEBUG(D_any) debug_printf(" %s\n", sa_un.sun_path);
+while (ele = string_nextinlist(&list, &sep, namebuf, sizeof(namebuf)))
+  mod_load_anyclass(ele);
 #endif
+}
 
-if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
-  { where = US"bind"; goto bad; }
 
-#ifdef SO_PASSCRED		/* Linux */
-if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
-  { where = US"SO_PASSCRED"; goto bad2; }
-#elif defined(LOCAL_CREDS)	/* FreeBSD-ish */
-if (setsockopt(fd, 0, LOCAL_CREDS, &on, sizeof(on)) < 0)
-  { where = US"LOCAL_CREDS"; goto bad2; }
-#endif
+/*************************************************
+*        Listeners for additional acceptors      *
+*************************************************/
 
-/* debug_printf("%s: fd %d\n", __FUNCTION__, fd); */
-daemon_notifier_fd = fd;
-return;
+/* Create a further listening socket for an address the main daemon is
+already listening on, for the use of an additional acceptor. The kernel
+distributes new connections across all the sockets bound to the port.
 
-bad2:
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-  Uunlink(sa_un.sun_path);
+Argument:  the address, which has a listening socket already
+Returns:   the new socket; failures are fatal
+*/
+
+#ifdef EXIM_SO_REUSEPORT
+static int
+daemon_listener_dup(const ip_address_item * ipa)
+{
+int af = Ustrchr(ipa->address, ':') ? AF_INET6 : AF_INET, fd;
+
+if ((fd = ip_socket(SOCK_STREAM, af)) < 0)
+  goto BAD;
+#ifdef IPV6_V6ONLY
+if (af == AF_INET6 && ipa->address[1] == 0)
+  (void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
 #endif
-bad:
-  log_write(0, LOG_MAIN|LOG_PANIC, "%s %s: %s",
-    __FUNCTION__, where, strerror(errno));
-  close(fd);
-  return;
+(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+if (setsockopt(fd, SOL_SOCKET, EXIM_SO_REUSEPORT, &on, sizeof(on)) < 0)
+  goto BAD;
+if (tcp_nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+if (ip_bind(fd, af, ipa->address, ipa->port) < 0)
+  goto BAD;
+#if defined(TCP_FASTOPEN) && !defined(__APPLE__)
+if (f.tcp_fastopen_ok)
+  (void) setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+		    &smtp_connect_backlog, sizeof(smtp_connect_backlog));
+#endif
+if (listen(fd, smtp_connect_backlog) < 0)
+  goto BAD;
+if (daemon_accept_batch > 1)
+  (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+return fd;
+
+BAD:
+  log_write_die(0, LOG_MAIN, "setting up acceptor socket for %s port %d "
+    "failed: %s: daemon abandoned",
+    *ipa->address ? ipa->address : US"(any IPv4)", ipa->port, strerror(errno));
+  /*NOTREACHED*/
+  return -1;
+}
+#else
+static int
+daemon_listener_dup(const ip_address_item * ipa)
+{
+return -1;
 }
+#endif
 
 
-/* Data for notifier-triggered queue runs */
+/*************************************************
+*        Start an additional acceptor            *
+*************************************************/
 
-static uschar queuerun_msgid[MESSAGE_ID_LENGTH+1];
-static const uschar * queuerun_msg_qname;
+/* Fork a process which accepts connections on its own set of listening
+sockets, and manages the reception processes it spawns, sharing the slot table
+with the other acceptors. It does no queue runs and takes no notifications;
+those stay with the main daemon process. The new process swaps its sockets into
+the poll vector and closes all the others it inherited.
 
+Arguments:
+  idx		  index of the acceptor, from 1
+  fd_polls	  the poll vector; the listeners come first
+  listen_socket_count  number of listeners
 
-/* The notifier socket has something to read. Pull the message from it, decode
-and do the action.
+Returns:  TRUE in the new acceptor process, FALSE in the main daemon
 */
 
-static void
-daemon_notification(void)
+static BOOL
+daemon_acceptor_start(int idx, struct pollfd * fd_polls, int listen_socket_count)
 {
-uschar buf[256], cbuf[256];
-struct sockaddr_un sa_un;
-struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)-1};
-struct msghdr msg = { .msg_name = &sa_un,
-		      .msg_namelen = sizeof(sa_un),
-		      .msg_iov = &iov,
-		      .msg_iovlen = 1,
-		      .msg_control = cbuf,
-		      .msg_controllen = sizeof(cbuf)
-		    };
-ssize_t sz;
-
-buf[sizeof(buf)-1] = 0;
-if ((sz = recvmsg(daemon_notifier_fd, &msg, 0)) <= 0) return;
-if (sz >= sizeof(buf)) return;
+pid_t pid = exim_fork(US"daemon-acceptor");
 
-#ifdef notdef
-debug_printf("addrlen %d\n", msg.msg_namelen);
-#endif
-DEBUG(D_queue_run)
-  if (msg.msg_namelen > 0)
-    {
-    BOOL abstract = !*sa_un.sun_path;
-    char * name = sa_un.sun_path + (abstract ? 1 : 0);
-    int namelen =  (int)msg.msg_namelen - abstract ? 1 : 0;
-    if (*name)
-      debug_printf("%s from addr '%s%.*s'\n", __FUNCTION__,
-	abstract ? "@" : "",
-	namelen, name);
-    else
-      debug_printf("%s (from unknown addr)\n", __FUNCTION__);
-    }
+if (pid != 0)
+  {
+  if (pid < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of acceptor %d failed: %s",
+      idx, strerror(errno));
   else
-    debug_printf("%s (from unknown addr)\n", __FUNCTION__);
+    DEBUG(D_any) debug_printf("started acceptor %d, pid %ld\n", idx, (long)pid);
+  acceptor_pids[idx] = pid > 0 ? pid : 0;
+  acceptor_started[idx] = time(NULL);
+  return FALSE;
+  }
 
-/* Refuse to handle the item unless the peer has good credentials */
-#ifdef SCM_CREDENTIALS
-# define EXIM_SCM_CR_TYPE SCM_CREDENTIALS
-#elif defined(LOCAL_CREDS) && defined(SCM_CREDS)
-# define EXIM_SCM_CR_TYPE SCM_CREDS
-#else
-	/* The OS has no way to get the creds of the caller (for a unix/datagram socket.
-	Punt; don't try to check. */
-#endif
+f.daemon_listen = TRUE;
+acceptor_index = idx;
+acceptor_pids = NULL;
+forkserver_pid = 0;
+syncserver_pid = 0;
+lookupproxy_count = 0;
+slots_lock_pid = getpid();
 
-#ifdef EXIM_SCM_CR_TYPE
-for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
-     cp;
-     cp = CMSG_NXTHDR(&msg, cp))
-  if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == EXIM_SCM_CR_TYPE)
+for (int i = 0; i < listen_socket_count; i++)
   {
-# ifdef SCM_CREDENTIALS					/* Linux */
-  struct ucred * cr = (struct ucred *) CMSG_DATA(cp);
-  if (cr->uid && cr->uid != exim_uid)
-    {
-    DEBUG(D_queue_run) debug_printf("%s: sender creds pid %ld uid %d gid %d\n",
-      __FUNCTION__, (long)cr->pid, (int)cr->uid, (int)cr->gid);
-    }
-# elif defined(LOCAL_CREDS)				/* BSD-ish */
-  struct sockcred * cr = (struct sockcred *) CMSG_DATA(cp);
-  if (cr->sc_uid && cr->sc_uid != exim_uid)
-    {
-    DEBUG(D_queue_run) debug_printf("%s: sender creds pid ??? uid %d gid %d\n",
-      __FUNCTION__, (int)cr->sc_uid, (int)cr->sc_gid);
-    }
-# endif
-  break;
+  (void) close(fd_polls[i].fd);
+  fd_polls[i].fd = acceptor_fds[(idx-1) * listen_socket_count + i];
   }
-#endif
+for (int i = 0; i < (acceptor_count-1) * listen_socket_count; i++)
+  if (i / listen_socket_count != idx-1) (void) close(acceptor_fds[i]);
+acceptor_fds = NULL;
 
-buf[sz] = 0;
-switch (buf[0])
+for (smtp_worker * w = smtp_workers; w && w < smtp_workers + smtp_worker_count; w++)
   {
-#ifndef DISABLE_QUEUE_RAMP
-  case NOTIFY_MSG_QRUN:
-    /* this should be a message_id */
-    DEBUG(D_queue_run)
-      debug_printf("%s: qrunner trigger: %s\n", __FUNCTION__, buf+1);
+  if (w->fd >= 0) (void) close(w->fd);
+  w->fd = smtp_worker_polls[w - smtp_workers].fd = -1;
+  w->pid = 0;
+  }
+smtp_workers_wanted = smtp_worker_count > 0;
 
-    memcpy(queuerun_msgid, buf+1, MESSAGE_ID_LENGTH+1);
+if (daemon_notifier_fd >= 0)
+  {
+  (void) close(daemon_notifier_fd);
+  daemon_notifier_fd = -1;
+  }
+#ifdef EXIM_HAVE_EPOLL
+if (daemon_epoll_fd >= 0)
+  {
+  (void) close(daemon_epoll_fd);
+  daemon_epoll_fd = -1;
+  }
+#endif
 
-    for (qrunner * q = qrunners; q; q = q->next)
-      if (q->name
-	  ? Ustrcmp(q->name, buf+1+MESSAGE_ID_LENGTH+1) == 0
-	  : !buf[1+MESSAGE_ID_LENGTH+1]
-	 )
-	{ queuerun_msg_qname = q->name; break; }
-    return;
+#ifdef PR_SET_PDEATHSIG
+(void) prctl(PR_SET_PDEATHSIG, SIGTERM);
 #endif
+qrunners = NULL;
+sigalrm_seen = FALSE;
+signal(SIGHUP, SIG_IGN);
+set_process_info("daemon(%s): acceptor %d", version_string, idx);
+return TRUE;
+}
 
-  case NOTIFY_QUEUE_SIZE_REQ:
-    {
-    uschar qsbuf[16];
-    int len = snprintf(CS qsbuf, sizeof(qsbuf), "%u", queue_count_cached());
 
-    DEBUG(D_queue_run)
-      debug_printf("%s: queue size request: %s\n", __FUNCTION__, qsbuf);
 
-    if (sendto(daemon_notifier_fd, qsbuf, len, 0,
-		(const struct sockaddr *)&sa_un, msg.msg_namelen) < 0)
-      log_write(0, LOG_MAIN|LOG_PANIC,
-	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
-    break;
-    }
+/*************************************************
+*          Helper servers for the daemon         *
+*************************************************/
 
-  case NOTIFY_REGEX:
-    regex_at_daemon(buf);
-    break;
+/* The delivery fork server, the spool sync server and the lookup proxies are
+each a process forked by the daemon which serves its descendants over a
+socketpair, the daemon keeping one end for them to inherit. These are the
+common parts of starting them. */
+
+static BOOL
+daemon_server_socketpair(int * sv, const uschar * name)
+{
+if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: socketpair for %s: %s",
+    name, strerror(errno));
+  return FALSE;
   }
-return;
+(void) fcntl(sv[0], F_SETFD, fcntl(sv[0], F_GETFD) | FD_CLOEXEC);
+(void) fcntl(sv[1], F_SETFD, fcntl(sv[1], F_GETFD) | FD_CLOEXEC);
+return TRUE;
 }
 
 
+/* Fork a server. The child closes the daemon's sockets, including those to
+any other servers, sets up signals so that it goes with the daemon, and runs
+the loop, which does not return, on its end of the socketpair. The caller
+closes that end once it has started all the processes sharing it.
 
-static void
-daemon_inetd_wtimeout(time_t last_connection_time)
+Arguments:
+  sv		the socketpair
+  name		what the server is, for messages
+  purpose	for exim_fork()
+  loop		the server's main loop
+  fd_polls	the daemon's listening sockets
+  listen_socket_count  count of listening sockets
+
+Returns:	the pid of the server, or -1 if the fork failed
+*/
+
+static pid_t
+daemon_server_fork(int * sv, const uschar * name, const uschar * purpose,
+  void (*loop)(int), struct pollfd * fd_polls, int listen_socket_count)
 {
-time_t resignal_interval = inetd_wait_timeout;
+int * server_fds[] = {&daemon_forkserver_fd, &daemon_syncserver_fd,
+		      &daemon_lookupproxy_fd};
+pid_t pid;
 
-if (last_connection_time == (time_t)0)
+if ((pid = exim_fork(purpose)) == 0)
   {
-  DEBUG(D_any)
-    debug_printf("inetd wait timeout expired, but still not seen first message, ignoring\n");
+  (void) close(sv[0]);
+  close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
+  daemon_notifier_fd = -1;
+  for (int i = 0; i < nelem(server_fds); i++)
+    if (*server_fds[i] >= 0)
+      {
+      (void) close(*server_fds[i]);
+      *server_fds[i] = -1;
+      }
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+#ifdef PR_SET_PDEATHSIG
+  (void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+  set_process_info("daemon(%s): %s", version_string, name);
+  log_close_all();
+  loop(sv[1]);					/* Does not return */
   }
+
+if (pid < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: %s fork failed: %s",
+    name, strerror(errno));
 else
+  DEBUG(D_any) debug_printf("started %s, pid %ld\n", name, (long)pid);
+return pid;
+}
+
+
+
+/*************************************************
+*           Delivery fork server                 *
+*************************************************/
+
+/* A process which has received a message and wants it delivered at once has
+given up root privilege, so it normally re-execs Exim with -Mc, which costs a
+full read of the configuration and all the initialization done at startup.
+With daemon_fork_server set, the daemon instead forks, before it gives up
+root, a process which keeps root and waits for requests on a socketpair. The
+daemon's descendants hold the other end; for each request the server forks a
+process which does what the -Mc re-exec would have done. As with a re-exec,
+the delivery process runs with real and effective uid root, and deliver_message()
+changes uid for each delivery as it would anyway.
+
+The request carries a message id and the settings which child_exec_exim()
+would pass on the command line, and (when debugging) the requester's debug
+output fd. If the server has gone, the request fails and the caller falls
+back to a re-exec. */
+
+/* Called in a process descended from the daemon, in place of a re-exec for
+-Mc.
+
+Argument:  the message id
+Returns:   TRUE if the fork server took the request
+*/
+
+BOOL
+daemon_forkserver_deliver(const uschar * id)
+{
+forkserver_req req = {0};
+struct msghdr msg = {0};
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf = {0};
+struct iovec vec = {.iov_base = &req, .iov_len = sizeof(req)};
+ssize_t n;
+
+if (  daemon_forkserver_fd < 0
+   || Ustrlen(id) != MESSAGE_ID_LENGTH
+   || Ustrlen(queue_name) > EXIM_DRIVERNAME_MAX)
+  return FALSE;
+
+Ustrcpy(req.message_id, id);
+Ustrcpy(req.queue_name, queue_name);
+req.debug_selector = debug_selector;
+req.dtrigger_selector = dtrigger_selector;
+req.connection_max_messages = connection_max_messages;
+req.dont_deliver = f.dont_deliver;
+req.queue_smtp = f.queue_smtp;
+req.synchronous_delivery = f.synchronous_delivery;
+req.testsuite_delays = f.testsuite_delays;
+
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+if (debug_selector != 0 && debug_fd >= 0)
   {
-  time_t now = time(NULL);
-  if (now == (time_t)-1)
-    {
-    DEBUG(D_any) debug_printf("failed to get time: %s\n", strerror(errno));
-    }
-  else if ((now - last_connection_time) >= inetd_wait_timeout)
-    {
-    DEBUG(D_any)
-      debug_printf("inetd wait timeout %d expired, ending daemon\n",
-	  inetd_wait_timeout);
-    log_write(0, LOG_MAIN, "exim %s daemon terminating, inetd wait timeout reached.\n",
-	version_string);
-    daemon_die();		/* Does not return */
-    }
-  else
-    resignal_interval -= (now - last_connection_time);
+  struct cmsghdr * cmsg;
+  msg.msg_control = &cmsgbuf.buf;
+  msg.msg_controllen = sizeof(cmsgbuf.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), &debug_fd, sizeof(int));
   }
 
-sigalrm_seen = FALSE;
-ALARM(resignal_interval);
+while ((n = sendmsg(daemon_forkserver_fd, &msg, 0)) < 0 && errno == EINTR) ;
+if (n != sizeof(req))
+  {
+  DEBUG(D_any) debug_printf("delivery fork server request failed: %s\n",
+    n < 0 ? strerror(errno) : "short write");
+  return FALSE;
+  }
+DEBUG(D_any) debug_printf("delivery of %s passed to fork server\n", id);
+return TRUE;
 }
 
 
-/* Re-sort the qrunners list, and return the shortest interval.
-That could be negatime.
-The next-tick times should have been updated by any runs initiated,
-though will not be when the global limit on runners was reached.
+/* In a process forked by the fork server, set up as the re-exec would
+have done from its command line, and deliver. Does not return. */
 
-Unlikely to have many queues, so insertion-sort.
-*/
-
-static int
-next_qrunner_interval(void)
+static void
+forkserver_delivery(forkserver_req * req, int dfd)
 {
-qrunner * sorted = NULL;
-for (qrunner * q = qrunners, * next; q; q = next)
+uschar id[MESSAGE_ID_LENGTH + 1];
+
+signal(SIGCHLD, SIG_DFL);
+signal(SIGTERM, SIG_DFL);
+
+if (dfd >= 0)
   {
-  next = q->next;
-  q->next = NULL;
-  if (sorted)
-    {
-    qrunner ** p = &sorted;
-    for (qrunner * qq; qq = *p; p = &qq->next)
-      if (  q->next_tick < qq->next_tick
-	 || q->next_tick == qq->next_tick && q->interval < qq->interval
-	 )
-	{
-	*p = q;
-	q->next = qq;
-	goto INSERTED;
-	}
-    *p = q;
-  INSERTED: ;
-    }
-  else
-    sorted = q;
+  (void) dup2(dfd, 2);
+  (void) close(dfd);
+  debug_file = stderr;
+  debug_fd = fileno(debug_file);
   }
-qrunners = sorted;
-return qrunners ? qrunners->next_tick - time(NULL) : 0;
+debug_selector = req->debug_selector;
+dtrigger_selector = req->dtrigger_selector;
+queue_name = string_copy_taint(req->queue_name, GET_UNTAINTED);
+connection_max_messages = req->connection_max_messages;
+f.dont_deliver = req->dont_deliver;
+f.queue_smtp = req->queue_smtp;
+f.synchronous_delivery = req->synchronous_delivery;
+f.testsuite_delays = req->testsuite_delays;
+
+/* As for the re-exec, the caller is the Exim user, which is an admin user */
+
+real_uid = exim_uid;
+real_gid = exim_gid;
+f.admin_user = TRUE;
+
+Ustrcpy(id, req->message_id);
+(void) deliver_message(id, FALSE, FALSE);
+search_tidyup();
+exim_underbar_exit(EXIT_SUCCESS);
 }
 
-/* See if we can do a queue run.  If policy limit permit, kick one off.
-If both notification and timer events are present, handle the former
-and leave the timer outstanding.
 
-Return the number of seconds until the next due runner.
-*/
+/* The fork server main loop. Does not return. */
 
-static int
-daemon_qrun(int local_queue_run_max, struct pollfd * fd_polls, int listen_socket_count)
+static void
+forkserver_loop(int sock)
 {
-DEBUG(D_any) debug_printf("%s received\n",
-#ifndef DISABLE_QUEUE_RAMP
-  *queuerun_msgid ? "qrun notification" :
-#endif
-  "SIGALRM");
+#ifdef SA_NOCLDWAIT
+struct sigaction act;
 
-/* Do a full queue run in a child process, if required, unless we already have
-enough queue runners on the go. If we are not running as root, a re-exec is
-required. In the calling process, restart the alamr timer for the next run.  */
+act.sa_handler = SIG_IGN;
+sigemptyset(&(act.sa_mask));
+act.sa_flags = SA_NOCLDWAIT;
+sigaction(SIGCHLD, &act, NULL);
+#else
+signal(SIGCHLD, SIG_IGN);
+#endif
 
-if (is_multiple_qrun())				/* we are managing periodic runs */
-  if (local_queue_run_max <= 0 || queue_run_count < local_queue_run_max)
+for (;;)
+  {
+  forkserver_req req;
+  struct msghdr msg = {0};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsgbuf = {0};
+  struct cmsghdr * cmsg;
+  struct iovec vec = {.iov_base = &req, .iov_len = sizeof(req)};
+  int dfd = -1;
+  ssize_t n;
+  pid_t pid;
+
+  msg.msg_control = &cmsgbuf.buf;
+  msg.msg_controllen = sizeof(cmsgbuf.buf);
+  msg.msg_iov = &vec;
+  msg.msg_iovlen = 1;
+
+  if ((n = recvmsg(sock, &msg, 0)) < 0)
     {
-    qrunner * q = NULL;
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery fork server: recvmsg: %s",
+      strerror(errno));
+    exim_underbar_exit(EXIT_FAILURE);
+    }
+  if (n == 0)					/* all requesters have gone */
+    exim_underbar_exit(EXIT_SUCCESS);
 
-#ifndef DISABLE_QUEUE_RAMP
-    /* If this is a triggered run for a specific message, see if we can start
-    another runner for this queue. */
+  if (  (cmsg = CMSG_FIRSTHDR(&msg))
+     && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&dfd, CMSG_DATA(cmsg), sizeof(int));
 
-    if (*queuerun_msgid)
-      {
-      for (qrunner * qq = qrunners; qq; qq = qq->next)
-	if (qq->name == queuerun_msg_qname)
-	  {
-	  q = qq->run_count < qq->run_max ? qq : NULL;
-	  break;
-	  }
-      }
-    else
-#endif
-      /* Normal periodic run: in order of run priority, find the first queue
-      for which we can start a runner */
+  req.message_id[MESSAGE_ID_LENGTH] = '\0';
+  req.queue_name[EXIM_DRIVERNAME_MAX] = '\0';
+  if (n != sizeof(req) || !mac_ismsgid(req.message_id))
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery fork server: bad request");
+    log_close_all();
+    }
+  else if ((pid = exim_fork(US"forkserver-delivery")) == 0)
+    {
+    (void) close(sock);
+    forkserver_delivery(&req, dfd);		/* Does not return */
+    }
+  else if (pid < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery fork server: fork for %s "
+      "failed: %s", req.message_id, strerror(errno));
+    log_close_all();
+    }
+  if (dfd >= 0) (void) close(dfd);
+  }
+}
 
-      for (q = qrunners; q; q = q->next)
-	if (q->run_count < q->run_max) break;
 
-    if (q)					/* found a queue to run */
-      {
-      pid_t pid;
+/* Start the fork server, from the daemon while it is still root. Failure
+is not serious; deliveries re-exec as usual. */
 
-      /* Bump this queue's next-tick by it's interval */
+static void
+daemon_forkserver_start(struct pollfd * fd_polls, int listen_socket_count)
+{
+int sv[2];
 
-      if (q->interval)
-	{
-	time_t now = time(NULL);
-	do ; while ((q->next_tick += q->interval) <= now);
-	}
+if (!daemon_server_socketpair(sv, US"delivery fork server")) return;
+forkserver_pid = daemon_server_fork(sv, US"delivery fork server",
+  US"daemon-forkserver", forkserver_loop, fd_polls, listen_socket_count);
+(void) close(sv[1]);
+if (forkserver_pid < 0)
+  {
+  (void) close(sv[0]);
+  forkserver_pid = 0;
+  }
+else
+  daemon_forkserver_fd = sv[0];
+}
 
-      if ((pid = exim_fork(US"queue-runner")) == 0)
-	{
-	/* Disable debugging if it's required only for the daemon process. We
-	leave the above message, because it ties up with the "child ended"
-	debugging messages. */
 
-	if (f.debug_daemon) debug_selector = 0;
 
-	/* Close any open listening sockets in the child */
+/*************************************************
+*           Spool sync server                    *
+*************************************************/
 
-	close_daemon_sockets(daemon_notifier_fd,
-	  fd_polls, listen_socket_count);
+/* Every message received costs at least two synchronous disk flushes, for
+its -D and -H files, and each receiving process waits for its own. On a busy
+server the disk's flush latency then limits the rate at which messages can be
+accepted. With daemon_sync_server set, the daemon forks a process to do the
+flushing for all its descendants. A process wanting a file flushed sends the
+server the file's descriptor, together with the write end of a pipe, and waits
+for the result on the pipe. The server collects all the requests that are
+waiting, flushes each filesystem concerned once with syncfs() (or, where that
+is not available, each file with fsync()) and then replies to them all; while
+it is doing that, more requests queue up for the next batch. Linux kernels
+before 5.8 do not report writeback errors from syncfs(), so on those each file
+is flushed with fsync().
+
+A requester does not go on until its file has been flushed, just as when it
+calls fsync() itself, so no message is acknowledged before it is on disk. If
+the server has gone, the request cannot be made, or there is no reply within
+SYNCSERVER_WAIT, the requester calls fsync() itself. */
+
+#define SYNCSERVER_BATCH	64
+#define SYNCSERVER_WAIT		30	/* seconds for a reply */
 
-	/* Reset SIGHUP and SIGCHLD in the child in both cases. */
+static int
+sync_local(int fd, BOOL data_only)
+{
+#if _POSIX_C_SOURCE >= 199309L || _XOPEN_SOURCE >= 500
+if (data_only) return fdatasync(fd);
+#endif
+return fsync(fd);
+}
 
-	signal(SIGHUP,  SIG_DFL);
-	signal(SIGCHLD, SIG_DFL);
-	signal(SIGTERM, SIG_DFL);
-	signal(SIGINT, SIG_DFL);
 
-	/* Re-exec if privilege has been given up, unless deliver_drop_
-	privilege is set. Reset SIGALRM before exec(). */
+/* Flush a file, using the sync server if there is one.
 
-	if (geteuid() != root_uid && !deliver_drop_privilege)
-	  {
-	  uschar opt[8];
-	  uschar *p = opt;
-	  uschar *extra[7];
-	  int extracount = 1;
+Arguments:
+  fd         the file descriptor
+  data_only  TRUE if fdatasync() is enough when syncing locally
 
-	  signal(SIGALRM, SIG_DFL);
-	  queue_name = US"";
+Returns:     0 for success, -1 with errno set for failure, as for fsync()
+*/
 
-	  *p++ = '-';
-	  *p++ = 'q';
-	  if (  q->queue_2stage
-#ifndef DISABLE_QUEUE_RAMP
-	     && !*queuerun_msgid
+int
+daemon_sync(int fd, BOOL data_only)
+{
+struct msghdr msg = {0};
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(2 * sizeof(int))];
+} cmsgbuf = {0};
+struct cmsghdr * cmsg;
+uschar kind = 'F';
+struct iovec vec = {.iov_base = &kind, .iov_len = 1};
+int pfd[2], fds[2], result;
+ssize_t n;
+
+#ifdef ENABLE_DISABLE_FSYNC
+if (disable_fsync) return 0;
 #endif
-	     ) *p++ = 'q';
-	  if (q->queue_run_first_delivery) *p++ = 'i';
-	  if (q->queue_run_force) *p++ = 'f';
-	  if (q->deliver_force_thaw) *p++ = 'f';
-	  if (q->queue_run_local) *p++ = 'l';
-	  *p = 0;
+if (daemon_syncserver_fd < 0 || pipe(pfd) < 0)
+  return sync_local(fd, data_only);
+
+fds[0] = fd;
+fds[1] = pfd[1];
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+msg.msg_control = &cmsgbuf.buf;
+msg.msg_controllen = sizeof(cmsgbuf.buf);
+cmsg = CMSG_FIRSTHDR(&msg);
+cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+cmsg->cmsg_level = SOL_SOCKET;
+cmsg->cmsg_type = SCM_RIGHTS;
+memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+while ((n = sendmsg(daemon_syncserver_fd, &msg, 0)) < 0 && errno == EINTR) ;
+(void) close(pfd[1]);
+if (n == 1)
+  {
+  struct pollfd p = {.fd = pfd[0], .events = POLLIN};
+  time_t limit = time(NULL) + SYNCSERVER_WAIT;
+  int rc, wait;
+
+  while ((wait = (int)(limit - time(NULL))) > 0
+	&& (rc = poll(&p, 1, wait * 1000)) < 0 && errno == EINTR) ;
+  if (wait <= 0 || rc == 0)
+    { n = -1; errno = ETIMEDOUT; }
+  else if (rc > 0)
+    while ((n = read(pfd[0], &result, sizeof(result))) < 0 && errno == EINTR) ;
+  else
+    n = -1;
+  }
+(void) close(pfd[0]);
 
-	  extra[0] = q->name
-	    ? string_sprintf("%sG%s", opt, q->name) : opt;
+if (n != sizeof(result))
+  {
+  DEBUG(D_any) debug_printf("spool sync server request failed: %s\n",
+    n < 0 ? strerror(errno) : "no reply");
+  return sync_local(fd, data_only);
+  }
+if (result == 0) return 0;
+errno = result;
+return -1;
+}
 
-#ifndef DISABLE_QUEUE_RAMP
-	  if (*queuerun_msgid)
-	    {
-	    log_write(0, LOG_MAIN, "notify triggered queue run");
-	    extra[extracount++] = queuerun_msgid;	/* Trigger only the */
-	    extra[extracount++] = queuerun_msgid;	/* one message      */
-	    }
-#endif
 
-	  /* If -R or -S were on the original command line, ensure they get
-	  passed on. */
+/* The sync server main loop. Does not return. */
 
-	  if (deliver_selectstring)
-	    {
-	    extra[extracount++] = f.deliver_selectstring_regex ? US"-Rr" : US"-R";
-	    extra[extracount++] = deliver_selectstring;
-	    }
+typedef struct {
+  int	fd;
+  int	reply_fd;
+  dev_t	dev;
+  int	result;
+} sync_req;
 
-	  if (deliver_selectstring_sender)
-	    {
-	    extra[extracount++] = f.deliver_selectstring_sender_regex
-	      ? US"-Sr" : US"-S";
-	    extra[extracount++] = deliver_selectstring_sender;
-	    }
+static void
+syncserver_loop(int sock)
+{
+#ifdef EXIM_HAVE_SYNCFS
+struct utsname u;
+int major, minor;
+BOOL use_syncfs = uname(&u) == 0
+  && sscanf(u.release, "%d.%d", &major, &minor) == 2
+  && (major > 5 || major == 5 && minor >= 8);
+#endif
 
-	  /* Overlay this process with a new execution. */
+for (;;)
+  {
+  sync_req reqs[SYNCSERVER_BATCH];
+  int count = 0;
 
-	  (void)child_exec_exim(CEE_EXEC_PANIC, FALSE, NULL, FALSE, extracount,
-	    extra[0], extra[1], extra[2], extra[3], extra[4], extra[5], extra[6]);
+  /* Wait for a request, then take all the others that are waiting */
 
-	  /* Control never returns here. */
-	  }
+  while (count < SYNCSERVER_BATCH)
+    {
+    struct msghdr msg = {0};
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(2 * sizeof(int))];
+    } cmsgbuf = {0};
+    struct cmsghdr * cmsg;
+    uschar kind;
+    struct iovec vec = {.iov_base = &kind, .iov_len = 1};
+    struct stat statbuf;
+    int fds[2];
+    ssize_t n;
+
+    msg.msg_control = &cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+
+    if ((n = recvmsg(sock, &msg, count > 0 ? MSG_DONTWAIT : 0)) < 0)
+      {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      log_write(0, LOG_MAIN|LOG_PANIC, "spool sync server: recvmsg: %s",
+	strerror(errno));
+      exim_underbar_exit(EXIT_FAILURE);
+      }
+    if (n == 0)					/* all requesters have gone */
+      exim_underbar_exit(EXIT_SUCCESS);
 
-	/* No need to re-exec; SIGALRM remains set to the default handler */
+    if (  !(cmsg = CMSG_FIRSTHDR(&msg))
+       || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+       || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "spool sync server: bad request");
+      log_close_all();
+      continue;
+      }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    reqs[count].fd = fds[0];
+    reqs[count].reply_fd = fds[1];
+    reqs[count].dev = fstat(fds[0], &statbuf) == 0 ? statbuf.st_dev : 0;
+    reqs[count].result = -1;
+    count++;
+    }
 
-#ifndef DISABLE_QUEUE_RAMP
-	if (*queuerun_msgid)
-	  {
-	  log_write(0, LOG_MAIN, "notify triggered queue run");
-	  f.queue_2stage = FALSE;
-	  queue_run(q, queuerun_msgid, queuerun_msgid, FALSE);
-	  }
-	else
-#endif
-	  queue_run(q, NULL, NULL, FALSE);
-	exim_underbar_exit(EXIT_SUCCESS);
-	}
+  /* Flush each filesystem once, or each file */
 
-      if (pid < 0)
+  for (int i = 0; i < count; i++)
+    if (reqs[i].result < 0)
+      {
+#ifdef EXIM_HAVE_SYNCFS
+      if (use_syncfs)
 	{
-	log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of queue-runner "
-	  "process failed: %s", strerror(errno));
-	log_close_all();
+	int rc = syncfs(reqs[i].fd) < 0 ? errno : 0;
+	for (int j = i; j < count; j++)
+	  if (reqs[j].dev == reqs[i].dev) reqs[j].result = rc;
 	}
       else
-	{
-	for (int i = 0; i < local_queue_run_max; ++i)
-	  if (queue_runner_slots[i].pid <= 0)
-	    {
-	    queue_runner_slots[i].pid = pid;
-	    queue_runner_slots[i].queue_name = q->name;
-	    q->run_count++;
-	    queue_run_count++;
-	    break;
-	    }
-	DEBUG(D_any) debug_printf("%d queue-runner process%s running\n",
-	  queue_run_count, queue_run_count == 1 ? "" : "es");
-	}
+#endif
+	reqs[i].result = fsync(reqs[i].fd) < 0 ? errno : 0;
       }
-    }
 
-/* The queue run has been initiated (unless we were already running enough) */
-
-#ifndef DISABLE_QUEUE_RAMP
-if (*queuerun_msgid)		/* it was a fast-ramp kick; dealt with */
-  *queuerun_msgid = 0;
-else				/* periodic or one-time queue run */
-#endif
-  /* Set up next timer callback. Impose a minimum 1s tick,
-  even when a run was outstanding */
-  {
-  int interval = next_qrunner_interval();
-  if (interval <= 0) interval = 1;
+  DEBUG(D_any) debug_printf("spool sync server: %d request%s\n",
+    count, count == 1 ? "" : "s");
 
-  sigalrm_seen = FALSE;
-  if (qrunners)			/* there are still periodic qrunners */
+  for (int i = 0; i < count; i++)
     {
-    ALARM(interval);		/* set up next qrun tick */
-    return interval;
+    (void) write(reqs[i].reply_fd, &reqs[i].result, sizeof(int));
+    (void) close(reqs[i].reply_fd);
+    (void) close(reqs[i].fd);
     }
   }
-return 0;
 }
 
 
+/* Start the sync server. Failure is not serious; processes sync their own
+files. */
 
-
-static const uschar *
-describe_queue_runners(void)
+static void
+daemon_syncserver_start(struct pollfd * fd_polls, int listen_socket_count)
 {
-gstring * g = NULL;
-
-if (!is_multiple_qrun()) return US"no queue runs";
+int sv[2];
 
-for (qrunner * q = qrunners; q; q = q->next)
+if (!daemon_server_socketpair(sv, US"spool sync server")) return;
+syncserver_pid = daemon_server_fork(sv, US"spool sync server",
+  US"daemon-syncserver", syncserver_loop, fd_polls, listen_socket_count);
+(void) close(sv[1]);
+if (syncserver_pid < 0)
   {
-  g = string_catn(g, US"-q", 2);
-  if (q->queue_2stage) g = string_catn(g, US"q", 1);
-  if (q->name) g = string_append(g, 3, US"G", q->name, US"/");
-  g = string_cat(g, readconf_printtime(q->interval));
-  g = string_catn(g, US" ", 1);
+  (void) close(sv[0]);
+  syncserver_pid = 0;
   }
-gstring_trim(g, 1);
-gstring_release_unused(g);
-return string_from_gstring(g);
+else
+  daemon_syncserver_fd = sv[0];
 }
 
 
 
+/*************************************************
+*           Lookup proxy                         *
+*************************************************/
+
+/* The query-style lookups of the types listed in daemon_lookup_proxy are done
+for all the daemon's descendants by daemon_lookup_proxy_connections processes,
+which keep their connections to the database servers. Each proxy takes new
+clients from a shared socket, so they are spread across them. The protocol and
+the serving loop are in search.c. Failure is not serious; processes do their
+own lookups. */
+
 static void
-daemon_preload_modules(void)
+daemon_lookupproxy_start(struct pollfd * fd_polls, int listen_socket_count)
 {
-#ifdef LOOKUP_MODULE_DIR
-uschar namebuf[32];
-const uschar * list = daemon_modules_load, * ele;
-int sep = 0;
+int sv[2], count = daemon_lookup_proxy_connections;
 
-while (ele = string_nextinlist(&list, &sep, namebuf, sizeof(namebuf)))
-  mod_load_anyclass(ele);
-#endif
+if (count <= 0) return;
+if (count > 64) count = 64;
+if (!daemon_server_socketpair(sv, US"lookup proxy")) return;
+
+lookupproxy_pids = store_get(count * sizeof(pid_t), GET_UNTAINTED);
+for (int i = 0; i < count; i++)
+  {
+  pid_t pid = daemon_server_fork(sv, US"lookup proxy", US"daemon-lookup-proxy",
+    search_proxy_serve, fd_polls, listen_socket_count);
+  if (pid < 0) break;
+  lookupproxy_pids[lookupproxy_count++] = pid;
+  }
+lookupproxy_live = lookupproxy_count;
+
+(void) close(sv[1]);
+if (lookupproxy_count == 0)
+  (void) close(sv[0]);
+else
+  daemon_lookupproxy_fd = sv[0];
 }
 
 
+
 /*************************************************
 *              Exim Daemon Mainline              *
 *************************************************/
@@ -1714,6 +3160,7 @@ int listen_socket_count = 0, poll_fd_count;
 ip_address_item * addresses = NULL;
 time_t last_connection_time = (time_t)0;
 int local_queue_run_max = 0;
+int accept_batch = f.inetd_wait_mode ? 1 : daemon_accept_batch;
 
 if (is_multiple_qrun())
   {
@@ -2086,14 +3533,17 @@ if (f.daemon_listen && !f.inetd_wait_mode)
     }
 
   /* Get a vector to remember all the sockets in.
-  Two extra elements for the ancillary sockets */
+  Two extra elements for the ancillary sockets, and one for each pre-forked
+  SMTP worker. */
 
   for (ipa = addresses; ipa; ipa = ipa->next)
     listen_socket_count++;
-  fd_polls = store_get(sizeof(struct pollfd) * (listen_socket_count + 2),
-			    GET_UNTAINTED);
-  for (struct pollfd * p = fd_polls; p < fd_polls + listen_socket_count + 2;
-       p++)
+  smtp_worker_count = daemon_smtp_workers > 256 ? 256
+    : daemon_smtp_workers > 0 ? daemon_smtp_workers : 0;
+  fd_polls = store_get(sizeof(struct pollfd)
+		    * (listen_socket_count + 2 + smtp_worker_count), GET_UNTAINTED);
+  for (struct pollfd * p = fd_polls;
+       p < fd_polls + listen_socket_count + 2 + smtp_worker_count; p++)
     { p->fd = -1; p->events = POLLIN; }
 
   } /* daemon_listen but not inetd_wait_mode */
@@ -2112,13 +3562,33 @@ if (f.daemon_listen)
 
   if (smtp_accept_queue > smtp_accept_max) smtp_accept_queue = 0;
 
+  /* Additional acceptor processes need the kernel to spread connections
+  across several sockets listening on the same address. They make no sense
+  for the inetd wait mode. */
+
+  if (daemon_acceptors > 1 && !f.inetd_wait_mode)
+#ifdef EXIM_SO_REUSEPORT
+    acceptor_count = daemon_acceptors > 64 ? 64 : daemon_acceptors;
+#else
+    log_write(0, LOG_MAIN, "daemon_acceptors ignored: "
+      "no load-balancing listener support on this OS");
+#endif
+
   /* Get somewhere to keep the list of SMTP accepting pids if we are keeping
-  track of them for total number and queue/host limits. */
+  track of them for total number and queue/host limits. It has to be shared
+  when there are several acceptors. */
 
   if (smtp_accept_max > 0)
     {
-    smtp_slots = store_get(smtp_accept_max * sizeof(smtp_slot), GET_UNTAINTED);
-    for (int i = 0; i < smtp_accept_max; i++) smtp_slots[i] = empty_smtp_slot;
+    size_t size = sizeof(smtp_slot_table) + smtp_accept_max * sizeof(smtp_slot);
+
+    if (acceptor_count <= 1)
+      smtp_slots = store_get(size, GET_UNTAINTED);
+    else if ((smtp_slots = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_ANON, -1, 0)) == MAP_FAILED)
+      log_write_die(0, LOG_MAIN, "daemon: failed to map connection table: %s",
+	strerror(errno));
+    memset(smtp_slots, 0, size);
     }
   }
 
@@ -2234,6 +3704,16 @@ if (f.daemon_listen && !f.inetd_wait_mode)
       log_write_die(0, LOG_MAIN, "setting SO_REUSEADDR on socket "
         "failed when starting daemon: %s", strerror(errno));
 
+    /* With several acceptors, allow further sockets to share the port; they
+    are created once this loop has settled the list of addresses. */
+
+#ifdef EXIM_SO_REUSEPORT
+    if (  acceptor_count > 1
+       && setsockopt(fd, SOL_SOCKET, EXIM_SO_REUSEPORT, &on, sizeof(on)) < 0)
+      log_write_die(0, LOG_MAIN, "setting SO_REUSEPORT on socket "
+        "failed when starting daemon: %s", strerror(errno));
+#endif
+
     /* Set TCP_NODELAY; Exim does its own buffering. There is a switch to
     disable this because it breaks some broken clients. */
 
@@ -2311,6 +3791,11 @@ if (f.daemon_listen && !f.inetd_wait_mode)
 	f.tcp_fastopen_ok = FALSE;
 	}
 #endif
+      /* When accepting in batches the listener must not block once its
+      queue of pending connections has been drained. */
+
+      if (accept_batch > 1)
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
       fd_polls[sk].fd = fd;
       continue;
       }
@@ -2345,6 +3830,18 @@ if (f.daemon_listen && !f.inetd_wait_mode)
       ipa = ipa2;
       }
     }          /* End of bind/listen loop for each address */
+
+  /* Each additional acceptor gets its own socket for every address. */
+
+  if (acceptor_count > 1)
+    {
+    acceptor_fds = store_get((acceptor_count-1) * listen_socket_count
+			      * sizeof(int), GET_UNTAINTED);
+    for (int i = 0; i < acceptor_count-1; i++)
+      for (ipa = addresses, sk = 0; sk < listen_socket_count;
+	   ipa = ipa->next, sk++)
+	acceptor_fds[i * listen_socket_count + sk] = daemon_listener_dup(ipa);
+    }
   }            /* End of setup for listening */
 
 
@@ -2382,6 +3879,18 @@ if (f.running_in_test_harness || write_pid)
 sighup_seen = FALSE;
 signal(SIGHUP, sighup_handler);
 
+/* Map the table of lookup results shared by everything the daemon forks.
+This has to be done before any of them are started. */
+
+search_shared_init();
+
+/* If wanted, start the delivery fork server while we still have root. It is
+pointless when deliveries are done unprivileged, as no re-exec is done. */
+
+if (  daemon_fork_server && f.daemon_listen && !f.inetd_wait_mode
+   && geteuid() == root_uid && !deliver_drop_privilege)
+  daemon_forkserver_start(fd_polls, listen_socket_count);
+
 /* Give up root privilege at this point (assuming that exim_uid and exim_gid
 are not root). The third argument controls the running of initgroups().
 Normally we do this, in order to set up the groups for the Exim user. However,
@@ -2398,6 +3907,16 @@ originator_gid = exim_gid;
 originator_login = (pw = getpwuid(exim_uid))
   ? string_copy_perm(US pw->pw_name, FALSE) : US"exim";
 
+/* If wanted, start the spool sync server. It needs no privilege. */
+
+if (daemon_sync_server && f.daemon_listen && !f.inetd_wait_mode)
+  daemon_syncserver_start(fd_polls, listen_socket_count);
+
+/* Likewise the lookup proxies */
+
+if (daemon_lookup_proxy && f.daemon_listen && !f.inetd_wait_mode)
+  daemon_lookupproxy_start(fd_polls, listen_socket_count);
+
 /* Get somewhere to keep the list of queue-runner pids if we are keeping track
 of them (and also if we are doing queue runs). */
 
@@ -2560,6 +4079,20 @@ else	/* no listening sockets, only queue-runs */
   set_process_info("daemon(%s): %s, not listening", version_string, s);
   }
 
+/* Start any additional acceptors. Each carries on from here, doing its own
+initialization below. */
+
+if (acceptor_count > 1)
+  {
+  acceptor_pids = store_get(acceptor_count * sizeof(pid_t), GET_UNTAINTED);
+  acceptor_started = store_get(acceptor_count * sizeof(time_t), GET_UNTAINTED);
+  memset(acceptor_pids, 0, acceptor_count * sizeof(pid_t));
+  slots_lock_pid = getpid();
+  for (int i = 1; i < acceptor_count; i++)
+    if (daemon_acceptor_start(i, fd_polls, listen_socket_count))
+      break;
+  }
+
 /* Do any work it might be useful to amortize over our children
 (eg: compile regex) */
 
@@ -2591,6 +4124,22 @@ if (daemon_notifier_fd >= 0)
   dnotify_poll->events = POLLIN;
   }
 
+/* Start the pre-forked SMTP workers; each has a pollfd following the
+ancillary ones. Every acceptor has its own pool. */
+
+if (smtp_worker_count > 0)
+  {
+  smtp_workers = store_get(smtp_worker_count * sizeof(smtp_worker), GET_UNTAINTED);
+  for (smtp_worker * w = smtp_workers; w < smtp_workers + smtp_worker_count; w++)
+    *w = (smtp_worker) {.fd = -1, .slot = -1};
+  smtp_worker_polls = &fd_polls[poll_fd_count];
+  poll_fd_count += smtp_worker_count;
+  smtp_workers_start(fd_polls, listen_socket_count);
+  }
+
+if (f.daemon_listen)
+  daemon_poll_init(fd_polls, poll_fd_count);
+
 /* Close the log so it can be renamed and moved. In the few cases below where
 this long-running process writes to the log (always exceptional conditions), it
 closes the log afterwards, for the same reason. */
@@ -2616,6 +4165,37 @@ for (;;)
   if (sigterm_seen)
     daemon_die();	/* Does not return */
 
+  /* Replace any additional acceptor that has gone, unless it went very soon
+  after starting; that one is left until a later trip round the loop. A new
+  acceptor picks up the TLS setup for itself. */
+
+  if (orphan_slots)
+    smtp_slots_sweep(-1);
+
+  if (acceptor_restart)
+    {
+    time_t now = time(NULL);
+
+    acceptor_restart = FALSE;
+    for (int i = 1; i < acceptor_count; i++) if (acceptor_pids[i] == 0)
+      if (now - acceptor_started[i] < 5)
+	acceptor_restart = TRUE;
+      else if (daemon_acceptor_start(i, fd_polls, listen_socket_count))
+	{
+	if (dnotify_poll) dnotify_poll->fd = -1;
+#if !defined(DISABLE_TLS) && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
+	tls_watch_invalidate();
+	tls_daemon_init();
+	if (tls_watch_poll) tls_watch_poll->fd = tls_watch_fd;
+#endif
+	daemon_poll_init(fd_polls, poll_fd_count);
+	break;
+	}
+    }
+
+  if (smtp_workers_wanted)
+    smtp_workers_start(fd_polls, listen_socket_count);
+
   /* This code is placed first in the loop, so that it gets obeyed at the
   start, before the first wait, for the queue-runner case, so that the first
   one can be started immediately.
@@ -2661,7 +4241,7 @@ for (;;)
       errno = EINTR;
       }
     else
-      lcount = poll(fd_polls, poll_fd_count, -1);
+      lcount = daemon_poll(fd_polls, poll_fd_count);
 
     if (lcount < 0)
       {
@@ -2688,19 +4268,32 @@ for (;;)
       if ((old_tfd = tls_daemon_tick()) >= 0)
 	for (struct pollfd * p = &fd_polls[listen_socket_count];
 	     p < fd_polls + poll_fd_count; p++)
-	  if (p->fd == old_tfd) { p->fd = tls_watch_fd ; break; }
+	  if (p->fd == old_tfd)
+	    {
+	    p->fd = tls_watch_fd;
+#ifdef EXIM_HAVE_EPOLL
+	    (void) daemon_poll_add(fd_polls, p - fd_polls);
+#endif
+	    break;
+	    }
       }
 #endif
       errno = select_errno;
       }
 
+    /* Note any SMTP workers that have become idle */
+
+    if (smtp_workers && !select_failed)
+      lcount -= smtp_worker_events();
+
     /* Loop for all the sockets that are currently ready to go. If select
     actually failed, we have set the count to 1 and select_failed=TRUE, so as
     to use the common error code for select/accept below. */
 
     while (lcount-- > 0)
       {
-      int accept_socket = -1;
+      int accept_socket = -1, accept_fd = -1;
+      EXIM_SOCKLEN_T alen;
 #if HAVE_IPV6
       struct sockaddr_in6 accepted;
 #else
@@ -2731,7 +4324,6 @@ for (;;)
 	     p++)
 	  if (p->revents & POLLIN)
             {
-	    EXIM_SOCKLEN_T alen = sizeof(accepted);
 #if defined(__FreeBSD__) && defined(SO_LISTENQLEN)
 	    int backlog;
 	    socklen_t blen = sizeof(backlog);
@@ -2760,7 +4352,9 @@ for (;;)
 	      }
 #endif
 	    p->revents = 0;
-            accept_socket = accept(p->fd, (struct sockaddr *)&accepted, &alen);
+	    alen = sizeof(accepted);
+            accept_socket = accept(accept_fd = p->fd,
+				    (struct sockaddr *)&accepted, &alen);
             break;
             }
 	}
@@ -2773,9 +4367,12 @@ for (;;)
       crashes the daemon after 10 successive failures of accept, on the grounds
       that some OS fail continuously. Exim originally followed suit, but this
       appears to have caused problems. Now it just keeps going, but instead of
-      logging each error, it batches them up when they are continuous. */
+      logging each error, it batches them up when they are continuous.
+      A non-blocking listener (see daemon_accept_batch) can find its queue
+      already emptied; that is not an error either. */
 
-      if (accept_socket < 0 && errno != EINTR)
+      if (  accept_socket < 0 && errno != EINTR
+	 && (select_failed || errno != EAGAIN && errno != EWOULDBLOCK))
         {
         if (accept_retry_count == 0)
           {
@@ -2810,10 +4407,20 @@ for (;;)
 	accept_retry_count = 0;
 	}
 
-      /* If select/accept succeeded, deal with the connection. */
+      /* If select/accept succeeded, deal with the connection. Then, unless
+      limited to one per wakeup, go on accepting from the same listener until
+      its queue is drained or the batch limit is reached. Each connection is
+      subject to the usual checks in handle_smtp_call(); reap any finished
+      children first so that the counts it uses are current. */
 
-      if (accept_socket >= 0)
+      for (int batch = 1; accept_socket >= 0; batch++)
         {
+#if !defined(__linux__)
+	/* Elsewhere, an accepted socket can inherit O_NONBLOCK */
+	if (accept_batch > 1)
+	  (void) fcntl(accept_socket, F_SETFL,
+			fcntl(accept_socket, F_GETFL) & ~O_NONBLOCK);
+#endif
 #ifdef TCP_QUICKACK /* Avoid pure-ACKs while in tls protocol pingpong phase */
 	/* Unfortunately we cannot be certain to do this before a TLS-on-connect
 	Client Hello arrives and is acked. We do it as early as possible. */
@@ -2823,6 +4430,20 @@ for (;;)
           last_connection_time = time(NULL);
         handle_smtp_call(fd_polls, listen_socket_count, accept_socket,
           (struct sockaddr *)&accepted);
+
+	if (batch >= accept_batch || sigterm_seen || sighup_seen)
+	  accept_socket = -1;
+	else
+	  {
+	  if (sigchld_seen) handle_ending_processes();
+	  alen = sizeof(accepted);
+	  if (  (accept_socket = accept(accept_fd,
+				  (struct sockaddr *)&accepted, &alen)) < 0
+	     && errno != EAGAIN && errno != EWOULDBLOCK)
+	    DEBUG(D_any) debug_printf("batched accept(): %s\n", strerror(errno));
+	  }
+	if (accept_socket < 0 && batch > 1)
+	  DEBUG(D_any) debug_printf("accepted %d connections in batch\n", batch);
         }
       }
     }
@@ -2862,6 +4483,7 @@ for (;;)
     {
     log_write(0, LOG_MAIN, "pid %ld: SIGHUP received: re-exec daemon",
       getpid());
+    daemon_acceptors_stop();
     close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
     unlink_notifier_socket();
     ALARM_CLR(0);
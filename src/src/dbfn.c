@@ -56,7 +56,7 @@ API:
   dbfn_read_enforce_length
   dbfn_write
   dbfn_delete
-  dbfn_scan				unused; ifdeffout out
+  dbfn_scan
 
 Users:
   ACL ratelimit & seen conditions
@@ -64,6 +64,7 @@ Users:
   delivery serialization
   TLS session resumption
   peer capability cache
+  queue index
   callout & quota cache
   DBM lookup type
 
@@ -604,10 +605,8 @@ return rc;
 
 
 
-#ifdef notdef
-/* XXX This appears to be unused.  There's a separate implementation
-in dbutils.c for dumpdb and fixdb, using the same underlying support.
-*/
+/* There's a separate implementation in dbutils.c for dumpdb and fixdb, using
+the same underlying support. */
 
 /*************************************************
 *         Scan the keys of a database file       *
@@ -648,7 +647,6 @@ yield = exim_dbscan(dbblock->dbptr, &key_datum, &value_datum, start, *cursor)
 if (!yield) exim_dbdelete_cursor(*cursor);
 return yield;
 }
-#endif	/*notdef*/
 
 
 
@@ -6854,6 +6854,7 @@ give up; if the message has been around for sufficiently long, remove it. */
       Uunlink(spool_fname(US"input", message_subdir, id, US"-D"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-H"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-J"));
+      queue_index_update(queue_name, id, message_subdir, FALSE);
       log_write(0, LOG_MAIN, "Message removed because older than %s",
 	readconf_printtime(keep_malformed));
       }
@@ -8657,6 +8658,7 @@ if (!addr_defer)
   if (Uunlink(fname) < 0)
     log_write_die(0, LOG_MAIN, "failed to unlink %s: %s",
       fname, strerror(errno));
+  queue_index_update(queue_name, id, message_subdir, FALSE);
 
   /* Log the end of this message, with queue time if requested. */
 
@@ -9050,6 +9052,8 @@ if (cutthrough.cctx.sock >= 0 && cutthrough.callout_hold_only)
 else
   {
   cancel_cutthrough_connection(TRUE, US"non-continued delivery");
+  if (daemon_forkserver_deliver(message_id))
+    exim_underbar_exit(EXIT_SUCCESS);
   (void) child_exec_exim(exec_type, FALSE, NULL, FALSE, 2, US"-Mc", message_id);
   }
 return;		/* compiler quietening; control does not reach here. */
@@ -408,6 +408,16 @@ for (const misc_module_info * mi = misc_module_list; mi; mi = mi->next)
 return OK;
 }
 
+/* Ditto, connection-reset */
+
+void
+misc_mod_conn_reset(void)
+{
+for (const misc_module_info * mi = misc_module_list; mi; mi = mi->next)
+  if (mi->conn_reset)
+    (mi->conn_reset)();
+}
+
 /* Ditto, smtp-reset */
 
 void
@@ -838,6 +838,7 @@ exim_exit(int rc)
 {
 smtp_fflush(SFF_NO_UNCORK);
 search_tidyup();
+profile_write();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -850,6 +851,7 @@ exit(rc);
 void
 exim_underbar_exit(int rc)
 {
+profile_write();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -4855,6 +4857,8 @@ needed in transports so we lost the optimisation. */
 #endif
   }
 
+profile_init();
+
 /* Handle a request to check quota */
 if (rcpt_verify_quota)
   if (real_uid != root_uid && real_uid != exim_uid)
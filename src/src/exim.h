@@ -95,6 +95,9 @@ making unique names. */
 #ifdef EXIM_HAVE_KEVENT
 # include <sys/event.h>
 #endif
+#ifdef EXIM_HAVE_EPOLL
+# include <sys/epoll.h>
+#endif
 
 /* C99 integer types, figure out how to undo this if needed for older systems */
 
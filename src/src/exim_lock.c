@@ -69,6 +69,10 @@ the other stuff in os.c, so force the other macros to omit it. */
   #define OS_LOAD_AVERAGE
 #endif
 
+#ifndef OS_GET_RSS
+  #define OS_GET_RSS
+#endif
+
 #ifndef FIND_RUNNING_INTERFACES
   #define FIND_RUNNING_INTERFACES
 #endif
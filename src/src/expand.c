@@ -24,6 +24,7 @@ typedef unsigned esi_flags;
 #define ESI_HONOR_DOLLAR	BIT(1)	/* $ is meaningfull */
 #define ESI_SKIPPING		BIT(2)	/* value will not be needed */
 #define ESI_EXISTS_ONLY		BIT(3)	/* actual value not needed */
+#define ESI_ONE_ITEM		BIT(4)	/* stop after the first item */
 
 #ifdef STAND_ALONE
 # ifndef SUPPORT_CRYPTEQ
@@ -571,6 +572,9 @@ static var_entry var_table[] = {
   { "localhost_number",    vtype_int,         &host_number },
   { "log_inodes",          vtype_pinodes,     (void *)FALSE },
   { "log_space",           vtype_pspace,      (void *)FALSE },
+  { "lookup_cache_evictions", vtype_int,     &lookup_cache_evictions },
+  { "lookup_cache_hits",   vtype_int,         &lookup_cache_hits },
+  { "lookup_cache_misses", vtype_int,         &lookup_cache_misses },
   { "lookup_dnssec_authenticated",vtype_stringptr,&lookup_dnssec_authenticated},
   { "mailstore_basename",  vtype_stringptr,   &mailstore_basename },
 #ifdef WITH_CONTENT_SCAN
@@ -586,6 +590,7 @@ static var_entry var_table[] = {
   { "message_headers_raw", vtype_msgheaders_raw, NULL },
   { "message_id",          vtype_stringptr,   &message_id },
   { "message_linecount",   vtype_int,         &message_linecount },
+  { "message_priority",    vtype_int,         &message_priority },
   { "message_size",        vtype_int,         &message_size },
 #ifdef SUPPORT_I18N
   { "message_smtputf8",    vtype_bool,        &message_smtputf8 },
@@ -867,6 +872,70 @@ expansion_variables();
 static uschar var_buffer[256];
 static BOOL malformed_header;
 
+/* Set while an item of a configuration string that has only literal
+arguments is being evaluated in advance, so that its result can be used as
+text in place of it (see expand_split_string()).  Only the items, operators and
+conditions below, whose results depend on nothing but their arguments, are
+permitted; any other makes the evaluation fail before it has any effect, and
+the item is then left to be evaluated each time. */
+
+static BOOL expand_folding = FALSE;
+
+static BOOL
+item_is_constant(int item_type)
+{
+switch (item_type)
+  {
+  case EITEM_EXTRACT: case EITEM_HASH: case EITEM_HMAC: case EITEM_IF:
+  case EITEM_LENGTH: case EITEM_LISTEXTRACT: case EITEM_LISTQUOTE:
+  case EITEM_NHASH: case EITEM_SG: case EITEM_SUBSTR: case EITEM_TR:
+    return TRUE;
+  }
+return FALSE;
+}
+
+static BOOL
+op_is_constant(int c)
+{
+switch (c)
+  {
+  case EOP_FROM_UTF8: case EOP_LOCAL_PART: case EOP_QUOTE_LOCAL_PART:
+  case EOP_REVERSE_IP: case EOP_TIME_EVAL: case EOP_TIME_INTERVAL:
+  case EOP_ADDRESS: case EOP_ADDRESSES: case EOP_BASE32: case EOP_BASE32D:
+  case EOP_BASE62: case EOP_BASE62D: case EOP_BASE64: case EOP_BASE64D:
+  case EOP_DOMAIN: case EOP_ESCAPE: case EOP_ESCAPE8BIT: case EOP_EVAL:
+  case EOP_EVAL10: case EOP_H: case EOP_HASH: case EOP_HEADERWRAP:
+  case EOP_HEX2B64: case EOP_HEXQUOTE: case EOP_IPV6DENORM: case EOP_IPV6NORM:
+  case EOP_L: case EOP_LC: case EOP_LENGTH: case EOP_LISTCOUNT: case EOP_MASK:
+  case EOP_MD5: case EOP_NH: case EOP_NHASH: case EOP_RFC2047:
+  case EOP_RFC2047D: case EOP_RXQUOTE: case EOP_S: case EOP_SHA1:
+  case EOP_SHA2: case EOP_SHA256: case EOP_SHA3: case EOP_STR2B64:
+  case EOP_STRLEN: case EOP_SUBSTR: case EOP_UC: case EOP_UTF8CLEAN:
+  case EOP_XTEXTD:
+    return TRUE;
+  }
+return FALSE;
+}
+
+static BOOL
+cond_is_constant(int cond_type)
+{
+switch (cond_type)
+  {
+  case ECOND_NUM_L: case ECOND_NUM_LE: case ECOND_NUM_E: case ECOND_NUM_EE:
+  case ECOND_NUM_G: case ECOND_NUM_GE:
+  case ECOND_AND: case ECOND_OR: case ECOND_BOOL: case ECOND_BOOL_LAX:
+  case ECOND_STR_EQ: case ECOND_STR_EQI: case ECOND_STR_GE: case ECOND_STR_GEI:
+  case ECOND_STR_GT: case ECOND_STR_GTI: case ECOND_STR_LE: case ECOND_STR_LEI:
+  case ECOND_STR_LT: case ECOND_STR_LTI:
+  case ECOND_INLIST: case ECOND_INLISTI:
+  case ECOND_ISIP: case ECOND_ISIP4: case ECOND_ISIP6:
+  case ECOND_MATCH:
+    return TRUE;
+  }
+return FALSE;
+}
+
 /* For textual hashes */
 
 static const char *hashcodes = "abcdefghijklmnopqrtsuvwxyz"
@@ -2678,7 +2747,14 @@ expand_level++;
 for (;;)
   if (Uskip_whitespace(&s) == '!') { testfor = !testfor; s++; } else break;
 
-switch(cond_type = identify_operator(&s, &opname))
+cond_type = identify_operator(&s, &opname);
+if (expand_folding && yield && !cond_is_constant(cond_type))
+  {
+  expand_string_message = US"condition is not constant";
+  goto failout;
+  }
+
+switch(cond_type)
   {
   /* def: tests for a non-empty variable, or for the existence of a header. If
   yield == NULL we are in a skipping state, and don't care about the answer. */
@@ -4702,6 +4778,422 @@ return mi;
 
 #endif	/*EXIM_PERL*/
 
+/*************************************************
+*      Cache of split configuration strings      *
+*************************************************/
+
+/* Strings from the runtime configuration are expanded over and over, for
+every message and every address, but cannot change once the store holding
+them has been made readonly.  The first time such a string (or a braced
+argument within one) is expanded it is split into a list of pieces: literal
+text with escapes already interpreted, variable and header references, and
+${...} items.  Items whose value cannot vary (no variables in them, and only
+functions of their arguments, such as ${lc:...} or ${if eq{...}{...}}) are
+evaluated there and then, and become text, so a string that is constant
+throughout ends up as a single piece of text.  Later expansions of the same
+string, found by its address, walk the list: text is copied, variables are
+looked up directly, and only the remaining items are parsed again, one at a
+time, by expand_string_internal().  Their arguments come back here in turn.  A
+string that cannot be split cleanly (a syntax error, say) is remembered as such
+and expanded the ordinary way, to get the ordinary error.
+
+Only plain expansions are cached; skipping and exists-only ones, which can
+stop early, are not.  Nor is anything while expansion debugging is on, so that
+the trace is unchanged. */
+
+typedef enum { ESEG_TEXT, ESEG_VAR, ESEG_HEADER, ESEG_NUMVAR, ESEG_ITEM } eseg_type;
+
+typedef struct expand_seg {
+  eseg_type		type;
+  int			n;		/* text length, $<n> number or FH_ flags */
+  BOOL			nocharset;	/* $bh_ header */
+  const uschar *	s;		/* text, name, or start of the item */
+} expand_seg;
+
+typedef struct expand_split {
+  const uschar *	string;		/* the configuration string */
+  const uschar *	end;		/* where the expansion stops */
+  BOOL			brace_ends;	/* stopping at a closing brace */
+  int			nseg;		/* -1 if it could not be split */
+  expand_seg *		segs;
+} expand_split;
+
+#define ESPLIT_MAX_SEGS	64
+
+static expand_split * esplit_table = NULL;
+static unsigned esplit_size = 0;	/* slots, a power of two */
+static unsigned esplit_count = 0;	/* slots used */
+
+
+/* Evaluate an item of a configuration string in advance, if its value
+cannot vary.  The state of any expansion in hand is preserved.
+
+Argument:	the item, starting at its $
+Returns:	the value, or NULL if the item is not constant
+*/
+
+static const uschar *
+expand_fold_item(const uschar * item)
+{
+uschar * save_message = expand_string_message;
+uschar * save_lookup_value = lookup_value;
+const uschar * save_expand_nstring[EXPAND_MAXN+1];
+int save_expand_nlength[EXPAND_MAXN+1];
+int save_expand_nmax =
+  save_expand_strings(save_expand_nstring, save_expand_nlength);
+const uschar * res;
+BOOL save_forcedfail = f.expand_string_forcedfail;
+BOOL save_folding = expand_folding, resetok = TRUE;
+
+/* A match condition sets the numeric variables, and an evaluation that is
+abandoned part way does not put them back, so that is done here. */
+
+expand_folding = TRUE;
+res = expand_string_internal(item, ESI_HONOR_DOLLAR | ESI_ONE_ITEM,
+			    NULL, &resetok, NULL);
+expand_folding = save_folding;
+expand_string_message = save_message;
+f.expand_string_forcedfail = save_forcedfail;
+lookup_value = save_lookup_value;
+restore_expand_strings(save_expand_nmax, save_expand_nstring,
+  save_expand_nlength);
+return res && resetok && !is_tainted(res) ? res : NULL;
+}
+
+
+/* Split a string into pieces.  Items are checked by running the expansion
+code over them in skipping mode, which also finds where each one ends.
+Those with constant values are evaluated now and become part of the text.
+
+Arguments:
+  string	the string, untainted and unchanging
+  brace_ends	stop at an unescaped closing brace
+  endp		where to put a pointer to the stopping point
+  segsp		where to put a pointer to the list, in perm store
+
+Returns:	the number of pieces, or -1 if the string is not suitable
+*/
+
+static int
+expand_split_string(const uschar * string, BOOL brace_ends,
+  const uschar ** endp, expand_seg ** segsp)
+{
+expand_seg segs[ESPLIT_MAX_SEGS];
+gstring * text = NULL;
+const uschar * s = string;
+int nseg = 0;
+
+while (*s)
+  {
+  expand_seg seg = {.type = ESEG_TEXT};
+
+  if (*s == '\\')
+    {
+    if (!s[1]) return -1;
+    if (s[1] == 'N')
+      {
+      const uschar * t = s + 2;
+      for (s = t; *s ; s++) if (*s == '\\' && s[1] == 'N') break;
+      text = string_catn(text, t, s - t);
+      if (*s) s += 2;
+      }
+    else
+      {
+      uschar ch[1];
+      ch[0] = string_interpret_escape(&s);
+      text = string_catn(text, ch, 1);
+      s++;
+      }
+    continue;
+    }
+
+  if (brace_ends && *s == '}') break;
+
+  if (*s != '$')
+    {
+    const uschar * t = s;
+    while (*++s && *s != '$' && *s != '\\' && (!brace_ends || *s != '}')) ;
+    text = string_catn(text, t, s - t);
+    continue;
+    }
+
+  if (isalpha(*++s))			/* $name or $header_name: */
+    {
+    uschar name[256], * t;
+
+    s = read_name(name, sizeof(name), s, US"_");
+    seg.type = ESEG_VAR;
+    if (  ( *(t = name) == 'h'
+          || (*t == 'r' || *t == 'l' || *t == 'b') && *++t == 'h'
+	  )
+       && (*++t == '_' || Ustrncmp(t, "eader_", 6) == 0)
+       )
+      {
+      seg.type = ESEG_HEADER;
+      seg.n = *name == 'r' ? FH_WANT_RAW
+	    : *name == 'l' ? FH_WANT_RAW|FH_WANT_LIST
+	    : 0;
+      seg.nocharset = *name == 'b';
+      s = read_header_name(name, sizeof(name), s);
+      }
+    seg.s = string_copy(name);
+    }
+
+  else if (isdigit(*s))			/* $<n> */
+    {
+    s = read_cnumber(&seg.n, s);
+    seg.type = ESEG_NUMVAR;
+    }
+
+  else if (*s == '{' && isdigit(s[1]))	/* ${<n>} */
+    {
+    s = read_cnumber(&seg.n, s+1);
+    if (*s++ != '}') return -1;
+    seg.type = ESEG_NUMVAR;
+    }
+
+  else if (*s == '{' && isalpha(s[1]))	/* any other ${...} */
+    {
+    BOOL resetok = TRUE;
+    const uschar * folded;
+
+    seg.type = ESEG_ITEM;
+    seg.s = s - 1;
+    if (!expand_string_internal(seg.s,
+	  ESI_HONOR_DOLLAR | ESI_SKIPPING | ESI_ONE_ITEM, &s, &resetok, NULL))
+      return -1;
+
+    if ((folded = expand_fold_item(seg.s)))
+      {
+      text = string_cat(text, folded);
+      continue;
+      }
+    }
+
+  else
+    return -1;
+
+  if (nseg >= ESPLIT_MAX_SEGS - 2) return -1;
+  if (text)
+    {
+    segs[nseg++] = (expand_seg)
+      {.type = ESEG_TEXT, .n = gstring_length(text), .s = text->s};
+    text = NULL;
+    }
+  segs[nseg++] = seg;
+  }
+
+if (brace_ends && !*s) return -1;
+if (text)
+  segs[nseg++] = (expand_seg)
+    {.type = ESEG_TEXT, .n = gstring_length(text), .s = text->s};
+
+*endp = s;
+*segsp = store_get_perm(nseg * sizeof(expand_seg), GET_UNTAINTED);
+for (int i = 0; i < nseg; i++)
+  {
+  expand_seg * sp = *segsp + i;
+
+  *sp = segs[i];
+  if (sp->type == ESEG_TEXT)
+    {
+    uschar * t = store_get_perm(sp->n, GET_UNTAINTED);
+    memcpy(t, sp->s, sp->n);
+    sp->s = t;
+    }
+  else if (sp->type == ESEG_VAR || sp->type == ESEG_HEADER)
+    sp->s = string_copy_perm(sp->s, FALSE);
+  }
+return nseg;
+}
+
+
+/* Return the slot for a string in the table, either its entry or the empty
+slot where that should go.  The table is grown first if need be. */
+
+static expand_split *
+expand_split_slot(const uschar * string, BOOL brace_ends)
+{
+expand_split * ep;
+unsigned mask;
+
+if (esplit_count * 2 >= esplit_size)
+  {
+  unsigned oldsize = esplit_size;
+  expand_split * old = esplit_table;
+
+  esplit_size = oldsize ? oldsize * 2 : 256;
+  esplit_table = store_malloc(esplit_size * sizeof(expand_split));
+  memset(esplit_table, 0, esplit_size * sizeof(expand_split));
+  mask = esplit_size - 1;
+  for (expand_split * op = old; op < old + oldsize; op++) if (op->string)
+    {
+    for (unsigned h = (unsigned long)op->string * 2654435761u;
+	 (ep = esplit_table + (h & mask))->string; h++) ;
+    *ep = *op;
+    }
+  if (old) store_free(old);
+  }
+
+mask = esplit_size - 1;
+for (unsigned h = (unsigned long)string * 2654435761u;
+     (ep = esplit_table + (h & mask))->string; h++)
+  if (ep->string == string && ep->brace_ends == brace_ends)
+    break;
+return ep;
+}
+
+
+/* Find the cache entry for a string, splitting it if this is the first time
+it has been seen.  Return NULL if the cache is not to be used for the string. */
+
+static const expand_split *
+expand_split_find(const uschar * string, BOOL brace_ends)
+{
+expand_split * ep;
+expand_split e = {.string = string, .brace_ends = brace_ends};
+
+DEBUG(D_expand) return NULL;
+
+/* Anything in the table was readonly when it was put there, so is still */
+
+if (!esplit_table || !(ep = expand_split_slot(string, brace_ends))->string)
+  {
+  /* Not seen before.  Splitting runs the expansion code in skipping mode,
+  which must not disturb the state of the expansion in hand. */
+
+  BOOL save_malformed, save_defer;
+
+  if (!is_readonly_config(string)) return NULL;
+  save_malformed = malformed_header;
+  save_defer = f.search_find_defer;
+
+  e.nseg = expand_split_string(string, brace_ends, &e.end, &e.segs);
+  malformed_header = save_malformed;
+  f.search_find_defer = save_defer;
+
+  if (!(ep = expand_split_slot(string, brace_ends))->string)
+    {
+    *ep = e;
+    esplit_count++;
+    }
+  }
+return ep->nseg >= 0 ? ep : NULL;
+}
+
+
+/* Expand a string using its list of pieces.  Arguments and result are as for
+expand_string_internal() with ESI_HONOR_DOLLAR and maybe ESI_BRACE_ENDS. */
+
+static uschar *
+expand_split_eval(const expand_split * ep, const uschar ** left,
+  BOOL * resetok_p, BOOL * textonly_p)
+{
+gstring * yield = NULL;
+const expand_seg * segs = ep->segs;	/* the table may move under us */
+const uschar * end = ep->end;
+int nseg = ep->nseg;
+BOOL resetok = TRUE, textonly = TRUE;
+uschar * res;
+
+f.expand_string_forcedfail = FALSE;
+expand_string_message = US"";
+
+/* A string that turned out to be constant needs only copying */
+
+if (nseg == 1 && segs->type == ESEG_TEXT)
+  {
+  res = string_copyn(segs->s, segs->n);
+  goto DONE;
+  }
+
+for (const expand_seg * sp = segs; sp < segs + nseg; sp++)
+  {
+  const uschar * value;
+  int newsize = 0;
+  gstring * g = NULL;
+
+  if (sp->type == ESEG_TEXT)
+    {
+    yield = string_catn(yield, sp->s, sp->n);
+    continue;
+    }
+  textonly = FALSE;
+
+  switch (sp->type)
+    {
+    case ESEG_NUMVAR:
+      if (sp->n >= 0 && sp->n <= expand_nmax)
+	yield = string_catn(yield, expand_nstring[sp->n], expand_nlength[sp->n]);
+      continue;
+
+    case ESEG_ITEM:
+      if (!(res = expand_string_internal(sp->s, ESI_HONOR_DOLLAR | ESI_ONE_ITEM,
+				      NULL, &resetok, NULL)))
+	{
+	if (left) *left = sp->s;
+	if (resetok_p && !resetok) *resetok_p = FALSE;
+	return NULL;
+	}
+      if (nseg == 1)
+	{
+	yield = NULL;
+	goto DONE;
+	}
+      yield = string_cat(yield, res);
+      continue;
+
+    case ESEG_HEADER:
+      if (!yield) g = store_get(sizeof(gstring), GET_UNTAINTED);
+      if (!(value = find_header(sp->s, &newsize, sp->n,
+			      sp->nocharset ? NULL : headers_charset)))
+	{
+	if (Ustrchr(sp->s, '}')) malformed_header = TRUE;
+	continue;
+	}
+      break;
+
+    default:	/* ESEG_VAR */
+      if (!yield) g = store_get(sizeof(gstring), GET_UNTAINTED);
+      if (!(value = find_variable(US sp->s, ESI_HONOR_DOLLAR, &newsize)))
+	{
+	expand_string_message =
+	  string_sprintf("unknown variable name %q", sp->s);
+	check_variable_error_message(US sp->s);
+	if (left) *left = sp->s;
+	if (resetok_p && !resetok) *resetok_p = FALSE;
+	return NULL;
+	}
+      break;
+    }
+
+  /* As in expand_string_internal(), a value known to be in new store
+  becomes the result if it is the first thing. */
+
+  if (!yield && newsize != 0)
+    {
+    yield = g;
+    yield->size = newsize;
+    yield->ptr = Ustrlen(value);
+    yield->s = US value;
+    }
+  else
+    yield = string_cat(yield, value);
+  }
+
+if (!yield) yield = string_get(1);
+res = string_from_gstring(yield);
+
+DONE:
+if (left) *left = end;
+if (resetok && yield) gstring_release_unused(yield);
+else if (resetok_p && !resetok) *resetok_p = FALSE;
+if (textonly_p) *textonly_p = textonly;
+return res;
+}
+
+
+
 /*************************************************
 *                 Expand string                  *
 *************************************************/
@@ -4756,6 +5248,7 @@ Arguments:
    skipping       TRUE for recursive calls when the value isn't actually going
                   to be used (to allow for optimisation)
    exists_only	  return as soon as we have a char, for optimisation
+   one_item	  stop after the first text run, escape, variable or item
   left           if not NULL, a pointer to the first character after the
                  expansion is placed here (typically used with brace_ends)
   resetok_p	 if not NULL, pointer to flag - write FALSE if unsafe to reset
@@ -4772,14 +5265,27 @@ static uschar *
 expand_string_internal(const uschar * s, esi_flags flags, const uschar ** left,
   BOOL *resetok_p, BOOL * textonly_p)
 {
-rmark reset_point = store_mark();
+rmark reset_point;
 gstring * yield = NULL;
 int item_type;
 const uschar * orig_string = s;
 const uschar * save_expand_nstring[EXPAND_MAXN+1];
 int save_expand_nlength[EXPAND_MAXN+1];
 BOOL resetok = TRUE, first = TRUE, textonly = TRUE;
+BOOL one_item = !!(flags & ESI_ONE_ITEM);
+int prof_depth = profile_depth;
+
+/* Plain expansions of configuration strings are cached, split up.  Not while
+folding, which has to see each variable reference for itself. */
 
+if ((flags & ~ESI_BRACE_ENDS) == ESI_HONOR_DOLLAR && !expand_folding)
+  {
+  const expand_split * ep = expand_split_find(s, !!(flags & ESI_BRACE_ENDS));
+  if (ep) return expand_split_eval(ep, left, resetok_p, textonly_p);
+  }
+
+flags &= ~ESI_ONE_ITEM;		/* not for nested expansions */
+reset_point = store_mark();
 expand_level++;
 f.expand_string_forcedfail = FALSE;
 expand_string_message = US"";
@@ -4801,7 +5307,9 @@ while (*s)	/* known to be untainted */
   {
   uschar name[256];
 
+  if (profile_depth > prof_depth) profile_pop(prof_depth);
   if (flags & ESI_EXISTS_ONLY && gstring_length(yield) > 0) break;
+  if (one_item && s > orig_string) break;
 
   DEBUG(D_expand)
     {
@@ -4885,6 +5393,7 @@ while (*s)	/* known to be untainted */
     gstring * g = NULL;
     uschar * t;
 
+    if (expand_folding && !(flags & ESI_SKIPPING)) goto NOT_CONSTANT;
     s = read_name(name, sizeof(name), s, US"_");
 
     /* If this is the first thing to be expanded, release the pre-allocated
@@ -4973,6 +5482,7 @@ while (*s)	/* known to be untainted */
   if (isdigit(*s))		/* A $<n> variable */
     {
     int n;
+    if (expand_folding && !(flags & ESI_SKIPPING)) goto NOT_CONSTANT;
     s = read_cnumber(&n, s);
     if (n >= 0 && n <= expand_nmax)
       {
@@ -4997,6 +5507,7 @@ while (*s)	/* known to be untainted */
   if (isdigit(*++s))
     {
     int n;
+    if (expand_folding && !(flags & ESI_SKIPPING)) goto NOT_CONSTANT;
     s = read_cnumber(&n, s);						/*{{*/
     if (*s++ != '}')
       {
@@ -5024,6 +5535,11 @@ while (*s)	/* known to be untainted */
 
   s = read_name(name, sizeof(name), s, US"_-");
   item_type = chop_match(name, item_table, nelem(item_table));
+  if (  expand_folding && item_type >= 0 && !(flags & ESI_SKIPPING)
+     && !item_is_constant(item_type))
+    goto NOT_CONSTANT;
+  if (f.profiling && item_type >= 0 && !(flags & ESI_SKIPPING))
+    profile_push(PROF_EXPAND, item_table[item_type]);
 
   /* Switch on item type.  All nondefault choices should "continue* when
   skipping, but "break" otherwise so we get debug output for the item
@@ -7411,6 +7927,12 @@ NOT_ITEM: ;
 	}
       }
 
+    if (expand_folding && !(flags & ESI_SKIPPING) && !op_is_constant(c))
+      goto NOT_CONSTANT;
+    if (f.profiling && c >= 0 && !(flags & ESI_SKIPPING))
+      profile_push(PROF_EXPAND, c < nelem(op_table_underscore)
+	? op_table_underscore[c] : op_table_main[c - nelem(op_table_underscore)]);
+
     /* Deal specially with operators that might take a certificate variable
     as we do not want to do the usual expansion. For most, expand the string.*/
 
@@ -8591,6 +9113,7 @@ NOT_ITEM: ;
     int newsize = 0;
     gstring * g = NULL;
 
+    if (expand_folding && !(flags & ESI_SKIPPING)) goto NOT_CONSTANT;
     if (!yield)
       g = store_get(sizeof(gstring), GET_UNTAINTED);
     else if (yield->ptr == 0)
@@ -8646,6 +9169,7 @@ left != NULL, return a pointer to the endpoint in the source string. */
  {
   uschar * res;
 
+  if (profile_depth > prof_depth) profile_pop(prof_depth);
   if (!yield)
     yield = string_get(1);
   res = string_from_gstring(yield);
@@ -8686,6 +9210,12 @@ left != NULL, return a pointer to the endpoint in the source string. */
   return res;
  }
 
+/* Evaluation in advance found something that can vary (see expand_folding) */
+
+NOT_CONSTANT:
+expand_string_message = US"not constant";
+goto EXPAND_FAILED;
+
 /* This is the failure exit: easiest to program with a goto. We still need
 to update the pointer to the terminator, for cases of nested calls with "fail".
 */
@@ -8702,6 +9232,7 @@ else if (!expand_string_message || !*expand_string_message)
 that is a bad idea, because expand_string_message is in dynamic store. */
 
 EXPAND_FAILED:
+if (profile_depth > prof_depth) profile_pop(prof_depth);
 if (left) *left = s;
 DEBUG(D_expand)
   {
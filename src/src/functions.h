@@ -68,6 +68,7 @@ extern uschar *tls_getbuf(unsigned *);
 extern void    tls_get_cache(unsigned);
 extern BOOL    tls_hasc(void);
 extern BOOL    tls_import_cert(const uschar *, void **);
+extern void    tls_in_buffer_shrink(void);
 extern void    tls_state_in_to_out(int, const uschar *, int);
 extern void    tls_state_out_to_in(int, const uschar *, int);
 extern BOOL    tls_is_name_for_cert(const uschar *, void *);
@@ -135,6 +136,9 @@ extern uschar *b64encode_taint(const uschar *, int, const void *);
 extern int     b64decode(const uschar *, uschar **, const void *);
 extern int     bdat_getc(unsigned);
 extern uschar *bdat_getbuf(unsigned *);
+#ifdef EXIM_HAVE_SPLICE
+extern int     bdat_splice(FILE *, unsigned);
+#endif
 extern BOOL    bdat_hasc(void);
 extern int     bdat_ungetc(int);
 extern void    bdat_flush_data(void);
@@ -164,7 +168,9 @@ extern BOOL    cutthrough_headers_send(void);
 extern BOOL    cutthrough_predata(void);
 extern void    release_cutthrough_connection(const uschar *);
 
+extern BOOL    daemon_forkserver_deliver(const uschar *);
 extern void    daemon_go(void);
+extern int     daemon_sync(int, BOOL);
 #ifndef COMPILE_UTILITY
 extern ssize_t daemon_client_sockname(struct sockaddr_un *, uschar **);
 extern ssize_t daemon_notifier_sockname(struct sockaddr_un *);
@@ -359,6 +365,7 @@ extern int     misc_mod_conn_init(const uschar *, const uschar *,
 extern misc_module_info * misc_mod_find(const uschar * modname, uschar **);
 extern misc_module_info * misc_mod_findonly(const uschar * modname);
 extern int     misc_mod_msg_init(void);
+extern void    misc_mod_conn_reset(void);
 extern void    misc_mod_smtp_reset(void);
 
 extern uschar *moan_check_errorcopy(const uschar *);
@@ -410,11 +417,17 @@ const misc_module_info * perl_startup(const uschar *);
 
 extern void priv_drop_temp(const uid_t, const gid_t);
 extern void priv_restore(void);
+extern void    profile_init(void);
+extern void    profile_pop(int);
+extern void    profile_push(int, const uschar *);
+extern void    profile_write(void);
 
 extern BOOL    queue_action(const uschar *, int, const uschar **, int, int);
 extern void    queue_check_only(void);
 extern unsigned queue_count(void);
 extern unsigned queue_count_cached(void);
+extern void    queue_index_update(const uschar *, const uschar *,
+		 const uschar *, BOOL);
 extern void    queue_list(int, const uschar **, int);
 #ifndef DISABLE_QUEUE_RAMP
 extern void    queue_notify_daemon(const uschar * hostname);
@@ -453,6 +466,7 @@ extern int     exim_regex(const uschar **, BOOL);
 extern void    regex_vars_clear(void);
 #endif
 extern void    regex_at_daemon(const uschar *);
+extern void    regex_cache_report(void);
 extern BOOL    regex_match(const pcre2_code *, const uschar *, int, uschar **);
 extern BOOL    regex_match_and_setup(const pcre2_code *, const uschar *, int, int);
 extern const pcre2_code *regex_compile(const uschar *, mcs_flags, uschar **,
@@ -502,6 +516,8 @@ extern const lookup_info * search_findtype_partial(const uschar *, int *,
 		const uschar **, int *, int *, const uschar **);
 extern void   *search_open(const uschar *, const lookup_info *, int,
 		uid_t *, gid_t *);
+extern void    search_proxy_serve(int) NORETURN;
+extern void    search_shared_init(void);
 extern void    search_tidyup(void);
 extern BOOL    send_fd_over_socket(int, int);
 extern uschar *sender_helo_verified_boolstr(void);
@@ -522,6 +538,7 @@ extern void    smtp_data_sigint_exit(void) NORETURN;
 extern void    smtp_deliver_init(void);
 extern uschar *smtp_cmd_hist(void);
 extern int     smtp_connect(smtp_connect_args *, const blob *);
+extern void    smtp_connection_reset(void);
 extern int     smtp_feof(void);
 extern int     smtp_ferror(void);
 extern uschar *smtp_get_connection_info(void);
@@ -542,6 +559,8 @@ extern BOOL    smtp_read_response(void *, uschar *, int, int, int);
 rmark	       smtp_reset(rmark);
 extern void    smtp_respond(uschar *, int, BOOL, uschar *);
 extern void    smtp_send_prohibition_message(int, uschar *);
+extern BOOL    smtp_session_restore(void);
+extern void    smtp_session_save(void);
 extern int     smtp_setup_msg(void);
 extern int     smtp_sock_connect(smtp_connect_args *, int, const blob *);
 extern BOOL    smtp_start_session(void);
@@ -1421,6 +1440,7 @@ if ((pid = fork()) == 0)
   {
   f.daemon_listen = FALSE;
   process_purpose = purpose;
+  if (config_profile_file) profile_init();
   DEBUG(D_any) debug_printf_indent("postfork: %s\n", purpose);
   }
 else
@@ -364,12 +364,16 @@ BOOL    proxy_session          = FALSE;
 #ifndef DISABLE_QUEUE_RAMP
 BOOL    queue_fast_ramp		= TRUE;
 #endif
+BOOL    queue_index            = FALSE;
 BOOL    queue_list_requires_admin = TRUE;
 BOOL    queue_only             = FALSE;
 BOOL    queue_only_load_latch  = TRUE;
 BOOL    queue_only_override    = TRUE;
+BOOL    queue_run_by_host      = FALSE;
+BOOL    queue_run_by_priority  = FALSE;
 BOOL    queue_run_in_order     = FALSE;
 BOOL    recipients_max_reject  = FALSE;
+BOOL    regex_cache_stats      = FALSE;
 BOOL    return_path_remove     = TRUE;
 
 BOOL    smtp_batched_input     = FALSE;
@@ -604,6 +608,7 @@ const uschar * config_main_filelist = US CONFIGURE_FILE
                          "\0<-----------Space to patch configure_filename->";
 uschar *config_main_filename   = NULL;
 uschar *config_main_directory  = NULL;
+uschar *config_profile_file    = NULL;
 
 #ifdef CONFIGURE_OWNER
 uid_t   config_uid             = CONFIGURE_OWNER;
@@ -639,11 +644,23 @@ cut_t   cutthrough = {	/* All remaining items 0/FALSE/NULL */
   .cctx =		{.sock = -1},			/* open connection */
 };
 
+int     daemon_accept_batch    = 10;
+int     daemon_acceptors       = 1;
+BOOL    daemon_fork_server     = FALSE;
+int     daemon_forkserver_fd   = -1;
+uschar *daemon_lookup_proxy    = NULL;
+int     daemon_lookup_proxy_connections = 4;
+int     daemon_lookup_proxy_timeout = 60;
+int     daemon_lookupproxy_fd  = -1;
 uschar *daemon_modules_load    = NULL;
 int	daemon_notifier_fd     = -1;
 uschar *daemon_smtp_port       = US"smtp";
+int     daemon_smtp_worker_sessions = 100;
+int     daemon_smtp_workers    = 0;
 int     daemon_startup_retries = 9;
 int     daemon_startup_sleep   = 30;
+BOOL    daemon_sync_server     = FALSE;
+int     daemon_syncserver_fd   = -1;
 
 #ifdef EXPERIMENTAL_DCC
 uschar *dcc_header             = NULL;
@@ -943,6 +960,7 @@ bit_table log_options[]        = { /* must be in alphabetical order,
   BIT_TABLE(L, all_parents),
   BIT_TABLE(L, arguments),
   BIT_TABLE(L, connection_id),
+  BIT_TABLE(L, connection_memory),
   BIT_TABLE(L, connection_reject),
   BIT_TABLE(L, delay_delivery),
   BIT_TABLE(L, deliver_time),
@@ -1017,6 +1035,13 @@ unsigned int log_selector[log_selector_size]; /* initialized in main() */
 uschar *log_selector_string    = NULL;
 FILE   *log_stderr             = NULL;
 uschar *login_sender_address   = NULL;
+int     lookup_cache_evictions = 0;
+int     lookup_cache_hits      = 0;
+int     lookup_cache_misses    = 0;
+int     lookup_cache_shared    = 0;
+int     lookup_cache_shared_ttl = 5*60;
+int     lookup_cache_size      = 1024*1024;
+int     lookup_cache_ttl       = 0;
 uschar *lookup_dnssec_authenticated = NULL;
 int     lookup_open_max        = 25;
 uschar *lookup_value           = NULL;
@@ -1041,6 +1066,7 @@ uschar *message_id_text        = NULL;
 uschar  message_id_option[MESSAGE_ID_LENGTH + 3];
 uschar *message_id_external;
 int     message_linecount      = 0;
+int     message_priority       = 0;
 int     message_size           = 0;
 uschar *message_size_limit     = US"50M";
 #ifdef SUPPORT_I18N
@@ -1105,6 +1131,7 @@ uschar *process_info;
 int     process_info_len       = 0;
 uschar *process_log_path       = NULL;
 const uschar *process_purpose  = US"fresh-exec";
+int     profile_depth          = 0;
 
 #if defined(SUPPORT_PROXY) || defined(SUPPORT_SOCKS) || defined(EXPERIMENTAL_XCLIENT)
 uschar *proxy_external_address = NULL;
@@ -1124,10 +1151,13 @@ qrunner *qrunners	       = NULL;
 const uschar *qualify_domain_recipient = NULL;
 uschar *qualify_domain_sender  = NULL;
 uschar *queue_domains          = NULL;
+int     queue_index_rescan     = 60*60;
 int     queue_interval         = -1;
 uschar *queue_name             = US"";
 uschar *queue_name_dest        = NULL;
 uschar *queue_only_file        = NULL;
+int     queue_priority_aging   = 60*60;
+int     queue_run_shards       = 0;
 int     queue_only_load        = -1;
 uschar *queue_run_max          = US"5";
 pid_t   queue_run_pid          = (pid_t)0;
@@ -1316,6 +1346,8 @@ int     smtp_connect_backlog   = 20;
 double  smtp_delay_mail        = 0.0;
 double  smtp_delay_rcpt        = 0.0;
 int	smtp_in_fd	       = -1;
+int     smtp_in_reads          = 0;
+int     smtp_in_tls_reads      = 0;
 int     smtp_listen_backlog    = 0;
 int     smtp_load_reserve      = -1;
 int     smtp_mailcmd_count     = 0;
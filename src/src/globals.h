@@ -223,6 +223,7 @@ extern struct global_flags {
  BOOL   parse_allow_group		:1; /* Allow group syntax */
  BOOL   parse_found_group		:1; /* In the middle of a group */
  BOOL   pipelining_enable		:1; /* As it says */
+ BOOL   profiling			:1; /* Expansion/ACL profile being taken */
 
  BOOL   queue_2stage			:1; /* Run queue in 2-stage manner */
  BOOL   queue_only_policy		:1; /* ACL or local_scan wants queue_only */
@@ -415,6 +416,7 @@ extern unsigned config_lineno;         /* Line number */
 extern const uschar *config_main_filelist; /* List of possible config files */
 extern uschar *config_main_filename;   /* File name actually used */
 extern uschar *config_main_directory;  /* Directory where the main config file was found */
+extern uschar *config_profile_file;    /* Where to write expansion/ACL profile */
 extern uid_t   config_uid;             /* Additional owner */
 extern unsigned continue_flags;	       /* TLS-related info for connection */
 #ifndef DISABLE_ESMTP_LIMITS
@@ -461,11 +463,23 @@ typedef struct {
 } cut_t;
 extern cut_t cutthrough;               /* Deliver-concurrently */
 
+extern int     daemon_accept_batch;    /* Max connections accepted per wakeup */
+extern int     daemon_acceptors;       /* Processes accepting SMTP connections */
+extern BOOL    daemon_fork_server;     /* Fork deliveries from a privileged server */
+extern int     daemon_forkserver_fd;   /* Socket to the delivery fork server */
+extern uschar *daemon_lookup_proxy;    /* Lookup types done by the lookup proxy */
+extern int     daemon_lookup_proxy_connections; /* Lookup proxy processes */
+extern int     daemon_lookup_proxy_timeout; /* Wait for a lookup proxy reply */
+extern int     daemon_lookupproxy_fd;  /* Socket to the lookup proxies */
 extern uschar *daemon_modules_load;    /* Dyn-load modules to preload */
 extern int     daemon_notifier_fd;     /* Unix socket for notifications */
 extern uschar *daemon_smtp_port;       /* Can be a list of ports */
+extern int     daemon_smtp_worker_sessions; /* Connections per SMTP worker */
+extern int     daemon_smtp_workers;    /* Pre-forked SMTP processes */
 extern int     daemon_startup_retries; /* Number of times to retry */
 extern int     daemon_startup_sleep;   /* Sleep between retries */
+extern BOOL    daemon_sync_server;     /* Batch spool flushes in a server */
+extern int     daemon_syncserver_fd;   /* Socket to the spool sync server */
 
 #ifdef EXPERIMENTAL_DCC
 extern BOOL    dcc_direct_add_header;  /* directly add header */
@@ -680,6 +694,13 @@ extern BOOL    log_timezone;           /* TRUE to include the timezone in log li
 extern uschar *login_sender_address;   /* The actual sender address */
 extern tree_node *lookups_tree;        /* Tree of available lookups */
 extern unsigned lookup_list_count;     /* Number of entries in the list */
+extern int     lookup_cache_evictions; /* Lookup results dropped from the cache */
+extern int     lookup_cache_hits;      /* Lookups answered from the cache */
+extern int     lookup_cache_misses;    /* Lookups not answered from the cache */
+extern int     lookup_cache_shared;    /* Bytes for results shared by daemon children */
+extern int     lookup_cache_shared_ttl; /* Max lifetime of a shared result */
+extern int     lookup_cache_size;      /* Max bytes of cached results per lookup file */
+extern int     lookup_cache_ttl;       /* Max lifetime of a cached result */
 extern uschar *lookup_dnssec_authenticated; /* AD status of dns lookup */
 extern int     lookup_open_max;        /* Max lookup files to cache */
 extern uschar *lookup_value;           /* Value looked up from file */
@@ -707,6 +728,7 @@ extern uschar *message_id_domain;      /* Expanded to form domain-part of messag
 extern uschar *message_id_text;        /* Expanded to form message_id */
 extern int     message_linecount;      /* As it says */
 extern BOOL    message_logs;           /* TRUE to write message logs */
+extern int     message_priority;       /* Set by ACL, for queue runs */
 extern int     message_size;           /* Size of message */
 extern uschar *message_size_limit;     /* As it says */
 #ifdef SUPPORT_I18N
@@ -743,6 +765,7 @@ extern DIR *   module_dir;
 extern BOOL    mua_wrapper;            /* TRUE when Exim is wrapping an MUA */
 
 extern uid_t  *never_users;            /* List of uids never to be used */
+extern uschar *no_aliases;             /* An empty host aliases list */
 extern uschar *notifier_socket;        /* Name for daemon notifier unix-socket */
 
 extern const int on;                   /* For setsockopt */
@@ -788,6 +811,7 @@ extern int     process_info_len;
 extern uschar *process_log_path;       /* Alternate path */
 extern const uschar *process_purpose;  /* for debug output */
 extern BOOL    prod_requires_admin;    /* TRUE if prodding requires admin */
+extern int     profile_depth;          /* Open profile records */
 
 #if defined(SUPPORT_PROXY) || defined(SUPPORT_SOCKS) || defined(EXPERIMENTAL_XCLIENT)
 extern uschar *hosts_proxy;            /* Hostlist which (require) use proxy protocol */
@@ -812,6 +836,8 @@ extern uschar *queue_domains;          /* Queue these domains */
 #ifndef DISABLE_QUEUE_RAMP
 extern BOOL    queue_fast_ramp;        /* 2-phase queue-run overlap */
 #endif
+extern BOOL    queue_index;            /* Keep an index of queued messages */
+extern int     queue_index_rescan;     /* Rebuild the index after this */
 extern BOOL    queue_list_requires_admin; /* TRUE if -bp requires admin */
                                        /*   immediate children */
 extern pid_t   queue_run_pid;          /* PID of the queue running process or 0 */
@@ -824,8 +850,12 @@ extern int     queue_only_load;        /* Max load before auto-queue */
 extern BOOL    queue_only_load_latch;  /* Latch queue_only_load TRUE */
 extern uschar *queue_only_file;        /* Queue if file exists/not-exists */
 extern BOOL    queue_only_override;    /* Allow override from command line */
+extern int     queue_priority_aging;   /* Priority rises by one for each */
+extern BOOL    queue_run_by_host;      /* Group queue runs by destination */
+extern BOOL    queue_run_by_priority;  /* Order queue runs by priority */
 extern BOOL    queue_run_in_order;     /* As opposed to random */
 extern uschar *queue_run_max;          /* Max queue runners */
+extern int     queue_run_shards;       /* Partitions of the queue for runners */
 extern unsigned queue_size;            /* items in queue */
 extern time_t  queue_size_next;        /* next time to evaluate queue_size */
 extern uschar *queue_smtp_domains;     /* Ditto, for these domains */
@@ -874,6 +904,7 @@ extern const pcre2_code  *regex_SIZE;        /* For recognizing SIZE settings */
 extern const pcre2_code  *regex_EARLY_PIPE;  /* For recognizing PIPE_CONNCT */
 #endif
 extern int    regex_cachesize;		     /* number of entries */
+extern BOOL   regex_cache_stats;	     /* count cache hits across processes */
 extern const pcre2_code  *regex_ismsgid;     /* Compiled r.e. for message ID */
 extern const pcre2_code  *regex_smtp_code;   /* For recognizing SMTP codes */
 #ifdef WHITELIST_D_MACROS
@@ -962,6 +993,8 @@ extern BOOL    smtp_enforce_sync;      /* Enforce sync rules */
 extern uschar *smtp_etrn_command;      /* Command to run */
 extern BOOL    smtp_etrn_serialize;    /* Only one at once */
 extern int     smtp_in_fd;	       /* Incoming SMTP input file */
+extern int     smtp_in_reads;          /* read() calls for the current message */
+extern int     smtp_in_tls_reads;      /* TLS library reads for the current message */
 extern int     smtp_listen_backlog;    /* Current listener socket backlog, if monitored */
 extern int     smtp_load_reserve;      /* Only from reserved if load > this */
 extern int     smtp_mailcmd_count;     /* Count of MAIL commands */
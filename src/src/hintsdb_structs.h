@@ -153,6 +153,16 @@ typedef struct {
 } dbdata_ratelimit_unique;
 
 
+/* For the queue index. A record for a message added by a rebuild of the
+index has no data, and is just a dbdata_generic. */
+
+typedef struct {
+  dbdata_generic gen;
+  /*************/
+  int    priority;        /* Set by the ACL "priority" modifier */
+  time_t received;        /* Time of arrival */
+} dbdata_qindex;
+
 /* For "seen" ACL condition */
 typedef struct {
   dbdata_generic gen;
@@ -19,6 +19,81 @@ enum {
   LSEARCH_IP            /* IP addresses and networks */
 };
 
+/* A plain lsearch file that is searched more than once by a process is
+indexed: the key of each line is hashed, and an open-addressed table maps the
+hash and length of each key to the offset of its line in the file. A lookup
+then reads only the lines whose key hash matches, instead of the whole file.
+Lines with the same key hash probe from the same slot, and are inserted in file
+order, so the first occurrence of a key is still the one found.
+
+Wildcard searches get a compiled index instead, which finds the first line
+whose key matches without testing each line in turn: see lsearch_wild_build().
+
+Indexes are kept in malloc store for the life of the process, keyed by file
+name, so that they survive search_tidyup() and are inherited by forked
+children. An index is discarded and rebuilt when the file's device, inode,
+size, modification time or change time differs from when it was built. Their
+building and discarding is shown by the "memory" debug selector rather than
+"lookup", as it depends on how many lookups a process happens to do. */
+
+typedef struct {
+  unsigned	hash;
+  int		keylen;
+  long		offset;		/* Of start of line; -1 for empty slot */
+} lsearch_slot;
+
+/* The kinds of key in a wildcard index. Literal keys and "*suffix" keys are
+found by hashing the suffixes of the subject; the rest are tried in file order.
+Runs of simple regular expressions are combined into one. */
+
+enum { LW_LITERAL, LW_SUFFIX, LW_REGEX, LW_OTHER };
+
+typedef struct {
+  long		offset;		/* Of start of line */
+  int		kind;
+  int		keylen;
+  int		key;		/* Offset of key copy in the key store */
+} lsearch_wentry;
+
+typedef struct {
+  unsigned	hash;
+  int		entry;		/* -1 for empty slot */
+} lsearch_wslot;
+
+typedef struct {
+  int		first;		/* Entry numbers */
+  int		last;
+  const pcre2_code * re;	/* Combined REs, or NULL for one LW_OTHER key */
+} lsearch_wstep;
+
+typedef struct {
+  int		nentries;
+  int		nsteps;
+  unsigned	nslots;		/* Power of two */
+  lsearch_wentry * entries;
+  lsearch_wslot * slots;
+  lsearch_wstep * steps;
+  uschar *	keys;		/* Key store: lowercased literals and suffixes,
+				and other keys as they are */
+} lsearch_wild;
+
+typedef struct lsearch_index {
+  struct lsearch_index * next;
+  const uschar * filename;
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+  time_t	ctime;
+  unsigned	lookups;	/* Against this version of the file */
+  unsigned	nslots;		/* Power of two; 0 when not built */
+  BOOL		unindexable;	/* Build failed for this version */
+  lsearch_slot * slots;
+  lsearch_wild * wild[2];	/* For nwildlsearch and wildlsearch */
+} lsearch_index;
+
+static lsearch_index * lsearch_indexes = NULL;
+
 
 
 /*************************************************
@@ -52,6 +127,612 @@ return lf_check_file(fileno((FILE *)handle), filename, S_IFREG, modemask,
 
 
 
+/*************************************************
+*     Find the key at the start of a line        *
+*************************************************/
+
+/* We assume that the key will fit in the buffer. If the key starts with ",
+read it as a quoted string. We don't use string_dequote() because that uses new
+store for the result, and we may be doing this many times in a long file. We
+know that the dequoted string must be shorter than the original, because we are
+removing the quotes, and also any escape sequences always turn two or more
+characters into one character. Therefore, we can store the new string in the
+same buffer. Otherwise the key is terminated by a colon or white space.
+
+Arguments:
+  buffer     the start of a line, with trailing white space removed if the
+             whole line is present
+  ret_full   TRUE to move the rest of the line up after a dequoted key
+  sp         set to point past the key in the buffer
+
+Returns:     the length of the key
+*/
+
+static int
+lsearch_key(uschar * buffer, BOOL ret_full, uschar ** sp)
+{
+uschar * s = buffer;
+int linekeylength;
+
+if (*s == '\"')
+  {
+  uschar * t = s++;
+  while (*s && *s != '\"')
+    {
+    *t++ = *s == '\\' ? string_interpret_escape(CUSS &s) : *s;
+    s++;
+    }
+  linekeylength = t - buffer;
+  if (*s) s++;			/* Past terminating " */
+  if (ret_full)
+    memmove(t, s, Ustrlen(s)+1);	/* copy the rest of line also */
+  }
+else
+  {
+  while (*s && *s != ':' && !isspace(*s)) s++;
+  linekeylength = s - buffer;
+  }
+
+*sp = s;
+return linekeylength;
+}
+
+
+
+/*************************************************
+*            Index a plain lsearch file          *
+*************************************************/
+
+static unsigned
+lsearch_hash(const uschar * key, int len)
+{
+unsigned h = 2166136261u;			/* FNV-1a, caseless */
+while (len-- > 0) { h ^= tolower(*key++); h *= 16777619u; }
+return h;
+}
+
+/* Read the whole file, calling a function for the key of each line that
+starts an entry. Line offsets are counted from the lengths of the segments
+read, so a file containing a binary zero, which would upset the count, is left
+unindexed; so is one whose size is not as expected when the end is reached.
+
+Arguments:
+  f          the open file
+  li         the index block, with the file's identity filled in
+  fn         function to call with ctx, the key, its length and the offset of
+               its line; the key may be modified
+  ctx        context for fn
+
+Returns:     FALSE if the file cannot be indexed
+*/
+
+static BOOL
+lsearch_scan_keys(FILE * f, lsearch_index * li,
+  void (*fn)(void *, uschar *, int, long), void * ctx)
+{
+uschar buffer[4096];
+long pos = 0;
+
+rewind(f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     Ufgets(buffer, sizeof(buffer), f) != NULL;
+     last_was_eol = this_is_eol)
+  {
+  int p = Ustrlen(buffer);
+  long linestart = pos;
+  uschar * s;
+
+  pos += p;
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (!last_was_eol) continue;
+
+  if (this_is_eol)
+    {
+    while (p > 0 && isspace((uschar)buffer[p-1])) p--;
+    buffer[p] = 0;
+    }
+  if (buffer[0] == 0 || buffer[0] == '#' || isspace(buffer[0])) continue;
+
+  fn(ctx, buffer, lsearch_key(buffer, FALSE, &s), linestart);
+  }
+
+if (ferror(f) || pos != (long)li->size)
+  {
+  DEBUG(D_memory) debug_printf_indent("lsearch: not indexing %s\n", li->filename);
+  li->unindexable = TRUE;
+  return FALSE;
+  }
+return TRUE;
+}
+
+
+/* Grow a malloc'd array, if needed, to hold n more elements */
+
+static void *
+lsearch_grow(void * array, int * max, int used, int n, size_t size)
+{
+if (used + n > *max)
+  {
+  void * new;
+  while (used + n > *max) *max *= 2;
+  new = store_malloc(*max * size);
+  memcpy(new, array, used * size);
+  store_free(array);
+  array = new;
+  }
+return array;
+}
+
+
+typedef struct {
+  lsearch_slot * keys;
+  int		nkeys;
+  int		maxkeys;
+} lsearch_pbuild;
+
+static void
+lsearch_index_add(void * ctx, uschar * key, int len, long offset)
+{
+lsearch_pbuild * pb = ctx;
+pb->keys = lsearch_grow(pb->keys, &pb->maxkeys, pb->nkeys, 1, sizeof(lsearch_slot));
+pb->keys[pb->nkeys++] = (lsearch_slot)
+  { .hash = lsearch_hash(key, len), .keylen = len, .offset = offset };
+}
+
+/* Build the index for a plain lsearch, if it has not been built.
+
+Arguments:
+  f          the open file
+  li         the index block, with the file's identity filled in
+
+Returns:     TRUE if li->slots is usable
+*/
+
+static BOOL
+lsearch_index_build(FILE * f, lsearch_index * li)
+{
+lsearch_pbuild pb = { .maxkeys = 1024 };
+unsigned mask;
+
+if (li->slots) return TRUE;
+if (li->unindexable) return FALSE;
+
+pb.keys = store_malloc(pb.maxkeys * sizeof(lsearch_slot));
+if (!lsearch_scan_keys(f, li, lsearch_index_add, &pb))
+  {
+  store_free(pb.keys);
+  return FALSE;
+  }
+
+/* Size the table for a load of at most a half, and insert in file order */
+
+for (li->nslots = 64; li->nslots < 2 * pb.nkeys; ) li->nslots <<= 1;
+li->slots = store_malloc(li->nslots * sizeof(lsearch_slot));
+memset(li->slots, 0xff, li->nslots * sizeof(lsearch_slot));
+mask = li->nslots - 1;
+for (int i = 0; i < pb.nkeys; i++)
+  {
+  unsigned j = pb.keys[i].hash & mask;
+  while (li->slots[j].offset >= 0) j = (j + 1) & mask;
+  li->slots[j] = pb.keys[i];
+  }
+store_free(pb.keys);
+
+DEBUG(D_memory)
+  debug_printf_indent("lsearch: indexed %d keys of %s in %ld bytes\n",
+    pb.nkeys, li->filename, (long)(li->nslots * sizeof(lsearch_slot)));
+return TRUE;
+}
+
+
+static void lsearch_wild_free(lsearch_wild *);
+
+/* Find the index block for an open file, creating it as necessary, and
+discarding any indexes if the file has changed. The first lookup against a
+version of a file is done by scanning, as a process that only looks up one key
+gains nothing from reading the whole file; the caller builds an index for the
+second.
+
+Arguments:
+  f          the open file
+  filename   its name
+
+Returns:     the index block, or NULL if the file cannot be examined
+*/
+
+static lsearch_index *
+lsearch_index_get(FILE * f, const uschar * filename)
+{
+struct stat statbuf;
+lsearch_index * li;
+
+if (fstat(fileno(f), &statbuf) != 0) return NULL;
+
+for (li = lsearch_indexes; li; li = li->next)
+  if (Ustrcmp(li->filename, filename) == 0) break;
+if (!li)
+  {
+  li = store_malloc(sizeof(lsearch_index));
+  memset(li, 0, sizeof(lsearch_index));
+  li->filename = string_copy_perm(filename, FALSE);
+  li->next = lsearch_indexes;
+  lsearch_indexes = li;
+  }
+
+if (  li->dev != statbuf.st_dev || li->ino != statbuf.st_ino
+   || li->size != statbuf.st_size || li->mtime != statbuf.st_mtime
+   || li->ctime != statbuf.st_ctime)
+  {
+  if (li->slots || li->wild[0] || li->wild[1])
+    DEBUG(D_memory) debug_printf_indent("lsearch: %s changed\n", filename);
+  if (li->slots)
+    {
+    store_free(li->slots);
+    li->slots = NULL;
+    }
+  for (int i = 0; i < 2; i++) if (li->wild[i])
+    {
+    lsearch_wild_free(li->wild[i]);
+    li->wild[i] = NULL;
+    }
+  li->dev = statbuf.st_dev;
+  li->ino = statbuf.st_ino;
+  li->size = statbuf.st_size;
+  li->mtime = statbuf.st_mtime;
+  li->ctime = statbuf.st_ctime;
+  li->lookups = 0;
+  li->unindexable = FALSE;
+  }
+
+li->lookups++;
+return li;
+}
+
+
+/* Look up a key in an index. Each line whose key has the right hash and
+length is read to check the key itself.
+
+Arguments:
+  li         the index
+  f          the open file
+  keystring  the key
+  length     its length
+
+Returns:     the offset of the line holding the first occurrence of the
+             key, or -1 if it is not in the file
+*/
+
+static long
+lsearch_index_find(lsearch_index * li, FILE * f, const uschar * keystring,
+  int length)
+{
+unsigned h = lsearch_hash(keystring, length), mask = li->nslots - 1;
+
+for (unsigned j = h & mask; li->slots[j].offset >= 0; j = (j + 1) & mask)
+  {
+  lsearch_slot * ls = li->slots + j;
+  uschar buffer[4096], * s;
+  int p;
+
+  if (ls->hash != h || ls->keylen != length) continue;
+  if (  fseek(f, ls->offset, SEEK_SET) != 0
+     || Ufgets(buffer, sizeof(buffer), f) == NULL) break;
+
+  if ((p = Ustrlen(buffer)) > 0 && buffer[p-1] == '\n')
+    {
+    while (p > 0 && isspace((uschar)buffer[p-1])) p--;
+    buffer[p] = 0;
+    }
+  if (  lsearch_key(buffer, FALSE, &s) == length
+     && strncmpic(buffer, keystring, length) == 0)
+    return ls->offset;
+  }
+return -1;
+}
+
+
+
+/*************************************************
+*      Compiled index for wildcard keys          *
+*************************************************/
+
+/* The literal and suffix keys are hashed from their last character backwards,
+so that one pass along the subject from its end gives the hash of each of its
+suffixes, including the whole subject. Each is looked up in a single table,
+which thus serves as a hashed suffix trie. */
+
+#define LW_HASH_INIT	2166136261u
+#define LW_HASH(h, c)	(((h) ^ (c)) * 16777619u)
+#define LW_RE_MAX	100	/* Most REs combined into one */
+
+static void
+lsearch_wild_free(lsearch_wild * lw)
+{
+for (int i = 0; i < lw->nsteps; i++)
+  if (lw->steps[i].re) pcre2_code_free((pcre2_code *)lw->steps[i].re);
+store_free(lw->entries);
+store_free(lw->slots);
+store_free(lw->steps);
+store_free(lw->keys);
+store_free(lw);
+}
+
+
+/* Decide how a key from a wildcard file can be matched. A key that the list
+matching code treats specially (negation, a file name, a named list, or a
+lookup), or that expansion might change for wildlsearch, is LW_OTHER and is
+passed to match_isinlist() as before. Regular expressions can be combined only
+if they do not refer to groups by number or name, and do not use a construct
+starting "(?" or "(*" or quoting with \Q; such things could affect the
+expressions combined after them. Nor can one with an alternation at its top
+level, as any branch after the first is not anchored: the combination would
+find the match that starts earliest in the subject, not the first in the file. */
+
+static int
+lsearch_wild_kind(const uschar * key, int len, BOOL expand)
+{
+if (  len == 0 || isspace(key[0]) || isspace(key[len-1])
+   || memchr(key, 0, len))
+  return LW_OTHER;
+if (expand && (memchr(key, '$', len) || memchr(key, '\\', len)))
+  return LW_OTHER;
+
+switch (key[0])
+  {
+  case '*':
+    return LW_SUFFIX;
+  case '^':
+    {
+    int depth = 0;
+    BOOL inclass = FALSE;
+
+    for (int i = 0; i < len - 1; i++)
+      if (  (key[i] == '(' && (key[i+1] == '?' || key[i+1] == '*'))
+	 || (key[i] == '\\' && (isdigit(key[i+1]) || Ustrchr("gkQE", key[i+1]))))
+	return LW_OTHER;
+
+    for (int i = 0; i < len; i++)
+      if (key[i] == '\\') i++;
+      else if (inclass) { if (key[i] == ']') inclass = FALSE; }
+      else if (key[i] == '[')
+	{
+	inclass = TRUE;
+	if (i + 1 < len && key[i+1] == '^') i++;
+	if (i + 1 < len && key[i+1] == ']') i++;	/* literal ] first */
+	}
+      else if (key[i] == '(') depth++;
+      else if (key[i] == ')') depth--;
+      else if (key[i] == '|' && depth <= 0) return LW_OTHER;
+    return LW_REGEX;
+    }
+  case '!':
+  case '/':
+  case '+':
+    return LW_OTHER;
+  }
+return memchr(key, ';', len) ? LW_OTHER : LW_LITERAL;
+}
+
+
+typedef struct {
+  lsearch_wild * lw;
+  BOOL		expand;
+  int		maxentries;
+  int		keyused;
+  int		maxkeys;
+} lsearch_wbuild;
+
+static void
+lsearch_wild_add(void * ctx, uschar * key, int len, long offset)
+{
+lsearch_wbuild * wb = ctx;
+lsearch_wild * lw = wb->lw;
+int kind = lsearch_wild_kind(key, len, wb->expand);
+uschar * k;
+
+if (kind == LW_SUFFIX) { key++; len--; }
+lw->entries = lsearch_grow(lw->entries, &wb->maxentries, lw->nentries, 1,
+  sizeof(lsearch_wentry));
+lw->keys = lsearch_grow(lw->keys, &wb->maxkeys, wb->keyused, len + 1, 1);
+
+lw->entries[lw->nentries++] = (lsearch_wentry)
+  { .offset = offset, .kind = kind, .keylen = len, .key = wb->keyused };
+k = lw->keys + wb->keyused;
+for (int i = 0; i < len; i++)
+  k[i] = kind == LW_LITERAL || kind == LW_SUFFIX ? tolower(key[i]) : key[i];
+k[len] = 0;
+wb->keyused += len + 1;
+}
+
+
+/* Add a step that matches a run of regular expressions, combined into one
+whose alternatives are tried in order, each marked with its entry number. If
+the combination does not compile, the expressions are left to be matched one
+by one in the usual way, so that any error is reported as it would have been.
+
+Arguments:
+  lw         the index being built
+  first      entry number of the first RE
+  last       entry number of the last
+*/
+
+static void
+lsearch_wild_re_step(lsearch_wild * lw, int first, int last)
+{
+gstring * g = NULL;
+const pcre2_code * re;
+PCRE2_SIZE offset;
+int err;
+
+for (int i = first; i <= last; i++)
+  g = string_fmt_append(g, "%s(?:%s)(*MARK:%d)",
+    i == first ? "" : "|", lw->keys + lw->entries[i].key, i);
+
+if ((re = pcre2_compile((PCRE2_SPTR)string_from_gstring(g),
+	PCRE2_ZERO_TERMINATED, PCRE_COPT|PCRE2_CASELESS, &err, &offset,
+	pcre_mlc_cmp_ctx)))
+  {
+  lw->steps[lw->nsteps++] = (lsearch_wstep)
+    { .first = first, .last = last, .re = re };
+  return;
+  }
+
+for (int i = first; i <= last; i++)
+  {
+  lw->entries[i].kind = LW_OTHER;
+  lw->steps[lw->nsteps++] = (lsearch_wstep) { .first = i, .last = i };
+  }
+}
+
+
+/* Build the compiled index for a wildcard lsearch, if it has not been built.
+
+Arguments:
+  f          the open file
+  li         the index block, with the file's identity filled in
+  expand     TRUE for wildlsearch, FALSE for nwildlsearch
+
+Returns:     the index, or NULL if the file cannot be indexed
+*/
+
+static lsearch_wild *
+lsearch_wild_build(FILE * f, lsearch_index * li, BOOL expand)
+{
+lsearch_wbuild wb = { .expand = expand, .maxentries = 256, .maxkeys = 4096 };
+lsearch_wild * lw;
+int nfast = 0, first;
+unsigned mask;
+
+if (li->wild[expand]) return li->wild[expand];
+if (li->unindexable) return NULL;
+
+wb.lw = lw = store_malloc(sizeof(lsearch_wild));
+memset(lw, 0, sizeof(lsearch_wild));
+lw->entries = store_malloc(wb.maxentries * sizeof(lsearch_wentry));
+lw->keys = store_malloc(wb.maxkeys);
+if (!lsearch_scan_keys(f, li, lsearch_wild_add, &wb))
+  {
+  store_free(lw->entries);
+  store_free(lw->keys);
+  store_free(lw);
+  return NULL;
+  }
+
+/* Hash the literal and suffix keys, in file order */
+
+for (int i = 0; i < lw->nentries; i++)
+  if (lw->entries[i].kind <= LW_SUFFIX) nfast++;
+for (lw->nslots = 64; lw->nslots < 2 * nfast; ) lw->nslots <<= 1;
+lw->slots = store_malloc(lw->nslots * sizeof(lsearch_wslot));
+memset(lw->slots, 0xff, lw->nslots * sizeof(lsearch_wslot));
+mask = lw->nslots - 1;
+
+for (int i = 0; i < lw->nentries; i++)
+  {
+  lsearch_wentry * e = lw->entries + i;
+  const uschar * k = lw->keys + e->key;
+  unsigned h = LW_HASH_INIT, j;
+
+  if (e->kind > LW_SUFFIX) continue;
+  for (int n = e->keylen - 1; n >= 0; n--) h = LW_HASH(h, k[n]);
+  for (j = h & mask; lw->slots[j].entry >= 0; ) j = (j + 1) & mask;
+  lw->slots[j] = (lsearch_wslot) { .hash = h, .entry = i };
+  }
+
+/* The other keys become a list of steps, in file order */
+
+lw->steps = store_malloc((lw->nentries - nfast + 1) * sizeof(lsearch_wstep));
+first = -1;
+for (int i = 0; i <= lw->nentries; i++)
+  {
+  int kind = i < lw->nentries ? lw->entries[i].kind : LW_LITERAL;
+
+  if (first >= 0 && (kind != LW_REGEX || i - first >= LW_RE_MAX))
+    {
+    lsearch_wild_re_step(lw, first, i - 1);
+    first = -1;
+    }
+  if (kind == LW_REGEX)
+    { if (first < 0) first = i; }
+  else if (kind == LW_OTHER)
+    lw->steps[lw->nsteps++] = (lsearch_wstep) { .first = i, .last = i };
+  }
+
+DEBUG(D_memory)
+  debug_printf_indent("lsearch: indexed %d keys of %s: %d literal or suffix, "
+    "%d steps\n", lw->nentries, li->filename, nfast, lw->nsteps);
+return li->wild[expand] = lw;
+}
+
+
+/* Find the first line of a wildcard file whose key matches. The best of the
+literal and suffix keys is found by hash, then the steps for the other keys
+are tried in order, as far as that line.
+
+Arguments:
+  lw         the index
+  keystring  the subject
+  length     its length
+  expand     TRUE for wildlsearch, FALSE for nwildlsearch
+  offsetp    where to put the offset of the line, or -1 if none matches
+
+Returns:     OK, or DEFER if matching a key deferred
+*/
+
+static int
+lsearch_wild_find(lsearch_wild * lw, const uschar * keystring, int length,
+  BOOL expand, long * offsetp)
+{
+const uschar * lc = string_copylc(keystring);
+unsigned h = LW_HASH_INIT, mask = lw->nslots - 1;
+int best = lw->nentries;
+
+for (int len = 0; ; len++)
+  {
+  for (unsigned j = h & mask; lw->slots[j].entry >= 0; j = (j + 1) & mask)
+    {
+    int n = lw->slots[j].entry;
+    lsearch_wentry * e = lw->entries + n;
+
+    if (  lw->slots[j].hash == h && e->keylen == len && n < best
+       && (e->kind == LW_SUFFIX || len == length)
+       && memcmp(lw->keys + e->key, lc + length - len, len) == 0)
+      best = n;
+    }
+  if (len >= length) break;
+  h = LW_HASH(h, lc[length - 1 - len]);
+  }
+
+for (lsearch_wstep * st = lw->steps; st < lw->steps + lw->nsteps; st++)
+  {
+  if (st->first >= best) break;
+  if (st->re)
+    {
+    pcre2_match_data * md = pcre2_match_data_create(1, pcre_gen_ctx);
+    if (pcre2_match(st->re, (PCRE2_SPTR)keystring, length, 0, PCRE_EOPT, md,
+	  pcre_gen_mtc_ctx) >= 0)
+      {
+      int n = Uatoi(pcre2_get_mark(md));
+      if (n < best) best = n;
+      break;
+      }
+    }
+  else
+    {
+    const uschar * list = lw->keys + lw->entries[st->first].key;
+    int rc = match_isinlist(keystring, &list, UCHAR_MAX+1, NULL, NULL,
+      MCL_STRING + (expand ? 0 : MCL_NOEXPAND), TRUE, NULL);
+    if (rc == DEFER) return DEFER;
+    if (rc == OK) { best = st->first; break; }
+    }
+  }
+
+*offsetp = best < lw->nentries ? lw->entries[best].offset : -1;
+return OK;
+}
+
+
+
 /*************************************************
 *  Internal function for the various lsearches   *
 *************************************************/
@@ -73,7 +754,8 @@ internal_lsearch_find(void * handle, const uschar * filename,
   int type, const uschar * opts)
 {
 FILE *f = handle;
-BOOL ret_full = FALSE;
+lsearch_index * li;
+BOOL ret_full = FALSE, indexed = FALSE;
 int old_pool = store_pool;
 rmark reset_point = NULL;
 uschar buffer[4096];
@@ -98,7 +780,38 @@ if (type == LSEARCH_WILD || type == LSEARCH_NWILD)
   reset_point = store_mark();
   }
 
-rewind(f);
+/* When the file is indexed, the index says which line, if any, holds the
+matching key, and the scan below starts there, without testing the key again.
+Numeric variables are dropped, as they would have been by a scan. */
+
+if (  type != LSEARCH_IP
+   && (li = lsearch_index_get(f, filename)) && li->lookups > 1
+   && (type == LSEARCH_PLAIN
+      ? lsearch_index_build(f, li)
+      : lsearch_wild_build(f, li, type == LSEARCH_WILD) != NULL))
+  {
+  long offset;
+
+  if (type == LSEARCH_PLAIN)
+    offset = lsearch_index_find(li, f, keystring, length);
+  else
+    {
+    int rc = lsearch_wild_find(li->wild[type == LSEARCH_WILD], keystring,
+      length, type == LSEARCH_WILD, &offset);
+    expand_nmax = -1;
+    if (rc == DEFER)
+      {
+      store_reset(reset_point);
+      store_pool = old_pool;
+      return DEFER;
+      }
+    }
+  if (offset < 0 || fseek(f, offset, SEEK_SET) != 0) goto NOT_FOUND;
+  indexed = TRUE;
+  }
+else
+  rewind(f);
+
 for (BOOL this_is_eol, last_was_eol = TRUE;
      Ufgets(buffer, sizeof(buffer), f) != NULL;
      last_was_eol = this_is_eol)
@@ -134,35 +847,8 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 
   if (buffer[0] == 0 || buffer[0] == '#' || isspace(buffer[0])) continue;
 
-  /* We assume that they key will fit in the buffer. If the key starts with ",
-  read it as a quoted string. We don't use string_dequote() because that uses
-  new store for the result, and we may be doing this many times in a long file.
-  We know that the dequoted string must be shorter than the original, because
-  we are removing the quotes, and also any escape sequences always turn two or
-  more characters into one character. Therefore, we can store the new string in
-  the same buffer. */
-
-  if (*s == '\"')
-    {
-    uschar *t = s++;
-    while (*s && *s != '\"')
-      {
-      *t++ = *s == '\\' ? string_interpret_escape(CUSS &s) : *s;
-      s++;
-      }
-    linekeylength = t - buffer;
-    if (*s) s++;			/* Past terminating " */
-    if (ret_full)
-      memmove(t, s, Ustrlen(s)+1);	/* copy the rest of line also */
-    }
-
-  /* Otherwise it is terminated by a colon or white space */
-
-  else
-    {
-    while (*s && *s != ':' && !isspace(*s)) s++;
-    linekeylength = s - buffer;
-    }
+  linekeylength = lsearch_key(buffer, ret_full, &s);
+  if (indexed) goto MATCHED;
 
   /* The matching test depends on which kind of lsearch we are doing */
 
@@ -233,6 +919,7 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
   colon after the spaces. This is an odd specification, but it's for
   compatibility. */
 
+  MATCHED:
   if (!ret_full)
     if (Uskip_whitespace(&s) == ':')
       {
@@ -306,6 +993,7 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 
 /* Reset dynamic store, if we need to */
 
+NOT_FOUND:
 if (reset_point)
   {
   store_reset(reset_point);
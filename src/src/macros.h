@@ -466,6 +466,7 @@ enum logbit {
   Li_acl_warn_skipped,
   Li_arguments,
   Li_connection_id,
+  Li_connection_memory,
   Li_deliver_time,
   Li_delivery_size,
   Li_dkim,
@@ -1241,6 +1242,10 @@ When doing en extended loop of matching, release store periodically. */
 #define MACRO_FOUND	BIT(0)	/* At least one macro was found in the line */
 #define MACRO_FIRST	BIT(1)	/* A macro was the first thing in the line */
 
+/* Kinds of record for profile_push() */
+#define PROF_EXPAND	0	/* expansion item or operator */
+#define PROF_ACL	1	/* ACL condition or modifier */
+
 #endif	/* whole file */
 /* End of macros.h */
 /* vi: aw ai sw=2
@@ -348,6 +348,19 @@ if (SPF_request_set_helo_dom(spf_request, CCS spf_helo_domain))
 return OK;
 }
 
+/* Forget the context for a connection, before another */
+
+static void
+spf_conn_reset(void)
+{
+if (spf_request)
+  {
+  SPF_request_free(spf_request);
+  spf_request = NULL;
+  }
+spf_used_domain = NULL;
+}
+
 static void
 spf_smtp_reset(void)
 {
@@ -611,6 +624,7 @@ misc_module_info spf_module_info =
   .init =		spf_init,
   .lib_vers_report =	spf_lib_version_report,
   .conn_init =		spf_conn_init,
+  .conn_reset =		spf_conn_reset,
   .smtp_reset =		spf_smtp_reset,
   .authres =		authres_spf,
 
@@ -452,6 +452,47 @@ return -1;
 
 
 
+/***********************************************************
+*               Process memory size function               *
+***********************************************************/
+
+/* What is required is a function called os_get_rss which returns the current
+resident set size of the process in kB, or -1 if that is not available, and
+if given a pointer, passes back the peak resident set size in the same way;
+and a function called os_reset_rss_peak which makes the peak start again from
+the current size, returning FALSE if it cannot. Without specific versions, the
+peak is taken from getrusage(), which gives kB on most systems (but bytes on
+some), and cannot be reset; the current size is not known. */
+
+#ifndef OS_GET_RSS
+
+BOOL
+os_reset_rss_peak(void)
+{
+return FALSE;
+}
+
+int
+os_get_rss(int * peak)
+{
+if (peak)
+  {
+# ifndef NO_SYS_RESOURCE_H
+  struct rusage ru;
+  *peak = getrusage(RUSAGE_SELF, &ru) == 0 ? (int) ru.ru_maxrss : -1;
+# else
+  *peak = -1;
+# endif
+  }
+return -1;
+}
+
+#endif
+
+/* ----------------------------------------------------------------------- */
+
+
+
 #if !defined FIND_RUNNING_INTERFACES
 /*************************************************
 *     Find all the running network interfaces    *
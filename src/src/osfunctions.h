@@ -22,6 +22,12 @@ predicting constness is awkward. */
 #ifndef os_getloadavg
 extern int           os_getloadavg(void);
 #endif
+#ifndef os_get_rss
+extern int           os_get_rss(int *);
+#endif
+#ifndef os_reset_rss_peak
+extern BOOL          os_reset_rss_peak(void);
+#endif
 #ifndef os_restarting_signal
 extern void          os_restarting_signal(int, void (*)(int));
 #endif
@@ -0,0 +1,299 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/* Copyright (c) The Exim Maintainers 2026 */
+/* See the file NOTICE for conditions of use and distribution. */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Profiling of expansion items and ACL conditions.
+
+When the config_profile_file option expands to a non-empty string, each
+expansion item or operator that is evaluated, and each ACL condition or
+modifier, is timed.  Records are keyed by the configuration file and line
+current at the time (the ACL statement, or the router or transport being
+run) and by the name of the item or condition, and hold a call count plus
+wall-clock and CPU times.  Inclusive times cover anything nested inside;
+"self" times exclude nested records.  A record that is active more than once
+on the stack (a recursive item) has its inclusive time counted only for the
+outermost instance.
+
+The records are appended to the file, as one block of tab-separated lines per
+process, when the process exits.  The exim_profile utility aggregates them.
+
+The callers keep cost down when profiling is off: a push is conditional on
+f.profiling, and a pop on profile_depth being above the depth the caller saw
+on entry.  Every caller pops back to its own entry depth on all its exits, so
+records left open by an early return are closed by the next level up. */
+
+
+#include "exim.h"
+
+typedef struct prof_rec {
+  const uschar *	file;		/* config file, or NULL */
+  const uschar *	name;		/* item, operator or condition */
+  int			line;
+  int			kind;		/* PROF_EXPAND or PROF_ACL */
+  unsigned		active;		/* open stack frames for this record */
+  unsigned long		count;
+  uint64_t		wall, cpu;	/* inclusive, ns */
+  uint64_t		self_wall, self_cpu;
+} prof_rec;
+
+typedef struct prof_frame {
+  prof_rec *		rec;
+  uint64_t		wall0, cpu0;	/* at push */
+  uint64_t		child_wall, child_cpu;
+} prof_frame;
+
+#define PROF_STACK_MAX	64		/* deeper frames are not timed */
+
+static prof_rec *	prof_table = NULL;
+static unsigned		prof_size = 0;
+static unsigned		prof_count = 0;
+static prof_frame	prof_stack[PROF_STACK_MAX];
+static const uschar *	prof_path = NULL;
+
+
+static uint64_t
+prof_ns(clockid_t clk)
+{
+struct timespec ts;
+if (clock_gettime(clk, &ts) != 0) return 0;
+return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+# define PROF_CPU_NS()	prof_ns(CLOCK_PROCESS_CPUTIME_ID)
+#else
+# define PROF_CPU_NS()	0
+#endif
+#ifdef _POSIX_MONOTONIC_CLOCK
+# define PROF_WALL_NS()	prof_ns(CLOCK_MONOTONIC)
+#else
+# define PROF_WALL_NS()	prof_ns(CLOCK_REALTIME)
+#endif
+
+
+
+/*************************************************
+*          Find or make a profile record         *
+*************************************************/
+
+/* The table is open-addressed, keyed by the identity of the strings; they
+are either static or in the configuration store, so live for the process.
+
+Arguments:
+  kind		PROF_EXPAND or PROF_ACL
+  name		item or condition name
+  file		configuration file, or NULL
+  line		line in that file
+
+Returns:	pointer to the record
+*/
+
+static prof_rec *
+prof_find(int kind, const uschar * name, const uschar * file, int line)
+{
+unsigned long h;
+prof_rec * r;
+
+if (2 * (prof_count + 1) > prof_size)
+  {
+  prof_rec * old = prof_table;
+  unsigned old_size = prof_size;
+
+  prof_size = prof_size ? 2 * prof_size : 256;
+  prof_table = store_malloc(prof_size * sizeof(prof_rec));
+  memset(prof_table, 0, prof_size * sizeof(prof_rec));
+  for (unsigned i = 0; i < old_size; i++) if (old[i].name)
+    {
+    r = old + i;
+    h = ((unsigned long)r->name ^ (unsigned long)r->file ^ r->line) * 2654435761u;
+    for (unsigned j = h % prof_size; ; j = (j + 1) % prof_size)
+      if (!prof_table[j].name) { prof_table[j] = *r; break; }
+    }
+
+  /* Frames point into the table; move them along with it */
+
+  for (int d = 0; d < profile_depth && d < PROF_STACK_MAX; d++)
+    for (prof_rec * p = prof_table; ; p++)
+      if (  p->name == prof_stack[d].rec->name
+	 && p->file == prof_stack[d].rec->file
+	 && p->line == prof_stack[d].rec->line
+	 && p->kind == prof_stack[d].rec->kind)
+	{ prof_stack[d].rec = p; break; }
+  if (old) store_free(old);
+  }
+
+h = ((unsigned long)name ^ (unsigned long)file ^ line) * 2654435761u;
+for (unsigned j = h % prof_size; ; j = (j + 1) % prof_size)
+  {
+  r = prof_table + j;
+  if (!r->name)
+    {
+    *r = (prof_rec) {.kind = kind, .name = name, .file = file, .line = line};
+    prof_count++;
+    return r;
+    }
+  if (r->name == name && r->file == file && r->line == line && r->kind == kind)
+    return r;
+  }
+}
+
+
+
+/*************************************************
+*           Open and close profile frames        *
+*************************************************/
+
+/* Open a frame for an item or condition about to be evaluated.  The config
+position is that of the current ACL statement if there is one, otherwise of
+the current router or transport; if neither, line zero.
+
+Arguments:
+  kind		PROF_EXPAND or PROF_ACL
+  name		item or condition name; must be a static string
+*/
+
+void
+profile_push(int kind, const uschar * name)
+{
+if (profile_depth < PROF_STACK_MAX)
+  {
+  prof_frame * fp = prof_stack + profile_depth;
+
+  fp->rec = config_lineno
+    ? prof_find(kind, name, config_filename, config_lineno)
+    : prof_find(kind, name, driver_srcfile, driver_srcline);
+  fp->rec->active++;
+  fp->child_wall = fp->child_cpu = 0;
+  fp->cpu0 = PROF_CPU_NS();
+  fp->wall0 = PROF_WALL_NS();
+  }
+profile_depth++;
+}
+
+
+/* Close frames, innermost first, until the given depth is reached, adding
+their times into their records and into the enclosing frame's nested total.
+
+Argument:	depth to pop back to
+*/
+
+void
+profile_pop(int depth)
+{
+uint64_t wall = PROF_WALL_NS(), cpu = PROF_CPU_NS();
+
+while (profile_depth > depth)
+  if (--profile_depth < PROF_STACK_MAX)
+    {
+    prof_frame * fp = prof_stack + profile_depth;
+    prof_rec * r = fp->rec;
+    uint64_t dwall = wall - fp->wall0, dcpu = cpu - fp->cpu0;
+
+    r->count++;
+    if (--r->active == 0)
+      { r->wall += dwall; r->cpu += dcpu; }
+    r->self_wall += dwall - fp->child_wall;
+    r->self_cpu += dcpu - fp->child_cpu;
+    if (profile_depth > 0)
+      {
+      fp[-1].child_wall += dwall;
+      fp[-1].child_cpu += dcpu;
+      }
+    }
+}
+
+
+
+/*************************************************
+*            Start profiling a process           *
+*************************************************/
+
+/* Called once the configuration has been read, and again in each forked
+child, so that the option is evaluated per process (it can use, for example,
+${randint } to sample).  Anything inherited from a parent is discarded. */
+
+void
+profile_init(void)
+{
+const uschar * s;
+
+f.profiling = FALSE;
+profile_depth = 0;
+prof_count = 0;
+if (prof_table) memset(prof_table, 0, prof_size * sizeof(prof_rec));
+
+if (!config_profile_file) return;
+GET_OPTION("config_profile_file");
+if (!(s = expand_string(config_profile_file)))
+  {
+  if (!f.expand_string_forcedfail)
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand config_profile_file "
+      "%q: %s", config_profile_file, expand_string_message);
+  return;
+  }
+if (!*s) return;
+if (is_tainted(s))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC,
+    "tainted value for config_profile_file: %q", s);
+  return;
+  }
+
+prof_path = string_copy_perm(s, FALSE);
+f.profiling = TRUE;
+DEBUG(D_any) debug_printf("profiling to %s\n", prof_path);
+}
+
+
+
+/*************************************************
+*          Write the profile at exit             *
+*************************************************/
+
+/* One header line, then one line per record:
+
+  file line kind name count wall-ns cpu-ns self-wall-ns self-cpu-ns
+
+separated by tabs, with "-" for an unknown file.  The block is built in
+memory and appended with a single write so that blocks from concurrent
+processes do not interleave.  Failure to write (for instance from a delivery
+process running as a local user) is not an error for the process; it is only
+reported under debug. */
+
+void
+profile_write(void)
+{
+gstring * g;
+int fd;
+
+if (!f.profiling || !prof_count) return;
+f.profiling = FALSE;
+
+g = string_fmt_append(NULL, "#pid %d %s %ld\n",
+  (int)getpid(), process_purpose, (long)time(NULL));
+for (prof_rec * r = prof_table; r < prof_table + prof_size; r++)
+  if (r->count)
+    g = string_fmt_append(g, "%s\t%d\t%s\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+      r->file ? r->file : US"-", r->line,
+      r->kind == PROF_ACL ? "acl" : "expand", r->name, r->count,
+      (unsigned long)r->wall, (unsigned long)r->cpu,
+      (unsigned long)r->self_wall, (unsigned long)r->self_cpu);
+
+if ((fd = Uopen(prof_path,
+		EXIM_CLOEXEC | EXIM_NOFOLLOW | O_WRONLY|O_APPEND|O_CREAT, 0660)) < 0)
+  {
+  DEBUG(D_any) debug_printf("profile: open %s: %s\n", prof_path, strerror(errno));
+  return;
+  }
+if (geteuid() == root_uid)	/* so that later Exim-uid processes can write */
+  (void) exim_fchown(fd, exim_uid, exim_gid, prof_path);
+if (write(fd, g->s, g->ptr) != g->ptr)
+  DEBUG(D_any) debug_printf("profile: write %s: %s\n", prof_path, strerror(errno));
+(void)close(fd);
+}
+
+/* End of profile.c */
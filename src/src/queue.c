@@ -82,6 +82,101 @@ return first;
 
 
 
+/* State for building the list of queue items. When randomizing, the file
+names are added to the start or end of the list according to the bits of the
+flags variable. When not, the sublists for a bottom-up merge sort are held in
+root. */
+
+typedef struct {
+  queue_filename *	yield;
+  queue_filename *	last;
+  queue_filename *	root[LOG2_MAXNODES];
+  int			flags;
+  int			resetflags;
+  BOOL			randomize;
+  unsigned *		pcount;
+} spool_list_state;
+
+
+static BOOL qindex_list(spool_list_state *);
+static BOOL qindex_bypass = FALSE;
+
+
+/* Add the -H file with the given name, in the given subdirectory (0 for the
+main directory), to the list being built. Returns the new item, or NULL if only
+counting. */
+
+static queue_filename *
+spool_list_add(spool_list_state * sl, const uschar * name, int len,
+  int subdirchar)
+{
+queue_filename * next, * item;
+
+if (sl->pcount)
+  {
+  (*sl->pcount)++;
+  return NULL;
+  }
+
+next = store_get(sizeof(queue_filename) + len, name);
+memcpy(next->text, name, len);
+next->text[len] = 0;
+next->dir_uschar = subdirchar;
+next->received = 0;
+item = next;
+
+/* Handle the creation of a randomized list. The first item becomes both
+the top and bottom of the list. Subsequent items are inserted either at
+the top or the bottom, randomly. This is, I argue, faster than doing a
+sort by allocating a random number to each item, and it also saves having
+to store the number with each item. */
+
+if (sl->randomize)
+  if (!sl->yield)
+    {
+    next->next = NULL;
+    sl->yield = sl->last = next;
+    }
+  else
+    {
+    if (sl->flags == 0)
+      sl->flags = sl->resetflags;
+    if ((sl->flags & 1) == 0)
+      {
+      next->next = sl->yield;
+      sl->yield = next;
+      }
+    else
+      {
+      next->next = NULL;
+      sl->last->next = next;
+      sl->last = next;
+      }
+    sl->flags = sl->flags >> 1;
+    }
+
+/* Otherwise do a bottom-up merge sort based on the name. */
+
+else
+  {
+  next->next = NULL;
+  for (int j = 0; j < LOG2_MAXNODES; j++)
+    if (sl->root[j])
+      {
+      next = merge_queue_lists(next, sl->root[j]);
+      sl->root[j] = j == LOG2_MAXNODES - 1 ? next : NULL;
+      }
+    else
+      {
+      sl->root[j] = next;
+      break;
+      }
+  }
+return item;
+}
+
+
+
 /*************************************************
 *             Get list of spool files            *
 *************************************************/
@@ -128,23 +223,30 @@ static queue_filename *
 queue_get_spool_list(int subdiroffset, uschar * subdirs, int * subcount,
   BOOL randomize, unsigned * pcount)
 {
-int i, flags = 0, resetflags = -1, subptr;
-queue_filename * yield = NULL, * last = NULL;
+int i, subptr;
 uschar buffer[256];
-queue_filename *root[LOG2_MAXNODES];
+spool_list_state sl = {.resetflags = -1, .randomize = randomize,
+		       .pcount = pcount};
 
-/* When randomizing, the file names are added to the start or end of the list
-according to the bits of the flags variable. Get a collection of bits from the
-current time. Use the bottom 16 and just keep re-using them if necessary. When
-not randomizing, initialize the sublists for the bottom-up merge sort. */
+/* When randomizing, get a collection of bits from the current time. Use the
+bottom 16 and just keep re-using them if necessary. */
 
 if (pcount)
   *pcount = 0;
 else if (randomize)
-  resetflags = time(NULL) & 0xFFFF;
-else
-   for (i = 0; i < LOG2_MAXNODES; i++)
-     root[i] = NULL;
+  sl.resetflags = time(NULL) & 0xFFFF;
+
+/* A queue index, if in use, lists the whole queue. Claim there are no
+subdirectories, so that a caller working through them stops after the first
+call. */
+
+if (queue_index && !qindex_bypass && subdiroffset <= 0)
+  if (qindex_list(&sl))
+    {
+    subdirs[0] = 0;
+    *subcount = 0;
+    goto SORTED;
+    }
 
 /* If processing the full queue, or just the top-level, start at the base
 directory, and initialize the first subdirectory name (as none). Otherwise,
@@ -212,63 +314,7 @@ for (; i <= *subcount; i++)
     if (  (len == SPOOL_NAME_LENGTH || len == SPOOL_NAME_LENGTH_OLD)
        && Ustrcmp(name + len - 2, "-H") == 0
        )
-      if (pcount)
-	(*pcount)++;
-      else
-	{
-	queue_filename * next =
-	  store_get(sizeof(queue_filename) + len, name);
-	Ustrcpy(next->text, name);
-	next->dir_uschar = subdirchar;
-
-	/* Handle the creation of a randomized list. The first item becomes both
-	the top and bottom of the list. Subsequent items are inserted either at
-	the top or the bottom, randomly. This is, I argue, faster than doing a
-	sort by allocating a random number to each item, and it also saves having
-	to store the number with each item. */
-
-	if (randomize)
-	  if (!yield)
-	    {
-	    next->next = NULL;
-	    yield = last = next;
-	    }
-	  else
-	    {
-	    if (flags == 0)
-	      flags = resetflags;
-	    if ((flags & 1) == 0)
-	      {
-	      next->next = yield;
-	      yield = next;
-	      }
-	    else
-	      {
-	      next->next = NULL;
-	      last->next = next;
-	      last = next;
-	      }
-	    flags = flags >> 1;
-	    }
-
-	/* Otherwise do a bottom-up merge sort based on the name. */
-
-	else
-	  {
-	  next->next = NULL;
-	  for (int j = 0; j < LOG2_MAXNODES; j++)
-	    if (root[j])
-	      {
-	      next = merge_queue_lists(next, root[j]);
-	      root[j] = j == LOG2_MAXNODES - 1 ? next : NULL;
-	      }
-	    else
-	      {
-	      root[j] = next;
-	      break;
-	      }
-	  }
-	}
+      spool_list_add(&sl, name, len, subdirchar);
     }
 
   /* Finished with this directory */
@@ -305,16 +351,762 @@ for (; i <= *subcount; i++)
 /* When using a bottom-up merge sort, do the final merging of the sublists.
 Then pass back the final list of file items. */
 
+SORTED:
 if (!pcount && !randomize)
   for (i = 0; i < LOG2_MAXNODES; ++i)
-    yield = merge_queue_lists(yield, root[i]);
+    sl.yield = merge_queue_lists(sl.yield, sl.root[i]);
+
+return sl.yield;
+}
+
+
+
+/*************************************************
+*            Persistent queue index              *
+*************************************************/
+
+/* When queue_index is set, the messages on each queue are also recorded in a
+hints database, so that queue runs, counts and listings can get them without
+reading the spool directories. An entry is added before a message's -H file is
+put in place, and removed after it has gone, on every path that removes one,
+so the index always covers everything on the queue. An entry for a message that
+is no longer there (after a crash, or for a header file removed by hand) makes
+counts and listings too high until it is dropped, either when a queue runner
+finds the message gone or at the next rebuild. The index is rebuilt
+from a directory scan when it does not exist, or when it was last rebuilt more
+than queue_index_rescan ago; that also picks up messages put on the spool by
+other means.
+
+Receiving and delivery processes do not write the database themselves, as
+opening and committing it for every message would make them queue for its
+lock. They append a line to a journal file beside it instead, under a shared
+lock, and the journal is applied to the database, in one transaction, by
+whatever next wants the list of messages.
+
+An entry for a message that is being received, or whose header has been read,
+holds its priority and time of arrival, so that a queue run ordered by priority
+does not have to read every -H file. Entries added by a rebuild do not.
+
+The key is the message id, followed by a slash and the subdirectory character
+for a message in a split spool subdirectory. A record under QINDEX_BUILT holds
+the time of the last rebuild. */
+
+#define QINDEX_BUILT	US"=built"
+
+static const uschar *
+qindex_dbname(const uschar * qname)
+{
+return *qname ? string_sprintf("queueindex-%s", qname) : US"queueindex";
+}
+
+static const uschar *
+qindex_key(const uschar * id, const uschar * subdir)
+{
+return *subdir ? string_sprintf("%s/%s", id, subdir) : id;
+}
+
+
+/* Open the journal for a queue's index, creating it (and the db directory) if
+necessary.
+
+Returns:  an fd, or -1
+*/
+
+static int
+qindex_journal_open(const uschar * qname)
+{
+const uschar * fname = string_sprintf("%s/db/%s.journal",
+				      spool_directory, qindex_dbname(qname));
+int fd;
+
+priv_drop_temp(exim_uid, exim_gid);
+if (  (fd = Uopen(fname, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, EXIMDB_MODE)) < 0
+   && errno == ENOENT
+   && directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, FALSE))
+  fd = Uopen(fname, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, EXIMDB_MODE);
+priv_restore();
+return fd;
+}
+
+/* Lock the journal: shared for appending to it, exclusive for applying it */
+
+static BOOL
+qindex_journal_lock(int fd, short type)
+{
+flock_t lock_data = {.l_type = type, .l_whence = SEEK_SET};
+int rc;
+
+sigalrm_seen = FALSE;
+ALARM(EXIMDB_LOCK_TIMEOUT);
+rc = fcntl(fd, F_SETLKW, &lock_data);
+ALARM_CLR(0);
+return rc == 0;
+}
+
+
+/* Add a message to, or remove one from, the index for a queue. This is done
+through the journal; if that cannot be written, the database is updated
+directly. When the message is the current one, its priority and time of
+arrival go into the entry. Failures there are logged by the hints DB code; the index is then out
+of date until the next rebuild.
+
+Arguments:
+  qname		queue name, or empty for the default queue
+  id		message id
+  subdir	spool subdirectory, or empty
+  add		TRUE to add, FALSE to remove
+*/
+
+void
+queue_index_update(const uschar * qname, const uschar * id,
+  const uschar * subdir, BOOL add)
+{
+open_db dbblock, * dbm;
+rmark reset_point;
+const uschar * key;
+gstring * g;
+int fd;
+BOOL current;
+
+if (!queue_index) return;
+reset_point = store_mark();
+key = qindex_key(id, subdir);
+current = add && Ustrcmp(id, message_id) == 0;
+g = current
+  ? string_fmt_append(NULL, "+%s %d %ld\n", key,
+		      message_priority, (long)received_time.tv_sec)
+  : string_fmt_append(NULL, "%c%s\n", add ? '+' : '-', key);
+
+if ((fd = qindex_journal_open(qname)) >= 0)
+  {
+  BOOL done = qindex_journal_lock(fd, F_RDLCK)
+	      && write(fd, g->s, g->ptr) == g->ptr;
+  (void) close(fd);
+  if (done) { store_reset(reset_point); return; }
+  }
+
+if ((dbm = dbfn_open(qindex_dbname(qname), O_RDWR|O_CREAT, &dbblock,
+		      TRUE, TRUE)))
+  {
+  if (current)
+    {
+    dbdata_qindex rec = {.priority = message_priority,
+			 .received = received_time.tv_sec};
+    (void) dbfn_write(dbm, key, &rec, sizeof(rec));
+    }
+  else if (add)
+    {
+    dbdata_generic rec;
+    (void) dbfn_write(dbm, key, &rec, sizeof(rec));
+    }
+  else
+    (void) dbfn_delete(dbm, key);
+  dbfn_close(dbm);
+  }
+store_reset(reset_point);
+}
+
+
+/* Apply the journal for the current queue to its index, and empty it.
+
+Returns:  FALSE if the journal could not be read, or the index written
+*/
+
+static BOOL
+qindex_journal_apply(void)
+{
+open_db dbblock, * dbm;
+struct stat statbuf;
+rmark reset_point;
+uschar * buf;
+int fd, got = 0;
+BOOL yield = FALSE;
+
+if ((fd = qindex_journal_open(queue_name)) < 0) return FALSE;
+if (!qindex_journal_lock(fd, F_WRLCK) || fstat(fd, &statbuf) != 0)
+  goto out;
+if (statbuf.st_size == 0)
+  { yield = TRUE; goto out; }
+
+reset_point = store_mark();
+buf = store_get(statbuf.st_size + 1, GET_UNTAINTED);
+while (got < statbuf.st_size)
+  {
+  int n = read(fd, buf + got, statbuf.st_size - got);
+  if (n <= 0) { if (n < 0 && errno == EINTR) continue; break; }
+  got += n;
+  }
+
+if (got == statbuf.st_size && (dbm = dbfn_open(qindex_dbname(queue_name),
+				      O_RDWR|O_CREAT, &dbblock, TRUE, TRUE)))
+  {
+  uschar * nl;
+
+  DEBUG(D_queue_run) debug_printf("applying queue index journal\n");
+  buf[got] = 0;
+  for (uschar * s = buf; (nl = Ustrchr(s, '\n')); s = nl + 1)
+    {
+    uschar * sp;
+
+    *nl = 0;
+    if (*s == '+')
+      if ((sp = Ustrchr(s, ' ')))
+	{
+	dbdata_qindex rec;
+	long received;
+
+	*sp = 0;
+	if (sscanf(CS sp + 1, "%d %ld", &rec.priority, &received) == 2)
+	  {
+	  rec.received = (time_t)received;
+	  (void) dbfn_write(dbm, s + 1, &rec, sizeof(rec));
+	  }
+	}
+      else
+	{
+	dbdata_generic rec;
+	(void) dbfn_write(dbm, s + 1, &rec, sizeof(rec));
+	}
+    else if (*s == '-')
+      (void) dbfn_delete(dbm, s + 1);
+    }
+  dbfn_close(dbm);
+  yield = ftruncate(fd, 0) == 0;
+  }
+store_reset(reset_point);
+
+out:
+  (void) close(fd);
+  return yield;
+}
+
+
+/* Tree walk callback for qindex_rebuild(): write an entry for a message found
+in the spool but not in the index. */
+
+static void
+qindex_add_missing(uschar * key, uschar * present, void * ctx)
+{
+dbdata_generic rec;
+if (!present) (void) dbfn_write((open_db *)ctx, key, &rec, sizeof(rec));
+}
+
+
+/* Rebuild the index for the current queue from a scan of the spool
+directories. Entries for messages not found are deleted, unless they were
+written after the scan started (their -H file may not have been in place when
+the directory was read).
+
+Returns:  TRUE if the index was rebuilt
+*/
+
+static BOOL
+qindex_rebuild(void)
+{
+open_db dbblock, * dbm;
+EXIM_CURSOR * cursor;
+tree_node * found = NULL;
+uschar subdirs[64];
+int subcount;
+time_t start = time(NULL);
+queue_filename * stale = NULL;
+rmark reset_point = store_mark();
+
+DEBUG(D_queue_run) debug_printf("rebuilding queue index\n");
+
+qindex_bypass = TRUE;
+for (queue_filename * fq = queue_get_spool_list(-1, subdirs, &subcount,
+						 TRUE, NULL);
+     fq; fq = fq->next)
+  {
+  uschar subdir[2] = { [0] = fq->dir_uschar, [1] = 0 };
+  const uschar * key = qindex_key(
+    string_copyn(fq->text, Ustrlen(fq->text) - 2), subdir);
+  tree_node * node = store_get(sizeof(tree_node) + Ustrlen(key), key);
+
+  Ustrcpy(node->name, key);
+  node->data.ptr = NULL;
+  (void) tree_insertnode(&found, node);
+  }
+qindex_bypass = FALSE;
+
+/* Entries from the journal are written now, after the scan started, so any
+for messages the scan missed are kept */
+
+if (  !qindex_journal_apply()
+   || !(dbm = dbfn_open(qindex_dbname(queue_name), O_RDWR|O_CREAT, &dbblock,
+		      TRUE, TRUE)))
+  {
+  store_reset(reset_point);
+  return FALSE;
+  }
+
+/* Mark the entries already present; remember the others */
+
+for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+     key = dbfn_scan(dbm, FALSE, &cursor))
+  {
+  tree_node * node;
+  if (Ustrcmp(key, QINDEX_BUILT) == 0) continue;
+  if ((node = tree_search(found, key)))
+    node->data.ptr = node;
+  else
+    {
+    int len = Ustrlen(key);
+    queue_filename * q = store_get(sizeof(queue_filename) + len, key);
+    memcpy(q->text, key, len + 1);
+    q->next = stale;
+    stale = q;
+    }
+  }
+
+for (queue_filename * q = stale; q; q = q->next)
+  {
+  dbdata_generic * rec = dbfn_read(dbm, q->text);
+  if (!rec || rec->time_stamp < start)
+    (void) dbfn_delete(dbm, q->text);
+  }
+
+tree_walk(found, qindex_add_missing, dbm);
+  {
+  dbdata_generic rec;
+  (void) dbfn_write(dbm, QINDEX_BUILT, &rec, sizeof(rec));
+  }
+dbfn_close(dbm);
+store_reset(reset_point);
+return TRUE;
+}
+
+
+/* Get the list of queue items from the index, rebuilding it first if
+necessary.
+
+Returns:  FALSE if the index could not be used; the caller then scans the
+          directories
+*/
+
+static BOOL
+qindex_list(spool_list_state * sl)
+{
+open_db dbblock, * dbm;
+EXIM_CURSOR * cursor;
+dbdata_generic * built;
+const uschar * dbname = qindex_dbname(queue_name);
 
+if (!qindex_journal_apply()) return FALSE;
+for (int pass = 0; ; pass++)
+  {
+  if (!(dbm = dbfn_open(dbname, O_RDONLY, &dbblock, FALSE, TRUE)))
+    {
+    if (errno != ENOENT || pass > 0 || !qindex_rebuild()) return FALSE;
+    continue;
+    }
+  if (  (built = dbfn_read(dbm, QINDEX_BUILT))
+     && time(NULL) - built->time_stamp < queue_index_rescan)
+    break;
+  dbfn_close(dbm);
+  if (pass > 0 || !qindex_rebuild()) return FALSE;
+  }
+
+for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+     key = dbfn_scan(dbm, FALSE, &cursor))
+  {
+  const uschar * slash = Ustrchr(key, '/');
+  int len = slash ? slash - key : Ustrlen(key);
+  uschar name[MESSAGE_ID_LENGTH + 3];
+  queue_filename * fq;
+  dbdata_qindex * rec;
+  int rlen;
+
+  if (len != MESSAGE_ID_LENGTH && len != MESSAGE_ID_LENGTH_OLD) continue;
+  memcpy(name, key, len);
+  memcpy(name + len, "-H", 2);
+  if (  (fq = spool_list_add(sl, name, len + 2, slash ? slash[1] : 0))
+     && queue_run_by_priority
+     && (rec = dbfn_read_with_length(dbm, key, &rlen))
+     && rlen == sizeof(dbdata_qindex))
+    {
+    fq->priority = rec->priority;
+    fq->received = rec->received;
+    }
+  }
+dbfn_close(dbm);
+return TRUE;
+}
+
+
+
+
+
+/*************************************************
+*      Reorder a queue list by priority          *
+*************************************************/
+
+/* When queue_run_by_priority is set, the list of messages for a queue run is
+sorted so that those with the highest priority come first. The priority is the
+value set by the ACL "priority" modifier when the message was received, plus
+one for each queue_priority_aging interval it has been on the queue, so that
+messages with a low priority are not passed over indefinitely, and those nearest
+to timing out of their retry rules move up. Messages of equal priority keep
+their order.
+
+The priority and the time of arrival come from the queue index when it has them.
+Otherwise they are read from near the start of the -H file, so only its first
+few lines are read.
+
+Argument:  the list of -H file names
+Returns:   the sorted list
+*/
+
+typedef struct {
+  queue_filename *	fq;
+  int			priority;
+  int			seq;
+} qprio;
+
+static int
+qprio_compare(const void * a, const void * b)
+{
+const qprio * pa = a, * pb = b;
+return pa->priority != pb->priority
+  ? (pa->priority > pb->priority ? -1 : 1) : pa->seq - pb->seq;
+}
+
+static int
+queue_msg_priority(const queue_filename * fq, time_t now)
+{
+uschar subdir[2] = {fq->dir_uschar, 0}, buffer[256];
+int priority = 0;
+time_t received = 0;
+FILE * fp;
+
+if (fq->received > 0)
+  {
+  priority = fq->priority;
+  received = fq->received;
+  goto aging;
+  }
+
+if (!(fp = Ufopen(spool_fname(US"input", subdir, fq->text, US""), "rb")))
+  return 0;
+
+/* Lines 1-3 are the name, the originator and the sender. The fourth holds the
+time of arrival; priority follows the received_time lines, if it is set. */
+
+for (int line = 1; Ufgets(buffer, sizeof(buffer), fp); line++)
+  if (line == 4)
+    received = Uatoi(buffer);
+  else if (line > 4)
+    {
+    if (Ustrncmp(buffer, "-priority ", 10) == 0)
+      priority = Uatoi(buffer + 10);
+    else if (Ustrncmp(buffer, "-received_time", 14) == 0)
+      continue;
+    break;
+    }
+(void)fclose(fp);
+
+aging:
+if (queue_priority_aging > 0 && received > 0 && now > received)
+  priority += (now - received) / queue_priority_aging;
+return priority;
+}
+
+static queue_filename *
+queue_order_by_priority(queue_filename * list)
+{
+qprio * arr;
+int count = 0;
+time_t now = time(NULL);
+queue_filename * yield = NULL;
+
+for (queue_filename * fq = list; fq; fq = fq->next) count++;
+if (count < 2) return list;
+
+arr = store_get(count * sizeof(qprio), GET_UNTAINTED);
+count = 0;
+for (queue_filename * fq = list; fq; fq = fq->next, count++)
+  {
+  arr[count].fq = fq;
+  arr[count].priority = queue_msg_priority(fq, now);
+  arr[count].seq = count;
+  }
+qsort(arr, count, sizeof(qprio), qprio_compare);
+
+for (int i = count - 1; i >= 0; i--)
+  {
+  arr[i].fq->next = yield;
+  yield = arr[i].fq;
+  }
+
+DEBUG(D_queue_run)
+  debug_printf("queue_run_by_priority: %d messages, priorities %d to %d\n",
+    count, arr[0].priority, arr[count-1].priority);
 return yield;
 }
 
 
 
 
+
+/*************************************************
+*      Reorder a queue list by destination       *
+*************************************************/
+
+/* When queue_run_by_host is set, the list of messages for a queue run is
+rearranged so that messages waiting for the same host are adjacent. The
+grouping comes from the wait-<transport> hints databases, which the smtp
+transport fills in when it defers messages, or routes them in the first phase
+of a two-phase run. Delivering the messages for one host together means each
+delivery process finds the others still waiting, and passes them down the
+same connection, rather than a later one having to open a new connection after
+the continuation chain has been broken (for example by connection_max_messages).
+
+Each group of messages for a host is placed where the first of them was in the
+list, so the order given by queue_run_by_priority (or by id, or random) still
+decides which host is served first. Messages that are not in any wait database
+keep their places.
+
+Argument:  the list of -H file names
+Returns:   the reordered list
+*/
+
+static queue_filename *
+queue_order_by_host(queue_filename * list)
+{
+tree_node * tree = NULL, * hosts = NULL;
+queue_filename ** orig, * yield = NULL, ** tail = &yield;
+int * group, * group_next, * group_head, * group_tail;
+int count = 0, ngroups = 0, grouped = 0;
+
+for (queue_filename * fq = list; fq; fq = fq->next) count++;
+if (count < 2) return list;
+
+/* Remember the original order, and index the messages by id */
+
+orig = store_get(count * sizeof(queue_filename *), GET_UNTAINTED);
+group = store_get(4 * count * sizeof(int), GET_UNTAINTED);
+group_next = group + count;
+group_head = group_next + count;
+group_tail = group_head + count;
+
+count = 0;
+for (queue_filename * fq = list; fq; fq = fq->next)
+  {
+  int len = Ustrlen(fq->text) - 2;
+  tree_node * node = store_get(sizeof(tree_node) + len, fq->text);
+
+  memcpy(node->name, fq->text, len);
+  node->name[len] = 0;
+  node->data.val = count;
+  if (tree_insertnode(&tree, node))
+    {
+    orig[count] = fq;
+    group[count++] = -1;
+    }
+  }
+
+/* Assign each message found in a wait database to the group for its host.
+Continuation records ("host:n") belong to the same group as the main record. */
+
+for (transport_instance * t = transports; t; t = t->drinst.next)
+  {
+  open_db dbblock, * dbm;
+  EXIM_CURSOR * cursor;
+  string_item * keys = NULL, ** ktail = &keys;
+
+  if (!(dbm = dbfn_open(string_sprintf("wait-%.200s", t->drinst.name),
+			O_RDONLY, &dbblock, FALSE, TRUE)))
+    continue;
+
+  /* Collect the keys before reading any records, as not every DB backend
+  copes with reads while a scan is in progress. */
+
+  for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+       key = dbfn_scan(dbm, FALSE, &cursor))
+    {
+    string_item * s = store_get(sizeof(string_item), GET_UNTAINTED);
+    s->text = string_copy(key);
+    s->next = NULL;
+    *ktail = s;
+    ktail = &s->next;
+    }
+
+  for (string_item * s = keys; s; s = s->next)
+    {
+    dbdata_wait * rec = dbfn_read(dbm, s->text);
+    uschar * colon = Ustrrchr(s->text, ':');
+    tree_node * hnode;
+    int g;
+
+    if (!rec || rec->count <= 0 || rec->count > WAIT_NAME_MAX) continue;
+
+    if (colon && colon[1] && Ustrspn(colon + 1, "0123456789") == Ustrlen(colon + 1))
+      *colon = 0;
+    if ((hnode = tree_search(hosts, s->text)))
+      g = hnode->data.val;
+    else
+      {
+      int len = Ustrlen(s->text);
+      hnode = store_get(sizeof(tree_node) + len, s->text);
+      memcpy(hnode->name, s->text, len + 1);
+      hnode->data.val = g = ngroups;
+      if (!tree_insertnode(&hosts, hnode)) continue;
+      ngroups++;
+      }
+
+    for (int i = 0; i < rec->count; i++)
+      {
+      uschar id[MESSAGE_ID_LENGTH + 1];
+      tree_node * node;
+
+      Ustrncpy_nt(id, rec->text + i * MESSAGE_ID_LENGTH, MESSAGE_ID_LENGTH);
+      id[MESSAGE_ID_LENGTH] = 0;
+      if ((node = tree_search(tree, id)) && group[node->data.val] < 0)
+	{
+	group[node->data.val] = g;
+	grouped++;
+	}
+      }
+    }
+  dbfn_close(dbm);
+  }
+
+/* Chain the members of each group in list order */
+
+for (int g = 0; g < ngroups; g++) group_head[g] = -1;
+for (int i = 0; i < count; i++)
+  {
+  int g = group[i];
+  group_next[i] = -1;
+  if (g < 0) continue;
+  if (group_head[g] < 0) group_head[g] = i;
+  else group_next[group_tail[g]] = i;
+  group_tail[g] = i;
+  }
+
+/* Rebuild the list. An ungrouped message stays where it was; the first
+member of a group brings the rest of the group with it. */
+
+for (int i = 0; i < count; i++)
+  {
+  int g = group[i];
+
+  if (g < 0)
+    {
+    *tail = orig[i];
+    tail = &orig[i]->next;
+    }
+  else if (group_head[g] == i)
+    for (int j = i; j >= 0; j = group_next[j])
+      {
+      *tail = orig[j];
+      tail = &orig[j]->next;
+      }
+  }
+*tail = NULL;
+
+DEBUG(D_queue_run)
+  debug_printf("queue_run_by_host: %d of %d messages grouped for %d hosts\n",
+    grouped, count, ngroups);
+return yield;
+}
+
+
+
+
+
+/*************************************************
+*          Shared queue runs                     *
+*************************************************/
+
+/* When queue_run_shards is set, the queue is divided into that many shards by
+the character of the message id that selects the split-spool subdirectory, so
+that with split_spool_directory each shard is a set of whole subdirectories. A
+queue runner claims the first free shard by locking a file in the hints
+database directory; the lock goes when the process ends. It works through the
+messages of its own shard first, and then the rest of the queue, so that
+concurrent runners start on different parts of the queue but a single runner
+still does all of it. A runner that finds every shard claimed runs the queue in
+the usual way.
+
+Before forking a delivery process, the runner checks whether the message is
+locked by another process, which saves a fork for a message that another
+runner is already delivering. The number of such messages is reported on the
+"End queue run" log line. */
+
+static int queue_shard = -1;
+static unsigned qrun_started = 0, qrun_locked = 0;
+
+static void
+queue_shard_claim(void)
+{
+for (int n = 0; n < queue_run_shards; n++)
+  {
+  uschar * fname = string_sprintf("%s/db/qshard%s%s.%d", spool_directory,
+			  *queue_name ? "-" : "", queue_name, n);
+  flock_t lock_data = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  int fd;
+
+  priv_drop_temp(exim_uid, exim_gid);
+  if ((fd = Uopen(fname, EXIM_CLOEXEC | O_RDWR, EXIMDB_LOCKFILE_MODE)) < 0)
+    {
+    (void) directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, FALSE);
+    fd = Uopen(fname, EXIM_CLOEXEC | O_RDWR | O_CREAT, EXIMDB_LOCKFILE_MODE);
+    }
+  priv_restore();
+
+  if (fd < 0)
+    {
+    DEBUG(D_queue_run) debug_printf("%s: %s\n", fname, strerror(errno));
+    return;
+    }
+  if (fcntl(fd, F_SETLK, &lock_data) == 0)
+    {
+    queue_shard = n;		/* keep the fd, and with it the lock */
+    DEBUG(D_queue_run)
+      debug_printf("claimed queue shard %d of %d\n", n, queue_run_shards);
+    return;
+    }
+  (void) close(fd);
+  }
+DEBUG(D_queue_run) debug_printf("all %d queue shards claimed\n",
+  queue_run_shards);
+}
+
+/* Return the shard for a message id or spool subdirectory character */
+
+static inline int
+queue_shard_of(int c)
+{
+const uschar * p = Ustrchr(base62_chars, c);
+return p ? (p - base62_chars) % queue_run_shards : 0;
+}
+
+/* Return TRUE if another process holds the lock on a message */
+
+static BOOL
+queue_msg_locked(const uschar * id)
+{
+flock_t lock_data = {.l_type = F_WRLCK, .l_whence = SEEK_SET,
+		     .l_len = spool_data_start_offset(id)};
+int fd = Uopen(spool_fname(US"input", message_subdir, id, US"-D"),
+		EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDONLY, 0);
+BOOL yield = FALSE;
+
+if (fd >= 0)
+  {
+  if (fcntl(fd, F_GETLK, &lock_data) == 0 && lock_data.l_type != F_UNLCK)
+    yield = TRUE;
+  (void) close(fd);
+  }
+return yield;
+}
+
+
+
+
+
 /*************************************************
 *              Perform a queue run               *
 *************************************************/
@@ -363,6 +1155,7 @@ int subcount = 0;
 uschar subdirs[64];
 pid_t qpid[4] = {0};	/* Parallelism factor for q2stage 1st phase */
 BOOL single_id = FALSE, msg_handled = FALSE;
+int shard_pass = -1;	/* 0: own shard; 1: the rest; -1: not sharded */
 
 #ifdef MEASURE_TIMING
 report_time_since(&timestamp_startup, US"queue_run start");
@@ -429,7 +1222,12 @@ if (!recurse)
 
   single_id = start_id && stop_id && !q->queue_2stage
 	      && Ustrcmp(start_id, stop_id) == 0;
+
+  qrun_started = qrun_locked = 0;
+  if (queue_run_shards > 1 && !start_id && !stop_id)
+    queue_shard_claim();
   }
+if (queue_shard >= 0) shard_pass = 0;
 
 /* If deliver_selectstring is a regex, compile it. */
 
@@ -462,13 +1260,21 @@ then randomized after the first time through, before they are scanned in
 subsequent iterations.
 
 When the first argument of queue_get_spool_list() is -1 (for queue_run_in_
-order), it scans all directories and makes a single message list. */
+order), it scans all directories and makes a single message list.
 
+A sharded run goes round twice: first for its own shard, then for the rest. */
+
+shard_pass_start:
 for (int i = queue_run_in_order ? -1 : 0;
      i <= (queue_run_in_order ? -1 : subcount);
      i++)
   {
-  rmark reset_point1 = store_mark();
+  rmark reset_point1;
+
+  if (  shard_pass >= 0 && i > 0
+     && (queue_shard_of(subdirs[i]) == queue_shard) != (shard_pass == 0))
+    continue;
+  reset_point1 = store_mark();
 
   DEBUG(D_queue_run)
     {
@@ -480,9 +1286,19 @@ for (int i = queue_run_in_order ? -1 : 0;
       debug_printf("queue running subdirectory '%c'\n", subdirs[i]);
     }
 
-  for (queue_filename * fq = queue_get_spool_list(i, subdirs, &subcount,
+  queue_filename * fq_list = queue_get_spool_list(i, subdirs, &subcount,
 					     !queue_run_in_order, NULL);
-       fq; fq = fq->next)
+
+  /* Put the most urgent messages first, and group the messages by
+  destination host. The grouping is not done for the first phase of a
+  two-phase run, which is what records the destinations. */
+
+  if (queue_run_by_priority)
+    fq_list = queue_order_by_priority(fq_list);
+  if (queue_run_by_host && !q->queue_2stage)
+    fq_list = queue_order_by_host(fq_list);
+
+  for (queue_filename * fq = fq_list; fq; fq = fq->next)
     {
     pid_t pid;
     int status;
@@ -501,6 +1317,7 @@ for (int i = queue_run_in_order ? -1 : 0;
           (double)load_average/1000.0,
           (double)deliver_queue_load_max/1000.0);
         i = subcount;                 /* Don't process other directories */
+	shard_pass = -1;	      /* or the rest of the shards */
         break;
         }
       else
@@ -508,6 +1325,14 @@ for (int i = queue_run_in_order ? -1 : 0;
           (double)load_average/1000.0,
           (double)deliver_queue_load_max/1000.0);
 
+    /* Leave messages in other shards for the second pass, and ones in our
+    own shard out of it */
+
+    if (  shard_pass >= 0
+       && (queue_shard_of(fq->text[MESSAGE_ID_TIME_LEN-1]) == queue_shard)
+	  != (shard_pass == 0))
+      continue;
+
     /* If initial of a 2-phase run (and not under the test-harness)
     maintain a set of child procs to get disk parallelism */
 
@@ -552,7 +1377,12 @@ for (int i = queue_run_in_order ? -1 : 0;
 
     message_subdir[0] = fq->dir_uschar;
     if (Ustat(spool_fname(US"input", message_subdir, fq->text, US""), &statbuf) < 0)
+      {
+      if (queue_index && errno == ENOENT)
+	queue_index_update(queue_name,
+	  string_copyn(fq->text, Ustrlen(fq->text) - 2), message_subdir, FALSE);
       goto go_around;
+      }
 
     /* There are some tests that require the reading of the header file. Ensure
     the store used is scavenged afterwards so that this process doesn't keep
@@ -647,6 +1477,21 @@ for (int i = queue_run_in_order ? -1 : 0;
       if (!wanted) goto go_around;      /* With next message */
       }
 
+    /* When runners share the queue, skip a message that one of the others is
+    delivering, rather than forking a process to find that out. */
+
+    if (queue_run_shards > 1)
+      {
+      uschar * id = string_copyn(fq->text, Ustrlen(fq->text) - 2);
+      if (queue_msg_locked(id))
+	{
+	DEBUG(D_queue_run) debug_printf("%s: locked by another process\n", id);
+	qrun_locked++;
+	goto go_around;
+	}
+      qrun_started++;
+      }
+
     /* OK, got a message we want to deliver. Create a pipe which will
     serve as a means of detecting when all the processes created by the
     delivery process are finished. This is relevant when the delivery
@@ -799,6 +1644,14 @@ single_item_retry:
       }
   }                                    /* End loop for multiple directories */
 
+if (shard_pass == 0)
+  {
+  DEBUG(D_queue_run) debug_printf("queue shard %d done; running the rest\n",
+    queue_shard);
+  shard_pass = 1;
+  goto shard_pass_start;
+  }
+
 /* If queue_2stage is true, we do it all again, with the 2stage flag
 turned off. */
 
@@ -831,6 +1684,9 @@ if (q->queue_2stage)
 
 if (!recurse)
   {
+  if (queue_run_shards > 1)
+    log_detail = string_sprintf("%s shard=%d/%d started=%u locked=%u",
+      log_detail, queue_shard, queue_run_shards, qrun_started, qrun_locked);
   if (q->name)
     log_write(L_queue_run, LOG_MAIN, "End '%s' queue run: %s",
       q->name, log_detail);
@@ -1040,6 +1896,7 @@ if (count > 0)
       store_get(sizeof(queue_filename) + Ustrlen(list[i]) + 2, list[i]);
     sprintf(CS next->text, "%s-H", list[i]);
     next->dir_uschar = '*';
+    next->received = 0;
     next->next = NULL;
     if (i == 0) qf = next; else last->next = next;
     last = next;
@@ -1455,6 +2312,7 @@ switch(action)
 	  DEBUG(D_any) debug_printf(" (done)\n");
 	  }
 	}
+      queue_index_update(queue_name, id, message_subdir, FALSE);
       }
 
     /* In the common case, the datafile is open (and locked), so give the
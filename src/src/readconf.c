@@ -98,11 +98,21 @@ static optionlist optionlist_config[] = {
   { "check_spool_space",        opt_Kint,        {&check_spool_space} },
   { "chunking_advertise_hosts", opt_stringptr,	 {&chunking_advertise_hosts} },
   { "commandline_checks_require_admin", opt_bool,{&commandline_checks_require_admin} },
+  { "config_profile_file",      opt_stringptr,   {&config_profile_file} },
+  { "daemon_accept_batch",      opt_int,         {&daemon_accept_batch} },
+  { "daemon_acceptors",         opt_int,         {&daemon_acceptors} },
+  { "daemon_fork_server",       opt_bool,        {&daemon_fork_server} },
+  { "daemon_lookup_proxy",      opt_stringptr,   {&daemon_lookup_proxy} },
+  { "daemon_lookup_proxy_connections", opt_int,  {&daemon_lookup_proxy_connections} },
+  { "daemon_lookup_proxy_timeout", opt_time,     {&daemon_lookup_proxy_timeout} },
   { "daemon_modules_load",	opt_stringptr,   {&daemon_modules_load} },
   { "daemon_smtp_port",         opt_stringptr|opt_hidden, {&daemon_smtp_port} },
   { "daemon_smtp_ports",        opt_stringptr,   {&daemon_smtp_port} },
+  { "daemon_smtp_worker_sessions", opt_int,      {&daemon_smtp_worker_sessions} },
+  { "daemon_smtp_workers",      opt_int,         {&daemon_smtp_workers} },
   { "daemon_startup_retries",   opt_int,         {&daemon_startup_retries} },
   { "daemon_startup_sleep",     opt_time,        {&daemon_startup_sleep} },
+  { "daemon_sync_server",       opt_bool,        {&daemon_sync_server} },
 #ifdef EXPERIMENTAL_DCC
   { "dcc_direct_add_header",    opt_bool,        {&dcc_direct_add_header} },
   { "dccifd_address",           opt_stringptr,   {&dccifd_address} },
@@ -219,6 +229,10 @@ static optionlist optionlist_config[] = {
   { "log_ports",		opt_stringptr,	 {&log_ports} },
   { "log_selector",             opt_stringptr,   {&log_selector_string} },
   { "log_timezone",             opt_bool,        {&log_timezone} },
+  { "lookup_cache_shared",      opt_mkint,       {&lookup_cache_shared} },
+  { "lookup_cache_shared_ttl",  opt_time,        {&lookup_cache_shared_ttl} },
+  { "lookup_cache_size",        opt_mkint,       {&lookup_cache_size} },
+  { "lookup_cache_ttl",         opt_time,        {&lookup_cache_ttl} },
   { "lookup_open_max",          opt_int,         {&lookup_open_max} },
   { "max_username_length",      opt_int,         {&max_username_length} },
   { "message_body_newlines",    opt_bool,        {&message_body_newlines} },
@@ -275,14 +289,20 @@ static optionlist optionlist_config[] = {
 #ifndef DISABLE_QUEUE_RAMP
   { "queue_fast_ramp",          opt_bool,        {&queue_fast_ramp} },
 #endif
+  { "queue_index",              opt_bool,        {&queue_index} },
+  { "queue_index_rescan",       opt_time,        {&queue_index_rescan} },
   { "queue_list_requires_admin",opt_bool,        {&queue_list_requires_admin} },
   { "queue_only",               opt_bool,        {&queue_only} },
   { "queue_only_file",          opt_stringptr,   {&queue_only_file} },
   { "queue_only_load",          opt_fixed,       {&queue_only_load} },
   { "queue_only_load_latch",    opt_bool,        {&queue_only_load_latch} },
   { "queue_only_override",      opt_bool,        {&queue_only_override} },
+  { "queue_priority_aging",     opt_time,        {&queue_priority_aging} },
+  { "queue_run_by_host",        opt_bool,        {&queue_run_by_host} },
+  { "queue_run_by_priority",    opt_bool,        {&queue_run_by_priority} },
   { "queue_run_in_order",       opt_bool,        {&queue_run_in_order} },
   { "queue_run_max",            opt_stringptr,   {&queue_run_max} },
+  { "queue_run_shards",         opt_int,         {&queue_run_shards} },
   { "queue_smtp_domains",       opt_stringptr,   {&queue_smtp_domains} },
   { "receive_timeout",          opt_time,        {&receive_timeout} },
   { "received_header_text",     opt_stringptr,   {&received_header_text} },
@@ -293,6 +313,7 @@ static optionlist optionlist_config[] = {
 #ifdef LOOKUP_REDIS
   { "redis_servers",            opt_lookup_module, {US"redis"} },
 #endif
+  { "regex_cache_stats",        opt_bool,        {&regex_cache_stats} },
   { "remote_max_parallel",      opt_int,         {&remote_max_parallel} },
   { "remote_sort_domains",      opt_stringptr,   {&remote_sort_domains} },
   { "retry_data_expire",        opt_time,        {&retry_data_expire} },
@@ -517,6 +538,10 @@ for (bit_table * bp = log_options; bp < log_options + log_options_count; bp++)
 
 #else	/*!MACRO_PREDEF*/
 
+#ifdef CONFIGURE_CACHE_DIRECTORY
+# include <sys/mman.h>
+#endif
+
 extern char **environ;
 
 static void save_config_line(const uschar* line);
@@ -537,6 +562,9 @@ typedef struct config_file_item {
   const uschar *directory;
   FILE *file;
   int lineno;
+#ifdef CONFIGURE_CACHE_DIRECTORY
+  int cache_file;
+#endif
 } config_file_item;
 
 /* Structure for chain of configuration lines (-bP config) */
@@ -770,6 +798,371 @@ return name ? name : US"";
 
 
 
+#ifdef CONFIGURE_CACHE_DIRECTORY
+/*************************************************
+*     Cache of preprocessed configuration        *
+*************************************************/
+
+/* For a large configuration most of the cost of reading it is in the
+preprocessing: every physical line is scanned for every defined macro, each
+new macro name is checked against all the earlier ones, and .include and .ifdef
+have to be followed. The logical lines that come out depend only on the files
+read, the command-line macros and the binary, so a root process that has read
+the whole configuration successfully saves them in a file in
+CONFIGURE_CACHE_DIRECTORY, and later processes map that file and replay the
+lines instead, without repeating the macro checks. The parsed structures are not cached; they are built
+of pointers, including ones into the (position-independent) binary, and would
+not survive into another process.
+
+The file is named by the MD5 of the configuration file path. Its header holds
+an MD5 over the binary version, the path and content of the main configuration
+file, and any -D macros. Then come records for every other file the
+preprocessor looked at (a missing .include_if_exists target included), which
+must still match stat() for the cache to be used, and then the logical lines,
+each with the file and line number it ended on. Every variable-length record is
+zero-terminated and padded to a multiple of 8 bytes.
+
+The modification and change times are compared to the nanosecond where the
+system records that. On a filesystem whose times are coarser, a file rewritten
+with the same size in the same tick as the previous version would not be seen
+to have changed, so no cache is written while any of the files has a change
+time no earlier than the current second. */
+
+#define CFCACHE_MAGIC	"EximCfC2"
+
+typedef struct {
+  uschar	magic[8];
+  uschar	key[16];
+  uint32_t	nfiles;
+  uint32_t	nlines;
+} cfcache_header;
+
+typedef struct {
+  int64_t	size;
+  int64_t	ino;
+  int64_t	dev;
+  int64_t	mtime;
+  int64_t	ctime;
+  int64_t	mtime_ns;
+  int64_t	ctime_ns;
+  uint32_t	exists;
+  uint32_t	namelen;
+} cfcache_file;
+
+typedef struct {
+  uint32_t	file;
+  uint32_t	lineno;
+  uint32_t	len;
+  uint32_t	spare;
+} cfcache_line;
+
+static uschar *	cfcache_path = NULL;		/* Non-NULL when caching */
+static uschar	cfcache_key[16];
+static uint32_t	cfcache_nfiles, cfcache_nlines;
+
+static const uschar *	cfcache_map = NULL;	/* Replaying */
+static size_t		cfcache_mapsize;
+static const uschar *	cfcache_next;
+static const uschar **	cfcache_names;
+
+static gstring *	cfcache_files = NULL;	/* Recording */
+static gstring *	cfcache_lines = NULL;
+static int		cfcache_cur_file;
+static time_t		cfcache_newest = 0;	/* latest change time */
+
+
+/* Size of a record plus its padded string */
+
+#define CFCACHE_RECSIZE(rec, len) (sizeof(rec) + ((len) & ~7) + 8)
+
+static gstring *
+cfcache_cat(gstring * g, const void * rec, int reclen, const uschar * s,
+  int len)
+{
+static const uschar zeros[8] = {0};
+int old_pool = store_pool;
+
+store_pool = POOL_PERM;
+g = string_catn(g, CUS rec, reclen);
+g = string_catn(g, s, len);
+g = string_catn(g, zeros, 8 - (len & 7));
+store_pool = old_pool;
+return g;
+}
+
+static void
+cfcache_set_stat(cfcache_file * cf, const struct stat * sb)
+{
+memset(cf, 0, sizeof(*cf));
+if (!sb) return;
+cf->exists = 1;
+cf->size = (int64_t)sb->st_size;
+cf->ino = (int64_t)sb->st_ino;
+cf->dev = (int64_t)sb->st_dev;
+cf->mtime = (int64_t)sb->st_mtime;
+cf->ctime = (int64_t)sb->st_ctime;
+#ifdef EXIM_HAVE_FUTIMENS
+cf->mtime_ns = (int64_t)sb->st_mtim.tv_nsec;
+cf->ctime_ns = (int64_t)sb->st_ctim.tv_nsec;
+#endif
+}
+
+
+/* Record a file seen by the preprocessor. Returns its index, for tagging
+lines. A NULL stat pointer records a file that did not exist. */
+
+static int
+cfcache_record_file(const uschar * name, const struct stat * sb)
+{
+cfcache_file cf;
+
+cfcache_set_stat(&cf, sb);
+if (sb && sb->st_ctime > cfcache_newest) cfcache_newest = sb->st_ctime;
+cf.namelen = Ustrlen(name);
+cfcache_files = cfcache_cat(cfcache_files, &cf, sizeof(cf), name, cf.namelen);
+return cfcache_nfiles++;
+}
+
+static void
+cfcache_record_line(const uschar * s, int len)
+{
+cfcache_line cl = {.file = cfcache_cur_file, .lineno = config_lineno,
+		   .len = len};
+
+cfcache_lines = cfcache_cat(cfcache_lines, &cl, sizeof(cl), s, len);
+cfcache_nlines++;
+}
+
+
+/* Called once the main configuration file is open and has passed its checks.
+Compute the cache key and either map a valid cache file, so that
+get_config_line() replays from it, or arrange to record the lines read so that
+a cache can be written at the end of readconf_rest().
+
+Arguments:
+  sb		stat of the open main configuration file
+*/
+
+static void
+cfcache_open(const struct stat * sb)
+{
+md5 base;
+gstring * g;
+uschar digest[16], name[33];
+int fd;
+struct stat cst;
+const cfcache_header * h;
+const uschar * p, * end;
+void * map;
+rmark reset_point = store_mark();
+
+if (sb->st_size > 16 * 1024 * 1024) return;
+
+/* The cache file name comes from the full configuration path */
+
+g = string_fmt_append(NULL, "%s/%s", config_main_directory,
+  Ustrrchr(config_main_filename, '/')
+  ? Ustrrchr(config_main_filename, '/') + 1 : config_main_filename);
+md5_start(&base);
+md5_end(&base, g->s, g->ptr, digest);
+for (int i = 0; i < 16; i++) sprintf(CS name + 2*i, "%02x", digest[i]);
+
+/* The key covers the binary, the main file path and content, and the
+command-line macros */
+
+g = string_fmt_append(g, "\n%s\n%s\n%s\n", version_string, version_cnumber,
+  version_date);
+for (const macro_item * m = macros_user; m; m = m->next)
+  if (m->command_line)
+    g = string_fmt_append(g, "-D%s=%s\n", m->name, m->replacement);
+  {
+  uschar * buf = store_get((int)sb->st_size + 1, GET_UNTAINTED);
+  size_t n = fread(buf, 1, (size_t)sb->st_size + 1, config_file);
+  BOOL ok = !ferror(config_file) && n == (size_t)sb->st_size;
+
+  if (fseek(config_file, 0, SEEK_SET) != 0 || !ok)
+    { store_reset(reset_point); return; }
+  g = string_catn(g, buf, n);
+  }
+md5_start(&base);
+md5_end(&base, g->s, g->ptr, cfcache_key);
+store_reset(reset_point);
+cfcache_path = string_sprintf("%s/%s", CONFIGURE_CACHE_DIRECTORY, name);
+
+/* Look for a usable cache file. It must have been written by root, and be
+writeable by nobody else. */
+
+if ((fd = Uopen(cfcache_path, O_RDONLY, 0)) < 0)
+  goto RECORD;
+if (  fstat(fd, &cst) != 0
+   || !S_ISREG(cst.st_mode) || cst.st_uid != root_uid
+   || (cst.st_mode & 022) != 0
+   || cst.st_size < sizeof(cfcache_header)
+   || (map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+       == MAP_FAILED)
+  {
+  (void)close(fd);
+  goto RECORD;
+  }
+(void)close(fd);
+
+h = map;
+p = US map + sizeof(cfcache_header);
+end = US map + cst.st_size;
+if (  memcmp(h->magic, CFCACHE_MAGIC, sizeof(h->magic)) != 0
+   || memcmp(h->key, cfcache_key, sizeof(cfcache_key)) != 0
+   || h->nfiles == 0 || h->nfiles > cst.st_size / sizeof(cfcache_file))
+  goto UNMAP;
+
+/* Check the other files are as they were. The first is the main file. */
+
+cfcache_names = store_get(h->nfiles * sizeof(uschar *), GET_UNTAINTED);
+for (uint32_t i = 0; i < h->nfiles; i++)
+  {
+  const cfcache_file * cf = (const cfcache_file *)p;
+  cfcache_file now;
+  struct stat fst;
+
+  if (  p + sizeof(cfcache_file) > end
+     || p + CFCACHE_RECSIZE(cfcache_file, cf->namelen) > end)
+    goto UNMAP;
+  p += sizeof(cfcache_file);
+  if (i == 0)
+    {
+    cfcache_set_stat(&now, sb);
+    cfcache_names[0] = config_main_filename;
+    }
+  else
+    {
+    cfcache_set_stat(&now, Ustat(p, &fst) == 0 ? &fst : NULL);
+    cfcache_names[i] = string_copyn(p, cf->namelen);
+    }
+  if (  now.exists != cf->exists || now.size != cf->size
+     || now.ino != cf->ino || now.dev != cf->dev
+     || now.mtime != cf->mtime || now.ctime != cf->ctime
+     || now.mtime_ns != cf->mtime_ns || now.ctime_ns != cf->ctime_ns)
+    {
+    DEBUG(D_any) debug_printf("config cache %s: %s has changed\n",
+      cfcache_path, cfcache_names[i]);
+    goto UNMAP;
+    }
+  p += (cf->namelen & ~7) + 8;
+  }
+
+DEBUG(D_any) debug_printf("using config cache %s\n", cfcache_path);
+cfcache_map = map;
+cfcache_mapsize = cst.st_size;
+cfcache_next = p;
+cfcache_nfiles = h->nfiles;
+cfcache_nlines = h->nlines;
+return;
+
+UNMAP:
+  (void)munmap(map, cst.st_size);
+RECORD:
+  cfcache_cur_file = cfcache_record_file(config_main_filename, sb);
+}
+
+
+/* Replay one logical line from a mapped cache into big_buffer, setting the
+position variables for error messages.
+
+Returns: the length of the line, or -1 at the end of the configuration
+*/
+
+static int
+cfcache_get_line(void)
+{
+const cfcache_line * cl = (const cfcache_line *)cfcache_next;
+const uschar * end = cfcache_map + cfcache_mapsize;
+
+if (cfcache_nlines == 0) return -1;
+if (  cfcache_next + sizeof(cfcache_line) > end
+   || cfcache_next + CFCACHE_RECSIZE(cfcache_line, cl->len) > end
+   || cl->file >= cfcache_nfiles)
+  log_write_die(0, LOG_MAIN, "configuration cache %s is corrupt",
+    cfcache_path);
+
+if (cl->len >= big_buffer_size)
+  {
+  store_free(big_buffer);
+  big_buffer_size = (cl->len / BIG_BUFFER_SIZE + 1) * BIG_BUFFER_SIZE;
+  big_buffer = store_malloc(big_buffer_size);
+  }
+memcpy(big_buffer, cfcache_next + sizeof(cfcache_line), cl->len + 1);
+config_filename = cfcache_names[cl->file];
+config_lineno = cl->lineno;
+
+cfcache_next += CFCACHE_RECSIZE(cfcache_line, cl->len);
+cfcache_nlines--;
+return cl->len;
+}
+
+
+/* Called at the end of readconf_rest(). When replaying, drop the mapping.
+When recording, and running as root, write the cache file. It is written under
+a temporary name and renamed into place, so a reader never sees a partial
+file. Failures only lose the cache, so they are just debug-logged. */
+
+static void
+cfcache_close(void)
+{
+cfcache_header h;
+uschar * temp;
+int fd;
+BOOL ok;
+
+if (!cfcache_path) return;
+if (cfcache_map)
+  {
+  (void)munmap(US cfcache_map, cfcache_mapsize);
+  cfcache_map = NULL;
+  cfcache_path = NULL;
+  return;
+  }
+if (geteuid() != root_uid) goto DONE;
+if (cfcache_newest >= time(NULL))
+  {
+  DEBUG(D_any) debug_printf("config cache: not written, as a file has only "
+    "just changed\n");
+  goto DONE;
+  }
+
+memset(&h, 0, sizeof(h));
+memcpy(h.magic, CFCACHE_MAGIC, sizeof(h.magic));
+memcpy(h.key, cfcache_key, sizeof(h.key));
+h.nfiles = cfcache_nfiles;
+h.nlines = cfcache_nlines;
+
+(void)mkdir(CONFIGURE_CACHE_DIRECTORY, 0700);
+temp = string_sprintf("%s.%d", cfcache_path, (int)getpid());
+if ((fd = Uopen(temp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0)
+  {
+  DEBUG(D_any) debug_printf("config cache: failed to create %s: %s\n",
+    temp, strerror(errno));
+  goto DONE;
+  }
+ok = write(fd, &h, sizeof(h)) == sizeof(h)
+  && write(fd, cfcache_files->s, cfcache_files->ptr) == cfcache_files->ptr
+  && (!cfcache_lines
+     || write(fd, cfcache_lines->s, cfcache_lines->ptr) == cfcache_lines->ptr);
+ok = close(fd) == 0 && ok && Urename(temp, cfcache_path) == 0;
+if (!ok)
+  {
+  DEBUG(D_any) debug_printf("config cache: failed to write %s: %s\n",
+    cfcache_path, strerror(errno));
+  (void)Uunlink(temp);
+  }
+else
+  DEBUG(D_any) debug_printf("wrote config cache %s\n", cfcache_path);
+
+DONE:
+  cfcache_path = NULL;
+}
+#endif	/*CONFIGURE_CACHE_DIRECTORY*/
+
+
+
 /*************************************************
 *       Deal with an assignment to a macro       *
 *************************************************/
@@ -859,7 +1252,21 @@ It is also an error to define a macro whose name begins with the name of a
 previously defined macro.  This is the requirement that make using a tree
 for macros hard; we must check all macros for the substring.  Perhaps a
 sorted list, and a bsearch, would work?
-Note: it is documented that the other way round works. */
+Note: it is documented that the other way round works.
+
+Those checks were made when a configuration cache was written, so for a line
+replayed from one only an overriding command-line definition (these come first
+in the user list) has to be looked for, unless this is a redefinition. */
+
+#ifdef CONFIGURE_CACHE_DIRECTORY
+if (cfcache_map && !redef)
+  {
+  for (m = macros_user; m && m->command_line; m = m->next)
+    if (Ustrcmp(m->name, name) == 0) return TRUE;
+  (void) macro_create(name, s, FALSE);
+  return TRUE;
+  }
+#endif
 
 for (m = macros; m; m = m->next)
   {
@@ -1058,7 +1465,20 @@ uschar *s, *ss;
 int macro_found;
 
 /* Loop for handling continuation lines, skipping comments, and dealing with
-.include files. */
+.include files. All of that has been done already for lines replayed from the
+configuration cache. */
+
+#ifdef CONFIGURE_CACHE_DIRECTORY
+if (cfcache_map)
+  {
+  if ((len = cfcache_get_line()) < 0)
+    {
+    next_section[0] = 0;
+    return NULL;
+    }
+  }
+else
+#endif
 
 for (;;)
   {
@@ -1071,6 +1491,9 @@ for (;;)
       config_filename = config_file_stack->filename;
       config_directory = config_file_stack->directory;
       config_lineno = config_file_stack->lineno;
+#ifdef CONFIGURE_CACHE_DIRECTORY
+      cfcache_cur_file = config_file_stack->cache_file;
+#endif
       config_file_stack = config_file_stack->next;
       if (config_lines)
         save_config_position(config_filename, config_lineno);
@@ -1215,7 +1638,13 @@ for (;;)
       else
 	ss = string_sprintf("%s/%s", config_directory, ss);
 
-    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0)) continue;
+    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0))
+      {
+#ifdef CONFIGURE_CACHE_DIRECTORY
+      if (cfcache_path) (void) cfcache_record_file(ss, NULL);
+#endif
+      continue;
+      }
 
     if (config_lines)
       save_config_position(config_filename, config_lineno);
@@ -1234,6 +1663,15 @@ for (;;)
     config_filename = string_copy(ss);
     config_directory = string_copyn(ss, CUstrrchr(ss, '/') - ss);
     config_lineno = 0;
+
+#ifdef CONFIGURE_CACHE_DIRECTORY
+    save->cache_file = cfcache_cur_file;
+    if (cfcache_path)
+      if (fstat(fileno(config_file), &statbuf) == 0)
+	cfcache_cur_file = cfcache_record_file(config_filename, &statbuf);
+      else
+	cfcache_path = NULL;
+#endif
     continue;
     }
 
@@ -1281,6 +1719,11 @@ s = big_buffer + startoffset;            /* First non-space character */
 if (config_lines)
   save_config_line(s);
 
+#ifdef CONFIGURE_CACHE_DIRECTORY
+if (cfcache_path && !cfcache_map)
+  cfcache_record_line(s, len - startoffset);
+#endif
+
 if (strncmpic(s, US"begin ", 6) == 0)
   {
   s += 6;
@@ -3040,6 +3483,11 @@ if (!type)
       }
     return TRUE;
     }
+  else if (Ustrcmp(name, "regex_cache") == 0)
+    {
+    regex_cache_report();
+    return TRUE;
+    }
 
   else
     return print_ol(find_option(name,
@@ -3446,6 +3894,13 @@ if (f.trusted_config && Ustrcmp(filename, US"/dev/null"))
     dummy = dummy;	/* stupid compiler quietening */
     store_reset(r);
     }
+
+#ifdef CONFIGURE_CACHE_DIRECTORY
+  /* The preprocessed lines can come from a cache, except when the
+  configuration is to be listed. */
+
+  if (!config_lines) cfcache_open(&statbuf);
+#endif
   }
 
 /* Process the main configuration settings. They all begin with a lower case
@@ -4640,6 +5095,9 @@ while(*next_section)
 
 (void)fclose(config_file);
 config_lineno = 0;		/* Ensure we don't log a spurious position */
+#ifdef CONFIGURE_CACHE_DIRECTORY
+cfcache_close();
+#endif
 }
 
 /* Init the storage for the pre-parsed config lines */
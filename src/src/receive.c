@@ -11,6 +11,9 @@
 
 #include "exim.h"
 #include <setjmp.h>
+#ifdef __SSE2__
+# include <immintrin.h>
+#endif
 
 #ifdef EXPERIMENTAL_DCC
 extern int dcc_ok;
@@ -369,7 +372,8 @@ if (spool_name[0] != '\0')
   {
   Uunlink(spool_name);
   spool_name[Ustrlen(spool_name) - 1] = 'H';
-  Uunlink(spool_name);
+  if (Uunlink(spool_name) == 0)
+    queue_index_update(queue_name, message_id, message_subdir, FALSE);
   spool_name[0] = '\0';
   }
 
@@ -802,6 +806,79 @@ return END_EOF;
 
 
 
+/*************************************************
+*      Scan message data for line structure      *
+*************************************************/
+
+/* Find the next CR, LF or NUL in a block of message data, or the end of the
+block.  In the middle of a line these are the only bytes the DATA and BDAT
+readers need to look at; runs of anything else are copied as they are.  Lines
+in mail are short, so a 16- or 32-byte compare is as wide as is useful.
+
+Arguments:
+  s		start of the data
+  end		end of the data
+
+Returns:	pointer to the first CR, LF or NUL; end if there is none
+*/
+
+static inline const uschar *
+data_scan(const uschar * s, const uschar * end)
+{
+#ifdef __AVX2__
+const __m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n'),
+  nul32 = _mm256_setzero_si256();
+
+for ( ; end - s >= 32; s += 32)
+  {
+  __m256i v = _mm256_loadu_si256((const __m256i *) s);
+  unsigned m = _mm256_movemask_epi8(_mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, cr32), _mm256_cmpeq_epi8(v, lf32)),
+    _mm256_cmpeq_epi8(v, nul32)));
+  if (m) return s + __builtin_ctz(m);
+  }
+#endif
+#ifdef __SSE2__
+const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n'),
+  nul = _mm_setzero_si128();
+
+for ( ; end - s >= 16; s += 16)
+  {
+  __m128i v = _mm_loadu_si128((const __m128i *) s);
+  unsigned m = _mm_movemask_epi8(_mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+    _mm_cmpeq_epi8(v, nul)));
+  if (m) return s + __builtin_ctz(m);
+  }
+#endif
+
+while (s < end && *s != '\r' && *s != '\n' && *s) s++;
+return s;
+}
+
+
+/* Send a block of spool-format message data to a cutthrough connection,
+converting each LF back to CRLF.
+
+Arguments:
+  s		start of the data
+  end		end of the data
+*/
+
+static void
+cutthrough_data_block(const uschar * s, const uschar * end)
+{
+for (const uschar * nl; s < end; s = nl + 1)
+  {
+  if (!(nl = memchr(s, '\n', end - s)))
+    { cutthrough_data_puts(US s, end - s); break; }
+  cutthrough_data_puts(US s, nl - s);
+  cutthrough_data_put_nl();
+  }
+}
+
+
+
 /*************************************************
 *      Read data portion of an SMTP message      *
 *************************************************/
@@ -827,6 +904,14 @@ followed by SMTP commands is a possible "smtp smuggling" attack.  If
 the first (header) line for the message has a proper CRLF then enforce
 that for the body: convert bare LF to a space.
 
+The input is taken a buffer-load at a time.  Runs of ordinary characters within
+a line are found with data_scan() and copied in one go; line endings and
+leading dots go through the state machine a character at a time.  The result
+is collected in a local buffer and written with one fwrite(); the conversion
+never lengthens the data by more than the one LF for a CR left over from the
+previous block.  Anything following the terminating dot (pipelined SMTP
+commands) is put back into the input buffer.
+
 Arguments:
   fout		a FILE to which to write the message; NULL if skipping
   strict_crlf	require full CRLF sequence as a line ending
@@ -839,122 +924,162 @@ read_message_data_smtp(FILE * fout, BOOL strict_crlf)
 {
 enum { s_linestart, s_normal, s_had_cr, s_had_nl_dot, s_had_dot_cr } ch_state =
 	      s_linestart;
-int linelength = 0, ch;
+int linelength = 0, ch, rc = END_NOTENDED;
+const uschar * s = NULL, * end = NULL, * bend;
+uschar obuf[8192];
 
-while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) >= 0)
+while (rc == END_NOTENDED)
   {
-  if (ch == 0) body_zerocount++;
-  switch (ch_state)
+  uschar * o = obuf, * cut = obuf;
+
+  /* EOF indicates some kind of error, since a correct message is terminated
+  by [CR] LF . [CR] LF. */
+
+  if (s >= end)
     {
-    case s_linestart:			/* After LF or CRLF */
-      if (ch == '.')
-	{
-	ch_state = s_had_nl_dot;
-	continue;			/* Don't ever write . after LF */
-	}
-      ch_state = s_normal;
+    unsigned len = GETC_BUFFER_UNLIMITED;
 
-      /* Else fall through to handle as normal uschar. */
+    if (!(s = (receive_getbuf)(&len))) return END_EOF;
+    end = s + len;
+    }
+  bend = end - s < (int) sizeof(obuf) ? end : s + sizeof(obuf) - 1;
 
-    case s_normal:			/* Normal state */
-      if (ch == '\r')
-	{
-	ch_state = s_had_cr;
-	continue;			/* Don't write the CR */
-	}
-      if (ch == '\n')			/* Bare LF at end of line */
-	if (strict_crlf)
-	  ch = ' ';			/* replace LF with space */
-	else
-	  {				/* treat as line ending */
-	  ch_state = s_linestart;
-	  body_linecount++;
-	  if (linelength > max_received_linelength)
-	    max_received_linelength = linelength;
-	  linelength = -1;
+  while (s < bend)
+    {
+    if (ch_state == s_normal)		/* Copy a run of ordinary characters */
+      {
+      const uschar * p = data_scan(s, bend);
+      int n = p - s;
+
+      if (fout && n > thismessage_size_limit - message_size)
+	n = thismessage_size_limit - message_size + 1;
+      memcpy(o, s, n);
+      o += n;
+      s += n;
+      message_size += n;
+      linelength += n;
+      if (fout && message_size > thismessage_size_limit)
+	{ rc = END_SIZE; break; }
+      if (s >= bend) break;
+      }
+
+    if ((ch = *s++) == 0) body_zerocount++;
+    switch (ch_state)
+      {
+      case s_linestart:			/* After LF or CRLF */
+	if (ch == '.')
+	  {
+	  ch_state = s_had_nl_dot;
+	  continue;			/* Don't ever write . after LF */
 	  }
-      break;
+	ch_state = s_normal;
 
-    case s_had_cr:			/* After (unwritten) CR */
-      body_linecount++;			/* Any char ends line */
-      if (linelength > max_received_linelength)
-	max_received_linelength = linelength;
-      linelength = -1;
-      if (ch == '\n')			/* proper CRLF */
-	ch_state = s_linestart;
-      else
-	{
-	message_size++;		/* convert the dropped CR to a stored NL */
-	if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-	cutthrough_data_put_nl();
-	if (ch == '\r')			/* CR; do not write */
-	  continue;
-	ch_state = s_normal;		/* not LF or CR; process as standard */
-	}
-      break;
+	/* Else fall through to handle as normal uschar. */
+
+      case s_normal:			/* Normal state */
+	if (ch == '\r')
+	  {
+	  ch_state = s_had_cr;
+	  continue;			/* Don't write the CR */
+	  }
+	if (ch == '\n')			/* Bare LF at end of line */
+	  if (strict_crlf)
+	    ch = ' ';			/* replace LF with space */
+	  else
+	    {				/* treat as line ending */
+	    ch_state = s_linestart;
+	    body_linecount++;
+	    if (linelength > max_received_linelength)
+	      max_received_linelength = linelength;
+	    linelength = -1;
+	    }
+	break;
 
-    case s_had_nl_dot:			/* After [CR] LF . */
-      if (ch == '\n')			/* [CR] LF . LF */
-	if (strict_crlf)
-	  ch = ' ';			/* replace LF with space */
+      case s_had_cr:			/* After (unwritten) CR */
+	body_linecount++;			/* Any char ends line */
+	if (linelength > max_received_linelength)
+	  max_received_linelength = linelength;
+	linelength = -1;
+	if (ch == '\n')			/* proper CRLF */
+	  ch_state = s_linestart;
 	else
-	  return END_DOT;
-      else if (ch == '\r')		/* [CR] LF . CR */
-	{
-	ch_state = s_had_dot_cr;
-	continue;			/* Don't write the CR */
-	}
-      /* The dot was removed on reaching s_had_nl_dot. For a doubled dot, here,
-      reinstate it to cutthrough. The current ch, dot or not, is passed both to
-      cutthrough and to file below. */
-      else if (ch == '.')
-	{
-	uschar c = ch;
-	cutthrough_data_puts(&c, 1);
-	}
-      ch_state = s_normal;
-      break;
+	  {
+	  message_size++;		/* convert the dropped CR to a stored NL */
+	  *o++ = '\n';
+	  if (ch == '\r')			/* CR; do not write */
+	    continue;
+	  ch_state = s_normal;		/* not LF or CR; process as standard */
+	  }
+	break;
+
+      case s_had_nl_dot:			/* After [CR] LF . */
+	if (ch == '\n')			/* [CR] LF . LF */
+	  if (strict_crlf)
+	    ch = ' ';			/* replace LF with space */
+	  else
+	    rc = END_DOT;
+	else if (ch == '\r')		/* [CR] LF . CR */
+	  {
+	  ch_state = s_had_dot_cr;
+	  continue;			/* Don't write the CR */
+	  }
+	/* The dot was removed on reaching s_had_nl_dot. For a doubled dot, here,
+	reinstate it to cutthrough. The current ch, dot or not, is passed both to
+	cutthrough and to file below. */
+	else if (ch == '.' && cutthrough.delivery)
+	  {
+	  cutthrough_data_block(cut, o);
+	  cutthrough_data_puts(US".", 1);
+	  cut = o;
+	  }
+	ch_state = s_normal;
+	break;
 
-    case s_had_dot_cr:			/* After [CR] LF . CR */
-      if (ch == '\n')
-	return END_DOT;			/* Preferred termination */
+      case s_had_dot_cr:			/* After [CR] LF . CR */
+	if (ch == '\n')
+	  {
+	  rc = END_DOT;			/* Preferred termination */
+	  break;
+	  }
 
-      message_size++;		/* convert the dropped CR to a stored NL */
-      body_linecount++;
-      if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-      cutthrough_data_put_nl();
-      if (ch == '\r')
-	{
-	ch_state = s_had_cr;
-	continue;			/* CR; do not write */
-	}
-      ch_state = s_normal;
-      break;
-    }
+	message_size++;		/* convert the dropped CR to a stored NL */
+	body_linecount++;
+	*o++ = '\n';
+	if (ch == '\r')
+	  {
+	  ch_state = s_had_cr;
+	  continue;			/* CR; do not write */
+	  }
+	ch_state = s_normal;
+	break;
+      }
+    if (rc == END_DOT) break;
 
-  /* Add the character to the spool file, unless skipping; then loop for the
-  next. */
+    /* Add the character to the block, then loop for the next. */
 
-  message_size++;
-  linelength++;
-  if (fout)
-    {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
-    }
-  if(ch == '\n')
-    cutthrough_data_put_nl();
-  else
-    {
-    uschar c = ch;
-    cutthrough_data_puts(&c, 1);
+    message_size++;
+    linelength++;
+    *o++ = ch;
+    if (fout && message_size > thismessage_size_limit)
+      { rc = END_SIZE; break; }
     }
-  }
 
-/* Fall through here if EOF encountered. This indicates some kind of error,
-since a correct message is terminated by [CR] LF . [CR] LF. */
+  /* Put back anything after the end of the message, or after the point where
+  it became too big (to be swallowed by a further call). */
 
-return END_EOF;
+  if (rc != END_NOTENDED)
+    for (const uschar * p = end; p > s; ) (receive_ungetc)(*--p);
+
+  /* Write the block to the spool file, unless skipping, and to any cutthrough
+  connection. */
+
+  if (o > obuf && fout && fwrite(obuf, o - obuf, 1, fout) != 1)
+    return END_WERROR;
+  if (cutthrough.delivery)
+    cutthrough_data_block(cut, o);
+  }
+
+return rc;
 }
 
 
@@ -967,6 +1092,12 @@ body_linecount accounting for proper re-expansion for the wire, so use
 a cut-down version of the state-machine above; we don't need to do leading-dot
 detection and unstuffing.
 
+Chunk data already in the input buffer (plain or TLS) is taken a block at a
+time and converted into a local buffer, as for DATA above, which is written
+with one fwrite(); only the first byte of a chunk, which may follow a BDAT command, goes through
+bdat_getc().  The conversion never lengthens the data by more than the one
+LF for a CR left over from the previous block.
+
 Arguments:
   fout      a FILE to which to write the message; NULL if skipping;
             must be open for both writing and reading.
@@ -980,10 +1111,23 @@ read_message_bdat_smtp(FILE * fout)
 int linelength = 0, ch;
 enum CH_STATE ch_state = LF_SEEN;
 BOOL fix_nl = FALSE;
+const uschar * s = NULL, * end = NULL, * bend;
+uschar obuf[8192], one;
 
 for(;;)
   {
-  switch ((ch = bdat_getc(GETC_BUFFER_UNLIMITED)))
+  uschar * o = obuf;
+
+  if (s < end)
+    ;					/* More of the last block */
+  else if (chunking_data_left > 0)
+    {
+    unsigned len = GETC_BUFFER_UNLIMITED;
+
+    if (!(s = bdat_getbuf(&len))) return END_EOF;
+    end = s + len;
+    }
+  else switch ((ch = bdat_getc(GETC_BUFFER_UNLIMITED)))
     {
     case EOF:	return END_EOF;
     case ERR:	return END_PROTOCOL;
@@ -1017,64 +1161,90 @@ for(;;)
       fix_nl = TRUE;
 
       continue;
-    case '\0':  body_zerocount++; break;
+    default:
+      one = ch;
+      s = &one;
+      end = s + 1;
+      break;
     }
-  switch (ch_state)
+  bend = end - s < (int) sizeof(obuf) ? end : s + sizeof(obuf) - 1;
+
+  for ( ; s < bend; s++)
     {
-    case LF_SEEN:                             /* After LF or CRLF */
-      ch_state = MID_LINE;
-      /* fall through to handle as normal uschar. */
+    if (ch_state == MID_LINE)		/* Copy a run of ordinary characters */
+      {
+      const uschar * p = data_scan(s, bend);
+      int n = p - s;
+
+      memcpy(o, s, n);
+      o += n;
+      s = p;
+      message_size += n;
+      linelength += n;
+      if (s >= bend) break;
+      }
 
-    case MID_LINE:                            /* Mid-line state */
-      if (ch == '\n')
-	{
-	ch_state = LF_SEEN;
+    if ((ch = *s) == '\0') body_zerocount++;
+
+    switch (ch_state)
+      {
+      case LF_SEEN:                             /* After LF or CRLF */
+	ch_state = MID_LINE;
+	/* fall through to handle as normal uschar. */
+
+      case MID_LINE:                            /* Mid-line state */
+	if (ch == '\n')
+	  {
+	  ch_state = LF_SEEN;
+	  body_linecount++;
+	  if (linelength > max_received_linelength)
+	    max_received_linelength = linelength;
+	  linelength = -1;
+	  }
+	else if (ch == '\r')
+	  {
+	  ch_state = CR_SEEN;
+	  if (fix_nl) bdat_ungetc('\n');
+	  continue;			/* don't write CR */
+	  }
+	break;
+
+      case CR_SEEN:                       /* After (unwritten) CR */
 	body_linecount++;
 	if (linelength > max_received_linelength)
 	  max_received_linelength = linelength;
 	linelength = -1;
-	}
-      else if (ch == '\r')
-	{
-	ch_state = CR_SEEN;
-       if (fix_nl) bdat_ungetc('\n');
-	continue;			/* don't write CR */
-	}
-      break;
+	if (ch == '\n')
+	  ch_state = LF_SEEN;
+	else
+	  {
+	  message_size++;
+	  *o++ = '\n';
+	  if (ch == '\r') continue;	/* don't write CR */
+	  ch_state = MID_LINE;
+	  }
+	break;
+      }
 
-    case CR_SEEN:                       /* After (unwritten) CR */
-      body_linecount++;
-      if (linelength > max_received_linelength)
-	max_received_linelength = linelength;
-      linelength = -1;
-      if (ch == '\n')
-	ch_state = LF_SEEN;
-      else
-	{
-	message_size++;
-	if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-	cutthrough_data_put_nl();
-	if (ch == '\r') continue;	/* don't write CR */
-	ch_state = MID_LINE;
-	}
-      break;
+    /* Add the character to the block for the spool file */
+
+    message_size++;
+    linelength++;
+    *o++ = ch;
     }
 
-  /* Add the character to the spool file, unless skipping */
+  /* Write the block to the spool file, unless skipping, and to any
+  cutthrough connection with the LFs expanded back to CRLF */
 
-  message_size++;
-  linelength++;
-  if (fout)
-    {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
-    }
-  if(ch == '\n')
-    cutthrough_data_put_nl();
-  else
+  if (o > obuf)
     {
-    uschar c = ch;
-    cutthrough_data_puts(&c, 1);
+    if (fout)
+      {
+      if (fwrite(obuf, o - obuf, 1, fout) != 1) return END_WERROR;
+      if (message_size > thismessage_size_limit) return END_SIZE;
+      }
+    if (cutthrough.delivery)
+      cutthrough_data_block(obuf, o);
     }
   }
 /*NOTREACHED*/
@@ -1096,9 +1266,27 @@ for (;;)
   if (chunking_data_left > 0)
     {
     unsigned len = MAX(chunking_data_left, thismessage_size_limit - message_size + 1);
-    const uschar * buf = bdat_getbuf(&len);
+    const uschar * buf;
+
+#ifdef EXIM_HAVE_SPLICE
+    /* Unbuffered cleartext data goes straight from the socket to the file */
+
+    if (fout)
+      {
+      int n = bdat_splice(fout, len);
+
+      if (n == -1) return END_EOF;
+      if (n == -2) return END_WERROR;
+      if (n > 0)
+	{
+	message_size += n;
+	if (message_size > thismessage_size_limit) return END_SIZE;
+	continue;
+	}
+      }
+#endif
 
-    if (!buf) return END_EOF;
+    if (!(buf = bdat_getbuf(&len))) return END_EOF;
     message_size += len;
     if (fout && fwrite(buf, len, 1, fout) != 1) return END_WERROR;
     }
@@ -1639,6 +1827,25 @@ DEBUG(D_receive) debug_printf(">>Generated Received: header line\n%c %s",
 
 
 
+/*************************************************
+*     Remove the spool files for a message       *
+*************************************************/
+
+/* This is used when a message whose header file has been written is not to
+be kept: the connection went, the data file could not be closed, or it was
+delivered by cutthrough. Its queue index entry goes with the header file. */
+
+static void
+remove_spool_files(void)
+{
+Uunlink(spool_name);
+if (Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H")) == 0)
+  queue_index_update(queue_name, message_id, message_subdir, FALSE);
+Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+}
+
+
+
 /*************************************************
 *                 Receive message                *
 *************************************************/
@@ -1889,7 +2096,10 @@ happen in the smtp_getc() function when it refills its buffer. */
 
 had_data_timeout = 0;
 if (smtp_input)
+  {
   os_non_restarting_signal(SIGALRM, data_timeout_handler);
+  smtp_in_reads = smtp_in_tls_reads = 0;
+  }
 
 /* If not SMTP input, timeout happens only if configured, and we just set a
 single timeout for the whole message. */
@@ -3304,6 +3514,10 @@ if (!ferror(spool_data_file) && !(receive_feof)() && message_ended != END_DOT)
   receive_linecount += body_linecount;  /* For BSMTP errors mainly */
   message_linecount += body_linecount;
 
+  DEBUG(D_receive) if (smtp_input)
+    debug_printf("message: %d bytes, %d reads, %d TLS reads\n",
+      message_size, smtp_in_reads, smtp_in_tls_reads);
+
   switch (message_ended)
     {
     /* Handle premature termination of SMTP */
@@ -3377,7 +3591,7 @@ the input in cases of output errors, since the far end doesn't expect to see
 anything until the terminating dot line is sent. */
 
 if (fflush(spool_data_file) == EOF || ferror(spool_data_file) ||
-    EXIMfsync(fileno(spool_data_file)) < 0 || (receive_ferror)())
+    daemon_sync(fileno(spool_data_file), FALSE) < 0 || (receive_ferror)())
   {
   uschar *msg_errno = US strerror(errno);
   BOOL input_error = (receive_ferror)() != 0;
@@ -4045,11 +4259,7 @@ receive_messagecount++;
 
 if (  fflush(spool_data_file)
 #if _POSIX_C_SOURCE >= 199309L || _XOPEN_SOURCE >= 500
-# ifdef ENABLE_DISABLE_FSYNC
-   || !disable_fsync && fdatasync(data_fd)
-# else
-   || fdatasync(data_fd)
-# endif
+   || daemon_sync(data_fd, TRUE) < 0
 #endif
    )
   {
@@ -4304,9 +4514,7 @@ if (  smtp_input && sender_host_address && !f.sender_host_notsocket
 
       /* Delete the files for this aborted message. */
 
-      Uunlink(spool_name);
-      Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
-      Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+      remove_spool_files();
 
       goto CONN_GONE;
       }
@@ -4445,9 +4653,7 @@ if (spool_data_file && cutthrough_done == NOT_TRIED)
 		  (LOGGING(received_sender) ? LOG_SENDER : 0),
 	      "rescind the above message-accept");
 
-    Uunlink(spool_name);
-    Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
-    Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+    remove_spool_files();
 
     /* Claim a data ACL temp-reject, just to get reject logging and response */
     if (smtp_input) smtp_handle_acl_fail(ACL_WHERE_DATA, rc, NULL, log_msg);
@@ -4531,17 +4737,13 @@ if (smtp_input)
 	log_write(0, LOG_MAIN, "Completed");/* Delivery was done */
       case PERM_REJ:
 							 /* Delete spool files */
-	Uunlink(spool_name);
-	Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
-	Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	remove_spool_files();
 	break;
 
       case TMP_REJ:
 	if (cutthrough.defer_pass)
 	  {
-	  Uunlink(spool_name);
-	  Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
-	  Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	  remove_spool_files();
 	  }
       default:
 	break;
@@ -27,9 +27,16 @@ transport process which has been re-exec'd to gain privs - and therefore does no
 have the daemon-maintained cache.  Using shared-memory might reduce that cost
 (the attach time for the memory segment will matter); the implimentation
 would require suitable R/W locks.
+
+To show whether that would be worthwhile, lookups in the local layer, its
+hits, and the time spent compiling on misses can be counted, across all
+processes, in a small file in the hints directory that the Exim user can
+write. This is enabled by regex_cache_stats; "exim -bP regex_cache" shows
+the counts.
 */
 
 #include "exim.h"
+#include <sys/mman.h>
 
 typedef struct re_req {
   uschar	notifier_reqtype;
@@ -42,6 +49,87 @@ static tree_node * regex_caseless_cache = NULL;
 
 #define REGEX_CACHESIZE_LIMIT 1000
 
+#define RCS_MAGIC	"EximRC1"
+
+typedef struct rcs_stats {
+  uschar	magic[8];
+  uint64_t	lookups;
+  uint64_t	hits;
+  uint64_t	compile_ns;		/* compiles after a miss */
+} rcs_stats;
+
+static rcs_stats *	rcs_counts = NULL;
+static BOOL		rcs_counts_tried = FALSE;
+
+/******************************************************************************/
+/* Statistics */
+
+static uint64_t
+rcs_ns(void)
+{
+struct timespec ts;
+#ifdef _POSIX_MONOTONIC_CLOCK
+if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+#endif
+  if (clock_gettime(CLOCK_REALTIME, &ts) != 0) return 0;
+return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/* Map the stats file, making it if need be, once per process (a child of the
+daemon inherits the mapping). It belongs to the Exim user. */
+
+static rcs_stats *
+rcs_stats_map(void)
+{
+const uschar * path;
+struct stat st;
+void * map;
+int fd;
+
+if (rcs_counts_tried || !regex_cache_stats || !spool_directory
+   || !*spool_directory)
+  return rcs_counts;
+rcs_counts_tried = TRUE;
+
+path = string_sprintf("%s/db/regexcache.stats", spool_directory);
+(void) directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, FALSE);
+if ((fd = Uopen(path, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDWR|O_CREAT,
+		EXIMDB_MODE)) < 0)
+  return NULL;
+if (geteuid() == root_uid) (void) exim_fchown(fd, exim_uid, exim_gid, path);
+if (  fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+   && (st.st_size >= sizeof(rcs_stats) || ftruncate(fd, sizeof(rcs_stats)) == 0)
+   && (map = mmap(NULL, sizeof(rcs_stats), PROT_READ|PROT_WRITE, MAP_SHARED,
+		  fd, 0)) != MAP_FAILED)
+  {
+  rcs_counts = map;
+  if (memcmp(rcs_counts->magic, RCS_MAGIC, sizeof(rcs_counts->magic)) != 0)
+    {
+    memset(rcs_counts, 0, sizeof(rcs_stats));
+    memcpy(rcs_counts->magic, RCS_MAGIC, sizeof(rcs_counts->magic));
+    }
+  }
+(void) close(fd);
+return rcs_counts;
+}
+
+
+/* Count a lookup in the local layer, and its outcome */
+
+static void
+rcs_count(BOOL hit, uint64_t compile_ns)
+{
+rcs_stats * s = rcs_stats_map();
+
+if (!s) return;
+__sync_fetch_and_add(&s->lookups, 1);
+if (hit)
+  __sync_fetch_and_add(&s->hits, 1);
+else
+  __sync_fetch_and_add(&s->compile_ns, compile_ns);
+}
+
 /******************************************************************************/
 
 static void
@@ -141,14 +229,19 @@ BOOL caseless = !!(flags & MCS_CASELESS);
 size_t offset;
 const pcre2_code * yield;
 int old_pool = store_pool, err;
+uint64_t start;
 
 /* Optionally, check the cache and return if found */
 
 if (  flags & MCS_CACHEABLE
    && (yield = regex_from_cache(pattern, caseless)))
+  {
+  if (regex_cache_stats) rcs_count(TRUE, 0);
   return yield;
+  }
 
 store_pool = POOL_PERM;
+start = regex_cache_stats ? rcs_ns() : 0;
 
 if (!(yield = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
   caseless ? PCRE_COPT|PCRE2_CASELESS : PCRE_COPT,
@@ -166,7 +259,10 @@ if (use_malloc)
   }
 
 if (flags & MCS_CACHEABLE)
+  {
+  if (regex_cache_stats) rcs_count(FALSE, rcs_ns() - start);
   regex_to_cache(pattern, caseless, yield);
+  }
 
 store_pool = old_pool;
 return yield;
@@ -197,17 +293,22 @@ int err;
 PCRE2_SIZE offset;
 const pcre2_code * yield;
 int old_pool = store_pool;
+uint64_t start;
 
 /* Optionally, check the cache and return if found */
 
 if (  flags & MCS_CACHEABLE
    && (yield = regex_from_cache(key, caseless)))
+  {
+  if (regex_cache_stats) rcs_count(TRUE, 0);
   return yield;
+  }
 
 DEBUG(D_expand|D_lists) debug_printf_indent("compiling %sRE '%s'\n",
 				caseless ? "caseless " : "", pattern);
 
 store_pool = POOL_PERM;
+start = regex_cache_stats ? rcs_ns() : 0;
 if (!(yield = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
 		caseless ? PCRE_COPT|PCRE2_CASELESS : PCRE_COPT,
 		&err, &offset, cctx)))
@@ -219,7 +320,10 @@ if (!(yield = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
 	    "%q: %s at offset %ld", pattern, errbuf, (long)offset);
   }
 else if (flags & MCS_CACHEABLE)
+  {
+  if (regex_cache_stats) rcs_count(FALSE, rcs_ns() - start);
   regex_to_cache(key, caseless, yield);
+  }
 store_pool = old_pool;
 
 return yield;
@@ -249,3 +353,29 @@ else if ((cre = regex_compile(req->re,
 DEBUG(D_any) if (!cre) debug_printf("%s\n", errstr);
 return;
 }
+
+
+
+/*************************************************
+*      Report the cache statistics, for -bP      *
+*************************************************/
+
+void
+regex_cache_report(void)
+{
+const rcs_stats * s;
+
+if (!regex_cache_stats)
+  printf("regex_cache_stats is not set\n");
+else if (!(s = rcs_stats_map()))
+  printf("no statistics available\n");
+else
+  {
+  uint64_t lookups = s->lookups, hits = s->hits;
+  printf("%lu lookups, %lu hits (%.1f%%), %.3fms spent compiling on misses\n",
+    (unsigned long)lookups, (unsigned long)hits,
+    lookups ? 100.0 * hits / lookups : 0.0, s->compile_ns / 1e6);
+  }
+}
+
+/* End of regex_cache.c */
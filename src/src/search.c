@@ -13,7 +13,8 @@ specific "open" function. These are now all held in individual modules in the
 lookups subdirectory and the functions here form a generic interface.
 
 Caching is used to improve performance. Open files are cached until a tidyup
-function is called, and for each file the result of the last lookup is cached.
+function is called, and for each file the results of lookups are cached, up to
+lookup_cache_size bytes, with the least recently used pushed out beyond that.
 However, if too many files are opened, some of those that are not in use have
 to be closed. Those open items that use real files are kept on a LRU chain to
 help with this.
@@ -21,9 +22,14 @@ help with this.
 All the data is held in permanent store so as to be independent of the stacking
 pool that is reset from time to time. In fact, we use malloc'd store so that it
 can be freed when the caches are tidied up. It isn't actually clear whether
-this is a benefit or not, to be honest. */
+this is a benefit or not, to be honest.
+
+The results of query-style lookups can also be shared between the processes
+descended from a daemon, through a table in shared memory that the daemon sets
+up when lookup_cache_shared is set. */
 
 #include "exim.h"
+#include <sys/mman.h>
 
 
 /* Tree in which to cache open files until tidyup called. */
@@ -50,6 +56,862 @@ static rmark search_reset_point = NULL;
 #define CACHE_WR	BIT(1)
 
 
+
+/*************************************************
+*            Lookup result cache                 *
+*************************************************/
+
+/* The results of lookups on each file (or, for query-style lookups, each
+lookup type) are kept in a hash table, chained in order of use. Items are in
+malloc store so that they can be freed one at a time: when the total size for a
+file passes lookup_cache_size, the least recently used are removed; an expired
+item is removed when it is next looked up. */
+
+static unsigned
+lcache_hash(const uschar * key)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+while (*key) { h ^= *key++; h *= 16777619u; }
+return h;
+}
+
+
+static lookup_cache_item *
+lcache_find(search_cache * c, const uschar * key, unsigned hash)
+{
+if (c->nbuckets)
+  for (lookup_cache_item * i = c->items[hash & (c->nbuckets - 1)]; i; i = i->next)
+    if (i->hash == hash && Ustrcmp(i->key, key) == 0)
+      return i;
+return NULL;
+}
+
+
+/* Unlink an item from the LRU chain */
+
+static void
+lcache_unchain(search_cache * c, lookup_cache_item * i)
+{
+if (i->newer) i->newer->older = i->older; else c->newest = i->older;
+if (i->older) i->older->newer = i->newer; else c->oldest = i->newer;
+}
+
+
+/* Move an item to the newest end of the LRU chain */
+
+static void
+lcache_touch(search_cache * c, lookup_cache_item * i)
+{
+if (c->newest == i) return;
+lcache_unchain(c, i);
+i->newer = NULL;
+if ((i->older = c->newest)) c->newest->newer = i; else c->oldest = i;
+c->newest = i;
+}
+
+
+/* Remove an item from the cache and free it */
+
+static void
+lcache_remove(search_cache * c, lookup_cache_item * i)
+{
+lookup_cache_item ** ip = &c->items[i->hash & (c->nbuckets - 1)];
+
+while (*ip != i) ip = &(*ip)->next;
+*ip = i->next;
+lcache_unchain(c, i);
+c->nitems--;
+c->size -= i->size;
+store_free(i);
+}
+
+
+/* Empty the cache for a file */
+
+static void
+lcache_flush(search_cache * c)
+{
+for (lookup_cache_item * i = c->oldest, * newer; i; i = newer)
+  {
+  newer = i->newer;
+  store_free(i);
+  }
+if (c->items) store_free(c->items);
+c->items = NULL;
+c->newest = c->oldest = NULL;
+c->nitems = c->nbuckets = c->size = 0;
+}
+
+
+/* Add an item to the cache for a file, with copies of the key, options and
+data, growing the hash table when it is full, then remove the least recently
+used items while the total is above the limit. The new item is never removed,
+so a single oversized result is still cached until the next lookup.
+
+Arguments:
+  c		the cache block for the file
+  key		the lookup key
+  hash		its hash
+  opts		lookup options, or NULL
+  data		the result, or NULL for a failed lookup
+  expiry	time after which the data is invalid, or zero
+*/
+
+static void
+lcache_add(search_cache * c, const uschar * key, unsigned hash,
+  const uschar * opts, const uschar * data, time_t expiry)
+{
+int klen = Ustrlen(key) + 1, olen = opts ? Ustrlen(opts) + 1 : 0,
+  dlen = data ? Ustrlen(data) + 1 : 0;
+unsigned size = sizeof(lookup_cache_item) + klen + olen + dlen;
+lookup_cache_item * i = store_malloc(size), ** bp;
+uschar * s = i->key + klen;
+
+memcpy(i->key, key, klen);
+i->opts = opts ? memcpy(s, opts, olen) : NULL;
+i->data = data ? memcpy(s + olen, data, dlen) : NULL;
+i->tainted = data && is_tainted(data);
+i->expiry = expiry;
+i->hash = hash;
+i->size = size;
+
+if (c->nitems >= c->nbuckets)
+  {
+  unsigned n = c->nbuckets ? c->nbuckets * 2 : 16;
+  lookup_cache_item ** items = store_malloc(n * sizeof(lookup_cache_item *));
+
+  memset(items, 0, n * sizeof(lookup_cache_item *));
+  for (lookup_cache_item * j = c->oldest; j; j = j->newer)
+    {
+    bp = &items[j->hash & (n - 1)];
+    j->next = *bp;
+    *bp = j;
+    }
+  if (c->items) store_free(c->items);
+  c->items = items;
+  c->nbuckets = n;
+  }
+
+bp = &c->items[hash & (c->nbuckets - 1)];
+i->next = *bp;
+*bp = i;
+i->newer = NULL;
+if ((i->older = c->newest)) c->newest->newer = i; else c->oldest = i;
+c->newest = i;
+c->nitems++;
+c->size += size;
+
+while (lookup_cache_size > 0 && c->size > lookup_cache_size && c->oldest != i)
+  {
+  DEBUG(D_lookup) debug_printf_indent("lookup cache full: dropping %q\n",
+    c->oldest->key);
+  lcache_remove(c, c->oldest);
+  lookup_cache_evictions++;
+  }
+}
+
+
+/*************************************************
+*        Shared lookup result cache              *
+*************************************************/
+
+/* A daemon with lookup_cache_shared set maps a table that all the processes it
+forks inherit. The table is a number of buckets each of a few fixed-size slots.
+A key, made of the lookup type name, any file or socket name, the options and
+the query, hashes to a bucket; a new result replaces an expired slot there, or else the least recently
+stored. A result too big for a slot is not shared.
+
+Each bucket has a lock word holding the pid of the process using it. It is only
+ever tried a few times: a process that cannot get it treats the lookup as a miss
+or does not store, as the cache is only an optimisation. A lock left by a
+process that died is broken.
+
+When a lookup says that it changed its data (a SQL UPDATE, for example) the
+generation number for its type is bumped, which invalidates every result of
+that type stored before. */
+
+#define LCS_SLOTS	4		/* slots per bucket */
+#define LCS_SLOTSIZE	512		/* bytes per slot, including header */
+#define LCS_GENS	32		/* generation counters */
+
+typedef struct lcs_slot {
+  time_t	expiry;			/* zero for an unused slot */
+  time_t	stored;
+  unsigned	hash;
+  unsigned	gen;			/* generation of the lookup type */
+  unsigned short klen;			/* key length, including its NULs */
+  short		dlen;			/* data length, or -1 for a failed lookup */
+  BOOL		tainted;
+  uschar	buf[1];			/* key then data - variable length */
+} lcs_slot;
+
+#define LCS_BUFSIZE	(LCS_SLOTSIZE - offsetof(lcs_slot, buf))
+
+/* The union keeps each slot aligned for the time_t fields of its header. */
+
+typedef union lcs_slotbuf {
+  lcs_slot	s;
+  uschar	b[LCS_SLOTSIZE];
+} lcs_slotbuf;
+
+typedef struct lcs_bucket {
+  pid_t		lock;
+  lcs_slotbuf	slots[LCS_SLOTS];
+} lcs_bucket;
+
+typedef struct lcs_table {
+  unsigned	nbuckets;		/* a power of two */
+  unsigned	gens[LCS_GENS];
+  lcs_bucket	buckets[1];		/* variable length */
+} lcs_table;
+
+static lcs_table * lcs = NULL;
+
+
+
+/* Set up the shared table. Called by the daemon before it forks anything.
+The size is rounded down to a power of two of buckets. */
+
+void
+search_shared_init(void)
+{
+size_t size;
+unsigned n = 1;
+
+if (lookup_cache_shared <= 0 || lcs) return;
+while ((size_t)n * 2 * sizeof(lcs_bucket) <= (size_t)lookup_cache_shared) n *= 2;
+size = sizeof(lcs_table) + (n - 1) * sizeof(lcs_bucket);
+
+if ((lcs = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0))
+    == MAP_FAILED)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "lookup_cache_shared: mmap failed: %s",
+    strerror(errno));
+  lcs = NULL;
+  return;
+  }
+memset(lcs, 0, sizeof(lcs_table));	/* anonymous maps start zeroed */
+lcs->nbuckets = n;
+DEBUG(D_any) debug_printf("shared lookup cache: %u buckets of %d slots\n",
+  n, LCS_SLOTS);
+}
+
+
+static unsigned
+lcs_hash(const uschar * key, int len)
+{
+unsigned h = 2166136261u;			/* FNV-1a, over the NULs too */
+while (len--) { h ^= *key++; h *= 16777619u; }
+return h;
+}
+
+
+/* Results of the query-style lookups, and of sqlite (whose file is part of the
+key), are shared. The ldapauth results are not: the queries carry a cleartext
+password, and a result would outlive a change to it. */
+
+static BOOL
+lcs_wanted(const lookup_info * li)
+{
+return lcs
+  && (li->type == lookup_querystyle || li->type == lookup_absfilequery)
+  && Ustrcmp(li->name, "ldapauth") != 0;
+}
+
+
+static BOOL
+lcs_lock(lcs_bucket * b)
+{
+pid_t pid = getpid();
+
+for (int tries = 0; tries < 8; tries++)
+  {
+  pid_t holder;
+  if (__sync_bool_compare_and_swap(&b->lock, 0, pid)) return TRUE;
+  if ((holder = b->lock) > 0 && kill(holder, 0) < 0 && errno == ESRCH)
+    (void) __sync_bool_compare_and_swap(&b->lock, holder, 0);
+  }
+return FALSE;
+}
+
+
+/* Build the key for a shared lookup: type name, file (for a readsocket, the
+socket), options and query, each with its terminating NUL. Returns the length,
+or zero if it does not fit a slot. */
+
+static int
+lcs_key(uschar * buf, const lookup_info * li, const uschar * filename,
+  const uschar * opts, const uschar * query)
+{
+const uschar * parts[] = { US li->name, filename, opts, query };
+int len = 0;
+
+for (int n = 0; n < nelem(parts); n++)
+  {
+  int plen = parts[n] ? Ustrlen(parts[n]) : 0;
+  if (len + plen + 1 > LCS_BUFSIZE) return 0;
+  if (plen) memcpy(buf + len, parts[n], plen);
+  buf[len += plen] = 0;
+  len++;
+  }
+return len;
+}
+
+
+/* Look for a shared result. On a hit, the data (or NULL for a cached failure)
+is copied into the current pool with the taint it had, and its expiry time is
+returned.
+
+Arguments:
+  li		the lookup type
+  filename	the file or socket name, or NULL
+  opts		lookup options, or NULL
+  query		the query
+  datap		where to put the data
+  expiryp	where to put the expiry time
+
+Returns:	TRUE for a hit
+*/
+
+static BOOL
+lcs_find(const lookup_info * li, const uschar * filename, const uschar * opts,
+  const uschar * query, uschar ** datap, time_t * expiryp)
+{
+uschar key[LCS_BUFSIZE];
+int klen = lcs_key(key, li, filename, opts, query);
+unsigned hash, gen;
+lcs_bucket * b;
+time_t now = time(NULL);
+BOOL found = FALSE;
+
+if (!klen) return FALSE;
+hash = lcs_hash(key, klen);
+gen = lcs->gens[lcache_hash(US li->name) % LCS_GENS];
+b = &lcs->buckets[hash & (lcs->nbuckets - 1)];
+
+if (!lcs_lock(b)) return FALSE;
+for (int n = 0; n < LCS_SLOTS; n++)
+  {
+  lcs_slot * s = &b->slots[n].s;
+  if (  s->expiry > now && s->hash == hash && s->gen == gen
+     && s->klen == klen && memcmp(s->buf, key, klen) == 0)
+    {
+    *datap = s->dlen < 0 ? NULL
+      : string_copyn_taint(s->buf + klen, s->dlen,
+			  s->tainted ? GET_TAINTED : GET_UNTAINTED);
+    *expiryp = s->expiry;
+    found = TRUE;
+    break;
+    }
+  }
+__sync_lock_release(&b->lock);
+return found;
+}
+
+
+/* Store a result in the shared table, replacing an entry for the same key, an
+expired or stale one, or the oldest in the bucket. */
+
+static void
+lcs_store(const lookup_info * li, const uschar * filename, const uschar * opts,
+  const uschar * query, const uschar * data, time_t expiry)
+{
+uschar key[LCS_BUFSIZE];
+int klen = lcs_key(key, li, filename, opts, query), dlen = data ? Ustrlen(data) : -1;
+unsigned hash, gen;
+lcs_bucket * b;
+lcs_slot * s, * victim = NULL;
+time_t now = time(NULL);
+
+if (!klen || klen + dlen + 1 > LCS_BUFSIZE) return;
+hash = lcs_hash(key, klen);
+gen = lcs->gens[lcache_hash(US li->name) % LCS_GENS];
+b = &lcs->buckets[hash & (lcs->nbuckets - 1)];
+
+if (!lcs_lock(b)) return;
+for (int n = 0; n < LCS_SLOTS; n++)
+  {
+  s = &b->slots[n].s;
+  if (s->hash == hash && s->klen == klen && memcmp(s->buf, key, klen) == 0)
+    { victim = s; break; }
+  if (  !victim
+     || (victim->expiry > now && victim->gen == gen
+        && (s->expiry <= now || s->gen != gen || s->stored < victim->stored)))
+    victim = s;
+  }
+
+/* The slot is invalid while it is rewritten, so that a writer dying part way
+through (its lock is then broken) does not leave a torn entry for a reader. */
+
+s = victim;
+s->expiry = 0;
+__sync_synchronize();
+s->hash = hash;
+s->gen = gen;
+s->klen = klen;
+s->dlen = dlen;
+s->tainted = data && is_tainted(data);
+memcpy(s->buf, key, klen);
+if (data) memcpy(s->buf + klen, data, dlen + 1);
+s->stored = now;
+__sync_synchronize();
+s->expiry = expiry;
+__sync_lock_release(&b->lock);
+DEBUG(D_lookup) debug_printf_indent("stored in shared lookup cache\n");
+}
+
+
+/* Invalidate the shared results of a lookup type */
+
+static void
+lcs_invalidate(const lookup_info * li)
+{
+__sync_fetch_and_add(&lcs->gens[lcache_hash(US li->name) % LCS_GENS], 1);
+}
+
+
+
+/*************************************************
+*               Lookup proxy                     *
+*************************************************/
+
+/* With daemon_lookup_proxy set, the daemon forks some processes that do the
+query-style lookups of the types listed for all the processes it creates, so
+that the connections to the database servers, which the lookup modules keep
+only for the life of a process, are made once and then used by everything.
+
+A process wanting a lookup makes itself a stream socketpair and passes one end
+to the proxies, through a socket inherited from the daemon; whichever proxy
+takes it serves that process from then on. Requests and replies are framed by
+a header giving the length and an id, and a process may send several requests
+before reading the replies, which come back in order. A proxy waits on all its
+client sockets and serves each complete request it finds, so concurrent
+queries are spread over the proxies, and each proxy has at most one connection
+to each server.
+
+If the proxy cannot be reached the process does the lookup itself. Once a
+request has been sent it is not repeated, as the query might change data and
+the proxy might yet run it; a proxy that fails, or does not answer within
+daemon_lookup_proxy_timeout, makes the lookup defer. */
+
+#define LP_TIDY		1000		/* lookups by a proxy between tidyups */
+#define LP_MAXREQ	65536		/* largest request accepted */
+
+typedef struct lp_hdr {
+  unsigned	len;			/* bytes following the header */
+  unsigned	id;
+} lp_hdr;
+
+/* Fixed part of a reply, followed by the data (if any) including its NUL and
+then the error message with its NUL */
+
+typedef struct lp_reply {
+  lp_hdr	h;
+  int		rc;
+  unsigned	do_cache;
+  int		dlen;			/* -1 for no data */
+  BOOL		tainted;
+} lp_reply;
+
+#define LPF_TAINTED	BIT(0)		/* request flags: query was tainted */
+#define LPF_OPTS	BIT(1)		/*                options present */
+
+static int lp_fd = -1;			/* this process's socket to a proxy */
+static pid_t lp_pid = 0;		/* the process that made it */
+static unsigned lp_id = 0;
+
+
+/* Check whether a lookup type is one listed for the proxy */
+
+static BOOL
+lp_listed(const uschar * name)
+{
+const uschar * list = daemon_lookup_proxy, * ele;
+int sep = 0;
+
+while ((ele = string_nextinlist(&list, &sep, NULL, 0)))
+  if (Ustrcmp(ele, name) == 0) return TRUE;
+return FALSE;
+}
+
+/* Check whether a lookup is to be done by the proxy */
+
+static BOOL
+lp_wanted(const lookup_info * li, const uschar * filename)
+{
+return daemon_lookupproxy_fd >= 0 && !filename && lp_listed(li->name);
+}
+
+
+/* Get a socket to a proxy for this process. One inherited from a parent is
+shared with it, so is not used. */
+
+static int
+lp_connect(void)
+{
+struct msghdr msg = {0};
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf = {0};
+struct cmsghdr * cmsg;
+uschar kind = 'L';
+struct iovec vec = {.iov_base = &kind, .iov_len = 1};
+int sv[2];
+ssize_t n;
+
+if (lp_fd >= 0)
+  {
+  if (lp_pid == getpid()) return lp_fd;
+  (void) close(lp_fd);
+  lp_fd = -1;
+  }
+if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+msg.msg_control = &cmsgbuf.buf;
+msg.msg_controllen = sizeof(cmsgbuf.buf);
+cmsg = CMSG_FIRSTHDR(&msg);
+cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+cmsg->cmsg_level = SOL_SOCKET;
+cmsg->cmsg_type = SCM_RIGHTS;
+memcpy(CMSG_DATA(cmsg), &sv[1], sizeof(int));
+
+while ((n = sendmsg(daemon_lookupproxy_fd, &msg, 0)) < 0 && errno == EINTR) ;
+(void) close(sv[1]);
+if (n != 1)
+  {
+  DEBUG(D_lookup) debug_printf_indent("lookup proxy: cannot pass socket: %s\n",
+    n < 0 ? strerror(errno) : "short write");
+  (void) close(sv[0]);
+  return -1;
+  }
+(void) fcntl(sv[0], F_SETFD, fcntl(sv[0], F_GETFD) | FD_CLOEXEC);
+lp_pid = getpid();
+return lp_fd = sv[0];
+}
+
+
+/* Read a given amount from the proxy, with an overall timeout */
+
+static BOOL
+lp_read(int fd, void * buf, size_t len, time_t limit)
+{
+uschar * p = buf;
+
+while (len > 0)
+  {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int wait = (int)(limit - time(NULL));
+  ssize_t n;
+  int rc;
+
+  if (wait <= 0 || (rc = poll(&pfd, 1, wait * 1000)) == 0)
+    { errno = ETIMEDOUT; return FALSE; }
+  if (rc < 0)
+    { if (errno == EINTR) continue; return FALSE; }
+  if ((n = read(fd, p, len)) < 0)
+    { if (errno == EINTR) continue; return FALSE; }
+  if (n == 0) { errno = 0; return FALSE; }
+  p += n;
+  len -= n;
+  }
+return TRUE;
+}
+
+
+/* Have the proxy do a lookup. The arguments and the result are as for the
+lookup's find function.
+
+Returns:	OK, FAIL or DEFER from the lookup, DEFER if the proxy failed
+		after the request was sent, or -1 if the request could not be
+		sent, in which case the caller does the lookup itself
+*/
+
+static int
+lp_find(const lookup_info * li, const uschar * query, const uschar * opts,
+  uschar ** result, uschar ** errmsg, uint * do_cache)
+{
+int fd = lp_connect(), nlen = Ustrlen(li->name) + 1,
+  olen = opts ? Ustrlen(opts) + 1 : 0, qlen = Ustrlen(query) + 1;
+lp_hdr h = {.len = 1 + nlen + olen + qlen, .id = ++lp_id};
+lp_reply r;
+uschar flags = (is_tainted(query) ? LPF_TAINTED : 0) | (opts ? LPF_OPTS : 0);
+time_t limit = time(NULL) + daemon_lookup_proxy_timeout;
+gstring * g;
+uschar * s;
+int rest;
+
+if (fd < 0 || h.len > LP_MAXREQ) return -1;
+
+g = string_get(sizeof(h) + h.len);
+g = string_catn(g, US &h, sizeof(h));
+g = string_catn(g, &flags, 1);
+g = string_catn(g, US li->name, nlen);
+if (opts) g = string_catn(g, opts, olen);
+g = string_catn(g, query, qlen);
+
+if (write_to_fd_buf(fd, g->s, g->ptr) != g->ptr)
+  {
+  DEBUG(D_lookup) debug_printf_indent("lookup proxy: cannot send request: %s\n",
+    strerror(errno));
+  (void) close(lp_fd);
+  lp_fd = -1;
+  return -1;
+  }
+
+/* The reply has the id of the request; any for earlier requests (abandoned
+after a timeout) have gone with the socket. */
+
+if (!lp_read(fd, &r, sizeof(r), limit))
+  goto bad;
+if (  r.h.id != h.id
+   || r.h.len < sizeof(r) - sizeof(lp_hdr) + 1
+   || r.h.len > LP_MAXREQ * 16)
+  { errno = EPROTO; goto bad; }
+
+rest = r.h.len - (sizeof(r) - sizeof(lp_hdr));
+s = store_get(rest, r.tainted ? GET_TAINTED : GET_UNTAINTED);
+if (!lp_read(fd, s, rest, limit))
+  goto bad;
+if (s[rest-1] || r.dlen >= rest)
+  { errno = EPROTO; goto bad; }
+
+*result = r.dlen >= 0 ? s : NULL;
+*errmsg = r.dlen >= 0 ? s + r.dlen + 1 : s;
+if (r.do_cache < *do_cache) *do_cache = r.do_cache;	/* keep any cache=no_wr */
+DEBUG(D_lookup) debug_printf_indent("lookup done by proxy\n");
+return r.rc;
+
+bad:
+  *errmsg = string_sprintf("lookup proxy failed: %s",
+    errno ? strerror(errno) : "connection closed");
+  DEBUG(D_lookup) debug_printf_indent("%s\n", *errmsg);
+  (void) close(lp_fd);
+  lp_fd = -1;
+  return DEFER;
+}
+
+
+/* Serve one request, in the main pool, and write the reply */
+
+static void
+lp_serve_one(int fd, unsigned id, const uschar * req, int len)
+{
+rmark reset_point = store_mark();
+const uschar * name = req + 1, * opts = NULL, * query, * end = req + len;
+const lookup_info * li;
+lp_reply r = {.h.id = id, .rc = DEFER, .do_cache = 0, .dlen = -1};
+uschar * data = NULL, * errmsg = US"bad request to lookup proxy";
+gstring * g;
+
+/* The request must end with a NUL, so that each of its strings does */
+
+if (len > 1 && req[len-1] == 0)
+  {
+  query = name + Ustrlen(name) + 1;
+  if (*req & LPF_OPTS && query < end)
+    { opts = query; query += Ustrlen(query) + 1; }
+  }
+else
+  query = end;
+
+if (query >= end)
+  ;
+else if (!lp_listed(name))
+  errmsg = string_sprintf("lookup type \"%s\" is not done by the lookup proxy",
+    name);
+else if (!(li = search_findtype(name, Ustrlen(name))))
+  errmsg = search_error_message;
+else
+  {
+  void * handle = search_open(NULL, li, 0, NULL, NULL);
+  uschar * q = string_copy_taint(query,
+			*req & LPF_TAINTED ? GET_TAINTED : GET_UNTAINTED);
+  int old_pool = store_pool;
+
+  errmsg = search_error_message;
+  if (handle)
+    {
+    search_cache * c = ((tree_node *)handle)->data.ptr;
+    uint do_cache = UINT_MAX;
+
+    errmsg = US"";
+    store_pool = POOL_SEARCH;
+    r.rc = li->find(c->handle, NULL, q, Ustrlen(q), &data, &errmsg,
+	&do_cache, opts);
+    store_pool = old_pool;
+    r.do_cache = do_cache;
+    if (!errmsg) errmsg = US"";
+    }
+  }
+
+if (data)
+  {
+  r.dlen = Ustrlen(data);
+  r.tainted = is_tainted(data);
+  }
+g = string_catn(NULL, US &r, sizeof(r));
+if (data) g = string_catn(g, data, r.dlen + 1);
+g = string_catn(g, errmsg, Ustrlen(errmsg) + 1);
+((lp_reply *)g->s)->h.len = g->ptr - sizeof(lp_hdr);
+(void) write_to_fd_buf(fd, g->s, g->ptr);
+store_reset(reset_point);
+}
+
+
+/* The main loop of a lookup proxy process. The socket is the one on which
+client sockets arrive. Does not return. */
+
+typedef struct lp_client {
+  int		fd;
+  unsigned	len;			/* bytes in buf */
+  unsigned	size;
+  uschar *	buf;
+} lp_client;
+
+void
+search_proxy_serve(int sock)
+{
+lp_client * clients = NULL;
+struct pollfd * polls = NULL;
+int nclients = 0, maxclients = 0;
+unsigned served = 0;
+BOOL pending = FALSE;
+
+for (;;)
+  {
+  if (nclients >= maxclients)
+    {
+    lp_client * nc;
+    maxclients = maxclients ? maxclients * 2 : 16;
+    nc = store_malloc(maxclients * sizeof(lp_client));
+    if (clients)
+      {
+      memcpy(nc, clients, nclients * sizeof(lp_client));
+      store_free(clients);
+      store_free(polls);
+      }
+    clients = nc;
+    polls = store_malloc((maxclients + 1) * sizeof(struct pollfd));
+    }
+
+  polls[0] = (struct pollfd) {.fd = sock, .events = POLLIN};
+  for (int i = 0; i < nclients; i++)
+    polls[i+1] = (struct pollfd) {.fd = clients[i].fd, .events = POLLIN};
+
+  /* With requests already read and not yet served, do not wait */
+
+  if (poll(polls, nclients + 1, pending ? 0 : -1) < 0)
+    {
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC, "lookup proxy: poll: %s", strerror(errno));
+    exim_underbar_exit(EXIT_FAILURE);
+    }
+
+  /* A new client */
+
+  if (polls[0].revents)
+    {
+    struct msghdr msg = {0};
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf = {0};
+    struct cmsghdr * cmsg;
+    uschar kind;
+    struct iovec vec = {.iov_base = &kind, .iov_len = 1};
+    ssize_t n;
+
+    msg.msg_control = &cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+
+    if ((n = recvmsg(sock, &msg, MSG_DONTWAIT)) == 0)
+      exim_underbar_exit(EXIT_SUCCESS);		/* all requesters have gone */
+    if (  n > 0 && (cmsg = CMSG_FIRSTHDR(&msg))
+       && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+       && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+      {
+      lp_client * c = &clients[nclients++];
+      memcpy(&c->fd, CMSG_DATA(cmsg), sizeof(int));
+      c->len = c->size = 0;
+      c->buf = NULL;
+      polls[nclients] = (struct pollfd) {.fd = -1};	/* nothing read yet */
+      DEBUG(D_lookup) debug_printf("lookup proxy: new client on fd %d\n", c->fd);
+      }
+    }
+
+  /* Read what has arrived from each client, and serve one request from each,
+  so that a client with many pipelined requests does not hold up others. */
+
+  pending = FALSE;
+  for (int i = 0; i < nclients; i++)
+    {
+    lp_client * c = &clients[i];
+    lp_hdr h;
+    BOOL drop = FALSE;
+
+    if (polls[i+1].revents)
+      {
+      ssize_t n;
+      if (c->size - c->len < 4096)
+	{
+	uschar * nb = store_malloc(c->size += 8192);
+	if (c->buf)
+	  {
+	  memcpy(nb, c->buf, c->len);
+	  store_free(c->buf);
+	  }
+	c->buf = nb;
+	}
+      if ((n = read(c->fd, c->buf + c->len, c->size - c->len)) > 0)
+	c->len += n;
+      else if (n == 0 || errno != EINTR)
+	drop = TRUE;
+      }
+
+    if (!drop && c->len >= sizeof(h))
+      {
+      memcpy(&h, c->buf, sizeof(h));
+      if (h.len == 0 || h.len > LP_MAXREQ)
+	drop = TRUE;
+      else if (c->len >= sizeof(h) + h.len)
+	{
+	lp_serve_one(c->fd, h.id, c->buf + sizeof(h), h.len);
+	c->len -= sizeof(h) + h.len;
+	memmove(c->buf, c->buf + sizeof(h) + h.len, c->len);
+
+	if (++served >= LP_TIDY)	/* drop store and reconnect occasionally */
+	  {
+	  search_tidyup();
+	  served = 0;
+	  }
+	if (c->len >= sizeof(h))
+	  {
+	  memcpy(&h, c->buf, sizeof(h));
+	  if (c->len >= sizeof(h) + h.len) pending = TRUE;
+	  }
+	}
+      }
+
+    if (drop)
+      {
+      DEBUG(D_lookup) debug_printf("lookup proxy: client on fd %d gone\n", c->fd);
+      (void) close(c->fd);
+      if (c->buf) store_free(c->buf);
+      *c = clients[--nclients];
+      polls[i+1] = polls[nclients+1];
+      i--;
+      }
+    }
+  }
+}
+
+
+
 /*************************************************
 *      Validate a plain lookup type name         *
 *************************************************/
@@ -298,6 +1160,7 @@ if (t->left)  tidyup_subtree(t->left);
 if (t->right) tidyup_subtree(t->right);
 if (c && c->handle && c->li->close)
   c->li->close(c->handle);
+if (c) lcache_flush(c);
 }
 
 
@@ -493,7 +1356,7 @@ if (!t)
   {
   t = store_get(sizeof(tree_node) + Ustrlen(keybuffer), GET_UNTAINTED);
   t->data.ptr = c = store_get(sizeof(search_cache), GET_UNTAINTED);
-  c->item_cache = NULL;
+  memset(c, 0, sizeof(search_cache));
   Ustrcpy(t->name, keybuffer);
   tree_insertnode(&search_tree, t);
   }
@@ -515,8 +1378,8 @@ return t;
 *  Internal function: Find one item in database  *
 *************************************************/
 
-/* The answer is always put into dynamic store. The last lookup for each handle
-is cached.
+/* The answer is always put into dynamic store. The results of lookups for each
+handle are cached.
 
 Arguments:
   handle	the handle from search_open; points to tree node
@@ -540,7 +1403,9 @@ internal_search_find(void * handle, const uschar * filename,
 tree_node * t = (tree_node *)handle;
 search_cache * c = (search_cache *)(t->data.ptr);
 const lookup_info * li = c->li;
-expiring_data * e = NULL;	/* compiler quietening */
+lookup_cache_item * i, * hit = NULL;
+unsigned hash;
+time_t expiry;
 uschar * data = NULL;
 int old_pool = store_pool;
 
@@ -563,30 +1428,46 @@ if (!*keystring) return NULL;
 store_pool = POOL_SEARCH;
 
 /* Look up the data for the key, unless it is already in the cache for this
-file. No need to check c->item_cache for NULL, tree_search will do so. Check
-whether we want to use the cache entry last so that we can always replace it. */
+file. Check whether we want to use the cache entry last so that we can always
+replace it. */
 
-if (  (t = tree_search(c->item_cache, keystring))
-   && (!(e = t->data.ptr)->expiry || e->expiry > time(NULL))
-   && (!opts && !e->opts  ||  opts && e->opts && Ustrcmp(opts, e->opts) == 0)
+hash = lcache_hash(keystring);
+if (  (i = lcache_find(c, keystring, hash))
+   && (!i->expiry || i->expiry > time(NULL))
+   && (!opts && !i->opts  ||  opts && i->opts && Ustrcmp(opts, i->opts) == 0)
    && cache & CACHE_RD
    )
-  { /* Data was in the cache already; set the pointer from the tree node */
-  data = e->data.ptr;
+  { /* Data was in the cache already; copy it out below */
+  lcache_touch(c, hit = i);
+  lookup_cache_hits++;
+  data = US i->data;
   DEBUG(D_lookup) debug_printf_indent("cached data used for lookup of %s%s%s\n",
     keystring,
     filename ? US"\n  in " : US"", filename ? filename : US"");
   }
+
+/* A shared lookup may have been done already by another process of the
+daemon. The result is then taken into the cache for this process too. */
+
+else if (  lcs_wanted(li) && cache & CACHE_RD
+	&& lcs_find(li, filename, opts, keystring, &data, &expiry))
+  {
+  lookup_cache_hits++;
+  DEBUG(D_lookup) debug_printf_indent("shared cached data used for lookup of %s\n",
+    keystring);
+  if (i) lcache_remove(c, i);
+  lcache_add(c, keystring, hash, opts, data, expiry);
+  }
 else
   {
   uint do_cache = cache & CACHE_WR ? UINT_MAX : 0;
-  int keylength = Ustrlen(keystring);
+  int keylength = Ustrlen(keystring), rc;
 
   DEBUG(D_lookup)
     {
-    if (t)
+    if (i)
       debug_printf_indent("cached data found but %s; ",
-	e->expiry && e->expiry <= time(NULL) ? "out-of-date"
+	i->expiry && i->expiry <= time(NULL) ? "out-of-date"
 	: cache & CACHE_RD ? "wrong opts" : "no_rd option set");
     debug_printf_indent("%s lookup required for %s%s%s\n",
       filename ? US"file" : US"database",
@@ -651,12 +1532,28 @@ else
 #endif
     }
 
-  /* Call the code for the different kinds of search. DEFER is handled
-  like FAIL, except that search_find_defer is set so the caller can
-  distinguish if necessary. */
+  /* An out-of-date entry is dropped now, whatever happens to the lookup */
+
+  if (i && i->expiry && i->expiry <= time(NULL))
+    {
+    lcache_remove(c, i);
+    lookup_cache_evictions++;
+    i = NULL;
+    }
+  lookup_cache_misses++;
+
+  /* Call the code for the different kinds of search, unless the lookup proxy
+  does it. DEFER is handled like FAIL, except that search_find_defer is set so
+  the caller can distinguish if necessary. */
+
+  rc = lp_wanted(li, filename)
+    ? lp_find(li, keystring, opts, &data, &search_error_message, &do_cache)
+    : -1;
+  if (rc < 0)
+    rc = li->find(c->handle, filename, keystring, keylength,
+	  &data, &search_error_message, &do_cache, opts);
 
-  if (li->find(c->handle, filename, keystring, keylength,
-	  &data, &search_error_message, &do_cache, opts) == DEFER)
+  if (rc == DEFER)
     f.search_find_defer = TRUE;
 
   /* A record that has been found is now in data, which is either NULL
@@ -664,38 +1561,39 @@ else
   caching is permitted. Lookups can disable caching, when they did something
   that changes their data. The mysql and pgsql lookups do this when an
   UPDATE/INSERT query was executed.  Lookups can also set a TTL for the
-  cache entry; the dnsdb lookup does.
-  Finally, the caller can request no caching by setting an option. */
+  cache entry; the dnsdb lookup does, and lookup_cache_ttl sets a limit for
+  all of them. Finally, the caller can request no caching by setting an option.
+  The cache has its own copy of the data, in malloc store. */
 
   else if (do_cache)
     {
+    if (lookup_cache_ttl > 0 && do_cache > (uint)lookup_cache_ttl)
+      do_cache = lookup_cache_ttl;
     DEBUG(D_lookup) debug_printf_indent("%s cache entry\n",
-      t ? "replacing old" : "creating new");
-    if (!t)	/* No existing entry.  Create new one. */
+      i ? "replacing old" : "creating new");
+    if (i) lcache_remove(c, i);
+    lcache_add(c, keystring, hash, opts, data,
+      do_cache == UINT_MAX ? 0 : time(NULL) + do_cache);
+
+    /* Results shared with other processes always have a lifetime */
+
+    if (lcs_wanted(li))
       {
-      int len = keylength + 1;
-      /* The cache node value should never be expanded so use tainted mem */
-      e = store_get(sizeof(expiring_data) + sizeof(tree_node) + len, GET_TAINTED);
-      t = (tree_node *)(e+1);
-      memcpy(t->name, keystring, len);
-      t->data.ptr = e;
-      tree_insertnode(&c->item_cache, t);
+      if (lookup_cache_shared_ttl > 0 && do_cache > (uint)lookup_cache_shared_ttl)
+	do_cache = lookup_cache_shared_ttl;
+      if (do_cache != UINT_MAX)
+	lcs_store(li, filename, opts, keystring, data, time(NULL) + do_cache);
       }
-      /* Else previous, out-of-date cache entry.  Update with the */
-      /* new result and forget the old one */
-    e->expiry = do_cache == UINT_MAX ? 0 : time(NULL)+do_cache;
-    e->opts = opts ? string_copy(opts) : NULL;
-    e->data.ptr = data;
     }
 
 /* If caching was disabled by the method call (as opposed to a no_wr option),
-empty the cache tree. We just set the cache pointer to NULL here, because we
-cannot release the store at this stage. */
+empty the cache. */
 
   else if (cache & CACHE_WR)
     {
     DEBUG(D_lookup) debug_printf_indent("lookup forced cache cleanup\n");
-    c->item_cache = NULL; 	/* forget all lookups on this connection */
+    lcache_flush(c);	/* forget all lookups on this connection */
+    if (lcs_wanted(li)) lcs_invalidate(li);
     }
   else DEBUG(D_lookup)
     debug_printf_indent("no_wr option: no cache invalidate\n");
@@ -711,10 +1609,13 @@ DEBUG(D_lookup)
   else debug_printf_indent("lookup failed\n");
   }
 
-/* Return it in new dynamic store in the regular pool */
+/* Return it in new dynamic store in the regular pool. Data from the cache
+takes the taint it had when the lookup was done. */
 
 store_pool = old_pool;
-return data ? string_copy(data) : NULL;
+return !data ? NULL
+  : hit ? string_copy_taint(data, hit->tainted ? GET_TAINTED : GET_UNTAINTED)
+  : string_copy(data);
 }
 
 
@@ -11,6 +11,7 @@
 
 
 #include "exim.h"
+#include <sys/uio.h>
 #include <assert.h>
 
 
@@ -26,13 +27,16 @@ we need room to handle large base64-encoded AUTHs for GSSAPI.
 
 #define SMTP_CMD_BUFFER_SIZE	16384
 
-/* Size of buffer for reading SMTP incoming packets */
+/* Size of buffer for reading SMTP incoming packets, and the size it may grow
+to while message data is arriving */
 
 #define IN_BUFFER_SIZE		8192
+#define IN_BUFFER_MAX		(128*1024)
 
-/* Buffer for SMTP responses */
+/* Buffer for SMTP responses; the responses to a pipelined group of commands
+are gathered here, up to the payload of one TLS record. */
 
-#define SMTP_RESP_BUFFER_SIZE	2048
+#define SMTP_RESP_BUFFER_SIZE	16384
 
 /* Structure for SMTP command list */
 
@@ -138,6 +142,7 @@ static struct {
 #endif
   BOOL rcpt_smtp_response_same		:1;
   BOOL rcpt_in_progress			:1;
+  BOOL resp_batch			:1;
 #ifdef SUPPORT_I18N
   BOOL smtputf8_advertised		:1;
 #endif
@@ -154,6 +159,9 @@ static int  unknown_command_count;
 static int  sync_cmd_limit;
 static int  smtp_write_error = 0;
 static int  smtp_resp_ptr = 0;
+static int  smtp_rss_steady = -1;
+static int  smtp_rss_max = -1;		/* Largest size seen, if no peak */
+static BOOL smtp_rss_peak_reset = FALSE;
 
 static uschar *rcpt_smtp_response;
 static uschar *smtp_data_buffer;
@@ -345,6 +353,8 @@ one incoming SMTP call, we just use a single buffer and flags. There is no need
 to implement a complicated private FILE-like structure.*/
 
 static uschar *smtp_inbuffer;
+static unsigned smtp_inbuffer_size = IN_BUFFER_SIZE;
+static BOOL    smtp_inbuffer_filled = FALSE;
 static uschar *smtp_inptr;
 static uschar *smtp_inend;
 static int     smtp_had_eof;
@@ -394,8 +404,27 @@ log_write(L_smtp_incomplete_transaction, LOG_MAIN|LOG_SENDER|LOG_RECIPIENTS,
 static void
 log_close_event(const uschar * reason)
 {
-log_write(L_smtp_connection, LOG_MAIN, "%s D=%s closed %s",
-  smtp_get_connection_info(), string_timesince(&smtp_connection_start), reason);
+uschar * rss = US"";
+
+if (LOGGING(connection_memory))
+  {
+  int peak, now = os_get_rss(&peak);
+  if (smtp_rss_steady < 0) smtp_rss_steady = now;
+
+  /* The peak is for the process's lifetime, inherited from the daemon and
+  any earlier connections, unless it was reset when this one started. Failing
+  that, use the largest of the sizes seen at the ends of messages. */
+
+  if (!smtp_rss_peak_reset) peak = MAX(smtp_rss_max, now);
+  if (peak >= 0)
+    rss = smtp_rss_steady >= 0
+      ? string_sprintf(" RSS=%dk/%dk", smtp_rss_steady, peak)
+      : string_sprintf(" RSS=-/%dk", peak);
+  }
+
+log_write(L_smtp_connection, LOG_MAIN, "%s D=%s%s closed %s",
+  smtp_get_connection_info(), string_timesince(&smtp_connection_start), rss,
+  reason);
 }
 
 
@@ -456,9 +485,9 @@ smtp_buf_init(void)
 call the local functions instead of the standard C ones.  Place a NUL at the
 end of the buffer to safety-stop C-string reads from it. */
 
-if (!(smtp_inbuffer = US malloc(IN_BUFFER_SIZE)))
+if (!smtp_inbuffer && !(smtp_inbuffer = US malloc(smtp_inbuffer_size)))
   log_write_die(0, LOG_MAIN, "malloc() failed for SMTP input buffer");
-smtp_inbuffer[IN_BUFFER_SIZE-1] = '\0';
+smtp_inbuffer[smtp_inbuffer_size-1] = '\0';
 
 smtp_inptr = smtp_inend = smtp_inbuffer;
 smtp_had_eof = smtp_had_error = 0;
@@ -483,6 +512,49 @@ if (!dkim_mi && !(dkim_mi = misc_mod_findonly(US"dkim")))
 #endif
 
 
+/* Change the size of the input buffer, keeping any data in it.  Used to grow
+it while message data is arriving, so that each read() takes more, and to
+shrink it again afterwards.  If the memory cannot be had the old size is kept.
+
+Argument:	the new size; must be more than the amount buffered
+*/
+
+static void
+smtp_inbuffer_resize(unsigned size)
+{
+int n = smtp_inend - smtp_inptr;
+uschar * p;
+
+if (n > 0 && smtp_inptr > smtp_inbuffer)
+  memmove(smtp_inbuffer, smtp_inptr, n);
+if ((p = US realloc(smtp_inbuffer, size)))
+  {
+  smtp_inbuffer = p;
+  smtp_inbuffer_size = size;
+  }
+smtp_inbuffer[smtp_inbuffer_size-1] = '\0';
+smtp_inptr = smtp_inbuffer;
+smtp_inend = smtp_inbuffer + n;
+smtp_inbuffer_filled = FALSE;
+DEBUG(D_receive) debug_printf("SMTP input buffer size %u\n", smtp_inbuffer_size);
+}
+
+
+/* Shrink the input buffers back to their command-phase size, if they were
+grown for the last message and what is buffered now fits. */
+
+static void
+smtp_inbuffer_shrink(void)
+{
+if (  smtp_inbuffer_size > IN_BUFFER_SIZE
+   && smtp_inend - smtp_inptr < IN_BUFFER_SIZE)
+  smtp_inbuffer_resize(IN_BUFFER_SIZE);
+#ifndef DISABLE_TLS
+if (tls_in.active.sock >= 0) tls_in_buffer_shrink();
+#endif
+}
+
+
 /* Refill the buffer, and notify DKIM verification code.
 Return false for error or EOF.
 */
@@ -495,13 +567,22 @@ int rc, save_errno;
 if (smtp_out_fd < 0 || smtp_in_fd < 0) return FALSE;
 
 smtp_fflush(SFF_UNCORK);
+
+/* If the last read filled the buffer, a bulk transfer (message data) is in
+progress; double the (now empty) buffer, up to a limit, to take more at a time.
+Command traffic never fills it. */
+
+if (smtp_inbuffer_filled && smtp_inbuffer_size < IN_BUFFER_MAX)
+  smtp_inbuffer_resize(smtp_inbuffer_size * 2);
+
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
 
 /* Limit amount read, so non-message data is not fed to DKIM.
 Take care to not touch the safety NUL at the end of the buffer. */
 
-rc = read(smtp_in_fd, smtp_inbuffer, MIN(IN_BUFFER_SIZE-1, lim));
+rc = read(smtp_in_fd, smtp_inbuffer, MIN(smtp_inbuffer_size-1, lim));
 save_errno = errno;
+smtp_in_reads++;
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
 if (rc <= 0)
   {
@@ -527,6 +608,7 @@ smtp_verify_feed(smtp_inbuffer, rc);
 #endif
 smtp_inend = smtp_inbuffer + rc;
 smtp_inptr = smtp_inbuffer;
+smtp_inbuffer_filled = rc == smtp_inbuffer_size - 1;
 return TRUE;
 }
 
@@ -592,7 +674,8 @@ if (n > 0)
 
 
 /* SMTP version of ungetc()
-Puts a character back in the input buffer. Only ever called once.
+Puts a character back in the input buffer. Only ever called for characters
+just taken from the buffer, in reverse order.
 
 Arguments:
   ch           the character
@@ -723,6 +806,7 @@ return wouldblock_reading(eof_ok);
 /* Forward declarations */
 static inline void bdat_push_receive_functions(void);
 static inline void bdat_pop_receive_functions(void);
+static BOOL pipeline_response(void);
 
 
 /* Get a byte from the smtp input, in CHUNKING mode.  Handle ack of the
@@ -791,8 +875,9 @@ for(;;)
     goto repeat_until_rset;
     }
 
-  /* If not the last, ack the received chunk.  The last response is delayed
-  until after the data ACL decides on it */
+  /* If not the last, ack the received chunk; when the next BDAT is already
+  waiting the ack can go with the responses that follow.  The last response is
+  delayed until after the data ACL decides on it */
 
   if (chunking_state == CHUNKING_LAST)
     {
@@ -802,7 +887,8 @@ for(;;)
     return EOD;
     }
 
-  smtp_printf("250 %u byte chunk received\r\n", SP_NO_MORE, chunking_datasize);
+  smtp_printf("250 %u byte chunk received\r\n", pipeline_response(),
+    chunking_datasize);
   chunking_state = CHUNKING_OFFERED;
   DEBUG(D_receive)
     debug_printf("chunking state '%s'\n", chunking_states[chunking_state]);
@@ -902,6 +988,84 @@ chunking_data_left -= *len;
 return buf;
 }
 
+#ifdef EXIM_HAVE_SPLICE
+/* Move up to len bytes of the current chunk from the SMTP input socket to a
+spool file, via a pipe, without copying them through user space.  This is only
+possible when none of the chunk is already buffered, the connection is not
+TLS, and the data is not needed for DKIM verification; otherwise the caller
+should use bdat_getbuf().
+
+Arguments:
+  fout		stream to append to; it is flushed before, and repositioned
+		to the end after
+  len		maximum number of bytes to move
+
+Returns:	the number of bytes moved, 0 if the data cannot be spliced,
+		-1 for error or EOF on the input, -2 for error on the output
+*/
+
+int
+bdat_splice(FILE * fout, unsigned len)
+{
+static int pipefd[2] = {-1, -1};
+int fd = fileno(fout);
+ssize_t got;
+
+if (  chunking_data_left == 0 || smtp_hasc() || smtp_in_fd < 0
+# ifndef DISABLE_TLS
+   || tls_in.active.sock >= 0
+# endif
+# ifndef DISABLE_DKIM
+   || !f.dkim_disable_verify
+# endif
+   )
+  return 0;
+
+if (pipefd[0] < 0 && pipe2(pipefd, O_CLOEXEC) < 0)
+  {
+  DEBUG(D_receive) debug_printf("CHUNKING: pipe for splice: %s\n",
+				strerror(errno));
+  return 0;
+  }
+
+if (len > chunking_data_left) len = chunking_data_left;
+if (fflush(fout) != 0) return -2;
+
+smtp_fflush(SFF_UNCORK);
+if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
+got = splice(smtp_in_fd, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE);
+if (smtp_receive_timeout > 0) ALARM_CLR(0);
+if (got <= 0)
+  {
+  if (got < 0)
+    {
+    int save_errno = errno;
+    if (had_data_timeout)
+      smtp_data_timeout_exit();
+    if (had_data_sigint)
+      smtp_data_sigint_exit();
+    smtp_had_error = save_errno;
+    }
+  else
+    smtp_had_eof = 1;
+  return -1;
+  }
+chunking_data_left -= got;
+
+for (ssize_t left = got, n; left > 0; left -= n)
+  if ((n = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+    {
+    /* Empty the pipe so it can be used again */
+
+    uschar buf[4096];
+    while (left > 0 && (n = read(pipefd[0], buf, MIN(left, (ssize_t)sizeof(buf)))) > 0)
+      left -= n;
+    return -2;
+    }
+return fseek(fout, 0, SEEK_END) < 0 ? -2 : got;
+}
+#endif
+
 void
 bdat_flush_data(void)
 {
@@ -1063,53 +1227,24 @@ if (smtp_out_fd < 0)
 else if (tls_in.active.sock >= 0)
   { if (tls_write(NULL, gs.s, gs.ptr, more) < 0) smtp_write_error = -1; }
 #endif
-else
-  if (more)				/* stash for later if possible */
-    {
-    if (smtp_resp_ptr + gs.ptr <= SMTP_RESP_BUFFER_SIZE)
-      {					/* can fit new */
-      memcpy(smtp_resp_buffer + smtp_resp_ptr, gs.s, gs.ptr);
-      smtp_resp_ptr += gs.ptr;
-      }
-    else
-      {
-      if (smtp_resp_ptr > 0)
-	{					/* flush the old */
-	if (write(smtp_out_fd, smtp_resp_buffer, smtp_resp_ptr) != smtp_resp_ptr)
-	  smtp_write_error = -1;
-	smtp_resp_ptr = 0;
-	}
-      if (gs.ptr <= SMTP_RESP_BUFFER_SIZE)
-	{					/* can fit new */
-	memcpy(smtp_resp_buffer + smtp_resp_ptr, gs.s, gs.ptr);
-	smtp_resp_ptr = gs.ptr;
-	}
-      else					/* new too big */
-	if (write (smtp_out_fd, gs.s, gs.ptr) != gs.ptr)
-	  smtp_write_error = -1;
-      }
-    }
-  else					/* send it now */
-    if (smtp_resp_ptr > 0)			/* previously buffered */
-      {
-      if (smtp_resp_ptr + gs.ptr <= SMTP_RESP_BUFFER_SIZE)
-	{					/* can fit new */
-	int n = smtp_resp_ptr + gs.ptr;
-	memcpy(smtp_resp_buffer + smtp_resp_ptr, gs.s, gs.ptr);
-	if (write(smtp_out_fd, smtp_resp_buffer, n) != n)
-	  smtp_write_error = -1;
-	}
-      else
-	if (  write(smtp_out_fd, smtp_resp_buffer, smtp_resp_ptr)
-	      != smtp_resp_ptr
-	   || write (smtp_out_fd, gs.s, gs.ptr) != gs.ptr
-	   )
-	  smtp_write_error = -1;
-      smtp_resp_ptr = 0;
-      }
-    else					/* nothing buffered */
-      if (write (smtp_out_fd, gs.s, gs.ptr) != gs.ptr)
-	smtp_write_error = -1;
+else if (more && smtp_resp_ptr + gs.ptr <= SMTP_RESP_BUFFER_SIZE)
+  {					/* stash for later */
+  memcpy(smtp_resp_buffer + smtp_resp_ptr, gs.s, gs.ptr);
+  smtp_resp_ptr += gs.ptr;
+  }
+else if (smtp_resp_ptr > 0)		/* send with those previously buffered */
+  {
+  struct iovec iov[2] = {
+    { .iov_base = smtp_resp_buffer, .iov_len = smtp_resp_ptr },
+    { .iov_base = gs.s, .iov_len = gs.ptr } };
+
+  if (writev(smtp_out_fd, iov, 2) != smtp_resp_ptr + gs.ptr)
+    smtp_write_error = -1;
+  smtp_resp_ptr = 0;
+  }
+else					/* nothing buffered */
+  if (write(smtp_out_fd, gs.s, gs.ptr) != gs.ptr)
+    smtp_write_error = -1;
 }
 
 
@@ -1753,6 +1888,7 @@ fl.rcpt_in_progress = FALSE;
 f.deliver_freeze = FALSE;				/* Can be set by ACL */
 freeze_tell = freeze_tell_config;			/* Can be set by ACL */
 fake_response = OK;					/* Can be set by ACL */
+message_priority = 0;					/* Can be set by ACL */
 #ifdef WITH_CONTENT_SCAN
 f.no_mbox_unspool = FALSE;				/* Can be set by ACL */
 #endif
@@ -1824,8 +1960,15 @@ while (acl_warn_logged)
   }
 
 misc_mod_smtp_reset();
+if (LOGGING(connection_memory) && !smtp_rss_peak_reset)
+  smtp_rss_max = MAX(smtp_rss_max, os_get_rss(NULL));
 message_tidyup();
-store_reset(reset_point);
+store_reset_full(reset_point);
+
+/* The process size now, with the store for any previous message released, is
+the steady-state figure for the connection. */
+
+if (LOGGING(connection_memory)) smtp_rss_steady = os_get_rss(NULL);
 
 message_start();
 return store_mark();
@@ -1835,6 +1978,159 @@ return store_mark();
 
 
 
+/*************************************************
+*       Reset per-connection state               *
+*************************************************/
+
+/* Called at the start of each SMTP session in the daemon, both by a process
+forked for the connection and by a pre-forked worker which may have handled
+others before. It clears what a connection finds out or is told, apart from
+the host and interface addresses, which have already been set up for it, and
+what ACLs and modules may have left from the last message. In a newly forked
+process this changes nothing. */
+
+void
+smtp_connection_reset(void)
+{
+/* The connecting host, and what we found out about it */
+
+sender_host_name = NULL;
+sender_host_aliases = &no_aliases;
+sender_fullhost = sender_rcvhost = sender_ident = sender_helo_name = NULL;
+sender_helo_dnssec = sender_host_dnssec = FALSE;
+sender_host_authenticated = sender_host_auth_pubname = NULL;
+memset(sender_host_cache, 0, sizeof(sender_host_cache));
+host_lookup_deferred = host_lookup_failed = FALSE;
+host_lookup_msg = US"";
+host_data = csa_status = NULL;
+lookup_dnssec_authenticated = NULL;
+dnslist_domain = dnslist_matched = dnslist_text = dnslist_value = NULL;
+#if defined(SUPPORT_PROXY) || defined(SUPPORT_SOCKS) || defined(EXPERIMENTAL_XCLIENT)
+proxy_session = FALSE;
+proxy_local_address = proxy_external_address = NULL;
+proxy_local_port = proxy_external_port = 0;
+#endif
+
+/* Authentication, verification, and other state of the SMTP conversation */
+
+authenticated_id = authenticated_fail_id = authenticated_sender = NULL;
+auth_defer_msg = US"reason not recorded";
+atrn_host = atrn_domains = NULL;
+ratelimiters_conn = ratelimiters_cmd = NULL;
+sender_verified_failed = NULL;
+sender_verify_failure = NULL;
+acl_verify_message = NULL;
+receive_messagecount = 0;
+chunking_state = CHUNKING_NOT_OFFERED;
+chunking_data_left = 0;
+connection_id = NULL;
+smtp_notquit_reason = NULL;
+memset(&fl, 0, sizeof(fl));
+smtp_write_error = smtp_resp_ptr = 0;
+had_command_timeout = had_command_sigterm = 0;
+had_data_timeout = had_data_sigint = 0;
+
+/* Module state (the SPF request made at HELO, for example), and anything left
+from the last transaction, which may not have been followed by a reset */
+
+misc_mod_conn_reset();
+(void) smtp_reset(store_mark());
+}
+
+
+
+
+/*************************************************
+*     Save and restore per-connection state      *
+*************************************************/
+
+/* A pre-forked SMTP worker in the daemon handles several connections in turn.
+Before the first, it saves here the state which handling a connection can
+change and which is otherwise set up only at process start: the global flags,
+options which ACL controls or connection setup can override, and the command
+table. After each connection the saved state is put back; the connection
+variables are cleared by smtp_connection_reset() as the next one starts. The
+caller releases the store used.
+
+A connection that used TLS or ATRN, or that had debug output turned on by an
+ACL, leaves library or process state which is not unpicked here; the worker
+must then exit rather than take another connection. */
+
+static struct {
+  struct global_flags	f;
+  smtp_cmd_list		cmd_list[nelem(cmd_list)];
+  uschar *		queue_name;
+  uschar *		originator_name;
+  const uschar *	submission_domain;
+  FILE *		debug_file;
+  unsigned int		debug_selector;
+  int			smtp_receive_timeout;
+  int			smtp_mailcmd_max;
+  unsigned int		dtrigger_selector;
+#ifdef SUPPORT_I18N
+  int			message_utf8_downconvert;
+#endif
+  BOOL			smtp_enforce_sync;
+  BOOL			allow_utf8_domains;
+} session_saved;
+
+
+void
+smtp_session_save(void)
+{
+session_saved.f = f;
+memcpy(session_saved.cmd_list, cmd_list, sizeof(cmd_list));
+session_saved.queue_name = queue_name;
+session_saved.originator_name = originator_name;
+session_saved.submission_domain = submission_domain;
+session_saved.debug_file = debug_file;
+session_saved.debug_selector = debug_selector;
+session_saved.smtp_receive_timeout = smtp_receive_timeout;
+session_saved.smtp_mailcmd_max = smtp_mailcmd_max;
+session_saved.dtrigger_selector = dtrigger_selector;
+#ifdef SUPPORT_I18N
+session_saved.message_utf8_downconvert = message_utf8_downconvert;
+#endif
+session_saved.smtp_enforce_sync = smtp_enforce_sync;
+session_saved.allow_utf8_domains = allow_utf8_domains;
+}
+
+
+/* Called after the connection is closed.
+
+Returns:  TRUE if another connection may be handled
+*/
+
+BOOL
+smtp_session_restore(void)
+{
+#ifndef DISABLE_TLS
+if (tls_in.active.sock >= 0 || tls_in.cipher || tls_in.on_connect)
+  return FALSE;
+#endif
+if (atrn_mode && *atrn_mode || debug_file != session_saved.debug_file)
+  return FALSE;
+
+f = session_saved.f;
+memcpy(cmd_list, session_saved.cmd_list, sizeof(cmd_list));
+queue_name = session_saved.queue_name;
+originator_name = session_saved.originator_name;
+submission_domain = session_saved.submission_domain;
+debug_selector = session_saved.debug_selector;
+smtp_receive_timeout = session_saved.smtp_receive_timeout;
+smtp_mailcmd_max = session_saved.smtp_mailcmd_max;
+dtrigger_selector = session_saved.dtrigger_selector;
+#ifdef SUPPORT_I18N
+message_utf8_downconvert = session_saved.message_utf8_downconvert;
+#endif
+smtp_enforce_sync = session_saved.smtp_enforce_sync;
+allow_utf8_domains = session_saved.allow_utf8_domains;
+return TRUE;
+}
+
+
+
+
 /*************************************************
 *  Initialize for incoming batched SMTP message  *
 *************************************************/
@@ -2333,6 +2629,9 @@ uschar *p, *s;
 gstring * ss;
 
 gettimeofday(&smtp_connection_start, NULL);
+smtp_rss_steady = smtp_rss_max = -1;
+if (LOGGING(connection_memory))
+  smtp_rss_peak_reset = os_reset_rss_peak();
 for (smtp_ch_index = 0; smtp_ch_index < SMTP_HBUFF_SIZE; smtp_ch_index++)
   smtp_connection_had[smtp_ch_index] = SCH_NONE;
 smtp_ch_index = 0;
@@ -2376,15 +2675,18 @@ fl.smtputf8_advertised = FALSE;
 
 acl_var_c = NULL;
 
-/* Allow for trailing 0 in the command and data buffers.  Tainted. */
+/* Allow for trailing 0 in the command and data buffers.  Tainted.
+A process handling a succession of connections keeps its buffers. */
 
-smtp_cmd_buffer = store_get_perm(2*SMTP_CMD_BUFFER_SIZE + 2, GET_TAINTED);
+if (!smtp_cmd_buffer)
+  {
+  smtp_cmd_buffer = store_get_perm(2*SMTP_CMD_BUFFER_SIZE + 2, GET_TAINTED);
+  smtp_resp_buffer = store_get_perm(SMTP_RESP_BUFFER_SIZE, GET_UNTAINTED);
+  }
 
 smtp_cmd_buffer[0] = 0;
 smtp_data_buffer = smtp_cmd_buffer + SMTP_CMD_BUFFER_SIZE + 1;
 
-smtp_resp_buffer = store_get_perm(SMTP_RESP_BUFFER_SIZE, GET_UNTAINTED);
-
 /* For batched input, the protocol setting can be overridden from the
 command line by a trusted caller. */
 
@@ -2981,18 +3283,18 @@ if (fl.rcpt_in_progress)
   }
 
 /* Now output the message, splitting it up into multiple lines if necessary.
-We only handle pipelining these responses as far as nonfinal/final groups,
-not the whole MAIL/RCPT/DATA response set. */
+The final line is also held back when the caller has flagged the response as
+one of a pipelined MAIL/RCPT group; it then goes out with the rest of them. */
 
 for (uschar * nl;;)
   if (!(nl = Ustrchr(msg, '\n')))
     {
-    smtp_printf("%.3s%c%.*s%s\r\n", !final, code, final ? ' ':'-', esclen, esc, msg);
+    smtp_printf("%.3s%c%.*s%s\r\n", !final || fl.resp_batch, code, final ? ' ':'-', esclen, esc, msg);
     return;
     }
   else if (nl[1] == 0 || f.no_multiline_responses)
     {
-    smtp_printf("%.3s%c%.*s%.*s\r\n", !final, code, final ? ' ':'-', esclen, esc,
+    smtp_printf("%.3s%c%.*s%.*s\r\n", !final || fl.resp_batch, code, final ? ' ':'-', esclen, esc,
       (int)(nl - msg), msg);
     return;
     }
@@ -3219,7 +3521,12 @@ if ((lognl = Ustrchr(log_msg, '\n'))) *lognl = 0;
 
 /* Send permanent failure response to the command, but the code used isn't
 always a 5xx one - see comments at the start of this function. If the original
-rc was FAIL_DROP we drop the connection and yield 2. */
+rc was FAIL_DROP we drop the connection and yield 2. A rejection within a
+pipelined MAIL/RCPT group is held back to go with the responses to the rest of
+the group; any other is sent now. */
+
+fl.resp_batch = !drop && (where == ACL_WHERE_MAIL || where == ACL_WHERE_RCPT)
+  && pipeline_response();
 
 if (rc == FAIL)
   smtp_respond(smtp_code, codelen, SR_FINAL,
@@ -3248,7 +3555,8 @@ else
     smtp_respond(smtp_code, codelen, SR_FINAL,
       US"Temporary local problem - please try later");
 
-smtp_fflush(SFF_UNCORK);
+if (!fl.resp_batch) smtp_fflush(SFF_UNCORK);
+fl.resp_batch = FALSE;
 
 /* Log the incident to the logs that are specified by log_reject_target
 (default main, reject). This can be empty to suppress logging of rejections. If
@@ -3514,16 +3822,19 @@ just to avoid a lot of repetition.
 Arguments:
   code         the response code
   user_msg     the user message
+  more         the response is one of a pipelined group, and may be held back
 
 Returns:       nothing
 */
 
 static void
-smtp_user_msg(uschar * code, uschar * user_msg)
+smtp_user_msg(uschar * code, uschar * user_msg, BOOL more)
 {
 int len = 3;
 smtp_message_code(&code, &len, &user_msg, NULL, TRUE);
+fl.resp_batch = more;
 smtp_respond(code, len, SR_FINAL, user_msg);
+fl.resp_batch = FALSE;
 }
 
 
@@ -3765,7 +4076,7 @@ if (verify_check_host(&wellknown_advertise_hosts) != FAIL)
       return smtp_handle_acl_fail(ACL_WHERE_WELLKNOWN, rc, user_msg, log_msg);
     else if (!wellknown_response)
       return smtp_handle_acl_fail(ACL_WHERE_WELLKNOWN, ERROR, user_msg, log_msg);
-    smtp_user_msg(US"250", wellknown_response);
+    smtp_user_msg(US"250", wellknown_response, SP_NO_MORE);
     return 0;
     }
   }
@@ -3834,6 +4145,7 @@ reset_point = smtp_reset(reset_point);
 message_ended = END_NOTSTARTED;
 
 chunking_state = f.chunking_offered ? CHUNKING_OFFERED : CHUNKING_NOT_OFFERED;
+smtp_inbuffer_shrink();
 
 cmd_list[CL_RSET].is_mail_cmd = TRUE;
 cmd_list[CL_HELO].is_mail_cmd = TRUE;
@@ -4964,7 +5276,7 @@ while (done <= 0)
 	  if (prdr_requested)
 	     user_msg = string_sprintf("%s%s", user_msg, US", PRDR Requested");
 	#endif
-	  smtp_user_msg(US"250", user_msg);
+	  smtp_user_msg(US"250", user_msg, more);
 	  }
 	smtp_delay_rcpt = smtp_rlr_base;
 	f.recipients_discarded = (rc == DISCARD);
@@ -5151,7 +5463,7 @@ while (done <= 0)
 	if (recipients_max_reject)
 	  {
 	  rcpt_fail_count++;
-	  smtp_printf("552 too many recipients\r\n", SP_NO_MORE);
+	  smtp_printf("552 too many recipients\r\n", pipeline_response());
 	  if (!toomany)
 	    log_write(0, LOG_MAIN|LOG_REJECT, "too many recipients: message "
 	      "rejected: sender=<%s> %s", sender_address, host_and_ident(TRUE));
@@ -5159,7 +5471,7 @@ while (done <= 0)
 	else
 	  {
 	  rcpt_defer_count++;
-	  smtp_printf("452 too many recipients\r\n", SP_NO_MORE);
+	  smtp_printf("452 too many recipients\r\n", pipeline_response());
 	  if (!toomany)
 	    log_write(0, LOG_MAIN|LOG_REJECT, "too many recipients: excess "
 	      "temporarily rejected: sender=<%s> %s", sender_address,
@@ -5207,7 +5519,7 @@ while (done <= 0)
 	BOOL more = pipeline_response();
 
 	if (user_msg)
-	  smtp_user_msg(US"250", user_msg);
+	  smtp_user_msg(US"250", user_msg, more);
 	else
 	  smtp_printf("250 Accepted\r\n", more);
 	receive_add_recipient(recipient, -1);
@@ -5225,10 +5537,12 @@ while (done <= 0)
 
       else if (rc == DISCARD)
 	{
+	BOOL more = pipeline_response();
+
 	if (user_msg)
-	  smtp_user_msg(US"250", user_msg);
+	  smtp_user_msg(US"250", user_msg, more);
 	else
-	  smtp_printf("250 Accepted\r\n", SP_NO_MORE);
+	  smtp_printf("250 Accepted\r\n", more);
 	rcpt_fail_count++;
 	discarded = TRUE;
 	log_write(0, LOG_MAIN|LOG_REJECT, "%s F=<%s> RCPT %s: "
@@ -5382,7 +5696,7 @@ while (done <= 0)
 	  }
 
 	if (user_msg)
-	  smtp_user_msg(US"354", user_msg);
+	  smtp_user_msg(US"354", user_msg, SP_NO_MORE);
 	else
 	  smtp_printf(
 	    "354 Enter message, ending with \".\" on a line by itself\r\n", SP_NO_MORE);
@@ -5534,7 +5848,7 @@ while (done <= 0)
       It seems safest to just wipe away the content rather than leave it as a
       target to jump to. */
 
-      memset(smtp_inbuffer, 0, IN_BUFFER_SIZE);
+      memset(smtp_inbuffer, 0, smtp_inbuffer_size);
 
       /* Attempt to start up a TLS session, and if successful, discard all
       knowledge that was obtained previously. At least, that's what the RFC says,
@@ -5806,7 +6120,7 @@ while (done <= 0)
 	  debug_printf("ETRN command execution skipped\n");
 	  }
 	if (user_msg == NULL) smtp_printf("250 OK\r\n", SP_NO_MORE);
-	  else smtp_user_msg(US"250", user_msg);
+	  else smtp_user_msg(US"250", user_msg, SP_NO_MORE);
 	break;
 	}
 
@@ -5887,7 +6201,7 @@ while (done <= 0)
 	if (!user_msg)
 	  smtp_printf("250 OK\r\n", SP_NO_MORE);
 	else
-	  smtp_user_msg(US"250", user_msg);
+	  smtp_user_msg(US"250", user_msg, SP_NO_MORE);
 
       signal(SIGCHLD, oldsignal);
       break;
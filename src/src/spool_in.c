@@ -244,6 +244,7 @@ local_scan_data = NULL;
 #endif
 max_received_linelength = 0;
 message_linecount = 0;
+message_priority = 0;
 received_protocol = NULL;
 received_count = 0;
 recipients_list = NULL;
@@ -699,6 +700,11 @@ for (;;)
     if (*p == 0) f.dont_deliver = TRUE;   /* -N */
     break;
 
+    case 'p':
+    if (Ustrncmp(p, "riority ", 8) == 0)
+      message_priority = Uatoi(var + 9);
+    break;
+
     case 'r':
     if (Ustrncmp(p, "eceived_protocol", 16) == 0)
       received_protocol = string_copy_taint(var + 18, proto_mem);
@@ -183,6 +183,11 @@ fprintf(fp, "-received_time_usec .%06d\n", (int)received_time.tv_usec);
 fprintf(fp, "-received_time_complete %d.%06d\n",
   (int)received_time_complete.tv_sec, (int)received_time_complete.tv_usec);
 
+/* A queue runner ordering by priority reads only this far into the file, so
+the priority must come next. */
+
+if (message_priority) fprintf(fp, "-priority %d\n", message_priority);
+
 /* If there is information about a sending host, remember it. The HELO
 data can be set for local SMTP as well as remote. */
 
@@ -375,7 +380,7 @@ if (fflush(fp) != 0 || ferror(fp))
 just pushes it out of C, and fclose() doesn't guarantee to do the write
 either. That's just the way Unix works... */
 
-if (EXIMfsync(fileno(fp)) < 0)
+if (daemon_sync(fileno(fp), FALSE) < 0)
   return spool_write_error(where, errmsg, US"sync", tname, fp);
 
 /* Get the size of the file, and close it. */
@@ -385,6 +390,12 @@ if (fstat(fd, &statbuf) != 0)
 if (fclose(fp) != 0)
   return spool_write_error(where, errmsg, US"close", tname, NULL);
 
+/* A new message goes into the queue index before its -H file appears, so
+that the index never misses a message that is on the queue. */
+
+if (where == SW_RECEIVING)
+  queue_index_update(queue_name, id, message_subdir, TRUE);
+
 /* Rename the file to its correct name, thereby replacing any previous
 incarnation. */
 
@@ -415,7 +426,7 @@ tname = spool_fname(US"input", message_subdir, US".", US"");
 if ((fd = Uopen(tname, O_RDONLY|O_DIRECTORY, 0)) < 0)
   return spool_write_error(where, errmsg, US"directory open", fname, NULL);
 
-if (EXIMfsync(fd) < 0 && errno != EINVAL)
+if (daemon_sync(fd, FALSE) < 0 && errno != EINVAL)
   return spool_write_error(where, errmsg, US"directory sync", fname, NULL);
 
 if (close(fd) < 0)
@@ -553,6 +564,9 @@ rule of waiting for a -H file before doing anything. When moving messages off
 the mail spool, the -D file should be open and locked at the time, thus keeping
 Exim's hands off. */
 
+if (!*to)
+  queue_index_update(dest_qname, id, subdir, TRUE);
+
 if (!make_link(US"msglog", dest_qname, subdir, id, US"", from, to, TRUE) ||
     !make_link(US"input",  dest_qname, subdir, id, US"-D", from, to, FALSE) ||
     !make_link(US"input",  dest_qname, subdir, id, US"-H", from, to, FALSE))
@@ -563,6 +577,9 @@ if (!break_link(US"input",  subdir, id, US"-H", from, FALSE) ||
     !break_link(US"msglog", subdir, id, US"", from, TRUE))
   return FALSE;
 
+if (!*from && (*to || Ustrcmp(dest_qname, queue_name) != 0))
+  queue_index_update(queue_name, id, subdir, FALSE);
+
 log_write(0, LOG_MAIN, "moved from %s%s%s%sinput, %smsglog to %s%s%s%sinput, %smsglog",
    *queue_name?"(":"", *queue_name?queue_name:US"", *queue_name?") ":"",
    from, from,
@@ -112,6 +112,8 @@ typedef struct pooldesc {
   void *	next_yield;		/* next allocation point */
   int		yield_length;		/* remaining space in current block */
   unsigned	store_block_order;	/* log2(size) block allocation size */
+  BOOL		tainted:1;		/* blocks hold tainted data */
+  BOOL		quoted:1;		/* is the pool of a quoted_pooldesc */
 
   /* This variable is set by store_get() to its yield, and by store_reset() to
   NULL. This enables string_cat() to optimize its store handling for very long
@@ -144,14 +146,30 @@ length. */
 #define ALIGNED_SIZEOF_STOREBLOCK \
   (((sizeof(storeblock) + alignment - 1) / alignment) * alignment)
 
+/* Index of the blocks of all the pools, sorted by address, so that the pool
+owning a pointer (and hence its taint and quoting) can be found by a binary
+search rather than by walking every block chain.  It is kept in plain malloc
+store, grown by doubling; blocks are added and removed far less often than the
+index is searched. */
+
+typedef struct blockindex {
+  const uschar *	start;		/* usable area of the block */
+  const uschar *	end;
+  pooldesc *		pool;
+  BOOL			readonly;	/* made so by store_writeprotect() */
+} blockindex;
+
+static blockindex * block_index = NULL;
+static unsigned block_index_n = 0;	/* entries in use */
+static unsigned block_index_size = 0;	/* entries allocated */
+
 /* Size of block to get from malloc to carve up into smaller ones. This
 must be a multiple of the alignment. We assume that 4096 is going to be
 suitably aligned.  Double the size per-pool for every malloc, to mitigate
 certain denial-of-service attacks.  Don't bother to decrease on block frees.
 We waste average half the current alloc size per pool.  This could be several
-hundred kB now, vs. 4kB with a constant-size block size.  But the search time
-for is_tainted(), linear in the number of blocks for the pool, is O(n log n)
-rather than O(n^2).
+hundred kB now, vs. 4kB with a constant-size block size.  But there are fewer
+blocks to track; is_tainted() is a binary search of the block index above.
 A test of 2000 RCPTs and just accept ACL had 370kB in 21 blocks before,
 504kB in 6 blocks now, for the untainted-main (largest) pool.
 Builds for restricted-memory system can disable the expansion by
@@ -219,11 +237,13 @@ static void   internal_store_free(void *, const char *, int linenumber);
 /******************************************************************************/
 
 static void
-pool_init(pooldesc * pp)
+pool_init(pooldesc * pp, BOOL tainted, BOOL quoted)
 {
 memset(pp, 0, sizeof(*pp));
 pp->yield_length = -1;
 pp->store_block_order = 12; /* log2(allocation_size) ie. 4kB */
+pp->tainted = tainted;
+pp->quoted = quoted;
 }
 
 /* Initialisation, for things fragile with parameter channges when using
@@ -233,7 +253,8 @@ void
 store_init(void)
 {
 for (pooldesc * pp = paired_pools; pp < paired_pools + N_PAIRED_POOLS; pp++)
-  pool_init(pp);
+  pool_init(pp, pp >= paired_pools + POOL_TAINT_BASE, FALSE);
+block_index_n = 0;
 }
 
 /******************************************************************************/
@@ -261,21 +282,75 @@ for (pooldesc * pp = paired_pools; pp < paired_pools + N_PAIRED_POOLS; pp++)
 return NULL;
 }
 
+/* Return the index of the first entry starting above the given address,
+which is where a block at that address goes. */
+
+static unsigned
+block_index_slot(const void * p)
+{
+unsigned lo = 0, hi = block_index_n;
+
+while (lo < hi)
+  {
+  unsigned mid = (lo + hi) / 2;
+  if (block_index[mid].start <= CUS p) lo = mid + 1; else hi = mid;
+  }
+return lo;
+}
+
+/* Return the pool holding the given address, or NULL */
+
+static pooldesc *
+pool_indexed_for_pointer(const void * p)
+{
+unsigned i = block_index_slot(p);
+return i > 0 && CUS p < block_index[i-1].end ? block_index[i-1].pool : NULL;
+}
+
+static void
+block_index_add(const storeblock * b, pooldesc * pp)
+{
+const uschar * start = CUS b + ALIGNED_SIZEOF_STOREBLOCK;
+unsigned i = block_index_slot(start);
+
+if (block_index_n >= block_index_size)
+  {
+  unsigned size = block_index_size ? block_index_size * 2 : 64;
+  blockindex * new = realloc(block_index, size * sizeof(blockindex));
+
+  if (!new)
+    log_write_die(0, LOG_MAIN, "failed to grow store block index to %u", size);
+  block_index = new;
+  block_index_size = size;
+  }
+
+memmove(block_index + i + 1, block_index + i,
+  (block_index_n - i) * sizeof(blockindex));
+block_index[i] = (blockindex) {.start = start, .end = start + b->length, .pool = pp};
+block_index_n++;
+}
+
+static void
+block_index_remove(const storeblock * b)
+{
+const uschar * start = CUS b + ALIGNED_SIZEOF_STOREBLOCK;
+unsigned i = block_index_slot(start);
+
+if (i == 0 || block_index[--i].start != start)
+  log_write_die(0, LOG_MAIN, "internal error: block %p not in store index",
+    (void *)b);
+block_index_n--;
+memmove(block_index + i, block_index + i + 1,
+  (block_index_n - i) * sizeof(blockindex));
+}
+
 static pooldesc *
 pool_for_pointer(const void * p, const char * func, int linenumber)
 {
 pooldesc * pp;
-storeblock * b;
 
 if ((pp = pool_current_for_pointer(p))) return pp;
-
-for (quoted_pooldesc * qp = quoted_pools; qp; qp = qp->next)
-  for (b = qp->pool.chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return &qp->pool;
-
-for (pp = paired_pools; pp < paired_pools + N_PAIRED_POOLS; pp++)
-  for (b = pp->chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return pp;
+if ((pp = pool_indexed_for_pointer(p))) return pp;
 
 #ifndef COMPILE_UTILITY
 stackdump();
@@ -288,9 +363,8 @@ return NULL;
 /******************************************************************************/
 /* Test if a pointer refers to tainted memory.
 
-Slower version check, for use when platform intermixes malloc and mmap area
-addresses. Test against the current-block of all tainted pools first, then all
-blocks of all tainted pools.
+Look up the pool owning the address in the block index; anything not in a pool
+block (stack, static or malloc store) is untainted.
 
 Return: TRUE iff tainted
 */
@@ -298,30 +372,12 @@ Return: TRUE iff tainted
 BOOL
 is_tainted_fn(const void * p)
 {
-storeblock * b;
+pooldesc * pp;
 
 if (p == GET_UNTAINTED) return FALSE;
 if (p == GET_TAINTED) return TRUE;
 
-for (pooldesc * pp = paired_pools + POOL_TAINT_BASE;
-     pp < paired_pools + N_PAIRED_POOLS; pp++)
-  if ((b = pp->current_block))
-    if (is_pointer_in_block(b, p)) return TRUE;
-
-for (quoted_pooldesc * qp = quoted_pools; qp; qp = qp->next)
-  if (b = qp->pool.current_block)
-    if (is_pointer_in_block(b, p)) return TRUE;
-
-for (pooldesc * pp = paired_pools + POOL_TAINT_BASE;
-     pp < paired_pools + N_PAIRED_POOLS; pp++)
-  for (b = pp->chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return TRUE;
-
-for (quoted_pooldesc * qp = quoted_pools; qp; qp = qp->next)
-  for (b = qp->pool.chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return TRUE;
-
-return FALSE;
+return (pp = pool_indexed_for_pointer(p)) && pp->tainted;
 }
 
 
@@ -355,7 +411,7 @@ quoted_pool_new(unsigned quoter, const uschar * quoter_name)
 {
 quoted_pooldesc * qp = store_get_perm(sizeof(quoted_pooldesc), GET_UNTAINTED);
 
-pool_init(&qp->pool);
+pool_init(&qp->pool, TRUE, TRUE);
 qp->quoter = quoter;
 qp->quoter_name = quoter_name;
 qp->next = quoted_pools;
@@ -369,11 +425,25 @@ return &qp->pool;
 void
 store_writeprotect(int pool)
 {
-#if !defined(COMPILE_UTILITY) && !defined(MISSING_POSIX_MEMALIGN)
 for (storeblock * b =  paired_pools[pool].chainbase; b; b = b->next)
+  {
+  block_index[block_index_slot(CUS b + ALIGNED_SIZEOF_STOREBLOCK) - 1].readonly = TRUE;
+#if !defined(COMPILE_UTILITY) && !defined(MISSING_POSIX_MEMALIGN)
   if (mprotect(b, ALIGNED_SIZEOF_STOREBLOCK + b->length, PROT_READ) != 0)
     DEBUG(D_any) debug_printf("config block mprotect: (%d) %s\n", errno, strerror(errno));
 #endif
+  }
+}
+
+/* Return TRUE iff the address is in a block made readonly by
+store_writeprotect(), so that what is there will not change for the life of
+the process.  Used for caching work on configuration strings. */
+
+BOOL
+is_readonly_config(const void * p)
+{
+unsigned i = block_index_slot(p);
+return i > 0 && CUS p < block_index[i-1].end && block_index[i-1].readonly;
 }
 
 /******************************************************************************/
@@ -421,6 +491,7 @@ if (size > pp->yield_length)
     {
     /* Give up on this block, because it's too small */
     pp->nblocks--;
+    block_index_remove(newblock);
     internal_store_free(newblock, func, linenumber);
     newblock = NULL;
     }
@@ -454,6 +525,7 @@ if (size > pp->yield_length)
       newblock = internal_store_malloc(mlength, func, linenumber);
     newblock->next = NULL;
     newblock->length = length;
+    block_index_add(newblock, pp);
 #ifndef RESTRICTED_MEMORY
     if (pp->store_block_order++ > pp->maxorder)
       pp->maxorder = pp->store_block_order;
@@ -634,26 +706,16 @@ return is_tainted(proto_mem)
 int
 quoter_for_address(const void * p, const uschar ** namep)
 {
-const quoted_pooldesc * qp;
-for (qp = quoted_pools; qp; qp = qp->next)
-  {
-  const pooldesc * pp = &qp->pool;
-  storeblock * b;
-
-  if (b = pp->current_block)
-    if (is_pointer_in_block(b, p))
-      goto found;
+const pooldesc * pp;
 
-  for (b = pp->chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p))
-      goto found;
+if (quoted_pools && (pp = pool_indexed_for_pointer(p)) && pp->quoted)
+  {
+  const quoted_pooldesc * qp = (const quoted_pooldesc *)pp;
+  if (namep) *namep = qp->quoter_name;
+  return qp->quoter;
   }
 if (namep) *namep = NULL;
 return -1;
-
-found:
-  if (namep) *namep = qp->quoter_name;
-  return qp->quoter;
 }
 
 /* Return TRUE iff the given address is quoted for the given type.
@@ -802,6 +864,20 @@ return (x & (x - 1)) == 0;
 }
 
 
+/* The size order of a block as got by pool_get() for the pool's block-size
+order at the time, or zero for one enlarged to suit a big request. */
+
+static unsigned
+block_order(const storeblock * b)
+{
+unsigned len = b->length + 2 * ALIGNED_SIZEOF_STOREBLOCK, order = 0;
+
+if (!is_pwr2_size(len)) return 0;
+while (len >>= 1) order++;
+return order;
+}
+
+
 /*************************************************
 *    Back up to a previous point on the stack    *
 *************************************************/
@@ -811,11 +887,18 @@ that are now unused. Call with a cookie obtained from store_mark() only; do
 not call with a pointer returned by store_get().  Both the untainted and tainted
 pools corresposding to store_pool are reset.
 
+Normally a spare block is kept to avoid flapping, and the size for new blocks
+is only wound back a little.  For a full release, at the end of a message on a
+long-lived connection, every later block is freed and the size for new blocks
+goes back to what it was when the mark was taken, so that the pools do not stay
+sized for the largest message seen.
+
 Quoted pools are not handled.
 
 Arguments:
   ptr         place to back up to
   pool	      pool holding the pointer
+  release     TRUE for a full release
   func        function from which called
   linenumber  line number in source file
 
@@ -823,7 +906,8 @@ Returns:      nothing
 */
 
 static void
-internal_store_reset(void * ptr, int pool, const char *func, int linenumber)
+internal_store_reset(void * ptr, int pool, BOOL release, const char *func,
+  int linenumber)
 {
 storeblock * bb;
 pooldesc * pp = paired_pools + pool;
@@ -881,7 +965,8 @@ successor, if our current block has less than 256 bytes left. This should
 prevent us from flapping memory. However, keep this block only when it has
 a power-of-two size so probably is not a custom inflated one. */
 
-if (  pp->yield_length < STOREPOOL_MIN_SIZE
+if (  !release
+   && pp->yield_length < STOREPOOL_MIN_SIZE
    && b->next
    && is_pwr2_size(b->next->length + ALIGNED_SIZEOF_STOREBLOCK))
   {
@@ -913,13 +998,25 @@ while ((b = bb))
   pool_malloc -= siz;
   pp->nblocks--;
   if (pool != POOL_CONFIG)
+    {
+    block_index_remove(b);
     internal_store_free(b, func, linenumber);
+    }
 
 #ifndef RESTRICTED_MEMORY
   if (pp->store_block_order > 13) pp->store_block_order--;
 #endif
   }
 
+#ifndef RESTRICTED_MEMORY
+if (release)
+  {
+  unsigned order = block_order(pp->current_block);
+  if (order && order < pp->store_block_order - 1)
+    pp->store_block_order = order + 1;
+  }
+#endif
+
 /* Cut out the debugging stuff for utilities, but stop picky compilers from
 giving warnings. */
 
@@ -948,8 +1045,29 @@ if (!r)
   log_write_die(0, LOG_MAIN,
     "store_reset called with bad mark: %s %d\n", func, linenumber);
 
-internal_store_reset(*ptr, store_pool + POOL_TAINT_BASE, func, linenumber);
-internal_store_reset(ptr,  store_pool,		   func, linenumber);
+internal_store_reset(*ptr, store_pool + POOL_TAINT_BASE, FALSE, func, linenumber);
+internal_store_reset(ptr,  store_pool,		   FALSE, func, linenumber);
+return NULL;
+}
+
+
+/* As store_reset(), but release all the blocks got since the mark and wind
+back the block size; used between messages. */
+
+rmark
+store_reset_full_3(rmark r, const char * func, int linenumber)
+{
+void ** ptr = r;
+
+if (store_pool >= POOL_TAINT_BASE)
+  log_write_die(0, LOG_MAIN,
+    "store_reset called for pool %d: %s %d\n", store_pool, func, linenumber);
+if (!r)
+  log_write_die(0, LOG_MAIN,
+    "store_reset called with bad mark: %s %d\n", func, linenumber);
+
+internal_store_reset(*ptr, store_pool + POOL_TAINT_BASE, TRUE, func, linenumber);
+internal_store_reset(ptr,  store_pool,		   TRUE, func, linenumber);
 return NULL;
 }
 
@@ -1103,6 +1221,7 @@ for (storeblock * b =  pp->chainbase; b; b = b->next)
       memset(bb, 0xF0, bb->length+ALIGNED_SIZEOF_STOREBLOCK);
 #endif  /* COMPILE_UTILITY */
 
+    block_index_remove(bb);
     internal_store_free(bb, func, linenumber);
     return;
     }
@@ -1312,7 +1431,7 @@ int oldpool;
 if (!message_reset_point) return;
 oldpool = store_pool;
 store_pool = POOL_MESSAGE;
-message_reset_point = store_reset(message_reset_point);
+message_reset_point = store_reset_full(message_reset_point);
 store_pool = oldpool;
 }
 
@@ -63,6 +63,8 @@ tracing information for debugging. */
 	store_release_above_3(addr, __FUNCTION__, __LINE__)
 #define store_reset(mark) \
 	store_reset_3(mark, __FUNCTION__, __LINE__)
+#define store_reset_full(mark) \
+	store_reset_full_3(mark, __FUNCTION__, __LINE__)
 
 
 /* The real functions */
@@ -78,12 +80,14 @@ extern rmark   store_mark_3(const char *, int);
 extern void *  store_newblock_3(void *, int, int, const char *, int);
 extern void    store_release_above_3(void *, const char *, int);
 extern rmark   store_reset_3(rmark, const char *, int);
+extern rmark   store_reset_full_3(rmark, const char *, int);
 
 #define GET_UNTAINTED	(const void *)0
 #define GET_TAINTED	(const void *)1
 
 extern int	quoter_for_address(const void *, const uschar **);
 extern BOOL	is_quoted_like(const void *, const void *);
+extern BOOL	is_readonly_config(const void *);
 extern BOOL	is_real_quoter(int);
 extern void	debug_print_taint(const void * p);
 
@@ -688,6 +688,8 @@ typedef struct error_block {
 
 typedef struct queue_filename {
   struct queue_filename *next;
+  time_t received;		/* From the queue index; 0 if not known */
+  int    priority;		/* From the queue index */
   uschar dir_uschar;
   uschar text[1];
 } queue_filename;
@@ -743,17 +745,39 @@ typedef struct expiring_data {
     } data;
 } expiring_data;
 
-/* Structure for holding the handle and the cached last lookup for searches.
+/* Structure for a cached lookup result. These are in malloc store, with the
+key, options and data following the structure, so that each can be freed when
+it is pushed out of a full cache. */
+
+typedef struct lookup_cache_item {
+  struct lookup_cache_item * next;	/* hash chain */
+  struct lookup_cache_item * newer;	/* LRU chain */
+  struct lookup_cache_item * older;
+  time_t	expiry;		/* if nonzero, data invalid after this time */
+  const uschar * opts;		/* options, or NULL */
+  const uschar * data;		/* result, or NULL for a failed lookup */
+  unsigned	hash;		/* of the key */
+  unsigned	size;		/* total bytes, for accounting */
+  BOOL		tainted;	/* data was tainted */
+  uschar	key[1];		/* key - variable length */
+} lookup_cache_item;
+
+/* Structure for holding the handle and the cached lookups for searches.
 This block is pointed to by the tree entry for the file. The file can get
 closed if too many are opened at once. There is a LRU chain for deciding which
-to close. */
+to close, and another for the cached results of each file. */
 
 typedef struct search_cache {
   void   *handle;                 /* lookup handle, or NULL if closed */
   const lookup_info * li;	  /* info struct for search type */
   tree_node *up;                  /* LRU up pointer */
   tree_node *down;                /* LRU down pointer */
-  tree_node *item_cache;          /* tree of cached results */
+  lookup_cache_item ** items;     /* hash table of cached results */
+  lookup_cache_item * newest;     /* LRU chain of cached results */
+  lookup_cache_item * oldest;
+  unsigned	nitems;		  /* count of cached results */
+  unsigned	nbuckets;	  /* size of hash table */
+  unsigned	size;		  /* bytes of cached results */
 } search_cache;
 
 /* Structure for holding a partially decoded DNS record; the name has been
@@ -1036,6 +1060,7 @@ typedef struct misc_module_info {
   BOOL		(*init)(void *);	/* arg is the misc_module_info ptr */
   gstring *	(*lib_vers_report)(gstring *);	/* underlying library */
   int		(*conn_init)(const uschar *, const uschar *, const uschar * *);
+  void		(*conn_reset)(void);
   void		(*smtp_reset)(void);
   int		(*msg_init)(void);
   gstring *	(*authres)(gstring *);
@@ -1048,7 +1073,7 @@ typedef struct misc_module_info {
   unsigned	variables_count;
 } misc_module_info;
 
-#define MISC_MODULE_MAGIC	0x4d4d4d31	/* MMM1 */
+#define MISC_MODULE_MAGIC	0x4d4d4d32	/* MMM2 */
 
 #endif	/* whole file */
 /* End of structs.h */
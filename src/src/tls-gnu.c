@@ -613,6 +613,16 @@ tls_refill(unsigned lim)
 exim_gnutls_state_st * state = &state_server;
 ssize_t inbytes;
 
+if (ssl_xfer_buffer_filled && ssl_xfer_buffer_size < TLS_RECORD_SIZE)
+  tls_in_buffer_resize(TLS_RECORD_SIZE);
+
+#ifdef SUPPORT_CORK
+/* Responses held back for a pipelined group must be sent before a read which
+may have to wait for the client. */
+
+if (state->corked) (void) tls_write(NULL, NULL, 0, FALSE);
+#endif
+
 DEBUG(D_tls) debug_printf("Calling gnutls_record_recv"
   "(session=%p, buffer=%p, buffersize=%u)\n",
   state->session, state->xfer_buffer, ssl_xfer_buffer_size);
@@ -627,6 +637,7 @@ do
 while (inbytes == GNUTLS_E_AGAIN);
 
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
+smtp_in_tls_reads++;
 
 if (had_command_timeout)		/* set by signal handler */
   smtp_command_timeout_exit();		/* does not return */
@@ -669,6 +680,7 @@ smtp_verify_feed(state->xfer_buffer, inbytes);
 #endif
 state->xfer_buffer_hwm = (int) inbytes;
 state->xfer_buffer_lwm = 0;
+ssl_xfer_buffer_filled = inbytes == ssl_xfer_buffer_size;
 return TRUE;
 }
 
@@ -70,6 +70,7 @@ change this guard and punt the issue for a while longer. */
 #  define EXIM_HAVE_OPENSSL_GET0_SERIAL
 #  define EXIM_HAVE_OPENSSL_OCSP_RESP_GET0_CERTS
 #  define EXIM_HAVE_SSL_GET0_VERIFIED_CHAIN
+#  define EXIM_HAVE_OPENSSL_READ_AHEAD
 #  ifndef DISABLE_OCSP
 #   define EXIM_HAVE_OCSP
 #  endif
@@ -379,6 +380,7 @@ typedef struct {
 /* static SSL     *server_ssl = NULL; */
 
 static SSL_CTX *server_sni = NULL;
+static gstring * server_corked = NULL;	/* held-back SMTP responses */
 #ifdef EXIM_HAVE_ALPN
 static BOOL server_seen_alpn = FALSE;
 static const gstring * server_fail_alpn = NULL;
@@ -3583,6 +3585,10 @@ SSL_CTX_set_num_tickets(ctx, 0);	/* send no TLS1.3 stateful-tickets */
 if (!(ssl = SSL_new(ctx)))
   return tls_error(US"SSL_new", NULL, NULL, errstr);
 state_server.lib_state.lib_ssl = ssl;
+#ifdef EXIM_HAVE_OPENSSL_READ_AHEAD
+/* Room for several records per read() when read-ahead is on for message data */
+SSL_set_default_read_buffer_len(ssl, 4 * TLS_RECORD_SIZE);
+#endif
 
 /* Warning: we used to SSL_clear(ssl) here, it was removed.
  *
@@ -4552,6 +4558,14 @@ tls_refill(unsigned lim)
 SSL * ssl = state_server.lib_state.lib_ssl;
 int error, inbytes;
 
+if (ssl_xfer_buffer_filled && ssl_xfer_buffer_size < TLS_RECORD_SIZE)
+  tls_in_buffer_resize(TLS_RECORD_SIZE);
+
+/* Responses held back for a pipelined group must be sent before a read which
+may have to wait for the client. */
+
+if (server_corked) (void) tls_write(NULL, NULL, 0, FALSE);
+
 DEBUG(D_tls) debug_printf("Calling SSL_read(tls_refill %p, %p, %u)\n",
   ssl, ssl_xfer_buffer, ssl_xfer_buffer_size);
 
@@ -4561,6 +4575,7 @@ inbytes = SSL_read(ssl, CS ssl_xfer_buffer,
 		  MIN(ssl_xfer_buffer_size, lim));
 error = SSL_get_error(ssl, inbytes);
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
+smtp_in_tls_reads++;
 
 if (had_command_timeout)		/* set by signal handler */
   smtp_command_timeout_exit();		/* does not return */
@@ -4615,6 +4630,7 @@ smtp_verify_feed(ssl_xfer_buffer, inbytes);
 #endif
 ssl_xfer_buffer_hwm = inbytes;
 ssl_xfer_buffer_lwm = 0;
+ssl_xfer_buffer_filled = inbytes == ssl_xfer_buffer_size;
 return TRUE;
 }
 
@@ -4693,6 +4709,9 @@ fd_set fds;
 struct timeval tzero = {.tv_sec = 0, .tv_usec = 0};
 
 if (ssl_xfer_buffer_lwm < ssl_xfer_buffer_hwm) return TRUE;
+#ifdef EXIM_HAVE_OPENSSL_READ_AHEAD
+if (SSL_has_pending(state_server.lib_state.lib_ssl)) return TRUE;	/* read-ahead */
+#endif
 
 FD_ZERO(&fds);
 FD_SET(tls_in.active.sock, &fds);
@@ -4774,7 +4793,6 @@ int outbytes, error;
 SSL * ssl = ct_ctx
   ? ((exim_openssl_client_tls_ctx *)ct_ctx)->ssl
   : state_server.lib_state.lib_ssl;
-static gstring * server_corked = NULL;
 gstring ** corkedp = ct_ctx
   ? &((exim_openssl_client_tls_ctx *)ct_ctx)->corked : &server_corked;
 gstring * corked = *corkedp;
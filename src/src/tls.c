@@ -71,7 +71,14 @@ functions and the common functions below.
 We're moving away from this; GnuTLS is already using a state, which
 can switch, so we can do TLS callouts during ACLs. */
 
-static const int ssl_xfer_buffer_size = 4096;
+/* The server input buffer is grown to the largest TLS record while message
+data is arriving, and shrunk back for commands. */
+
+#define SSL_XFER_BUFFER_SIZE	4096
+#define TLS_RECORD_SIZE		16384
+
+static int ssl_xfer_buffer_size = SSL_XFER_BUFFER_SIZE;
+static BOOL ssl_xfer_buffer_filled = FALSE;
 #ifdef USE_OPENSSL
 static uschar *ssl_xfer_buffer = NULL;
 static int ssl_xfer_buffer_lwm = 0;
@@ -468,6 +475,7 @@ tzset();
 /* Forward decl. */
 static void tls_client_resmption_key(tls_support *, const smtp_connect_args *,
   const smtp_transport_options_block *);
+static void tls_in_buffer_resize(int);
 
 
 #ifdef USE_GNUTLS
@@ -487,12 +495,58 @@ static void tls_client_resmption_key(tls_support *, const smtp_connect_args *,
 
 
 
+/*************************************************
+*        Resize the server input buffer          *
+*************************************************/
+
+/* Change the size of the input buffer, keeping any data in it.  It is grown
+to a whole TLS record when a read fills it, as happens for message data, so
+that each library call returns a full record; and for OpenSSL, read-ahead is
+turned on so that each read() can take several records.  Both are undone for
+the command phase, by tls_in_buffer_shrink().
+
+Argument:	the new size; must be more than the amount buffered
+*/
+
+static void
+tls_in_buffer_resize(int size)
+{
+int n = ssl_xfer_buffer_hwm - ssl_xfer_buffer_lwm;
+uschar * p = store_malloc(size);
+
+if (n > 0) memcpy(p, ssl_xfer_buffer + ssl_xfer_buffer_lwm, n);
+store_free(ssl_xfer_buffer);
+ssl_xfer_buffer = p;
+ssl_xfer_buffer_lwm = 0;
+ssl_xfer_buffer_hwm = n;
+ssl_xfer_buffer_size = size;
+ssl_xfer_buffer_filled = FALSE;
+#ifdef EXIM_HAVE_OPENSSL_READ_AHEAD
+SSL_set_read_ahead(state_server.lib_state.lib_ssl, size > SSL_XFER_BUFFER_SIZE);
+#endif
+DEBUG(D_tls) debug_printf("TLS input buffer size %d\n", size);
+}
+
+
+/* Shrink the server input buffer back to its command-phase size, if it was
+grown for the last message and what is buffered now fits. */
+
+void
+tls_in_buffer_shrink(void)
+{
+if (  ssl_xfer_buffer_size > SSL_XFER_BUFFER_SIZE
+   && ssl_xfer_buffer_hwm - ssl_xfer_buffer_lwm < SSL_XFER_BUFFER_SIZE)
+  tls_in_buffer_resize(SSL_XFER_BUFFER_SIZE);
+}
+
+
+
 /*************************************************
 *           TLS version of ungetc                *
 *************************************************/
 
 /* Puts a character back in the input buffer. Only ever
-called once.
+called for characters just taken from the buffer, in reverse order.
 Only used by the server-side TLS.
 
 Arguments: